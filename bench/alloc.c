@@ -0,0 +1,339 @@
+/* =============================================================================
+   alloc.c
+
+   Cost of the library's allocations under different allocators set with
+   rpc_set_allocator. Each round trip does what a connection does for
+   every message: encode it into a growing buffer, queue it, and decode
+   it again into a new rpc_message. Compares libc, a per-thread bump
+   allocator that is reset whenever everything in it has been freed, and
+   a pool of power-of-two size classes, from one thread and from several.
+
+   Usage: ./build/bench-alloc [-n round_trips] [-t threads]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "linkedlist.h"
+#include "protocol.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Every block starts with a header recording where it came from, padded
+ * so the block itself stays 16 byte aligned.
+ */
+#define HEADER_SIZE 16
+
+#define BUMP_ARENA_SIZE (4 * 1024 * 1024)
+
+#define POOL_MIN_SHIFT 4
+#define POOL_CLASSES 17
+
+/*
+ * Payload sizes of the messages, cycled through in turn.
+ */
+static const size_t sizes[] = {0, 16, 256, 4096, 0, 64, 1024, 65536};
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+typedef struct {
+    int trips;
+} worker_t;
+
+/* libc ===================================================================== */
+static const rpc_allocator *libc_allocator = NULL;
+
+/* bump ===================================================================== */
+
+/*
+ * A thread's arena. Blocks are carved off the end, and the whole arena is
+ * reused once none of them are live. Blocks that do not fit come from
+ * malloc. Only the thread that allocated a block may free it, which holds
+ * for the round trips below.
+ */
+typedef struct {
+    unsigned char *base;
+    size_t next;
+    size_t last;
+    long live;
+} bump_arena_t;
+
+typedef struct {
+    size_t size;
+    bump_arena_t *arena;
+} bump_header_t;
+
+static __thread bump_arena_t *bump_arena = NULL;
+
+static void *bump_malloc(size_t size, void *ctx) {
+    bump_arena_t *a = bump_arena;
+    if (a == NULL) {
+        a = bump_arena = (bump_arena_t *)calloc(1, sizeof(*a));
+        a->base = (unsigned char *)malloc(BUMP_ARENA_SIZE);
+    }
+    size_t need = HEADER_SIZE + ((size + 15) & ~(size_t)15);
+    bump_header_t *h;
+    if (a->next + need <= BUMP_ARENA_SIZE) {
+        h = (bump_header_t *)(a->base + a->next);
+        h->arena = a;
+        a->last = a->next;
+        a->next += need;
+        a->live++;
+    } else {
+        h = (bump_header_t *)malloc(need);
+        h->arena = NULL;
+    }
+    h->size = size;
+    return (unsigned char *)h + HEADER_SIZE;
+}
+
+static void *bump_calloc(size_t n, size_t size, void *ctx) {
+    void *ptr = bump_malloc(n * size, ctx);
+    memset(ptr, 0, n * size);
+    return ptr;
+}
+
+static void bump_free(void *ptr, void *ctx) {
+    bump_header_t *h = (bump_header_t *)((unsigned char *)ptr - HEADER_SIZE);
+    bump_arena_t *a = h->arena;
+    if (a == NULL) {
+        free(h);
+    } else if (--a->live == 0) {
+        a->next = 0;
+    }
+}
+
+static void *bump_realloc(void *ptr, size_t size, void *ctx) {
+    if (ptr == NULL) {
+        return bump_malloc(size, ctx);
+    }
+    bump_header_t *h = (bump_header_t *)((unsigned char *)ptr - HEADER_SIZE);
+    bump_arena_t *a = h->arena;
+
+    // the newest block of the arena grows in place
+    size_t need = HEADER_SIZE + ((size + 15) & ~(size_t)15);
+    if (a != NULL && (unsigned char *)h == a->base + a->last &&
+        a->last + need <= BUMP_ARENA_SIZE) {
+        a->next = a->last + need;
+        h->size = size;
+        return ptr;
+    }
+    void *grown = bump_malloc(size, ctx);
+    memcpy(grown, ptr, h->size < size ? h->size : size);
+    bump_free(ptr, ctx);
+    return grown;
+}
+
+static const rpc_allocator bump_allocator = {
+    .malloc = bump_malloc,
+    .calloc = bump_calloc,
+    .realloc = bump_realloc,
+    .free = bump_free,
+};
+
+/* size-class pool ========================================================== */
+
+/*
+ * Free blocks of each power-of-two size, kept for reuse instead of being
+ * returned to libc. Larger blocks come straight from malloc.
+ */
+typedef struct {
+    void *free[POOL_CLASSES];
+    pthread_mutex_t lock[POOL_CLASSES];
+} pool_t;
+
+typedef struct {
+    int class;
+    size_t size;
+} pool_header_t;
+
+static pool_t pool;
+
+static int pool_class(size_t size) {
+    int class = 0;
+    while (class < POOL_CLASSES &&
+           ((size_t)1 << (class + POOL_MIN_SHIFT)) < size) {
+        class++;
+    }
+    return class;
+}
+
+static void *pool_malloc(size_t size, void *ctx) {
+    int class = pool_class(size);
+    pool_header_t *h = NULL;
+    if (class < POOL_CLASSES) {
+        pthread_mutex_lock(&pool.lock[class]);
+        h = (pool_header_t *)pool.free[class];
+        if (h != NULL) {
+            pool.free[class] = *(void **)((unsigned char *)h + HEADER_SIZE);
+        }
+        pthread_mutex_unlock(&pool.lock[class]);
+        if (h == NULL) {
+            size_t capacity = (size_t)1 << (class + POOL_MIN_SHIFT);
+            h = (pool_header_t *)malloc(HEADER_SIZE + capacity);
+        }
+    } else {
+        h = (pool_header_t *)malloc(HEADER_SIZE + size);
+    }
+    h->class = class;
+    h->size = size;
+    return (unsigned char *)h + HEADER_SIZE;
+}
+
+static void *pool_calloc(size_t n, size_t size, void *ctx) {
+    void *ptr = pool_malloc(n * size, ctx);
+    memset(ptr, 0, n * size);
+    return ptr;
+}
+
+static void pool_free(void *ptr, void *ctx) {
+    pool_header_t *h = (pool_header_t *)((unsigned char *)ptr - HEADER_SIZE);
+    int class = h->class;
+    if (class >= POOL_CLASSES) {
+        free(h);
+        return;
+    }
+    pthread_mutex_lock(&pool.lock[class]);
+    *(void **)ptr = pool.free[class];
+    pool.free[class] = h;
+    pthread_mutex_unlock(&pool.lock[class]);
+}
+
+static void *pool_realloc(void *ptr, size_t size, void *ctx) {
+    if (ptr == NULL) {
+        return pool_malloc(size, ctx);
+    }
+    pool_header_t *h = (pool_header_t *)((unsigned char *)ptr - HEADER_SIZE);
+
+    // the block's size class may already have room
+    if (h->class < POOL_CLASSES &&
+        size <= ((size_t)1 << (h->class + POOL_MIN_SHIFT))) {
+        h->size = size;
+        return ptr;
+    }
+    void *grown = pool_malloc(size, ctx);
+    memcpy(grown, ptr, h->size < size ? h->size : size);
+    pool_free(ptr, ctx);
+    return grown;
+}
+
+static const rpc_allocator pool_allocator = {
+    .malloc = pool_malloc,
+    .calloc = pool_calloc,
+    .realloc = pool_realloc,
+    .free = pool_free,
+};
+
+static void pool_drain(void) {
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        while (pool.free[i] != NULL) {
+            void *h = pool.free[i];
+            pool.free[i] = *(void **)((unsigned char *)h + HEADER_SIZE);
+            free(h);
+        }
+    }
+}
+
+/* round trips ============================================================== */
+static void *round_trips(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    unsigned char *payload = (unsigned char *)calloc(1, sizes[NUM_SIZES - 1]);
+    for (int i = 0; i < w->trips; i++) {
+        size_t size = sizes[i % NUM_SIZES];
+        rpc_message *msg =
+            new_rpc_message(i, CALL, new_string("echo"),
+                            new_rpc_data(i, size, size ? payload : NULL));
+        buffer_t *b = encode_rpc_message(msg);
+        rpc_message_free(msg, rpc_data_free);
+
+        // the buffer waits in a queue as it would for the writer thread
+        list_t *queue = create_empty_list();
+        append(queue, b);
+        b = (buffer_t *)pop(queue);
+        free_list(queue, NULL);
+        b->size = b->next;
+        b->next = 0;
+        rpc_message *decoded = deserialise_rpc_message(b);
+        buffer_free(b);
+        if (decoded == NULL || decoded->data->data2_len != size) {
+            fprintf(stderr, "Round trip %d failed\n", i);
+            exit(EXIT_FAILURE);
+        }
+        rpc_message_free(decoded, rpc_data_free);
+    }
+    free(payload);
+
+    // the arena belongs to this thread, and no block in it is still live
+    if (bump_arena != NULL) {
+        free(bump_arena->base);
+        free(bump_arena);
+        bump_arena = NULL;
+    }
+    return NULL;
+}
+
+static double run(const rpc_allocator *a, int threads, int trips) {
+    if (rpc_set_allocator(a) != 0) {
+        fprintf(stderr, "Could not set allocator\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_t tids[threads];
+    worker_t workers[threads];
+    uint64_t start = bench_now_usec();
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (worker_t){.trips = trips / threads};
+        pthread_create(&tids[i], NULL, round_trips, &workers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double ns = (bench_now_usec() - start) * 1000.0 / trips;
+    rpc_set_allocator(NULL);
+    pool_drain();
+    return ns;
+}
+
+int main(int argc, char *argv[]) {
+    int trips = 400000, threads = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            trips = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n round_trips] [-t threads]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        pthread_mutex_init(&pool.lock[i], NULL);
+    }
+
+    printf("%d round trips, payloads of 0 to %zu bytes\n\n", trips,
+           sizes[NUM_SIZES - 1]);
+    printf("%-10s %12s", "allocator", "1 thread ns");
+    if (threads > 1) {
+        printf(" %9d thr ns", threads);
+    }
+    printf("\n");
+    const rpc_allocator *allocators[] = {libc_allocator, &bump_allocator,
+                                         &pool_allocator};
+    const char *names[] = {"libc", "bump", "pool"};
+    for (int i = 0; i < 3; i++) {
+        printf("%-10s %12.0f", names[i], run(allocators[i], 1, trips));
+        if (threads > 1) {
+            printf(" %12.0f", run(allocators[i], threads, trips));
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,167 @@
+/* =============================================================================
+   bench.c
+
+   Helpers shared by the benchmark programs.
+
+   Author: David Sha
+============================================================================= */
+#define _DEFAULT_SOURCE
+#include "bench.h"
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+struct bench_samples {
+    pthread_mutex_t lock;
+    uint64_t *data;
+    size_t n;
+    size_t size;
+    int sorted;
+};
+
+/*
+ * Wait until a child process accepts connections on a port, or give up and
+ * exit if it does not come up.
+ */
+static void wait_for_port(pid_t pid, int port) {
+    for (int i = 0; i < 100; i++) {
+        rpc_client *cl = rpc_init_client("::1", port);
+        if (cl != NULL) {
+            rpc_close_client(cl);
+            return;
+        }
+        bench_sleep_usec(20000);
+    }
+    fprintf(stderr, "bench: nothing listening on %d\n", port);
+    kill(pid, SIGKILL);
+    exit(EXIT_FAILURE);
+}
+
+pid_t bench_start_server(int port, void (*setup)(rpc_server *srv)) {
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        rpc_server *srv = rpc_init_server(port);
+        if (srv == NULL) {
+            fprintf(stderr, "bench: could not start server on %d\n", port);
+            _exit(EXIT_FAILURE);
+        }
+        if (setup) {
+            setup(srv);
+        }
+        rpc_serve_all(srv);
+        _exit(EXIT_SUCCESS);
+    }
+
+    wait_for_port(pid, port);
+    return pid;
+}
+
+pid_t bench_start_command(char *const argv[], int port) {
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        execv(argv[0], argv);
+        fprintf(stderr, "bench: could not run %s, run make first\n", argv[0]);
+        _exit(EXIT_FAILURE);
+    }
+    wait_for_port(pid, port);
+    return pid;
+}
+
+void bench_stop_server(pid_t pid) {
+    kill(pid, SIGINT);
+    for (int i = 0; i < 100; i++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            return;
+        }
+        bench_sleep_usec(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+uint64_t bench_now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void bench_sleep_usec(uint64_t usec) {
+    struct timespec ts = {.tv_sec = usec / 1000000,
+                          .tv_nsec = (usec % 1000000) * 1000};
+    while (nanosleep(&ts, &ts) != 0) {
+    }
+}
+
+bench_samples_t *bench_samples_create(void) {
+    bench_samples_t *s = (bench_samples_t *)malloc(sizeof(*s));
+    assert(s);
+    pthread_mutex_init(&s->lock, NULL);
+    s->size = 1024;
+    s->data = (uint64_t *)malloc(s->size * sizeof(*s->data));
+    assert(s->data);
+    s->n = 0;
+    s->sorted = 1;
+    return s;
+}
+
+void bench_samples_add(bench_samples_t *s, uint64_t usec) {
+    pthread_mutex_lock(&s->lock);
+    if (s->n == s->size) {
+        s->size *= 2;
+        s->data = (uint64_t *)realloc(s->data, s->size * sizeof(*s->data));
+        assert(s->data);
+    }
+    s->data[s->n++] = usec;
+    s->sorted = 0;
+    pthread_mutex_unlock(&s->lock);
+}
+
+size_t bench_samples_count(bench_samples_t *s) {
+    pthread_mutex_lock(&s->lock);
+    size_t n = s->n;
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+uint64_t bench_samples_percentile(bench_samples_t *s, double p) {
+    pthread_mutex_lock(&s->lock);
+    uint64_t result = 0;
+    if (s->n > 0) {
+        if (!s->sorted) {
+            qsort(s->data, s->n, sizeof(*s->data), cmp_u64);
+            s->sorted = 1;
+        }
+        size_t i = (size_t)(p / 100.0 * (s->n - 1) + 0.5);
+        result = s->data[i < s->n ? i : s->n - 1];
+    }
+    pthread_mutex_unlock(&s->lock);
+    return result;
+}
+
+void bench_samples_reset(bench_samples_t *s) {
+    pthread_mutex_lock(&s->lock);
+    s->n = 0;
+    s->sorted = 1;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void bench_samples_free(bench_samples_t *s) {
+    pthread_mutex_destroy(&s->lock);
+    free(s->data);
+    free(s);
+}
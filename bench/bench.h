@@ -0,0 +1,94 @@
+/* =============================================================================
+   bench.h
+
+   Helpers shared by the benchmark programs: running a server in a child
+   process, timing and latency percentiles.
+
+   Author: David Sha
+============================================================================= */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "rpc.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* structures =============================================================== */
+
+/*
+ * A growable, thread-safe list of latency samples in microseconds.
+ */
+typedef struct bench_samples bench_samples_t;
+
+/* function prototypes ====================================================== */
+
+/*
+ * Fork a child process that runs an RPC server on the given port. The
+ * function returns once the server accepts connections.
+ *
+ * @param port The port to listen on.
+ * @param setup Called in the child to register handlers before serving.
+ * @return The pid of the child process.
+ */
+pid_t bench_start_server(int port, void (*setup)(rpc_server *srv));
+
+/*
+ * Run a program such as ./rpc-proxy in a child process. The function
+ * returns once the program accepts connections on the given port.
+ *
+ * @param argv The program and its arguments, terminated by NULL.
+ * @param port The port the program listens on.
+ * @return The pid of the child process.
+ */
+pid_t bench_start_command(char *const argv[], int port);
+
+/*
+ * Stop a server started with bench_start_server or bench_start_command. All
+ * clients connected to it should be closed first.
+ *
+ * @param pid The pid of the server process.
+ */
+void bench_stop_server(pid_t pid);
+
+/*
+ * Current time of the monotonic clock in microseconds.
+ */
+uint64_t bench_now_usec(void);
+
+/*
+ * Sleep for the given number of microseconds.
+ */
+void bench_sleep_usec(uint64_t usec);
+
+/*
+ * Create an empty list of samples.
+ */
+bench_samples_t *bench_samples_create(void);
+
+/*
+ * Add a sample. Safe to call from several threads.
+ */
+void bench_samples_add(bench_samples_t *s, uint64_t usec);
+
+/*
+ * Number of samples recorded.
+ */
+size_t bench_samples_count(bench_samples_t *s);
+
+/*
+ * The p-th percentile (0 to 100) of the samples, or 0 if there are none.
+ */
+uint64_t bench_samples_percentile(bench_samples_t *s, double p);
+
+/*
+ * Remove all samples.
+ */
+void bench_samples_reset(bench_samples_t *s);
+
+/*
+ * Free a list of samples.
+ */
+void bench_samples_free(bench_samples_t *s);
+
+#endif
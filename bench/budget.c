@@ -0,0 +1,250 @@
+/* =============================================================================
+   budget.c
+
+   Allocation and system call budget of a call. Steady-state calls are made
+   one after another over loopback, and every malloc, calloc, realloc and
+   free, and every read, write, send and receive on a socket, is counted in
+   both the client and the server. The counts come from wrappers defined
+   here, which the static library's calls bind to ahead of libc's. Calls
+   that wait on a lock or condition variable are not system calls that can
+   be wrapped like this, so voluntary context switches are counted as well.
+
+   The counts per call are printed for each side and checked against the
+   budgets below, and the exit status is non-zero if any is over, so that
+   a change adding work to the path of every call shows up as a failure.
+
+   Usage: ./build/bench-budget [-p port] [-n calls]
+
+   Author: David Sha
+============================================================================= */
+#define _GNU_SOURCE
+#include "bench.h"
+#include "rpc.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Most of each allowed per call, on each side, at what calls take today.
+ * Allocations count the mallocs, callocs and reallocs of the library and
+ * the handler together. Lower these along with any change that saves
+ * some.
+ */
+#define BUDGET_CLIENT_ALLOCS 14
+#define BUDGET_CLIENT_SYSCALLS 2
+#define BUDGET_SERVER_ALLOCS 18
+#define BUDGET_SERVER_SYSCALLS 2
+
+#define WARMUP_CALLS 1000
+
+/*
+ * Counts of one process.
+ */
+typedef struct {
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long syscalls;
+    unsigned long switches;
+} counts_t;
+
+static _Atomic unsigned long allocs = 0;
+static _Atomic unsigned long frees = 0;
+static _Atomic unsigned long syscalls = 0;
+
+/* wrappers ================================================================= */
+
+/*
+ * glibc's own allocator, behind the malloc defined here.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (ptr != NULL) {
+        atomic_fetch_add_explicit(&frees, 1, memory_order_relaxed);
+    }
+    __libc_free(ptr);
+}
+
+ssize_t read(int fd, void *buf, size_t size) {
+    atomic_fetch_add_explicit(&syscalls, 1, memory_order_relaxed);
+    return syscall(SYS_read, fd, buf, size);
+}
+
+ssize_t write(int fd, const void *buf, size_t size) {
+    atomic_fetch_add_explicit(&syscalls, 1, memory_order_relaxed);
+    return syscall(SYS_write, fd, buf, size);
+}
+
+ssize_t send(int fd, const void *buf, size_t size, int flags) {
+    atomic_fetch_add_explicit(&syscalls, 1, memory_order_relaxed);
+    return syscall(SYS_sendto, fd, buf, size, flags, NULL, 0);
+}
+
+ssize_t recv(int fd, void *buf, size_t size, int flags) {
+    atomic_fetch_add_explicit(&syscalls, 1, memory_order_relaxed);
+    return syscall(SYS_recvfrom, fd, buf, size, flags, NULL, NULL);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *mh, int flags) {
+    atomic_fetch_add_explicit(&syscalls, 1, memory_order_relaxed);
+    return syscall(SYS_sendmsg, fd, mh, flags);
+}
+
+ssize_t recvmsg(int fd, struct msghdr *mh, int flags) {
+    atomic_fetch_add_explicit(&syscalls, 1, memory_order_relaxed);
+    return syscall(SYS_recvmsg, fd, mh, flags);
+}
+
+/* calls ==================================================================== */
+static void get_counts(counts_t *c) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    c->allocs = atomic_load(&allocs);
+    c->frees = atomic_load(&frees);
+    c->syscalls = atomic_load(&syscalls);
+    c->switches = ru.ru_nvcsw;
+}
+
+static rpc_data *add(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1 + 1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static rpc_data *counts(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = 0;
+    out->data2_len = sizeof(counts_t);
+    out->data2 = malloc(sizeof(counts_t));
+    get_counts((counts_t *)out->data2);
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "add", add);
+    rpc_register(srv, "counts", counts);
+}
+
+static void fetch_counts(rpc_client *cl, rpc_handle *h, counts_t *c) {
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    rpc_data *reply = rpc_call(cl, h, &payload);
+    if (reply == NULL || reply->data2_len != sizeof(*c)) {
+        fprintf(stderr, "Could not fetch the server's counts\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(c, reply->data2, sizeof(*c));
+    rpc_data_free(reply);
+}
+
+/*
+ * Print the counts per call of one side, and whether they are within the
+ * budget. They are rounded to whole counts before checking, as the odd
+ * allocation or system call of a background thread is spread over all the
+ * calls.
+ *
+ * @return TRUE if they are.
+ */
+static int report(const char *side, counts_t *before, counts_t *after,
+                  int calls, long alloc_budget, long syscall_budget) {
+    double a = (double)(after->allocs - before->allocs) / calls;
+    double f = (double)(after->frees - before->frees) / calls;
+    double s = (double)(after->syscalls - before->syscalls) / calls;
+    double w = (double)(after->switches - before->switches) / calls;
+    int ok =
+        (long)(a + 0.5) <= alloc_budget && (long)(s + 0.5) <= syscall_budget;
+    printf("%-8s %8.2f %8.2f %9.2f %9.2f   %s\n", side, a, f, s, w,
+           ok ? "ok" : "OVER BUDGET");
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int port = 6700, calls = 20000;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            calls = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-n calls]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pid_t pid = bench_start_server(port, setup);
+    rpc_client *cl = rpc_init_client("::1", port);
+    if (cl == NULL) {
+        fprintf(stderr, "Could not connect to server\n");
+        exit(EXIT_FAILURE);
+    }
+    rpc_handle *h = rpc_find(cl, "add");
+    rpc_handle *counts_h = rpc_find(cl, "counts");
+    unsigned char data[16] = {0};
+    rpc_data payload = {.data1 = 0, .data2_len = sizeof(data), .data2 = data};
+
+    // warm up, so that buffers and pools are at their steady-state sizes
+    for (int i = 0; i < WARMUP_CALLS; i++) {
+        rpc_data_free(rpc_call(cl, h, &payload));
+    }
+
+    counts_t client_before, client_after, server_before, server_after;
+    fetch_counts(cl, counts_h, &server_before);
+    get_counts(&client_before);
+    for (int i = 0; i < calls; i++) {
+        rpc_data *reply = rpc_call(cl, h, &payload);
+        if (reply == NULL) {
+            fprintf(stderr, "Call failed\n");
+            exit(EXIT_FAILURE);
+        }
+        rpc_data_free(reply);
+    }
+    get_counts(&client_after);
+    fetch_counts(cl, counts_h, &server_after);
+
+    printf("%d calls with a %zu byte payload, per call\n\n", calls,
+           sizeof(data));
+    printf("%-8s %8s %8s %9s %9s\n", "side", "allocs", "frees", "syscalls",
+           "switches");
+    int ok = report("client", &client_before, &client_after, calls,
+                    BUDGET_CLIENT_ALLOCS, BUDGET_CLIENT_SYSCALLS);
+    ok &= report("server", &server_before, &server_after, calls,
+                 BUDGET_SERVER_ALLOCS, BUDGET_SERVER_SYSCALLS);
+    printf("\nbudget: client %d allocs %d syscalls, server %d allocs %d "
+           "syscalls\n",
+           BUDGET_CLIENT_ALLOCS, BUDGET_CLIENT_SYSCALLS, BUDGET_SERVER_ALLOCS,
+           BUDGET_SERVER_SYSCALLS);
+
+    free(h);
+    free(counts_h);
+    rpc_close_client(cl);
+    bench_stop_server(pid);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,158 @@
+/* =============================================================================
+   bulkhead.c
+
+   A slow handler and a fast handler on one server. Many callers hammer the
+   slow handler while a few call the fast one. Without a bulkhead the slow
+   calls take every worker; with one, the slow handler is limited to a few
+   workers and the rest stay free for the fast handler.
+
+   Usage: ./build/bench-bulkhead [-p port] [-s slow_threads] [-d seconds]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FAST_THREADS 2
+#define SLOW_COST_USEC 5000
+#define SLOW_LIMIT 2
+#define SLOW_QUEUE 4
+
+typedef struct {
+    rpc_client *cl;
+    rpc_handle *h;
+    volatile int *running;
+    bench_samples_t *latency;
+    unsigned long failed;
+} caller_t;
+
+static rpc_data *reply_with(int value) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = value;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static rpc_data *slow(rpc_data *in) {
+    bench_sleep_usec(SLOW_COST_USEC);
+    return reply_with(in->data1);
+}
+
+static rpc_data *fast(rpc_data *in) {
+    return reply_with(in->data1 + 1);
+}
+
+static void setup_plain(rpc_server *srv) {
+    rpc_register(srv, "slow", slow);
+    rpc_register(srv, "fast", fast);
+}
+
+static void setup_bulkhead(rpc_server *srv) {
+    rpc_handler_opts opts = {.max_concurrency = SLOW_LIMIT,
+                             .max_queue = SLOW_QUEUE};
+    rpc_register_ex(srv, "slow", slow, &opts);
+    rpc_register(srv, "fast", fast);
+}
+
+static void *caller(void *arg) {
+    caller_t *c = (caller_t *)arg;
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    while (*c->running) {
+        uint64_t start = bench_now_usec();
+        rpc_data *reply = rpc_call(c->cl, c->h, &payload);
+        if (reply != NULL) {
+            bench_samples_add(c->latency, bench_now_usec() - start);
+            rpc_data_free(reply);
+        } else {
+            c->failed++;
+        }
+    }
+    return NULL;
+}
+
+static void run(const char *name, void (*setup)(rpc_server *), int port,
+                int slow_threads, int seconds) {
+    pid_t server = bench_start_server(port, setup);
+    rpc_client *cl = rpc_init_client("::1", port);
+    if (cl == NULL) {
+        fprintf(stderr, "Could not connect to server\n");
+        exit(EXIT_FAILURE);
+    }
+    rpc_handle *slow_h = rpc_find(cl, "slow");
+    rpc_handle *fast_h = rpc_find(cl, "fast");
+    volatile int running = 1;
+    bench_samples_t *fast_latency = bench_samples_create();
+    bench_samples_t *slow_latency = bench_samples_create();
+
+    int n = FAST_THREADS + slow_threads;
+    caller_t callers[n];
+    pthread_t threads[n];
+    for (int i = 0; i < n; i++) {
+        int is_slow = i >= FAST_THREADS;
+        callers[i] = (caller_t){
+            .cl = cl,
+            .h = is_slow ? slow_h : fast_h,
+            .running = &running,
+            .latency = is_slow ? slow_latency : fast_latency,
+            .failed = 0,
+        };
+        pthread_create(&threads[i], NULL, caller, &callers[i]);
+    }
+    bench_sleep_usec(seconds * 1000000ULL);
+    running = 0;
+    unsigned long rejected = 0;
+    for (int i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+        rejected += callers[i].failed;
+    }
+
+    printf("%-10s %8lu %8lu %10.0f %10.0f %9lu\n", name,
+           (unsigned long)bench_samples_percentile(fast_latency, 50),
+           (unsigned long)bench_samples_percentile(fast_latency, 99),
+           (double)bench_samples_count(fast_latency) / seconds,
+           (double)bench_samples_count(slow_latency) / seconds, rejected);
+    bench_samples_free(fast_latency);
+    bench_samples_free(slow_latency);
+    free(slow_h);
+    free(fast_h);
+    rpc_close_client(cl);
+    bench_stop_server(server);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 4800, slow_threads = 16, seconds = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:d:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            slow_threads = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-p port] [-s slow_threads] [-d seconds]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%d fast callers, %d slow callers (%d us calls), bulkhead of %d "
+           "running and %d queued\n\n",
+           FAST_THREADS, slow_threads, SLOW_COST_USEC, SLOW_LIMIT, SLOW_QUEUE);
+    printf("%-10s %8s %8s %10s %10s %9s\n", "mode", "fast p50", "fast p99",
+           "fast/s", "slow/s", "rejected");
+    run("plain", setup_plain, port, slow_threads, seconds);
+    run("bulkhead", setup_bulkhead, port + 1, slow_threads, seconds);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/* =============================================================================
+   busypoll.c
+
+   Round-trip latency of back-to-back small calls on loopback, with the
+   client and server sleeping in the kernel while they wait, and with both
+   spinning first. Spinning only pays off with a core for every spinning
+   thread, and the library does not spin at all with a single CPU, so the
+   number of online CPUs is printed alongside.
+
+   Usage: ./build/bench-busypoll [-p port] [-s spin_usec] [-n calls]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+static int spin_usec = 50;
+
+static rpc_data *add(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1 + 1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static void setup_blocking(rpc_server *srv) {
+    rpc_register(srv, "add", add);
+}
+
+static void setup_busy_poll(rpc_server *srv) {
+    rpc_register(srv, "add", add);
+    rpc_server_set_busy_poll(srv, spin_usec);
+}
+
+static double cpu_usec(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void run(const char *name, void (*setup)(rpc_server *), int spin,
+                int port, int calls) {
+    pid_t server = bench_start_server(port, setup);
+    rpc_client *cl = rpc_init_client("::1", port);
+    if (cl == NULL) {
+        fprintf(stderr, "Could not connect to server\n");
+        exit(EXIT_FAILURE);
+    }
+    rpc_client_set_busy_poll(cl, spin);
+    rpc_handle *h = rpc_find(cl, "add");
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+
+    // warm up, then measure
+    for (int i = 0; i < calls / 10; i++) {
+        rpc_data_free(rpc_call(cl, h, &payload));
+    }
+    bench_samples_t *s = bench_samples_create();
+    double cpu = cpu_usec();
+    for (int i = 0; i < calls; i++) {
+        uint64_t start = bench_now_usec();
+        rpc_data *reply = rpc_call(cl, h, &payload);
+        bench_samples_add(s, bench_now_usec() - start);
+        rpc_data_free(reply);
+    }
+    cpu = cpu_usec() - cpu;
+
+    printf("%-10s %8lu %8lu %9lu %14.1f\n", name,
+           (unsigned long)bench_samples_percentile(s, 50),
+           (unsigned long)bench_samples_percentile(s, 99),
+           (unsigned long)bench_samples_percentile(s, 99.9), cpu / calls);
+    bench_samples_free(s);
+    free(h);
+    rpc_close_client(cl);
+    bench_stop_server(server);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 5300, calls = 20000;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:n:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            spin_usec = atoi(optarg);
+            break;
+        case 'n':
+            calls = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-s spin_usec] [-n calls]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%d back-to-back calls, spinning up to %d us, %ld CPUs online\n\n",
+           calls, spin_usec, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-10s %8s %8s %9s %14s\n", "mode", "p50 us", "p99 us", "p99.9 us",
+           "client cpu us");
+    run("blocking", setup_blocking, 0, port, calls);
+    run("busy poll", setup_busy_poll, spin_usec, port + 1, calls);
+    return 0;
+}
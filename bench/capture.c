@@ -0,0 +1,152 @@
+/* =============================================================================
+   capture.c
+
+   Overhead of capturing a server's requests with rpc_server_set_capture.
+   Client threads make calls with small payloads to a trivial handler, on
+   a server with capture off and then on, and the capture file is read back
+   to check that every call made it in. The capture left behind can be
+   replayed with ./rpc-replay -f file addr:port.
+
+   Usage: ./build/bench-capture [-p port] [-n calls] [-t threads] [-f file]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "capture.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    rpc_client *cl;
+    rpc_handle *h;
+    int calls;
+} caller_t;
+
+static const char *capture_path = "/tmp/rpc.cap";
+static int capturing = 0;
+
+static rpc_data *add(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1 + 1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "add", add);
+    if (capturing && rpc_server_set_capture(srv, capture_path) != 0) {
+        fprintf(stderr, "Could not create %s\n", capture_path);
+    }
+}
+
+static void *caller(void *arg) {
+    caller_t *c = (caller_t *)arg;
+    unsigned char data[64] = {0};
+    for (int i = 0; i < c->calls; i++) {
+        rpc_data payload = {
+            .data1 = i, .data2_len = sizeof(data), .data2 = data};
+        rpc_data *reply = rpc_call(c->cl, c->h, &payload);
+        if (reply == NULL) {
+            fprintf(stderr, "Call failed\n");
+            exit(EXIT_FAILURE);
+        }
+        rpc_data_free(reply);
+    }
+    return NULL;
+}
+
+/*
+ * Count the requests in a capture file, and add up their sizes.
+ */
+static long count_requests(const char *path, size_t *bytes) {
+    FILE *f = fopen(path, "rb");
+    *bytes = 0;
+    if (f == NULL || capture_read_header(f, NULL) != 0) {
+        return 0;
+    }
+    long n = 0;
+    capture_record_t rec;
+    while (capture_read(f, &rec)) {
+        n++;
+        *bytes += rec.len;
+        rpc_free(rec.bytes);
+    }
+    fclose(f);
+    return n;
+}
+
+static void run(const char *name, int capture, int port, int calls,
+                int threads) {
+    // the server is forked from here, so it sees the same setting
+    capturing = capture;
+    remove(capture_path);
+    pid_t server = bench_start_server(port, setup);
+    caller_t callers[threads];
+    pthread_t tids[threads];
+    for (int i = 0; i < threads; i++) {
+        callers[i].cl = rpc_init_client("::1", port);
+        if (callers[i].cl == NULL) {
+            fprintf(stderr, "Could not connect to server\n");
+            exit(EXIT_FAILURE);
+        }
+        callers[i].h = rpc_find(callers[i].cl, "add");
+        callers[i].calls = calls / threads;
+    }
+    uint64_t start = bench_now_usec();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, caller, &callers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    uint64_t elapsed = bench_now_usec() - start;
+    for (int i = 0; i < threads; i++) {
+        free(callers[i].h);
+        rpc_close_client(callers[i].cl);
+    }
+
+    // the capture is flushed once the server shuts down
+    bench_stop_server(server);
+    size_t bytes;
+    long captured = count_requests(capture_path, &bytes);
+    printf("%-8s %10.0f %10ld %10zu\n", name,
+           (calls / threads * threads) / (elapsed / 1e6), captured, bytes);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 6500, calls = 20000, threads = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:t:f:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            calls = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'f':
+            capture_path = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-p port] [-n calls] [-t threads] [-f file]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%d calls over %d connections\n\n", calls, threads);
+    printf("%-8s %10s %10s %10s\n", "capture", "calls/s", "requests", "bytes");
+    run("off", 0, port, calls, threads);
+    run("on", 1, port + 1, calls, threads);
+    printf("\nreplay with: ./rpc-replay -f %s addr:port\n", capture_path);
+    return 0;
+}
@@ -0,0 +1,228 @@
+/* =============================================================================
+   chash.c
+
+   Distribution quality, remapping and lookup cost of rendezvous hashing,
+   compared with jump consistent hashing and plain modulo. Finishes with an
+   end-to-end run of rpc_group_call_key against local servers.
+
+   Usage: ./build/bench-chash [-p base_port] [-k keys]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "chash.h"
+#include "rpc.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NODES 128
+
+typedef enum { RENDEZVOUS, JUMP, MODULO } method_t;
+static const char *method_names[] = {"rendezvous", "jump", "modulo"};
+
+static int lookup(method_t method, uint64_t key, const uint64_t *nodes,
+                  int n) {
+    switch (method) {
+    case RENDEZVOUS:
+        return rendezvous_hash(key, nodes, n);
+    case JUMP:
+        return jump_hash(key, n);
+    default:
+        return key % n;
+    }
+}
+
+static uint64_t key_hash(int i) {
+    char key[32];
+    int len = snprintf(key, sizeof(key), "user-%d", i);
+    return hash_bytes(key, len);
+}
+
+static void make_nodes(uint64_t *nodes, int n) {
+    for (int i = 0; i < n; i++) {
+        char id[32];
+        int len = snprintf(id, sizeof(id), "::1:%d", 5000 + i);
+        nodes[i] = hash_bytes(id, len);
+    }
+}
+
+static void distribution(method_t method, int n, int num_keys) {
+    uint64_t nodes[MAX_NODES];
+    int counts[MAX_NODES] = {0};
+    make_nodes(nodes, n);
+    for (int i = 0; i < num_keys; i++) {
+        counts[lookup(method, key_hash(i), nodes, n)]++;
+    }
+    double mean = (double)num_keys / n, var = 0;
+    int max = 0;
+    for (int i = 0; i < n; i++) {
+        var += (counts[i] - mean) * (counts[i] - mean);
+        max = counts[i] > max ? counts[i] : max;
+    }
+    printf("%-11s %5d %10.3f %10.2f%%\n", method_names[method], n, max / mean,
+           100 * sqrt(var / n) / mean);
+}
+
+/*
+ * Fraction of keys that move when a node is added at the end, and when the
+ * node in the middle is removed. Jump hash can only remove the last bucket,
+ * which reindexes nothing, so removing from the middle means renumbering.
+ */
+static void remapping(method_t method, int n, int num_keys) {
+    uint64_t nodes[MAX_NODES], removed[MAX_NODES];
+    make_nodes(nodes, n + 1);
+    int mid = n / 2;
+    memcpy(removed, nodes, mid * sizeof(*nodes));
+    memcpy(removed + mid, nodes + mid + 1, (n - mid - 1) * sizeof(*nodes));
+
+    int added_moved = 0, removed_moved = 0;
+    for (int i = 0; i < num_keys; i++) {
+        uint64_t key = key_hash(i);
+        int before = lookup(method, key, nodes, n);
+        added_moved += before != lookup(method, key, nodes, n + 1);
+
+        // compare node identities, since indexes shift after the removal
+        int after = lookup(method, key, removed, n - 1);
+        int after_node = after < mid ? after : after + 1;
+        removed_moved += before != after_node;
+    }
+    printf("%-11s %5d %10.1f%% %10.1f%% %10.1f%%\n", method_names[method], n,
+           100.0 * added_moved / num_keys, 100.0 / (n + 1),
+           100.0 * removed_moved / num_keys);
+}
+
+static void lookup_cost(method_t method, int n) {
+    uint64_t nodes[MAX_NODES];
+    make_nodes(nodes, n);
+    int iterations = 2000000;
+    volatile int sink = 0;
+    uint64_t start = bench_now_usec();
+    for (int i = 0; i < iterations; i++) {
+        sink += lookup(method, key_hash(i), nodes, n);
+    }
+    double ns = (bench_now_usec() - start) * 1000.0 / iterations;
+    printf("%-11s %5d %10.1f\n", method_names[method], n, ns);
+}
+
+static int server_port;
+
+static rpc_data *whoami(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = server_port;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "whoami", whoami);
+}
+
+static pid_t start(int port) {
+    server_port = port;
+    return bench_start_server(port, setup);
+}
+
+static void end_to_end(int base_port, int num_keys) {
+    int n = 3;
+    pid_t servers[4];
+    char *addrs[4] = {"::1", "::1", "::1", "::1"};
+    int ports[4];
+    for (int i = 0; i < 4; i++) {
+        ports[i] = base_port + i;
+        servers[i] = start(ports[i]);
+    }
+
+    rpc_group *g = rpc_init_group(addrs, ports, n);
+    rpc_handle *h = rpc_group_find(g, "whoami");
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    int *owner = (int *)malloc(num_keys * sizeof(*owner));
+    int sticky = 0, moved = 0;
+
+    uint64_t begin = bench_now_usec();
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < num_keys; i++) {
+            char key[32];
+            int len = snprintf(key, sizeof(key), "user-%d", i);
+            rpc_data *reply = rpc_group_call_key(g, key, len, h, &payload);
+            if (reply == NULL) {
+                continue;
+            }
+            if (round == 0) {
+                owner[i] = reply->data1;
+            } else {
+                sticky += owner[i] == reply->data1;
+            }
+            rpc_data_free(reply);
+        }
+    }
+    double usec = (double)(bench_now_usec() - begin) / (3 * num_keys);
+
+    rpc_group_add(g, addrs[3], ports[3]);
+    for (int i = 0; i < num_keys; i++) {
+        char key[32];
+        int len = snprintf(key, sizeof(key), "user-%d", i);
+        rpc_data *reply = rpc_group_call_key(g, key, len, h, &payload);
+        if (reply != NULL) {
+            moved += owner[i] != reply->data1;
+            rpc_data_free(reply);
+        }
+    }
+
+    printf("%d keys over %d servers, %.1f us per call\n", num_keys, n, usec);
+    printf("  repeated calls hitting the same server: %.1f%%\n",
+           100.0 * sticky / (2 * num_keys));
+    printf("  keys moved after adding a server: %.1f%% (ideal %.1f%%)\n",
+           100.0 * moved / num_keys, 100.0 / (n + 1));
+
+    free(owner);
+    free(h);
+    rpc_close_group(g);
+    for (int i = 0; i < 4; i++) {
+        bench_stop_server(servers[i]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int base_port = 4300, num_keys = 1000000;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-p") == 0) {
+            base_port = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-k") == 0) {
+            num_keys = atoi(argv[i + 1]);
+        }
+    }
+    int sizes[] = {3, 8, 32, 64};
+    int num_sizes = sizeof(sizes) / sizeof(*sizes);
+
+    printf("Distribution of %d keys\n", num_keys);
+    printf("%-11s %5s %10s %11s\n", "method", "nodes", "max/mean", "stddev");
+    for (int m = RENDEZVOUS; m <= MODULO; m++) {
+        for (int i = 0; i < num_sizes; i++) {
+            distribution(m, sizes[i], num_keys);
+        }
+    }
+
+    printf("\nKeys moved\n");
+    printf("%-11s %5s %11s %11s %11s\n", "method", "nodes", "add 1",
+           "ideal", "remove mid");
+    for (int m = RENDEZVOUS; m <= MODULO; m++) {
+        for (int i = 0; i < num_sizes; i++) {
+            remapping(m, sizes[i], num_keys);
+        }
+    }
+
+    printf("\nLookup cost including hashing the key\n");
+    printf("%-11s %5s %10s\n", "method", "nodes", "ns");
+    for (int m = RENDEZVOUS; m <= MODULO; m++) {
+        for (int i = 0; i < num_sizes; i++) {
+            lookup_cost(m, sizes[i]);
+        }
+    }
+
+    printf("\nEnd to end with rpc_group_call_key\n");
+    end_to_end(base_port, 2000);
+    return 0;
+}
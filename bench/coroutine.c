@@ -0,0 +1,167 @@
+/* =============================================================================
+   coroutine.c
+
+   Throughput of a handler that makes a nested call to a second service
+   before replying. The second service takes a couple of milliseconds per
+   call and runs on several local servers so that it is not the bottleneck.
+   Compares a plain handler, which holds its worker for the whole nested
+   round trip, with the same handler registered as a coroutine, which gives
+   the worker back while it waits.
+
+   Usage: ./build/bench-coroutine [-p port] [-c callers] [-d seconds]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BACKENDS 4
+#define BACKEND_DELAY_USEC 2000
+
+typedef struct {
+    rpc_client *cl;
+    rpc_handle *h;
+    volatile int *running;
+    bench_samples_t *latency;
+} caller_t;
+
+static int backend_port;
+static rpc_client *backends[BACKENDS];
+static rpc_handle *backend_handles[BACKENDS];
+static atomic_uint next_backend;
+
+static rpc_data *wait_a_bit(rpc_data *in) {
+    bench_sleep_usec(BACKEND_DELAY_USEC);
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1 + 1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static rpc_data *nested(rpc_data *in) {
+    unsigned i = atomic_fetch_add(&next_backend, 1) % BACKENDS;
+    rpc_data *out = rpc_call(backends[i], backend_handles[i], in);
+    if (out == NULL) {
+        out = (rpc_data *)malloc(sizeof(*out));
+        out->data1 = -1;
+        out->data2_len = 0;
+        out->data2 = NULL;
+    }
+    return out;
+}
+
+static void setup_backend(rpc_server *srv) {
+    rpc_register(srv, "wait", wait_a_bit);
+}
+
+static void connect_backends(void) {
+    for (int i = 0; i < BACKENDS; i++) {
+        backends[i] = rpc_init_client("::1", backend_port + i);
+        backend_handles[i] = rpc_find(backends[i], "wait");
+    }
+}
+
+static void setup_plain(rpc_server *srv) {
+    connect_backends();
+    rpc_register(srv, "nested", nested);
+}
+
+static void setup_coroutine(rpc_server *srv) {
+    connect_backends();
+    rpc_handler_opts opts = {.coroutine = 1};
+    rpc_register_ex(srv, "nested", nested, &opts);
+}
+
+static void *caller(void *arg) {
+    caller_t *c = (caller_t *)arg;
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    while (*c->running) {
+        uint64_t start = bench_now_usec();
+        rpc_data *reply = rpc_call(c->cl, c->h, &payload);
+        if (reply != NULL) {
+            if (reply->data1 == 1) {
+                bench_samples_add(c->latency, bench_now_usec() - start);
+            }
+            rpc_data_free(reply);
+        }
+    }
+    return NULL;
+}
+
+static void run(const char *name, void (*setup)(rpc_server *), int port,
+                int callers, int seconds) {
+    pid_t server = bench_start_server(port, setup);
+    rpc_client *cl = rpc_init_client("::1", port);
+    if (cl == NULL) {
+        fprintf(stderr, "Could not connect to server\n");
+        exit(EXIT_FAILURE);
+    }
+    rpc_handle *h = rpc_find(cl, "nested");
+    volatile int running = 1;
+    bench_samples_t *latency = bench_samples_create();
+    caller_t c = {.cl = cl, .h = h, .running = &running, .latency = latency};
+    pthread_t threads[callers];
+    for (int i = 0; i < callers; i++) {
+        pthread_create(&threads[i], NULL, caller, &c);
+    }
+    bench_sleep_usec(seconds * 1000000ULL);
+    running = 0;
+    for (int i = 0; i < callers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("%-10s %10.0f %8lu %8lu\n", name,
+           (double)bench_samples_count(latency) / seconds,
+           (unsigned long)bench_samples_percentile(latency, 50),
+           (unsigned long)bench_samples_percentile(latency, 99));
+    bench_samples_free(latency);
+    free(h);
+    rpc_close_client(cl);
+    bench_stop_server(server);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 5100, callers = 64, seconds = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:c:d:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            callers = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-c callers] [-d seconds]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    backend_port = port + 10;
+    pid_t backend_pids[BACKENDS];
+    for (int i = 0; i < BACKENDS; i++) {
+        backend_pids[i] = bench_start_server(backend_port + i, setup_backend);
+    }
+
+    printf("%d callers, nested call to %d backends taking %d us\n\n", callers,
+           BACKENDS, BACKEND_DELAY_USEC);
+    printf("%-10s %10s %8s %8s\n", "handler", "calls/s", "p50 us", "p99 us");
+    run("plain", setup_plain, port, callers, seconds);
+    run("coroutine", setup_coroutine, port + 1, callers, seconds);
+
+    for (int i = 0; i < BACKENDS; i++) {
+        bench_stop_server(backend_pids[i]);
+    }
+    return 0;
+}
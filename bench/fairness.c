@@ -0,0 +1,170 @@
+/* =============================================================================
+   fairness.c
+
+   One heavy client pipelining many calls on its connection against a few
+   light clients, all keeping the server's workers busy. Reports each
+   client's throughput and Jain's fairness index over the throughput per
+   unit of weight, first with equal weights and then with the heavy client
+   given a larger weight.
+
+   The heavy client connects through the IPv4-mapped loopback address so
+   that it can be given its own weight.
+
+   Usage: ./build/bench-fairness [-p port] [-t heavy_threads] [-d seconds]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LIGHT_CLIENTS 3
+#define LIGHT_THREADS 8
+#define CALL_COST_USEC 1000
+#define HEAVY_WEIGHT 3
+
+typedef struct {
+    rpc_client *cl;
+    rpc_handle *h;
+    volatile int *running;
+    unsigned long calls;
+} caller_t;
+
+static rpc_data *work(rpc_data *in) {
+    bench_sleep_usec(CALL_COST_USEC);
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static void setup_equal(rpc_server *srv) {
+    rpc_register(srv, "work", work);
+}
+
+static void setup_weighted(rpc_server *srv) {
+    rpc_register(srv, "work", work);
+    rpc_server_set_client_weight(srv, "127.0.0.1", HEAVY_WEIGHT);
+}
+
+static void *caller(void *arg) {
+    caller_t *c = (caller_t *)arg;
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    while (*c->running) {
+        rpc_data *reply = rpc_call(c->cl, c->h, &payload);
+        if (reply != NULL) {
+            c->calls++;
+            rpc_data_free(reply);
+        }
+    }
+    return NULL;
+}
+
+static double jain(double *x, int n) {
+    double sum = 0, squares = 0;
+    for (int i = 0; i < n; i++) {
+        sum += x[i];
+        squares += x[i] * x[i];
+    }
+    return squares == 0 ? 0 : sum * sum / (n * squares);
+}
+
+static void run(const char *name, void (*setup)(rpc_server *), int heavy_weight,
+                int port, int heavy_threads, int seconds) {
+    pid_t server = bench_start_server(port, setup);
+    int clients = LIGHT_CLIENTS + 1;
+    rpc_client *cl[clients];
+    rpc_handle *h[clients];
+    int threads_of[clients];
+    for (int i = 0; i < clients; i++) {
+        // client 0 is the heavy one
+        cl[i] = rpc_init_client(i == 0 ? "::ffff:127.0.0.1" : "::1", port);
+        if (cl[i] == NULL) {
+            fprintf(stderr, "Could not connect to server\n");
+            exit(EXIT_FAILURE);
+        }
+        h[i] = rpc_find(cl[i], "work");
+        threads_of[i] = i == 0 ? heavy_threads : LIGHT_THREADS;
+    }
+
+    volatile int running = 1;
+    int n = heavy_threads + LIGHT_CLIENTS * LIGHT_THREADS;
+    caller_t callers[n];
+    pthread_t threads[n];
+    int owner[n];
+    for (int i = 0, k = 0; i < clients; i++) {
+        for (int j = 0; j < threads_of[i]; j++, k++) {
+            owner[k] = i;
+            callers[k] = (caller_t){
+                .cl = cl[i], .h = h[i], .running = &running, .calls = 0};
+            pthread_create(&threads[k], NULL, caller, &callers[k]);
+        }
+    }
+    bench_sleep_usec(seconds * 1000000ULL);
+    running = 0;
+    double rate[clients], share[clients], total = 0;
+    memset(rate, 0, sizeof(rate));
+    for (int k = 0; k < n; k++) {
+        pthread_join(threads[k], NULL);
+        rate[owner[k]] += (double)callers[k].calls / seconds;
+    }
+    for (int i = 0; i < clients; i++) {
+        share[i] = rate[i] / (i == 0 ? heavy_weight : 1);
+        total += rate[i];
+    }
+
+    printf("%-8s %8.0f", name, rate[0]);
+    for (int i = 1; i < clients; i++) {
+        printf(" %8.0f", rate[i]);
+    }
+    printf(" %8.0f %6.3f\n", total, jain(share, clients));
+
+    for (int i = 0; i < clients; i++) {
+        free(h[i]);
+        rpc_close_client(cl[i]);
+    }
+    bench_stop_server(server);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 4900, heavy_threads = 64, seconds = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:t:d:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            heavy_threads = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-p port] [-t heavy_threads] [-d seconds]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("1 heavy client with %d threads, %d light clients with %d threads, "
+           "%d us calls\n\n",
+           heavy_threads, LIGHT_CLIENTS, LIGHT_THREADS, CALL_COST_USEC);
+    printf("%-8s %8s", "weights", "heavy/s");
+    for (int i = 1; i <= LIGHT_CLIENTS; i++) {
+        char label[16];
+        snprintf(label, sizeof(label), "light%d/s", i);
+        printf(" %8s", label);
+    }
+    printf(" %8s %6s\n", "total/s", "jain");
+    run("equal", setup_equal, 1, port, heavy_threads, seconds);
+    run("heavy x3", setup_weighted, HEAVY_WEIGHT, port + 1, heavy_threads,
+        seconds);
+    return 0;
+}
@@ -0,0 +1,205 @@
+/* =============================================================================
+   fanout.c
+
+   Completion time of calling the same function on many shards. Compares one
+   thread per shard doing a blocking rpc_call against rpc_call_all from a
+   single thread, and against waiting for a quorum or the first reply with
+   rpc_call_some.
+
+   Each shard runs in its own process. The handler sleeps for data1
+   microseconds (+/- 25% jitter), and one call in 50 is 10x slower to give
+   the stragglers a tail.
+
+   Usage: ./build/bench-fanout [-p base_port] [-r rounds]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_SHARDS 50
+#define COST_USEC 1000
+#define SLOW_ONE_IN 50
+
+static const int shard_counts[] = {1, 5, 10, 25, 50};
+
+typedef struct {
+    rpc_client **clients;
+    rpc_handle *h;
+    int n;
+    volatile int running;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+} threads_t;
+
+typedef struct {
+    threads_t *run;
+    int index;
+} worker_t;
+
+static rpc_data *work(rpc_data *in) {
+    static __thread unsigned int seed;
+    if (seed == 0) {
+        seed = (unsigned int)getpid();
+    }
+    int cost = in->data1 * 3 / 4 + rand_r(&seed) % (in->data1 / 2 + 1);
+    if (rand_r(&seed) % SLOW_ONE_IN == 0) {
+        cost *= 10;
+    }
+    bench_sleep_usec(cost);
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = cost;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "work", work);
+}
+
+static void *worker(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    threads_t *run = w->run;
+    rpc_data payload = {.data1 = COST_USEC, .data2_len = 0, .data2 = NULL};
+    while (1) {
+        pthread_barrier_wait(&run->start);
+        if (!run->running) {
+            break;
+        }
+        rpc_data *reply = rpc_call(run->clients[w->index], run->h, &payload);
+        if (reply != NULL) {
+            rpc_data_free(reply);
+        }
+        pthread_barrier_wait(&run->done);
+    }
+    return NULL;
+}
+
+static void report(const char *name, int n, bench_samples_t *s,
+                   uint64_t total) {
+    printf("%-14s %6d %10.0f %10lu %10lu\n", name, n,
+           (double)total / bench_samples_count(s),
+           (unsigned long)bench_samples_percentile(s, 50),
+           (unsigned long)bench_samples_percentile(s, 99));
+    bench_samples_reset(s);
+}
+
+/*
+ * One persistent thread per shard, released together for each round.
+ */
+static void run_threads(rpc_client **clients, rpc_handle *h, int n,
+                        int rounds, bench_samples_t *s) {
+    threads_t run = {.clients = clients, .h = h, .n = n, .running = 1};
+    pthread_barrier_init(&run.start, NULL, n + 1);
+    pthread_barrier_init(&run.done, NULL, n + 1);
+    pthread_t threads[n];
+    worker_t workers[n];
+    for (int i = 0; i < n; i++) {
+        workers[i] = (worker_t){.run = &run, .index = i};
+        pthread_create(&threads[i], NULL, worker, &workers[i]);
+    }
+
+    uint64_t total = 0;
+    for (int r = 0; r < rounds; r++) {
+        uint64_t start = bench_now_usec();
+        pthread_barrier_wait(&run.start);
+        pthread_barrier_wait(&run.done);
+        uint64_t elapsed = bench_now_usec() - start;
+        bench_samples_add(s, elapsed);
+        total += elapsed;
+    }
+    run.running = 0;
+    pthread_barrier_wait(&run.start);
+    for (int i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&run.start);
+    pthread_barrier_destroy(&run.done);
+    report("threads", n, s, total);
+}
+
+static void run_some(const char *name, rpc_client **clients, rpc_handle *h,
+                     int n, int k, int rounds, bench_samples_t *s) {
+    rpc_data payload = {.data1 = COST_USEC, .data2_len = 0, .data2 = NULL};
+    rpc_data *results[MAX_SHARDS];
+    uint64_t total = 0;
+    int short_rounds = 0;
+    for (int r = 0; r < rounds; r++) {
+        uint64_t start = bench_now_usec();
+        int got = rpc_call_some(clients, n, h, &payload, results, k, -1);
+        uint64_t elapsed = bench_now_usec() - start;
+        bench_samples_add(s, elapsed);
+        total += elapsed;
+        short_rounds += got < k;
+        for (int i = 0; i < n; i++) {
+            if (results[i] != NULL) {
+                rpc_data_free(results[i]);
+            }
+        }
+    }
+    report(name, n, s, total);
+    if (short_rounds) {
+        printf("  %d rounds had fewer than %d replies\n", short_rounds, k);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int base_port = 4500, rounds = 200;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:r:")) != -1) {
+        switch (opt) {
+        case 'p':
+            base_port = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p base_port] [-r rounds]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pid_t servers[MAX_SHARDS];
+    rpc_client *clients[MAX_SHARDS];
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        servers[i] = bench_start_server(base_port + i, setup);
+        clients[i] = rpc_init_client("::1", base_port + i);
+        if (clients[i] == NULL) {
+            fprintf(stderr, "Could not connect to shard %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // every server registers the same functions, so one handle serves all
+    rpc_handle *h = rpc_find(clients[0], "work");
+
+    printf("%d rounds, %d us per call, 1 in %d calls 10x slower\n\n", rounds,
+           COST_USEC, SLOW_ONE_IN);
+    printf("%-14s %6s %10s %10s %10s\n", "mode", "shards", "mean us",
+           "p50 us", "p99 us");
+    bench_samples_t *s = bench_samples_create();
+    for (size_t i = 0; i < sizeof(shard_counts) / sizeof(*shard_counts);
+         i++) {
+        int n = shard_counts[i];
+        run_threads(clients, h, n, rounds, s);
+        run_some("call_all", clients, h, n, n, rounds, s);
+        run_some("quorum", clients, h, n, n / 2 + 1, rounds, s);
+        run_some("first", clients, h, n, 1, rounds, s);
+        printf("\n");
+    }
+    bench_samples_free(s);
+
+    free(h);
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        rpc_close_client(clients[i]);
+        bench_stop_server(servers[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+/* =============================================================================
+   fastopen.c
+
+   Latency of the first call on a fresh connection, as made by short-lived
+   clients: connect, rpc_find, one rpc_call, close. Compares a normal
+   handshake with TCP Fast Open, where the rpc_find goes out in the SYN.
+   The server side of Fast Open needs bit 0x2 of net.ipv4.tcp_fastopen,
+   e.g. sysctl -w net.ipv4.tcp_fastopen=3.
+
+   Usage: ./build/bench-fastopen [-p port] [-n connections]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static rpc_data *add(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1 + 1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "add", add);
+    rpc_server_set_fast_open(srv, 1);
+}
+
+/*
+ * Make one call on a new client, returning how long it all took.
+ */
+static uint64_t fresh_call(int port) {
+    uint64_t start = bench_now_usec();
+    rpc_client *cl = rpc_init_client("::1", port);
+    if (cl == NULL) {
+        fprintf(stderr, "Could not connect to server\n");
+        exit(EXIT_FAILURE);
+    }
+    rpc_handle *h = rpc_find(cl, "add");
+    rpc_data payload = {.data1 = 1, .data2_len = 0, .data2 = NULL};
+    rpc_data *reply = h == NULL ? NULL : rpc_call(cl, h, &payload);
+    if (reply == NULL) {
+        fprintf(stderr, "Call failed\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t elapsed = bench_now_usec() - start;
+    rpc_data_free(reply);
+    free(h);
+    rpc_close_client(cl);
+    return elapsed;
+}
+
+static void run(const char *name, int fast_open, int port, int connections) {
+    rpc_set_fast_open(fast_open);
+
+    // the first connection picks up the server's cookie
+    fresh_call(port);
+    bench_samples_t *s = bench_samples_create();
+    for (int i = 0; i < connections; i++) {
+        bench_samples_add(s, fresh_call(port));
+    }
+    printf("%-10s %8lu %8lu %8lu\n", name,
+           (unsigned long)bench_samples_percentile(s, 50),
+           (unsigned long)bench_samples_percentile(s, 90),
+           (unsigned long)bench_samples_percentile(s, 99));
+    bench_samples_free(s);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 5800, connections = 2000;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            connections = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-n connections]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    FILE *f = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+    int sysctl = 0;
+    if (f == NULL || fscanf(f, "%d", &sysctl) != 1 || !(sysctl & 0x2)) {
+        printf("net.ipv4.tcp_fastopen lacks 0x2, so the server ignores data "
+               "in the SYN\n");
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+
+    pid_t server = bench_start_server(port, setup);
+    printf("%d fresh connections making one call each\n\n", connections);
+    printf("%-10s %8s %8s %8s\n", "connect", "p50 us", "p90 us", "p99 us");
+    run("handshake", 0, port, connections);
+    run("fast open", 1, port, connections);
+    bench_stop_server(server);
+    return 0;
+}
@@ -0,0 +1,146 @@
+/* =============================================================================
+   faults.c
+
+   How calls behave over a bad network, using the faults injected with
+   rpc_set_faults into the client's process only. One in a hundred sends
+   stalls as if a segment was lost and waited for its retransmission, and
+   the latency of sequential calls is measured plainly, with a timeout, and
+   hedged over two connections with rpc_call_some so the first reply wins.
+   Two more runs check that calls still succeed when sends and receives are
+   cut short, and show calls failing once connections get reset.
+
+   Usage: ./build/bench-faults [-p port] [-n calls] [-s stall_usec]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PAYLOAD_SIZE (64 * 1024)
+
+typedef enum { PLAIN, TIMEOUT, HEDGED } call_mode;
+
+static rpc_data *echo(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1;
+    out->data2_len = in->data2_len;
+    out->data2 = NULL;
+    if (in->data2_len > 0) {
+        out->data2 = malloc(in->data2_len);
+        memcpy(out->data2, in->data2, in->data2_len);
+    }
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "echo", echo);
+}
+
+/*
+ * Make calls one after another with faults injected, and print their
+ * latency percentiles and how many failed or came back wrong.
+ */
+static void run(const char *name, const rpc_fault_opts *faults,
+                call_mode mode, size_t size, int port, int calls) {
+    rpc_client *clients[2];
+    for (int i = 0; i < 2; i++) {
+        if ((clients[i] = rpc_init_client("::1", port)) == NULL) {
+            fprintf(stderr, "Could not connect to server\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    rpc_handle *h = rpc_find(clients[0], "echo");
+    unsigned char *data = size > 0 ? (unsigned char *)malloc(size) : NULL;
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (unsigned char)(i * 7);
+    }
+
+    rpc_fault_stats before, after;
+    rpc_get_fault_stats(&before);
+    rpc_set_faults(faults);
+    bench_samples_t *s = bench_samples_create();
+    int failed = 0;
+    for (int i = 0; i < calls; i++) {
+        rpc_data payload = {.data1 = i, .data2_len = size, .data2 = data};
+        rpc_data *results[2] = {NULL, NULL};
+        uint64_t start = bench_now_usec();
+        if (mode == PLAIN) {
+            results[0] = rpc_call(clients[0], h, &payload);
+        } else if (mode == TIMEOUT) {
+            rpc_call_some(clients, 1, h, &payload, results, 1, 20);
+        } else {
+            rpc_call_some(clients, 2, h, &payload, results, 1, -1);
+        }
+        uint64_t elapsed = bench_now_usec() - start;
+
+        rpc_data *reply = results[0] != NULL ? results[0] : results[1];
+        if (reply == NULL || reply->data1 != i || reply->data2_len != size ||
+            (size > 0 && memcmp(reply->data2, data, size) != 0)) {
+            failed++;
+        } else {
+            bench_samples_add(s, elapsed);
+        }
+        rpc_data_free(results[0]);
+        rpc_data_free(results[1]);
+    }
+    rpc_set_faults(NULL);
+
+    rpc_get_fault_stats(&after);
+    printf("%-16s %8d %8d %8lu %8lu %10lu %10lu\n", name, calls, failed,
+           after.stalls + after.partials + after.resets -
+               (before.stalls + before.partials + before.resets),
+           (unsigned long)bench_samples_percentile(s, 50),
+           (unsigned long)bench_samples_percentile(s, 99),
+           (unsigned long)bench_samples_percentile(s, 100));
+    bench_samples_free(s);
+    free(data);
+    free(h);
+    rpc_close_client(clients[0]);
+    rpc_close_client(clients[1]);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 6600, calls = 2000;
+    unsigned long stall_usec = 50000;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:s:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            calls = atoi(optarg);
+            break;
+        case 's':
+            stall_usec = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-n calls] [-s stall_usec]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // the server is forked before any faults are set, so only the client
+    // sees them
+    pid_t pid = bench_start_server(port, setup);
+    rpc_fault_opts stalls = {.stall = 0.01, .stall_usec = stall_usec};
+    rpc_fault_opts partial = {.partial = 0.3, .jitter_usec = 100};
+    rpc_fault_opts resets = {.reset = 0.001};
+
+    printf("%d sequential calls, stalls of %lu us\n\n", calls, stall_usec);
+    printf("%-16s %8s %8s %8s %8s %10s %10s\n", "network", "calls", "failed",
+           "faults", "p50 us", "p99 us", "max us");
+    run("clean", NULL, PLAIN, 0, port, calls);
+    run("1% stalls", &stalls, PLAIN, 0, port, calls);
+    run("  20 ms timeout", &stalls, TIMEOUT, 0, port, calls);
+    run("  hedged", &stalls, HEDGED, 0, port, calls);
+    run("partial I/O", &partial, PLAIN, PAYLOAD_SIZE, port, calls / 10);
+    run("0.1% resets", &resets, PLAIN, 0, port, calls);
+    bench_stop_server(pid);
+    return 0;
+}
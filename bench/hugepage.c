@@ -0,0 +1,135 @@
+/* =============================================================================
+   hugepage.c
+
+   Throughput of large payloads and the page faults they cost, with large
+   I/O buffers on the heap and with them in the pool of huge page regions.
+   A client echoes payloads of almost MAX_MESSAGE_BYTE_SIZE off a server,
+   and the minor page faults of both processes over all the calls are
+   counted, less those of starting the server.
+
+   Usage: ./build/bench-hugepage [-p port] [-n calls] [-s size]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "bufpool.h"
+#include "config.h"
+#include "rpc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define WARM_UP_CALLS 10
+
+static rpc_data *echo(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1;
+    out->data2_len = in->data2_len;
+    out->data2 = malloc(in->data2_len);
+    memcpy(out->data2, in->data2, in->data2_len);
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "echo", echo);
+}
+
+static long minor_faults(int who) {
+    struct rusage usage;
+    getrusage(who, &usage);
+    return usage.ru_minflt;
+}
+
+/*
+ * Start a server, make calls echo calls after a few to warm up, and stop
+ * it. Returns the minor faults of the server, and sets the time taken by
+ * the calls and the minor faults of this process from the first call on.
+ */
+static long session(int port, int calls, size_t size, uint64_t *elapsed,
+                    long *client_faults) {
+    long server_before = minor_faults(RUSAGE_CHILDREN);
+    pid_t server = bench_start_server(port, setup);
+    rpc_client *cl = rpc_init_client("::1", port);
+    if (cl == NULL) {
+        fprintf(stderr, "Could not connect to server\n");
+        exit(EXIT_FAILURE);
+    }
+    rpc_handle *h = rpc_find(cl, "echo");
+    rpc_data payload = {.data1 = 0, .data2_len = size};
+    payload.data2 = calloc(1, size);
+
+    // the faults of the first calls count, but not their time
+    long client_before = minor_faults(RUSAGE_SELF);
+    for (int i = 0; i < (calls > 0 ? WARM_UP_CALLS : 0); i++) {
+        rpc_data_free(rpc_call(cl, h, &payload));
+    }
+    uint64_t start = bench_now_usec();
+    for (int i = 0; i < calls; i++) {
+        rpc_data *reply = rpc_call(cl, h, &payload);
+        if (reply == NULL || reply->data2_len != size) {
+            fprintf(stderr, "Call failed\n");
+            exit(EXIT_FAILURE);
+        }
+        rpc_data_free(reply);
+    }
+    *elapsed = bench_now_usec() - start;
+    *client_faults = minor_faults(RUSAGE_SELF) - client_before;
+
+    free(payload.data2);
+    free(h);
+    rpc_close_client(cl);
+    bench_stop_server(server);
+    return minor_faults(RUSAGE_CHILDREN) - server_before;
+}
+
+static void run(const char *name, size_t threshold, int port, int calls,
+                size_t size) {
+    // the server is forked from here, so it uses the same threshold
+    buffer_pool_set_threshold(threshold);
+
+    // a server that is never called gives the faults of starting one
+    uint64_t elapsed;
+    long client_faults;
+    long baseline = session(port, 0, size, &elapsed, &client_faults);
+    long server_faults = session(port + 1, calls, size, &elapsed,
+                                 &client_faults) -
+                         baseline;
+
+    buffer_pool_stats stats;
+    buffer_pool_get_stats(&stats);
+    printf("%-7s %10.1f %14ld %14ld %8lu %8lu\n", name,
+           2.0 * size * calls / (elapsed / 1e6) / 1e6, client_faults,
+           server_faults, stats.mapped, stats.hugetlb);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 5600, calls = 500;
+    size_t size = 900000;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:s:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            calls = atoi(optarg);
+            break;
+        case 's':
+            size = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-n calls] [-s size]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%d echo calls of %zu bytes\n\n", calls, size);
+    printf("%-7s %10s %14s %14s %8s %8s\n", "buffers", "MB/s",
+           "client faults", "server faults", "regions", "hugetlb");
+    run("heap", 0, port, calls, size);
+    run("pool", BUFFER_POOL_THRESHOLD, port + 2, calls, size);
+    return 0;
+}
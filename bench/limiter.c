@@ -0,0 +1,155 @@
+/* =============================================================================
+   limiter.c
+
+   Simulation of a server that slows down while many threads share one
+   client. Compares calls without a concurrency limit against the AIMD and
+   gradient limiters.
+
+   The handler sleeps for data1 microseconds (+/- 25% jitter). The run is
+   split into three phases: normal cost, a 10x slowdown, and recovery.
+
+   Usage: ./build/bench-limiter [-p port] [-t threads]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_PHASES 3
+
+typedef struct {
+    const char *name;
+    int cost_usec;
+    uint64_t duration_usec;
+} phase_t;
+
+static const phase_t phases[NUM_PHASES] = {
+    {"normal", 300, 1500000},
+    {"slow x10", 3000, 3000000},
+    {"recovered", 300, 1500000},
+};
+
+typedef struct {
+    rpc_client *cl;
+    rpc_handle *h;
+    volatile int phase;
+    volatile int running;
+    bench_samples_t *latency[NUM_PHASES];
+    unsigned long rejected[NUM_PHASES];
+    pthread_mutex_t lock;
+} run_t;
+
+static rpc_data *work(rpc_data *in) {
+    bench_sleep_usec(in->data1);
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "work", work);
+}
+
+static void *caller(void *arg) {
+    run_t *run = (run_t *)arg;
+    unsigned int seed = (unsigned int)(uintptr_t)pthread_self();
+    while (run->running) {
+        int phase = run->phase;
+        int cost = phases[phase].cost_usec;
+        cost = cost * 3 / 4 + rand_r(&seed) % (cost / 2 + 1);
+        rpc_data payload = {.data1 = cost, .data2_len = 0, .data2 = NULL};
+
+        uint64_t start = bench_now_usec();
+        rpc_data *reply = rpc_call(run->cl, run->h, &payload);
+        uint64_t elapsed = bench_now_usec() - start;
+        if (reply == NULL) {
+            pthread_mutex_lock(&run->lock);
+            run->rejected[phase]++;
+            pthread_mutex_unlock(&run->lock);
+            // a rejected caller backs off briefly instead of spinning
+            bench_sleep_usec(phases[phase].cost_usec);
+            continue;
+        }
+        bench_samples_add(run->latency[phase], elapsed);
+        rpc_data_free(reply);
+    }
+    return NULL;
+}
+
+static void run_mode(const char *name, rpc_limit_algorithm algorithm,
+                     int max_queue, int port, int num_threads) {
+    run_t run;
+    memset(&run, 0, sizeof(run));
+    pthread_mutex_init(&run.lock, NULL);
+    run.cl = rpc_init_client("::1", port);
+    if (run.cl == NULL) {
+        fprintf(stderr, "Could not connect to server\n");
+        exit(EXIT_FAILURE);
+    }
+    rpc_client_set_limit(run.cl, algorithm, max_queue);
+    run.h = rpc_find(run.cl, "work");
+    for (int i = 0; i < NUM_PHASES; i++) {
+        run.latency[i] = bench_samples_create();
+    }
+
+    run.running = 1;
+    pthread_t threads[num_threads];
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, caller, &run);
+    }
+    for (int i = 0; i < NUM_PHASES; i++) {
+        run.phase = i;
+        bench_sleep_usec(phases[i].duration_usec);
+        rpc_limit_stats stats;
+        if (rpc_client_limit_stats(run.cl, &stats) == 0) {
+            printf("  [%s] limit at end of %s phase: %d\n", name,
+                   phases[i].name, stats.limit);
+        }
+    }
+    run.running = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < NUM_PHASES; i++) {
+        double secs = phases[i].duration_usec / 1e6;
+        printf("%-14s %-10s %9.0f %9.0f %9lu %9lu\n", name, phases[i].name,
+               bench_samples_count(run.latency[i]) / secs,
+               run.rejected[i] / secs,
+               bench_samples_percentile(run.latency[i], 50),
+               bench_samples_percentile(run.latency[i], 99));
+        bench_samples_free(run.latency[i]);
+    }
+
+    free(run.h);
+    rpc_close_client(run.cl);
+    pthread_mutex_destroy(&run.lock);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 4100, num_threads = 16;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-p") == 0) {
+            port = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            num_threads = atoi(argv[i + 1]);
+        }
+    }
+
+    pid_t server = bench_start_server(port, setup);
+    printf("%d threads sharing one client\n\n", num_threads);
+    printf("%-14s %-10s %9s %9s %9s %9s\n", "mode", "phase", "ok/s",
+           "reject/s", "p50 us", "p99 us");
+    run_mode("none", RPC_LIMIT_NONE, 0, port, num_threads);
+    run_mode("aimd", RPC_LIMIT_AIMD, 0, port, num_threads);
+    run_mode("aimd+queue4", RPC_LIMIT_AIMD, 4, port, num_threads);
+    run_mode("gradient", RPC_LIMIT_GRADIENT, 0, port, num_threads);
+    bench_stop_server(server);
+    return 0;
+}
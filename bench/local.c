@@ -0,0 +1,113 @@
+/* =============================================================================
+   local.c
+
+   Cost of a call to a server in the same process. Compares calling the
+   handler directly, calling it through a client attached with
+   rpc_init_local_client, and calling it through a loopback connection to
+   a server in another process, for an empty payload and a large one. The
+   local client shows the overhead of the library itself.
+
+   Usage: ./build/bench-local [-p port] [-n calls]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LARGE_SIZE 100000
+
+static rpc_data *echo(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1;
+    out->data2_len = in->data2_len;
+    out->data2 = NULL;
+    if (in->data2_len > 0) {
+        out->data2 = malloc(in->data2_len);
+        memcpy(out->data2, in->data2, in->data2_len);
+    }
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "echo", echo);
+}
+
+static double time_direct(rpc_data *payload, int calls) {
+    uint64_t start = bench_now_usec();
+    for (int i = 0; i < calls; i++) {
+        rpc_data_free(echo(payload));
+    }
+    return (bench_now_usec() - start) * 1000.0 / calls;
+}
+
+static double time_client(rpc_client *cl, rpc_data *payload, int calls) {
+    rpc_handle *h = rpc_find(cl, "echo");
+    if (h == NULL) {
+        fprintf(stderr, "Could not find echo\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t start = bench_now_usec();
+    for (int i = 0; i < calls; i++) {
+        rpc_data *reply = rpc_call(cl, h, payload);
+        if (reply == NULL) {
+            fprintf(stderr, "Call failed\n");
+            exit(EXIT_FAILURE);
+        }
+        rpc_data_free(reply);
+    }
+    double ns = (bench_now_usec() - start) * 1000.0 / calls;
+    free(h);
+    return ns;
+}
+
+int main(int argc, char *argv[]) {
+    int port = 5400, calls = 20000;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            calls = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-n calls]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pid_t server = bench_start_server(port, setup);
+    rpc_client *remote = rpc_init_client("::1", port);
+    rpc_server *srv = rpc_init_server(port + 1);
+    if (remote == NULL || srv == NULL) {
+        fprintf(stderr, "Could not start\n");
+        exit(EXIT_FAILURE);
+    }
+    setup(srv);
+    rpc_client *local = rpc_init_local_client(srv);
+
+    rpc_data empty = {.data1 = 1, .data2_len = 0, .data2 = NULL};
+    rpc_data large = {.data1 = 1, .data2_len = LARGE_SIZE};
+    large.data2 = calloc(1, LARGE_SIZE);
+
+    printf("%d calls of echo\n\n", calls);
+    printf("%-10s %12s %12s\n", "call", "empty ns", "100 KB ns");
+    printf("%-10s %12.0f %12.0f\n", "direct", time_direct(&empty, calls),
+           time_direct(&large, calls));
+    printf("%-10s %12.0f %12.0f\n", "local", time_client(local, &empty, calls),
+           time_client(local, &large, calls));
+    printf("%-10s %12.0f %12.0f\n", "loopback",
+           time_client(remote, &empty, calls),
+           time_client(remote, &large, calls / 10));
+
+    free(large.data2);
+    rpc_close_client(local);
+    rpc_close_client(remote);
+    bench_stop_server(server);
+    return 0;
+}
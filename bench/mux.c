@@ -0,0 +1,160 @@
+/* =============================================================================
+   mux.c
+
+   Latency of small calls on a connection that also carries bulk transfers.
+   One thread makes small add calls while other threads echo payloads of
+   almost MAX_MESSAGE_BYTE_SIZE. Compares an idle connection, the same
+   connection as the bulk traffic, and a separate connection to the same
+   server.
+
+   Usage: ./build/bench-mux [-p port] [-b bulk_threads] [-n calls]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BULK_SIZE 900000
+
+typedef struct {
+    rpc_client *cl;
+    rpc_handle *h;
+    volatile int running;
+    unsigned long bytes;
+    pthread_mutex_t lock;
+} bulk_t;
+
+static rpc_data *add(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1 + 1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static rpc_data *echo(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1;
+    out->data2_len = in->data2_len;
+    out->data2 = malloc(in->data2_len);
+    memcpy(out->data2, in->data2, in->data2_len);
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "add", add);
+    rpc_register(srv, "echo", echo);
+}
+
+static void *bulk_thread(void *arg) {
+    bulk_t *bulk = (bulk_t *)arg;
+    rpc_data payload = {.data1 = 0, .data2_len = BULK_SIZE};
+    payload.data2 = calloc(1, BULK_SIZE);
+    while (bulk->running) {
+        rpc_data *reply = rpc_call(bulk->cl, bulk->h, &payload);
+        if (reply != NULL) {
+            pthread_mutex_lock(&bulk->lock);
+            bulk->bytes += 2 * BULK_SIZE;
+            pthread_mutex_unlock(&bulk->lock);
+            rpc_data_free(reply);
+        }
+    }
+    free(payload.data2);
+    return NULL;
+}
+
+static void run(const char *name, rpc_client *small, rpc_client *bulk_cl,
+                int bulk_threads, int calls) {
+    rpc_handle *h = rpc_find(small, "add");
+    bulk_t bulk = {.cl = bulk_cl, .running = 1, .bytes = 0};
+    pthread_mutex_init(&bulk.lock, NULL);
+    pthread_t threads[bulk_threads > 0 ? bulk_threads : 1];
+    if (bulk_cl != NULL) {
+        bulk.h = rpc_find(bulk_cl, "echo");
+        for (int i = 0; i < bulk_threads; i++) {
+            pthread_create(&threads[i], NULL, bulk_thread, &bulk);
+        }
+        // let the bulk transfers get going
+        bench_sleep_usec(100000);
+    }
+
+    bench_samples_t *s = bench_samples_create();
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    uint64_t start = bench_now_usec();
+    for (int i = 0; i < calls; i++) {
+        uint64_t t = bench_now_usec();
+        rpc_data *reply = rpc_call(small, h, &payload);
+        bench_samples_add(s, bench_now_usec() - t);
+        if (reply != NULL) {
+            rpc_data_free(reply);
+        }
+        // pace the calls so they land at random points of the transfers
+        bench_sleep_usec(200);
+    }
+    uint64_t elapsed = bench_now_usec() - start;
+
+    if (bulk_cl != NULL) {
+        bulk.running = 0;
+        for (int i = 0; i < bulk_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        free(bulk.h);
+    }
+    printf("%-18s %8lu %8lu %8lu %10.1f\n", name,
+           (unsigned long)bench_samples_percentile(s, 50),
+           (unsigned long)bench_samples_percentile(s, 99),
+           (unsigned long)bench_samples_percentile(s, 99.9),
+           bulk.bytes / (elapsed / 1e6) / 1e6);
+    bench_samples_free(s);
+    pthread_mutex_destroy(&bulk.lock);
+    free(h);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 4600, bulk_threads = 2, calls = 5000;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:b:n:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'b':
+            bulk_threads = atoi(optarg);
+            break;
+        case 'n':
+            calls = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-p port] [-b bulk_threads] [-n calls]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pid_t server = bench_start_server(port, setup);
+    rpc_client *shared = rpc_init_client("::1", port);
+    rpc_client *separate = rpc_init_client("::1", port);
+    if (shared == NULL || separate == NULL) {
+        fprintf(stderr, "Could not connect to server\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%d small calls, %d threads echoing %d bytes\n\n", calls,
+           bulk_threads, BULK_SIZE);
+    printf("%-18s %8s %8s %8s %10s\n", "small calls on", "p50 us", "p99 us",
+           "p99.9 us", "bulk MB/s");
+    run("idle connection", shared, NULL, 0, calls);
+    run("shared connection", shared, shared, bulk_threads, calls);
+    run("own connection", separate, shared, bulk_threads, calls);
+
+    rpc_close_client(shared);
+    rpc_close_client(separate);
+    bench_stop_server(server);
+    return 0;
+}
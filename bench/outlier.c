@@ -0,0 +1,159 @@
+/* =============================================================================
+   outlier.c
+
+   Scenario with three local servers where one is deliberately slowed down
+   for a while, like a replica stuck in GC pauses. Compares a group with and
+   without outlier ejection, and checks that the slow server is ejected and
+   then probed back in once it recovers.
+
+   Usage: ./build/bench-outlier [-p base_port] [-t threads]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_SERVERS 3
+#define COST_USEC 200
+#define SLOW_COST_USEC 20000
+#define SLOW_FOR_USEC 3000000
+#define RUN_USEC 6000000
+
+static uint64_t slow_until = 0;
+
+static rpc_data *work(rpc_data *in) {
+    bench_sleep_usec(bench_now_usec() < slow_until ? SLOW_COST_USEC
+                                                   : COST_USEC);
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static void setup_fast(rpc_server *srv) {
+    rpc_register(srv, "work", work);
+}
+
+static void setup_slow(rpc_server *srv) {
+    slow_until = bench_now_usec() + SLOW_FOR_USEC;
+    rpc_register(srv, "work", work);
+}
+
+typedef struct {
+    rpc_group *g;
+    rpc_handle *h;
+    volatile int running;
+    bench_samples_t *latency;
+    unsigned long failed;
+} run_t;
+
+static void *caller(void *arg) {
+    run_t *run = (run_t *)arg;
+    rpc_data payload = {.data1 = 1, .data2_len = 0, .data2 = NULL};
+    while (run->running) {
+        uint64_t start = bench_now_usec();
+        rpc_data *reply = rpc_group_call(run->g, run->h, &payload);
+        bench_samples_add(run->latency, bench_now_usec() - start);
+        if (reply == NULL) {
+            __sync_fetch_and_add(&run->failed, 1);
+        }
+        rpc_data_free(reply);
+    }
+    return NULL;
+}
+
+/*
+ * Run the scenario and return 1 if the slow server ended up where it
+ * should: ejected at least once with detection on, healthy again at the end.
+ */
+static int run_mode(const char *name, int detection, int base_port,
+                    int num_threads) {
+    pid_t servers[NUM_SERVERS];
+    char *addrs[NUM_SERVERS];
+    int ports[NUM_SERVERS];
+    for (int i = 0; i < NUM_SERVERS; i++) {
+        addrs[i] = "::1";
+        ports[i] = base_port + i;
+        servers[i] =
+            bench_start_server(ports[i], i == 0 ? setup_slow : setup_fast);
+    }
+
+    run_t run = {.running = 1, .latency = bench_samples_create()};
+    run.g = rpc_init_group(addrs, ports, NUM_SERVERS);
+    rpc_group_set_outlier_detection(run.g, detection);
+    run.h = rpc_group_find(run.g, "work");
+
+    pthread_t threads[num_threads];
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, caller, &run);
+    }
+
+    // watch the slow server while the scenario runs
+    int ejected_seen = 0;
+    uint64_t end = bench_now_usec() + RUN_USEC;
+    while (bench_now_usec() < end) {
+        rpc_endpoint_stats stats;
+        rpc_group_endpoint_stats(run.g, 0, &stats);
+        ejected_seen |= stats.state == RPC_ENDPOINT_EJECTED;
+        bench_sleep_usec(50000);
+    }
+    run.running = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("%-12s %8zu %8lu %8lu %8lu %8lu\n", name,
+           bench_samples_count(run.latency), run.failed,
+           bench_samples_percentile(run.latency, 50),
+           bench_samples_percentile(run.latency, 99),
+           bench_samples_percentile(run.latency, 99.9));
+    int ok = 1;
+    for (int i = 0; i < NUM_SERVERS; i++) {
+        rpc_endpoint_stats stats;
+        rpc_group_endpoint_stats(run.g, i, &stats);
+        printf("  server %d%s: %lu calls, %d ejections, state %d, "
+               "latency %.0f us\n",
+               i, i == 0 ? " (slowed)" : "", stats.calls, stats.ejections,
+               stats.state, stats.latency_usec);
+        if (i == 0 && detection) {
+            ok = ejected_seen && stats.state != RPC_ENDPOINT_EJECTED &&
+                 stats.latency_usec < SLOW_COST_USEC / 2;
+        }
+    }
+
+    free(run.h);
+    rpc_close_group(run.g);
+    for (int i = 0; i < NUM_SERVERS; i++) {
+        bench_stop_server(servers[i]);
+    }
+    bench_samples_free(run.latency);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int base_port = 4200, num_threads = 8;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-p") == 0) {
+            base_port = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            num_threads = atoi(argv[i + 1]);
+        }
+    }
+
+    printf("%d servers, server 0 is %dx slower for the first %d ms\n\n",
+           NUM_SERVERS, SLOW_COST_USEC / COST_USEC, SLOW_FOR_USEC / 1000);
+    printf("%-12s %8s %8s %8s %8s %8s\n", "mode", "calls", "failed",
+           "p50 us", "p99 us", "p99.9 us");
+    run_mode("no ejection", 0, base_port, num_threads);
+    int ok = run_mode("ejection", 1, base_port + NUM_SERVERS, num_threads);
+
+    printf("\n%s: slow server %s\n", ok ? "PASS" : "FAIL",
+           ok ? "was ejected and probed back in"
+              : "was not ejected and restored as expected");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
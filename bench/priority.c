@@ -0,0 +1,147 @@
+/* =============================================================================
+   priority.c
+
+   Mixed workload on one server: a few interactive callers making short
+   calls while many batch callers keep every worker busy with long ones.
+   Compares sending everything as RPC_PRIORITY_NORMAL against tagging the
+   two kinds of call with their own priority classes.
+
+   Usage: ./build/bench-priority [-p port] [-b batch_threads] [-d seconds]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INTERACTIVE_THREADS 4
+#define INTERACTIVE_COST_USEC 200
+#define INTERACTIVE_PAUSE_USEC 1000
+#define BATCH_COST_USEC 2000
+
+typedef struct {
+    rpc_client *cl;
+    rpc_handle *h;
+    rpc_priority priority;
+    int cost;
+    int pause;
+    volatile int *running;
+    bench_samples_t *latency;
+} caller_t;
+
+static rpc_data *work(rpc_data *in) {
+    bench_sleep_usec(in->data1);
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "work", work);
+}
+
+static void *caller(void *arg) {
+    caller_t *c = (caller_t *)arg;
+    rpc_data payload = {.data1 = c->cost, .data2_len = 0, .data2 = NULL};
+    while (*c->running) {
+        uint64_t start = bench_now_usec();
+        rpc_data *reply = rpc_call_priority(c->cl, c->h, &payload, c->priority);
+        if (reply != NULL) {
+            bench_samples_add(c->latency, bench_now_usec() - start);
+            rpc_data_free(reply);
+        }
+        if (c->pause) {
+            bench_sleep_usec(c->pause);
+        }
+    }
+    return NULL;
+}
+
+static void run(const char *name, int use_classes, int port, int batch_threads,
+                int seconds) {
+    rpc_client *cl = rpc_init_client("::1", port);
+    if (cl == NULL) {
+        fprintf(stderr, "Could not connect to server\n");
+        exit(EXIT_FAILURE);
+    }
+    rpc_handle *h = rpc_find(cl, "work");
+    volatile int running = 1;
+    bench_samples_t *interactive = bench_samples_create();
+    bench_samples_t *batch = bench_samples_create();
+
+    int n = INTERACTIVE_THREADS + batch_threads;
+    caller_t callers[n];
+    pthread_t threads[n];
+    for (int i = 0; i < n; i++) {
+        int is_batch = i >= INTERACTIVE_THREADS;
+        callers[i] = (caller_t){
+            .cl = cl,
+            .h = h,
+            .priority = !use_classes ? RPC_PRIORITY_NORMAL
+                        : is_batch   ? RPC_PRIORITY_BATCH
+                                     : RPC_PRIORITY_INTERACTIVE,
+            .cost = is_batch ? BATCH_COST_USEC : INTERACTIVE_COST_USEC,
+            .pause = is_batch ? 0 : INTERACTIVE_PAUSE_USEC,
+            .running = &running,
+            .latency = is_batch ? batch : interactive,
+        };
+        pthread_create(&threads[i], NULL, caller, &callers[i]);
+    }
+    bench_sleep_usec(seconds * 1000000ULL);
+    running = 0;
+    for (int i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("%-10s %8lu %8lu %8lu %10.0f %8lu\n", name,
+           (unsigned long)bench_samples_percentile(interactive, 50),
+           (unsigned long)bench_samples_percentile(interactive, 99),
+           (unsigned long)bench_samples_percentile(interactive, 99.9),
+           (double)bench_samples_count(batch) / seconds,
+           (unsigned long)bench_samples_percentile(batch, 99));
+    bench_samples_free(interactive);
+    bench_samples_free(batch);
+    free(h);
+    rpc_close_client(cl);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 4700, batch_threads = 32, seconds = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:b:d:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'b':
+            batch_threads = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-p port] [-b batch_threads] [-d seconds]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pid_t server = bench_start_server(port, setup);
+    printf("%d interactive callers (%d us calls), %d batch callers (%d us "
+           "calls)\n\n",
+           INTERACTIVE_THREADS, INTERACTIVE_COST_USEC, batch_threads,
+           BATCH_COST_USEC);
+    printf("%-10s %8s %8s %8s %10s %8s\n", "mode", "int p50", "int p99",
+           "int p99.9", "batch/s", "batch p99");
+    run("all normal", 0, port, batch_threads, seconds);
+    run("classes", 1, port, batch_threads, seconds);
+    bench_stop_server(server);
+    return 0;
+}
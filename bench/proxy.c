@@ -0,0 +1,137 @@
+/* =============================================================================
+   proxy.c
+
+   Latency added by one hop through rpc-proxy, and throughput of many
+   clients calling a server directly versus through the proxy, which
+   multiplexes them over a few pipelined backend connections.
+
+   Run from the repository root after make, since it starts ./rpc-proxy.
+
+   Usage: ./build/bench-proxy [-p base_port] [-c backend_connections]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LATENCY_CALLS 5000
+#define THROUGHPUT_USEC 2000000
+
+static rpc_data *add2(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1 + 2;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "add2", add2);
+}
+
+static void latency(const char *name, int port) {
+    rpc_client *cl = rpc_init_client("::1", port);
+    rpc_handle *h = rpc_find(cl, "add2");
+    bench_samples_t *samples = bench_samples_create();
+    rpc_data payload = {.data1 = 1, .data2_len = 0, .data2 = NULL};
+    for (int i = 0; i < LATENCY_CALLS; i++) {
+        uint64_t start = bench_now_usec();
+        rpc_data *reply = rpc_call(cl, h, &payload);
+        bench_samples_add(samples, bench_now_usec() - start);
+        rpc_data_free(reply);
+    }
+    printf("%-8s %8lu %8lu %8lu\n", name,
+           bench_samples_percentile(samples, 50),
+           bench_samples_percentile(samples, 90),
+           bench_samples_percentile(samples, 99));
+    bench_samples_free(samples);
+    free(h);
+    rpc_close_client(cl);
+}
+
+typedef struct {
+    int port;
+    volatile int *running;
+    unsigned long calls;
+} caller_args;
+
+static void *caller(void *arg) {
+    caller_args *args = (caller_args *)arg;
+    rpc_client *cl = rpc_init_client("::1", args->port);
+    rpc_handle *h = rpc_find(cl, "add2");
+    rpc_data payload = {.data1 = 1, .data2_len = 0, .data2 = NULL};
+    while (*args->running) {
+        rpc_data *reply = rpc_call(cl, h, &payload);
+        if (reply != NULL) {
+            args->calls++;
+        }
+        rpc_data_free(reply);
+    }
+    free(h);
+    rpc_close_client(cl);
+    return NULL;
+}
+
+static double throughput(int port, int num_clients) {
+    volatile int running = 1;
+    pthread_t threads[num_clients];
+    caller_args args[num_clients];
+    for (int i = 0; i < num_clients; i++) {
+        args[i] = (caller_args){.port = port, .running = &running};
+        pthread_create(&threads[i], NULL, caller, &args[i]);
+    }
+    bench_sleep_usec(THROUGHPUT_USEC);
+    running = 0;
+    unsigned long calls = 0;
+    for (int i = 0; i < num_clients; i++) {
+        pthread_join(threads[i], NULL);
+        calls += args[i].calls;
+    }
+    return calls / (THROUGHPUT_USEC / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    int base_port = 4400, connections = 2;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-p") == 0) {
+            base_port = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-c") == 0) {
+            connections = atoi(argv[i + 1]);
+        }
+    }
+    int server_port = base_port, proxy_port = base_port + 1;
+
+    pid_t server = bench_start_server(server_port, setup);
+    char route[64], sport[16], sconns[16];
+    snprintf(route, sizeof(route), "*=::1:%d", server_port);
+    snprintf(sport, sizeof(sport), "%d", proxy_port);
+    snprintf(sconns, sizeof(sconns), "%d", connections);
+    char *const proxy_argv[] = {"./rpc-proxy", "-p", sport, "-c", sconns,
+                                "-r", route, NULL};
+    pid_t proxy = bench_start_command(proxy_argv, proxy_port);
+
+    printf("Latency of %d sequential calls (us)\n", LATENCY_CALLS);
+    printf("%-8s %8s %8s %8s\n", "path", "p50", "p90", "p99");
+    latency("direct", server_port);
+    latency("proxy", proxy_port);
+
+    printf("\nThroughput (calls/s), proxy uses %d backend connections\n",
+           connections);
+    printf("%-8s %10s %10s %12s\n", "clients", "direct", "proxy",
+           "server conns");
+    int counts[] = {1, 8, 32};
+    for (int i = 0; i < 3; i++) {
+        double direct = throughput(server_port, counts[i]);
+        double proxied = throughput(proxy_port, counts[i]);
+        printf("%-8d %10.0f %10.0f %5d -> %-4d\n", counts[i], direct, proxied,
+               counts[i], connections);
+    }
+
+    bench_stop_server(proxy);
+    bench_stop_server(server);
+    return 0;
+}
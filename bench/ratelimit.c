@@ -0,0 +1,171 @@
+/* =============================================================================
+   ratelimit.c
+
+   Cost of the server's rate limit check, and what it does under a flood.
+   First times token_bucket_take on its own, from one thread and from
+   several threads sharing a bucket. Then floods a server whose clients are
+   limited to a fixed rate with small and large calls, and reports how many
+   get through and how many are turned away before their payload is read.
+
+   Usage: ./build/bench-ratelimit [-p port] [-r rate] [-d seconds]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "clock.h"
+#include "ratelimit.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHECKS 10000000
+#define CHECK_THREADS 4
+#define FLOOD_THREADS 8
+#define LARGE_SIZE 500000
+
+typedef struct {
+    token_bucket_t *b;
+    int checks;
+    int with_clock;
+} checker_t;
+
+typedef struct {
+    rpc_client *cl;
+    rpc_handle *h;
+    size_t size;
+    volatile int *running;
+    unsigned long accepted;
+    unsigned long rejected;
+} flooder_t;
+
+static double client_rate = 1000;
+
+static rpc_data *echo(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "echo", echo);
+    rpc_server_set_client_rate(srv, NULL, client_rate, 10);
+}
+
+static void *checker(void *arg) {
+    checker_t *c = (checker_t *)arg;
+    // without the clock, time moves on by a microsecond per check
+    uint64_t now = monotonic_nsec();
+    for (int i = 0; i < c->checks; i++) {
+        now = c->with_clock ? monotonic_nsec() : now + 1000;
+        token_bucket_take(c->b, now);
+    }
+    return NULL;
+}
+
+static void time_checks(const char *name, double rate, int threads,
+                        int with_clock) {
+    token_bucket_t b;
+    token_bucket_init(&b, rate, 10);
+    checker_t c = {
+        .b = &b, .checks = CHECKS / threads, .with_clock = with_clock};
+    pthread_t t[threads];
+    uint64_t start = bench_now_usec();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&t[i], NULL, checker, &c);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(t[i], NULL);
+    }
+    double ns = (bench_now_usec() - start) * 1000.0 / CHECKS;
+    printf("%-28s %8.1f\n", name, ns);
+}
+
+static void *flooder(void *arg) {
+    flooder_t *f = (flooder_t *)arg;
+    rpc_data payload = {.data1 = 0, .data2_len = f->size, .data2 = NULL};
+    if (f->size > 0) {
+        payload.data2 = calloc(1, f->size);
+    }
+    while (*f->running) {
+        rpc_data *reply = rpc_call(f->cl, f->h, &payload);
+        if (reply != NULL) {
+            f->accepted++;
+            rpc_data_free(reply);
+        } else {
+            f->rejected++;
+        }
+    }
+    free(payload.data2);
+    return NULL;
+}
+
+static void flood(const char *name, int port, size_t size, int seconds) {
+    rpc_client *cl = rpc_init_client("::1", port);
+    if (cl == NULL) {
+        fprintf(stderr, "Could not connect to server\n");
+        exit(EXIT_FAILURE);
+    }
+    rpc_handle *h = rpc_find(cl, "echo");
+    volatile int running = 1;
+    flooder_t f[FLOOD_THREADS];
+    pthread_t t[FLOOD_THREADS];
+    for (int i = 0; i < FLOOD_THREADS; i++) {
+        f[i] = (flooder_t){.cl = cl, .h = h, .size = size, .running = &running};
+        pthread_create(&t[i], NULL, flooder, &f[i]);
+    }
+    bench_sleep_usec(seconds * 1000000ULL);
+    running = 0;
+    unsigned long accepted = 0, rejected = 0;
+    for (int i = 0; i < FLOOD_THREADS; i++) {
+        pthread_join(t[i], NULL);
+        accepted += f[i].accepted;
+        rejected += f[i].rejected;
+    }
+    printf("%-14s %10.0f %10.0f\n", name, (double)accepted / seconds,
+           (double)rejected / seconds);
+    free(h);
+    rpc_close_client(cl);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 5000, seconds = 2;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:r:d:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'r':
+            client_rate = atof(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-r rate] [-d seconds]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%-28s %8s\n", "token_bucket_take", "ns/check");
+    time_checks("no limit", 0, 1, 0);
+    time_checks("accepting", 1e9, 1, 0);
+    time_checks("rejecting", 1, 1, 0);
+    time_checks("accepting, reading clock", 1e9, 1, 1);
+    time_checks("accepting, 4 threads", 1e9, CHECK_THREADS, 0);
+
+    pid_t server = bench_start_server(port, setup);
+    printf("\n%d threads flooding a client limit of %.0f calls/s\n\n",
+           FLOOD_THREADS, client_rate);
+    printf("%-14s %10s %10s\n", "payload", "accepted/s", "rejected/s");
+    flood("empty", port, 0, seconds);
+    flood("500 KB", port, LARGE_SIZE, seconds);
+    bench_stop_server(server);
+    return 0;
+}
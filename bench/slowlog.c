@@ -0,0 +1,158 @@
+/* =============================================================================
+   slowlog.c
+
+   Overhead of the slow call log on a server's throughput. Client threads
+   make calls to a trivial handler with no log, and with a threshold of 0
+   so that every call counts as slow, logging all of them or sampling one
+   in 100. The calls written to the log, and those dropped because the
+   thread writing them fell a whole ring behind, are counted afterwards.
+
+   Usage: ./build/bench-slowlog [-p port] [-n calls] [-t threads] [-f file]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    rpc_client *cl;
+    rpc_handle *h;
+    int calls;
+} caller_t;
+
+static const char *log_path = "/tmp/rpc-slow.log";
+static int log_sample = 0;
+
+static rpc_data *add(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1 + 1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "add", add);
+    if (log_sample > 0) {
+        rpc_slow_log_opts opts = {
+            .threshold_usec = 0, .sample = log_sample, .data_bytes = 16};
+        if (rpc_server_set_slow_log(srv, log_path, &opts) != 0) {
+            fprintf(stderr, "Could not open %s\n", log_path);
+        }
+    }
+}
+
+static void *caller(void *arg) {
+    caller_t *c = (caller_t *)arg;
+    unsigned char data[32] = {0};
+    rpc_data payload = {.data1 = 0, .data2_len = sizeof(data), .data2 = data};
+    for (int i = 0; i < c->calls; i++) {
+        rpc_data *reply = rpc_call(c->cl, c->h, &payload);
+        if (reply == NULL) {
+            fprintf(stderr, "Call failed\n");
+            exit(EXIT_FAILURE);
+        }
+        rpc_data_free(reply);
+    }
+    return NULL;
+}
+
+/*
+ * Count the calls logged, and those dropped with the ring full.
+ */
+static long count_calls(const char *path, long *dropped) {
+    FILE *f = fopen(path, "r");
+    *dropped = 0;
+    if (f == NULL) {
+        return 0;
+    }
+    long calls = 0, n;
+    char line[1024];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "# %ld", &n) == 1) {
+            *dropped += n;
+        } else if (strncmp(line, "time=", 5) == 0) {
+            calls++;
+        }
+    }
+    fclose(f);
+    return calls;
+}
+
+static void run(const char *name, int sample, int port, int calls,
+                int threads) {
+    // the server is forked from here, so it sees the same setting
+    log_sample = sample;
+    remove(log_path);
+    pid_t server = bench_start_server(port, setup);
+    caller_t callers[threads];
+    pthread_t tids[threads];
+    for (int i = 0; i < threads; i++) {
+        callers[i].cl = rpc_init_client("::1", port);
+        if (callers[i].cl == NULL) {
+            fprintf(stderr, "Could not connect to server\n");
+            exit(EXIT_FAILURE);
+        }
+        callers[i].h = rpc_find(callers[i].cl, "add");
+        callers[i].calls = calls / threads;
+    }
+    uint64_t start = bench_now_usec();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, caller, &callers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    uint64_t elapsed = bench_now_usec() - start;
+    for (int i = 0; i < threads; i++) {
+        free(callers[i].h);
+        rpc_close_client(callers[i].cl);
+    }
+
+    // the log is flushed once the server shuts down
+    bench_stop_server(server);
+    long dropped;
+    long logged = count_calls(log_path, &dropped);
+    printf("%-12s %10.0f %10ld %10ld\n", name,
+           (calls / threads * threads) / (elapsed / 1e6), logged, dropped);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 6100, calls = 20000, threads = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:t:f:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            calls = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'f':
+            log_path = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-p port] [-n calls] [-t threads] [-f file]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%d calls over %d connections, every call slow\n\n", calls,
+           threads);
+    printf("%-12s %10s %10s %10s\n", "log", "calls/s", "logged", "dropped");
+    run("off", 0, port, calls, threads);
+    run("all", 1, port + 1, calls, threads);
+    run("1 in 100", 100, port + 2, calls, threads);
+    remove(log_path);
+    return 0;
+}
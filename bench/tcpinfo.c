@@ -0,0 +1,204 @@
+/* =============================================================================
+   tcpinfo.c
+
+   Transport health of a server's connections from rpc_server_transport_stats.
+   Client threads call an echo handler over their own connections, some with
+   small payloads and some with large ones that fill the congestion window,
+   for long enough that the accept loop has read every connection's TCP_INFO
+   a few times. The totals and the connections of the longest round trips
+   are then fetched through a handler and printed, along with what each
+   client read of its own end, and what a read of TCP_INFO costs.
+
+   Usage: ./build/bench-tcpinfo [-p port] [-s seconds] [-t threads]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define WORST 3
+#define LARGE_PAYLOAD (256 * 1024)
+
+/*
+ * The server, in the server process.
+ */
+static rpc_server *server = NULL;
+
+typedef struct {
+    rpc_client *cl;
+    rpc_handle *h;
+    size_t size;
+    uint64_t until;
+} caller_t;
+
+static rpc_data *echo(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1;
+    out->data2_len = in->data2_len;
+    out->data2 = NULL;
+    if (in->data2_len > 0) {
+        out->data2 = malloc(in->data2_len);
+        memcpy(out->data2, in->data2, in->data2_len);
+    }
+    return out;
+}
+
+/*
+ * Reply with the stats, followed by the worst connections.
+ */
+static rpc_data *transport(rpc_data *in) {
+    size_t size =
+        sizeof(rpc_transport_stats) + WORST * sizeof(rpc_connection_info);
+    char *buf = (char *)malloc(size);
+    rpc_transport_stats *stats = (rpc_transport_stats *)buf;
+    rpc_connection_info *worst =
+        (rpc_connection_info *)(buf + sizeof(rpc_transport_stats));
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = rpc_server_transport_stats(server, stats, worst, WORST);
+    out->data2_len = size;
+    out->data2 = buf;
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    server = srv;
+    rpc_register(srv, "echo", echo);
+    rpc_register(srv, "transport", transport);
+}
+
+static void *caller(void *arg) {
+    caller_t *c = (caller_t *)arg;
+    void *data = c->size > 0 ? calloc(1, c->size) : NULL;
+    rpc_data payload = {.data1 = 0, .data2_len = c->size, .data2 = data};
+    while (bench_now_usec() < c->until) {
+        rpc_data *reply = rpc_call(c->cl, c->h, &payload);
+        if (reply == NULL) {
+            fprintf(stderr, "Call failed\n");
+            exit(EXIT_FAILURE);
+        }
+        rpc_data_free(reply);
+    }
+    free(data);
+    return NULL;
+}
+
+static void print_info(const rpc_connection_info *info) {
+    printf("  %-16s %6d %9lu %9lu %9lu %6lu %8lu\n", info->host, info->port,
+           info->rtt_usec, info->rttvar_usec, info->retransmits, info->cwnd,
+           info->unacked);
+}
+
+/*
+ * Time a read of TCP_INFO on a new connection to the server.
+ */
+static void time_getsockopt(int port) {
+    struct sockaddr_in6 addr = {.sin6_family = AF_INET6,
+                                .sin6_port = htons(port),
+                                .sin6_addr = IN6ADDR_LOOPBACK_INIT};
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        return;
+    }
+    int reads = 100000;
+    struct tcp_info ti;
+    uint64_t start = bench_now_usec();
+    for (int i = 0; i < reads; i++) {
+        socklen_t len = sizeof(ti);
+        getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len);
+    }
+    printf("\none read of TCP_INFO: %.3f us\n",
+           (double)(bench_now_usec() - start) / reads);
+    close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 6400, seconds = 3, threads = 6;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:t:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-s seconds] [-t threads]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pid_t pid = bench_start_server(port, setup);
+    caller_t callers[threads];
+    pthread_t tids[threads];
+    uint64_t until = bench_now_usec() + (uint64_t)seconds * 1000000;
+    for (int i = 0; i < threads; i++) {
+        callers[i].cl = rpc_init_client("::1", port);
+        if (callers[i].cl == NULL) {
+            fprintf(stderr, "Could not connect to server\n");
+            exit(EXIT_FAILURE);
+        }
+        callers[i].h = rpc_find(callers[i].cl, "echo");
+        // every other connection sends large payloads
+        callers[i].size = i % 2 ? LARGE_PAYLOAD : 64;
+        callers[i].until = until;
+        pthread_create(&tids[i], NULL, caller, &callers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    rpc_handle *h = rpc_find(callers[0].cl, "transport");
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    rpc_data *reply = h == NULL ? NULL : rpc_call(callers[0].cl, h, &payload);
+    if (reply == NULL || reply->data1 < 0) {
+        fprintf(stderr, "Could not fetch the server's stats\n");
+        exit(EXIT_FAILURE);
+    }
+    rpc_transport_stats s;
+    memcpy(&s, reply->data2, sizeof(s));
+    rpc_connection_info *worst =
+        (rpc_connection_info *)((char *)reply->data2 + sizeof(s));
+
+    printf("%d connections for %d s, every other one sending %d KiB\n\n",
+           threads, seconds, LARGE_PAYLOAD / 1024);
+    printf("server: %d connections, rtt mean %lu us max %lu us, "
+           "%lu retransmits, cwnd min %lu mean %lu, %lu unacked\n\n",
+           s.connections, s.mean_rtt_usec, s.max_rtt_usec, s.retransmits,
+           s.min_cwnd, s.mean_cwnd, s.unacked);
+    printf("worst round trips on the server:\n");
+    printf("  %-16s %6s %9s %9s %9s %6s %8s\n", "host", "port", "rtt us",
+           "rttvar us", "retrans", "cwnd", "unacked");
+    for (int i = 0; i < reply->data1; i++) {
+        print_info(&worst[i]);
+    }
+    printf("clients:\n");
+    for (int i = 0; i < threads; i++) {
+        rpc_connection_info info;
+        if (rpc_client_transport_info(callers[i].cl, &info) == 0) {
+            print_info(&info);
+        }
+    }
+    rpc_data_free(reply);
+    free(h);
+
+    time_getsockopt(port);
+    for (int i = 0; i < threads; i++) {
+        free(callers[i].h);
+        rpc_close_client(callers[i].cl);
+    }
+    bench_stop_server(pid);
+    return 0;
+}
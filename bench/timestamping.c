@@ -0,0 +1,169 @@
+/* =============================================================================
+   timestamping.c
+
+   Whether latency is added by the network stack or by handlers, from a
+   server with rpc_server_set_timestamping on. Two loads are run against
+   their own servers: a handler that now and then stalls, and a fast
+   handler called over many connections at once, where calls pile up in
+   the kernel's buffers instead. The server's rpc_server_latency_stats are
+   fetched through a handler once the calls are done, and the mean and
+   longest time in each part printed.
+
+   Usage: ./build/bench-timestamping [-p port] [-n calls] [-t threads]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Every stall_every-th call of the handler spins for stall_usec.
+ */
+static int stall_every = 0;
+static uint64_t stall_usec = 2000;
+
+/*
+ * The server, in the server process.
+ */
+static rpc_server *server = NULL;
+
+typedef struct {
+    rpc_client *cl;
+    rpc_handle *h;
+    int calls;
+} caller_t;
+
+static rpc_data *work(rpc_data *in) {
+    if (stall_every > 0 && in->data1 % stall_every == 0) {
+        uint64_t start = bench_now_usec();
+        while (bench_now_usec() - start < stall_usec) {
+        }
+    }
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static rpc_data *latency(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = 0;
+    out->data2_len = sizeof(rpc_latency_stats);
+    out->data2 = malloc(sizeof(rpc_latency_stats));
+    rpc_server_latency_stats(server, (rpc_latency_stats *)out->data2);
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    server = srv;
+    rpc_register(srv, "work", work);
+    rpc_register(srv, "latency", latency);
+    if (rpc_server_set_timestamping(srv, 1) != 0) {
+        fprintf(stderr, "SO_TIMESTAMPING is not supported here\n");
+    }
+}
+
+static void *caller(void *arg) {
+    caller_t *c = (caller_t *)arg;
+    for (int i = 0; i < c->calls; i++) {
+        rpc_data payload = {.data1 = i, .data2_len = 0, .data2 = NULL};
+        rpc_data *reply = rpc_call(c->cl, c->h, &payload);
+        if (reply == NULL) {
+            fprintf(stderr, "Call failed\n");
+            exit(EXIT_FAILURE);
+        }
+        rpc_data_free(reply);
+    }
+    return NULL;
+}
+
+static void print_part(const char *name, unsigned long long sum,
+                       unsigned long n, unsigned long max) {
+    printf("  %-8s %10.1f %10lu\n", name, n ? (double)sum / n : 0.0, max);
+}
+
+static void run(const char *name, int stall, int port, int calls,
+                int threads) {
+    // the server is forked from here, so it sees the same setting
+    stall_every = stall;
+    pid_t pid = bench_start_server(port, setup);
+    caller_t callers[threads];
+    pthread_t tids[threads];
+    for (int i = 0; i < threads; i++) {
+        callers[i].cl = rpc_init_client("::1", port);
+        if (callers[i].cl == NULL) {
+            fprintf(stderr, "Could not connect to server\n");
+            exit(EXIT_FAILURE);
+        }
+        callers[i].h = rpc_find(callers[i].cl, "work");
+        callers[i].calls = calls / threads;
+    }
+    uint64_t start = bench_now_usec();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, caller, &callers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    uint64_t elapsed = bench_now_usec() - start;
+
+    rpc_handle *h = rpc_find(callers[0].cl, "latency");
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    rpc_data *reply = h == NULL ? NULL : rpc_call(callers[0].cl, h, &payload);
+    if (reply == NULL || reply->data2_len != sizeof(rpc_latency_stats)) {
+        fprintf(stderr, "Could not fetch the server's stats\n");
+        exit(EXIT_FAILURE);
+    }
+    rpc_latency_stats l;
+    memcpy(&l, reply->data2, sizeof(l));
+    rpc_data_free(reply);
+    free(h);
+
+    printf("%s: %d connections, %.1f us per call\n", name, threads,
+           (double)elapsed * threads / (calls / threads * threads));
+    printf("  %-8s %10s %10s\n", "part", "mean us", "max us");
+    print_part("receive", l.receive_usec, l.requests, l.max_receive_usec);
+    print_part("queue", l.queue_usec, l.requests, l.max_queue_usec);
+    print_part("handler", l.handler_usec, l.requests, l.max_handler_usec);
+    print_part("send", l.send_usec, l.replies, l.max_send_usec);
+    printf("  %lu requests, %lu replies timestamped\n\n", l.requests,
+           l.replies);
+
+    for (int i = 0; i < threads; i++) {
+        free(callers[i].h);
+        rpc_close_client(callers[i].cl);
+    }
+    bench_stop_server(pid);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 6000, calls = 8000, threads = 16;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:t:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            calls = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-n calls] [-t threads]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    run("stalling handler", 50, port, calls, 2);
+    run("many connections", 0, port + 1, calls, threads);
+    return 0;
+}
@@ -0,0 +1,151 @@
+/* =============================================================================
+   timing.c
+
+   Where the time of a call goes, as reported by a server with
+   rpc_server_set_timing on. Client threads call a handler that works for
+   a fixed time, and the mean and 99th percentile of each part are printed:
+   the wait in the server's queues, decoding the request, the handler, and
+   the rest, which is the network and both ends' I/O threads. With more
+   threads than the server has workers, the queue takes over.
+
+   Usage: ./build/bench-timing [-p port] [-n calls] [-t threads] [-w usec]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define NUM_PARTS 5
+
+static const char *parts[NUM_PARTS] = {"total", "network", "queue", "decode",
+                                       "handler"};
+
+typedef struct {
+    rpc_client *cl;
+    rpc_handle *h;
+    int calls;
+    uint64_t *values[NUM_PARTS];
+} caller_t;
+
+static uint64_t work_usec = 200;
+
+/*
+ * Spin rather than sleep, so the handler holds its worker like real work.
+ */
+static rpc_data *work(rpc_data *in) {
+    uint64_t start = bench_now_usec();
+    while (bench_now_usec() - start < work_usec) {
+    }
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static void setup(rpc_server *srv) {
+    rpc_register(srv, "work", work);
+    rpc_server_set_timing(srv, 1);
+}
+
+static void *caller(void *arg) {
+    caller_t *c = (caller_t *)arg;
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    for (int i = 0; i < c->calls; i++) {
+        rpc_call_timing t;
+        rpc_data *reply = rpc_call_timed(c->cl, c->h, &payload,
+                                         RPC_PRIORITY_NORMAL, &t);
+        if (reply == NULL || !t.server) {
+            fprintf(stderr, "Call failed or was not timed\n");
+            exit(EXIT_FAILURE);
+        }
+        rpc_data_free(reply);
+
+        unsigned long server = t.queue_usec + t.decode_usec + t.handler_usec;
+        c->values[0][i] = t.total_usec;
+        c->values[1][i] = t.total_usec > server ? t.total_usec - server : 0;
+        c->values[2][i] = t.queue_usec;
+        c->values[3][i] = t.decode_usec;
+        c->values[4][i] = t.handler_usec;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int port = 5900, calls = 4000, threads = 8;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:t:w:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            calls = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'w':
+            work_usec = atol(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-p port] [-n calls] [-t threads] [-w usec]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pid_t server = bench_start_server(port, setup);
+    caller_t callers[threads];
+    pthread_t tids[threads];
+    for (int i = 0; i < threads; i++) {
+        callers[i] = (caller_t){.calls = calls / threads};
+        callers[i].cl = rpc_init_client("::1", port);
+        if (callers[i].cl == NULL) {
+            fprintf(stderr, "Could not connect to server\n");
+            exit(EXIT_FAILURE);
+        }
+        callers[i].h = rpc_find(callers[i].cl, "work");
+        for (int j = 0; j < NUM_PARTS; j++) {
+            callers[i].values[j] =
+                (uint64_t *)calloc(callers[i].calls, sizeof(uint64_t));
+        }
+        pthread_create(&tids[i], NULL, caller, &callers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    printf("%d calls of a %lu us handler over %d connections\n\n",
+           calls / threads * threads, (unsigned long)work_usec, threads);
+    printf("%-8s %10s %10s\n", "part", "mean us", "p99 us");
+    for (int j = 0; j < NUM_PARTS; j++) {
+        bench_samples_t *all = bench_samples_create();
+        uint64_t sum = 0;
+        for (int i = 0; i < threads; i++) {
+            for (int k = 0; k < callers[i].calls; k++) {
+                sum += callers[i].values[j][k];
+                bench_samples_add(all, callers[i].values[j][k]);
+            }
+        }
+        printf("%-8s %10.1f %10lu\n", parts[j],
+               (double)sum / (calls / threads * threads),
+               (unsigned long)bench_samples_percentile(all, 99));
+        bench_samples_free(all);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        for (int j = 0; j < NUM_PARTS; j++) {
+            free(callers[i].values[j]);
+        }
+        free(callers[i].h);
+        rpc_close_client(callers[i].cl);
+    }
+    bench_stop_server(server);
+    return 0;
+}
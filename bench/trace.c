@@ -0,0 +1,194 @@
+/* =============================================================================
+   trace.c
+
+   Rebuilds where the time of a request through two servers goes from the
+   spans of its trace. A front server's coroutine handler calls a back
+   server, whose handler works for a while, and every request from here
+   starts a new trace. The spans are then collected from this process and
+   both servers, and for each hop the mean time taken and the mean time
+   not spent in the hop below it are printed. A client span's own time is
+   the network and I/O threads; a server span's is the queue and the
+   handler's own work.
+
+   Usage: ./build/bench-trace [-p port] [-n requests] [-w usec]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_SPANS 8192
+
+static uint64_t work_usec = 300;
+static int back_port = 0;
+
+/*
+ * The front server's client of the back server, in the front process.
+ */
+static rpc_client *back = NULL;
+static rpc_handle *back_h = NULL;
+
+static rpc_data *work(rpc_data *in) {
+    uint64_t start = bench_now_usec();
+    while (bench_now_usec() - start < work_usec) {
+    }
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+static rpc_data *front(rpc_data *in) {
+    rpc_data *reply = rpc_call(back, back_h, in);
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = reply == NULL ? -1 : reply->data1;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    rpc_data_free(reply);
+    return out;
+}
+
+static rpc_data *spans(rpc_data *in) {
+    rpc_span *s = (rpc_span *)malloc(MAX_SPANS * sizeof(*s));
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = 0;
+    out->data2_len = rpc_trace_collect(s, MAX_SPANS) * sizeof(*s);
+    out->data2 = s;
+    return out;
+}
+
+static void setup_back(rpc_server *srv) {
+    rpc_register(srv, "back", work);
+    rpc_register(srv, "spans", spans);
+}
+
+static void setup_front(rpc_server *srv) {
+    back = rpc_init_client("::1", back_port);
+    back_h = back == NULL ? NULL : rpc_find(back, "back");
+    if (back_h == NULL) {
+        fprintf(stderr, "Front server could not reach the back server\n");
+    }
+    rpc_handler_opts opts = {.coroutine = 1};
+    rpc_register_ex(srv, "front", front, &opts);
+    rpc_register(srv, "spans", spans);
+}
+
+/*
+ * Add the spans held by a server to s.
+ */
+static size_t fetch_spans(int port, rpc_span *s, size_t n) {
+    rpc_client *cl = rpc_init_client("::1", port);
+    rpc_handle *h = cl == NULL ? NULL : rpc_find(cl, "spans");
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    rpc_data *reply = h == NULL ? NULL : rpc_call(cl, h, &payload);
+    if (reply == NULL) {
+        fprintf(stderr, "Could not fetch spans from %d\n", port);
+        exit(EXIT_FAILURE);
+    }
+    size_t got = reply->data2_len / sizeof(rpc_span);
+    if (got > MAX_SPANS - n) {
+        got = MAX_SPANS - n;
+    }
+    memcpy(s + n, reply->data2, got * sizeof(rpc_span));
+    rpc_data_free(reply);
+    free(h);
+    rpc_close_client(cl);
+    return n + got;
+}
+
+/*
+ * Print the mean total and own time of the spans of one hop.
+ */
+static void print_hop(const char *label, rpc_span_kind kind, const char *name,
+                      rpc_span *s, size_t n) {
+    unsigned long count = 0;
+    double total = 0, own = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (s[i].kind != kind || strcmp(s[i].name, name) != 0) {
+            continue;
+        }
+        unsigned long children = 0;
+        for (size_t j = 0; j < n; j++) {
+            if (s[j].trace_id == s[i].trace_id &&
+                s[j].parent_id == s[i].span_id) {
+                children += s[j].total_usec;
+            }
+        }
+        count++;
+        total += s[i].total_usec;
+        own += s[i].total_usec > children ? s[i].total_usec - children : 0;
+    }
+    printf("%-14s %8lu %10.1f %10.1f\n", label, count,
+           count ? total / count : 0.0, count ? own / count : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 6300, requests = 500;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:w:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            requests = atoi(optarg);
+            break;
+        case 'w':
+            work_usec = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p port] [-n requests] [-w usec]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (requests > MAX_SPANS / 4) {
+        requests = MAX_SPANS / 4;
+    }
+
+    back_port = port + 1;
+    pid_t back_pid = bench_start_server(back_port, setup_back);
+    pid_t front_pid = bench_start_server(port, setup_front);
+    rpc_client *cl = rpc_init_client("::1", port);
+    if (cl == NULL) {
+        fprintf(stderr, "Could not connect to server\n");
+        exit(EXIT_FAILURE);
+    }
+    rpc_handle *h = rpc_find(cl, "front");
+    for (int i = 0; i < requests; i++) {
+        rpc_trace_start(NULL);
+        rpc_data payload = {.data1 = i, .data2_len = 0, .data2 = NULL};
+        rpc_data *reply = rpc_call(cl, h, &payload);
+        if (reply == NULL || reply->data1 != i) {
+            fprintf(stderr, "Request failed\n");
+            exit(EXIT_FAILURE);
+        }
+        rpc_data_free(reply);
+    }
+    rpc_trace_set(NULL);
+
+    rpc_span *s = (rpc_span *)malloc(MAX_SPANS * sizeof(*s));
+    size_t n = rpc_trace_collect(s, MAX_SPANS);
+    n = fetch_spans(port, s, n);
+    n = fetch_spans(back_port, s, n);
+
+    printf("%d requests, back handler working %lu us\n\n", requests,
+           (unsigned long)work_usec);
+    printf("%-14s %8s %10s %10s\n", "hop", "spans", "mean us", "own us");
+    print_hop("client front", RPC_SPAN_CLIENT, "front", s, n);
+    print_hop("server front", RPC_SPAN_SERVER, "front", s, n);
+    print_hop("client back", RPC_SPAN_CLIENT, "back", s, n);
+    print_hop("server back", RPC_SPAN_SERVER, "back", s, n);
+
+    free(s);
+    free(h);
+    rpc_close_client(cl);
+    bench_stop_server(front_pid);
+    bench_stop_server(back_pid);
+    return 0;
+}
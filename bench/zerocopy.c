@@ -0,0 +1,159 @@
+/* =============================================================================
+   zerocopy.c
+
+   CPU the server spends per GB of large replies, with replies copied into
+   the socket and with them sent with MSG_ZEROCOPY. Client threads fetch
+   replies of almost MAX_MESSAGE_BYTE_SIZE, and the server's user and
+   system time are counted, less those of starting a server.
+
+   On loopback the kernel copies zerocopy sends anyway when they reach the
+   receiving socket, so the saving only shows over a real network device.
+   Point the clients at a server on another host to see it there.
+
+   Usage: ./build/bench-zerocopy [-p port] [-n calls] [-s size] [-t threads]
+
+   Author: David Sha
+============================================================================= */
+#include "bench.h"
+#include "rpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+typedef struct {
+    rpc_client *cl;
+    rpc_handle *h;
+    int calls;
+    size_t size;
+} fetcher_t;
+
+/*
+ * The reply of every fetch, which handlers share since it never changes.
+ */
+static unsigned char *blob = NULL;
+static size_t blob_size = 900000;
+static int use_zerocopy = 0;
+
+static rpc_data *fetch(rpc_data *in) {
+    rpc_data *out = (rpc_data *)malloc(sizeof(*out));
+    out->data1 = in->data1;
+    out->data2_len = blob_size;
+    out->data2 = blob;
+    return out;
+}
+
+static void free_reply(rpc_data *data) { free(data); }
+
+static void setup(rpc_server *srv) {
+    rpc_handler_opts opts = {.free_result = free_reply};
+    rpc_register_ex(srv, "fetch", fetch, &opts);
+    if (use_zerocopy && rpc_server_set_zerocopy(srv, 256 * 1024) != 0) {
+        fprintf(stderr, "MSG_ZEROCOPY is not supported here\n");
+    }
+}
+
+static void *fetcher(void *arg) {
+    fetcher_t *f = (fetcher_t *)arg;
+    rpc_data payload = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    for (int i = 0; i < f->calls; i++) {
+        rpc_data *reply = rpc_call(f->cl, f->h, &payload);
+        if (reply == NULL || reply->data2_len != f->size) {
+            fprintf(stderr, "Call failed\n");
+            exit(EXIT_FAILURE);
+        }
+        rpc_data_free(reply);
+    }
+    return NULL;
+}
+
+static double cpu_usec(int who) {
+    struct rusage usage;
+    getrusage(who, &usage);
+    return usage.ru_utime.tv_sec * 1e6 + usage.ru_utime.tv_usec +
+           usage.ru_stime.tv_sec * 1e6 + usage.ru_stime.tv_usec;
+}
+
+/*
+ * Start a server, fetch calls replies over threads connections, and stop
+ * it. Returns the CPU time of the server, and sets the time taken.
+ */
+static double session(int port, int calls, int threads, uint64_t *elapsed) {
+    double before = cpu_usec(RUSAGE_CHILDREN);
+    pid_t server = bench_start_server(port, setup);
+    fetcher_t fetchers[threads];
+    pthread_t tids[threads];
+    for (int i = 0; i < threads; i++) {
+        fetchers[i].cl = rpc_init_client("::1", port);
+        if (fetchers[i].cl == NULL) {
+            fprintf(stderr, "Could not connect to server\n");
+            exit(EXIT_FAILURE);
+        }
+        fetchers[i].h = rpc_find(fetchers[i].cl, "fetch");
+        fetchers[i].calls = calls / threads;
+        fetchers[i].size = blob_size;
+    }
+    uint64_t start = bench_now_usec();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, fetcher, &fetchers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    *elapsed = bench_now_usec() - start;
+    for (int i = 0; i < threads; i++) {
+        free(fetchers[i].h);
+        rpc_close_client(fetchers[i].cl);
+    }
+    bench_stop_server(server);
+    return cpu_usec(RUSAGE_CHILDREN) - before;
+}
+
+static void run(const char *name, int zerocopy, int port, int calls,
+                int threads) {
+    // the server is forked from here, so it sees the same setting
+    use_zerocopy = zerocopy;
+    uint64_t elapsed;
+    double baseline = session(port, 0, threads, &elapsed);
+    double cpu = session(port + 1, calls, threads, &elapsed) - baseline;
+    double gb = (double)blob_size * (calls / threads * threads) / 1e9;
+    printf("%-9s %10.1f %14.1f\n", name, gb * 1e3 / (elapsed / 1e6),
+           cpu / 1e3 / gb);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 5700, calls = 2000, threads = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:s:t:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            calls = atoi(optarg);
+            break;
+        case 's':
+            blob_size = atol(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-p port] [-n calls] [-s size] [-t threads]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    blob = (unsigned char *)calloc(1, blob_size);
+
+    printf("%d replies of %zu bytes over %d connections\n\n", calls,
+           blob_size, threads);
+    printf("%-9s %10s %14s\n", "send", "MB/s", "server ms/GB");
+    run("copy", 0, port, calls, threads);
+    run("zerocopy", 1, port + 2, calls, threads);
+    free(blob);
+    return 0;
+}
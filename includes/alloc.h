@@ -0,0 +1,25 @@
+/* =============================================================================
+   alloc.h
+
+   The allocator behind every allocation the library makes. It is libc's
+   malloc and free unless replaced with rpc_set_allocator, which is
+   declared in rpc.h along with rpc_malloc and friends.
+
+   Author: David Sha
+============================================================================= */
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include "rpc.h"
+
+/* function prototypes ====================================================== */
+
+/*
+ * Is the library still allocating with libc? Memory from malloc and from
+ * rpc_malloc is then interchangeable.
+ *
+ * @return TRUE if no allocator has been set, FALSE otherwise.
+ */
+int rpc_allocator_is_default(void);
+
+#endif
@@ -0,0 +1,70 @@
+/* =============================================================================
+   bufpool.h
+
+   A pool of 2 MB regions for large I/O buffers. A buffer that grows past
+   BUFFER_POOL_THRESHOLD moves into a region, which is backed by huge pages
+   when the kernel has them (MAP_HUGETLB, or transparent huge pages through
+   madvise otherwise) and goes back to the pool when the buffer is freed.
+   Regions are never zeroed, and a reused one is already faulted in, so a
+   large message costs a memcpy instead of hundreds of page faults.
+
+   Author: David Sha
+============================================================================= */
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+/* structures =============================================================== */
+typedef struct {
+    // regions mapped so far, and how many of them with MAP_HUGETLB
+    unsigned long mapped;
+    unsigned long hugetlb;
+    // regions handed out, and how many of those were reused
+    unsigned long taken;
+    unsigned long reused;
+    // regions waiting in the pool
+    int free;
+} buffer_pool_stats;
+
+/* function prototypes ====================================================== */
+
+/*
+ * Take a region of BUFFER_POOL_REGION_SIZE bytes, whose contents are left
+ * over from its last use.
+ *
+ * @return The region, or NULL if no memory could be mapped.
+ */
+void *buffer_pool_take(void);
+
+/*
+ * Give a region back to the pool. Beyond BUFFER_POOL_MAX_REGIONS free
+ * regions it is unmapped instead.
+ *
+ * @param region The region from buffer_pool_take.
+ */
+void buffer_pool_give(void *region);
+
+/*
+ * Set the size from which buffers move into the pool. Buffers already
+ * allocated keep their memory.
+ *
+ * @param threshold The size in bytes, or 0 to stop using the pool.
+ */
+void buffer_pool_set_threshold(size_t threshold);
+
+/*
+ * Get the size from which buffers move into the pool.
+ *
+ * @return The size in bytes, or 0 if the pool is not used.
+ */
+size_t buffer_pool_threshold(void);
+
+/*
+ * Get the pool's counters.
+ *
+ * @param stats Filled in with the counters.
+ */
+void buffer_pool_get_stats(buffer_pool_stats *stats);
+
+#endif
@@ -0,0 +1,107 @@
+/* =============================================================================
+   capture.h
+
+   Capture of the requests a server receives, for replaying against a
+   server later with rpc-replay. Each request is kept as the serialised
+   message it arrived as, so a replay sends the same request, trailers and
+   all, and needs to know nothing about the handlers.
+
+   File format, all integers big endian:
+     magic       8 bytes, CAPTURE_MAGIC
+     start       8 bytes, wall clock time of the capture in microseconds
+   followed by one record per request:
+     time        8 bytes, microseconds since the capture started
+     connection  4 bytes, numbered from 0 in the order they were accepted
+     priority    1 byte
+     length      4 bytes
+     message     length bytes of the serialised rpc_message
+
+   Author: David Sha
+============================================================================= */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "config.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * The first bytes of a capture file.
+ */
+#define CAPTURE_MAGIC "RPCCAP1\n"
+#define CAPTURE_MAGIC_SIZE 8
+
+/* structures =============================================================== */
+
+/*
+ * A request read back from a capture file.
+ */
+typedef struct {
+    uint64_t time_usec;
+    uint32_t connection;
+    int priority;
+    size_t len;
+    unsigned char *bytes;
+} capture_record_t;
+
+typedef struct capture capture_t;
+
+/* function prototypes ====================================================== */
+
+/*
+ * Create a capture file, replacing any file at path.
+ *
+ * @param path The file.
+ * @return The new capture, or NULL if the file could not be created.
+ */
+capture_t *capture_open(const char *path);
+
+/*
+ * Number a new connection whose requests are to be captured.
+ *
+ * @param cap The capture.
+ * @return The connection's number.
+ */
+uint32_t capture_connection(capture_t *cap);
+
+/*
+ * Append a request to the file. Safe to call from any thread.
+ *
+ * @param cap The capture.
+ * @param connection The number of the connection it arrived on.
+ * @param priority Its priority class.
+ * @param bytes The serialised message.
+ * @param len The size of the message.
+ */
+void capture_write(capture_t *cap, uint32_t connection, int priority,
+                   const void *bytes, size_t len);
+
+/*
+ * Flush and close the file. Nothing may be written from then on.
+ *
+ * @param cap The capture.
+ */
+void capture_close(capture_t *cap);
+
+/*
+ * Check the header of a capture file opened for reading.
+ *
+ * @param file The file.
+ * @param start_usec Set to the wall clock time of the capture, or NULL.
+ * @return 0 if it is a capture file, FAILED otherwise.
+ */
+int capture_read_header(FILE *file, uint64_t *start_usec);
+
+/*
+ * Read the next request from a capture file. The bytes of the record are
+ * allocated with rpc_malloc and must be freed by the caller.
+ *
+ * @param file The file, just past its header or the previous record.
+ * @param rec Filled in with the request.
+ * @return TRUE if a request was read, FALSE at the end of the file or a
+ * record cut short or too large.
+ */
+int capture_read(FILE *file, capture_record_t *rec);
+
+#endif
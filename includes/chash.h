@@ -0,0 +1,64 @@
+/* =============================================================================
+   chash.h
+
+   Hash functions for routing keys to servers: rendezvous (highest random
+   weight) hashing, and jump consistent hashing for comparison.
+
+   References:
+   - Rendezvous hashing: https://en.wikipedia.org/wiki/Rendezvous_hashing
+   - Jump consistent hash: https://arxiv.org/abs/1406.2294
+   - 64-bit finaliser from MurmurHash3:
+     https://github.com/aappleby/smhasher/wiki/MurmurHash3
+
+   Author: David Sha
+============================================================================= */
+#ifndef CHASH_H
+#define CHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* function prototypes ====================================================== */
+
+/*
+ * Hash a string of bytes into 64 bits. FNV-1a followed by the MurmurHash3
+ * finaliser, so that nearby keys end up far apart.
+ *
+ * @param key The bytes to hash.
+ * @param len The number of bytes.
+ * @return The hash value.
+ */
+uint64_t hash_bytes(const void *key, size_t len);
+
+/*
+ * Combine two hash values into a new, well mixed hash value.
+ *
+ * @param a The first hash value.
+ * @param b The second hash value.
+ * @return The combined hash value.
+ */
+uint64_t hash_combine(uint64_t a, uint64_t b);
+
+/*
+ * Rendezvous hashing: pick the node whose combined hash with the key is the
+ * highest. Removing a node only moves the keys that node owned, and adding
+ * one only takes keys from the others.
+ *
+ * @param key The hash of the key.
+ * @param nodes The hashes identifying each node.
+ * @param n The number of nodes.
+ * @return The index of the chosen node, or -1 if n is 0.
+ */
+int rendezvous_hash(uint64_t key, const uint64_t *nodes, int n);
+
+/*
+ * Jump consistent hash: map a key to one of n buckets. Buckets can only be
+ * added or removed at the end.
+ *
+ * @param key The hash of the key.
+ * @param n The number of buckets.
+ * @return The chosen bucket between 0 and n - 1.
+ */
+int jump_hash(uint64_t key, int n);
+
+#endif
@@ -0,0 +1,39 @@
+/* =============================================================================
+   clock.h
+
+   Time helpers used for latency measurements. Intervals use the
+   monotonic clock, and the realtime clock is only for comparing against
+   timestamps taken by the kernel.
+
+   Author: David Sha
+============================================================================= */
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+/* function prototypes ====================================================== */
+
+/*
+ * Get the current time of the monotonic clock.
+ *
+ * @return The current time in microseconds.
+ */
+uint64_t monotonic_usec(void);
+
+/*
+ * Get the current time of the monotonic clock.
+ *
+ * @return The current time in nanoseconds.
+ */
+uint64_t monotonic_nsec(void);
+
+/*
+ * Get the current time of the realtime clock, which kernel socket
+ * timestamps use.
+ *
+ * @return The current time in microseconds since the epoch.
+ */
+uint64_t realtime_usec(void);
+
+#endif
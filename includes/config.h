@@ -12,6 +12,8 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include "alloc.h"
+
 /* #defines ================================================================= */
 
 /*
@@ -29,16 +31,26 @@
     } while (0)
 
 /*
- * Check ptr is not NULL, then free it and set it to NULL.
+ * Check ptr is not NULL, then free it with the library's allocator and set
+ * it to NULL.
  */
 #define free_and_null(ptr)                                                     \
     do {                                                                       \
         if (ptr) {                                                             \
-            free(ptr);                                                         \
+            rpc_free(ptr);                                                     \
             ptr = NULL;                                                        \
         }                                                                      \
     } while (0)
 
+/*
+ * Tell the CPU we are in a spin loop.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
 /*
  * Basic constants.
  */
@@ -62,12 +74,204 @@
  */
 #define HASHTABLE_SIZE 100
 
+/*
+ * How many per-address token buckets a server keeps before it sweeps out
+ * those of addresses limited by the default rate that have no connections
+ * and have refilled. Buckets in use are never dropped, so there can be
+ * more while many addresses are connected.
+ */
+#define MAX_CLIENT_BUCKETS 4096
+
+/*
+ * Slots in the table of requests a connection is waiting on. Requests in
+ * flight beyond this share slots.
+ */
+#define PENDING_TABLE_SIZE 1024
+
 /*
  * How many connections are kept in the backlog queue before rejecting new
  * connections using the accept() system call.
  */
 #define BACKLOG 128
 
+/*
+ * Most connections that sent data in their SYN with TCP Fast Open that a
+ * server keeps waiting to be accepted.
+ */
+#define FAST_OPEN_QUEUE 256
+
+/*
+ * How long an injected stall holds up a send when no length is given,
+ * about the shortest retransmission timeout of Linux TCP.
+ */
+#define FAULT_STALL_USEC 200000
+
+/*
+ * Most pieces of a message a send may be given in, for cutting sends
+ * short when injecting faults. Larger sends are never cut short.
+ */
+#define FAULT_MAX_IOV 8
+
+/*
+ * How long the server waits for a connection request in each iteration of
+ * the accept loop. A zero timeout would spin a core while idle.
+ */
+#define ACCEPT_TIMEOUT_USEC 100000
+
+/*
+ * How often the TCP_INFO of a connection is read. Servers read every
+ * connection's from the accept loop, and clients read theirs as replies
+ * arrive.
+ */
+#define TCP_INFO_INTERVAL_USEC 1000000
+
+/*
+ * Bounds and starting point of a client's adaptive concurrency limit.
+ */
+#define LIMIT_INITIAL 10
+#define LIMIT_MIN 1
+#define LIMIT_MAX 200
+
+/*
+ * AIMD limiter: a request slower than LIMIT_AIMD_TOLERANCE times the no-load
+ * RTT counts as a drop, and each drop multiplies the limit by
+ * LIMIT_AIMD_BACKOFF.
+ */
+#define LIMIT_AIMD_TOLERANCE 2.0
+#define LIMIT_AIMD_BACKOFF 0.9
+
+/*
+ * Gradient limiter: how much queueing is tolerated before the limit shrinks,
+ * and how quickly the limit moves towards its new target.
+ */
+#define LIMIT_GRADIENT_TOLERANCE 1.5
+#define LIMIT_GRADIENT_SMOOTHING 0.2
+
+/*
+ * Number of samples after which the no-load RTT is re-estimated.
+ */
+#define LIMIT_NOLOAD_WINDOW 1000
+
+/*
+ * Outlier detection in groups. A server is ejected after
+ * OUTLIER_CONSECUTIVE_FAILURES failures in a row, when its error rate exceeds
+ * OUTLIER_ERROR_RATE, or when its average latency exceeds
+ * OUTLIER_LATENCY_FACTOR times the median of the other servers by at least
+ * OUTLIER_LATENCY_MARGIN_USEC, so that jitter on fast servers is ignored.
+ * Latency and error rate are only judged after OUTLIER_MIN_CALLS calls.
+ */
+#define OUTLIER_CONSECUTIVE_FAILURES 5
+#define OUTLIER_ERROR_RATE 0.5
+#define OUTLIER_LATENCY_FACTOR 3.0
+#define OUTLIER_LATENCY_MARGIN_USEC 2000
+#define OUTLIER_MIN_CALLS 20
+
+/*
+ * Weight of a new sample in a server's latency and error rate averages.
+ */
+#define OUTLIER_EWMA_ALPHA 0.1
+
+/*
+ * A server is ejected for OUTLIER_BASE_EJECTION_USEC times the number of
+ * times it has been ejected, up to OUTLIER_MAX_EJECTION_USEC. At most
+ * OUTLIER_MAX_EJECTION_PERCENT of the servers are ejected at once.
+ */
+#define OUTLIER_BASE_EJECTION_USEC 500000
+#define OUTLIER_MAX_EJECTION_USEC 10000000
+#define OUTLIER_MAX_EJECTION_PERCENT 50
+
+/*
+ * After an ejection, a server's weight ramps up linearly from
+ * OUTLIER_PROBE_WEIGHT to 1 over OUTLIER_PROBE_USEC.
+ */
+#define OUTLIER_PROBE_WEIGHT 0.05
+#define OUTLIER_PROBE_USEC 1000000
+
+/*
+ * Largest frame payload on a multiplexed connection. A small message waits
+ * for at most one frame of every other message being sent before it.
+ */
+#define MUX_FRAME_SIZE 65536
+
+/*
+ * Receive buffer of a multiplexed connection. Frames that have arrived but
+ * not been read yet wait here in order, so a larger buffer trades latency
+ * of small messages for throughput of large ones on long links.
+ */
+#define MUX_RECEIVE_BUFFER_SIZE 262144
+
+/*
+ * Bytes asked for by each read from a multiplexed connection.
+ */
+#define MUX_READ_SIZE 16384
+
+/*
+ * Most bytes of messages sent with MSG_ZEROCOPY that a connection keeps
+ * allocated while waiting for the kernel to finish with them.
+ */
+#define MUX_ZEROCOPY_MAX_PENDING (8 * 1024 * 1024)
+
+/*
+ * Most messages a peer may have partly sent on one connection at a time.
+ */
+#define MUX_MAX_STREAMS 1024
+
+/*
+ * Buffers for messages of at least BUFFER_POOL_THRESHOLD bytes come from a
+ * pool of BUFFER_POOL_REGION_SIZE regions backed by huge pages, of which
+ * up to BUFFER_POOL_MAX_REGIONS are kept for reuse. A region must hold a
+ * whole message of MAX_MESSAGE_BYTE_SIZE, and the threshold is above
+ * MUX_FRAME_SIZE so that single frame messages stay on the heap.
+ */
+#define BUFFER_POOL_THRESHOLD (128 * 1024)
+#define BUFFER_POOL_REGION_SIZE (2 * 1024 * 1024)
+#define BUFFER_POOL_MAX_REGIONS 16
+
+/*
+ * Slow calls waiting to be written to a server's slow call log, which must
+ * be a power of two, how often the thread writing them checks for more,
+ * and how much of each call's name and data2 is kept.
+ */
+#define SLOW_LOG_RING_SIZE 1024
+#define SLOW_LOG_DRAIN_USEC 10000
+#define SLOW_LOG_MAX_NAME 128
+#define SLOW_LOG_MAX_DATA 64
+
+/*
+ * Spans of traced calls kept by a process until rpc_trace_collect.
+ */
+#define TRACE_BUFFER_SIZE 4096
+
+/*
+ * Number of worker threads a server runs calls on.
+ */
+#define SERVER_WORKERS 8
+
+/*
+ * Most calls a server keeps queued for its workers. Beyond this, calls of
+ * the lowest priority class are shed.
+ */
+#define SERVER_MAX_QUEUE 1024
+
+/*
+ * Share of the workers each priority class gets while all of them have
+ * calls queued.
+ */
+#define PRIORITY_WEIGHT_INTERACTIVE 8
+#define PRIORITY_WEIGHT_NORMAL 4
+#define PRIORITY_WEIGHT_BATCH 1
+
+/*
+ * How many calls a connection runs per turn when the server is busy,
+ * unless its address is given a weight with rpc_server_set_client_weight.
+ */
+#define CLIENT_WEIGHT_DEFAULT 1
+
+/*
+ * Stack size of each call of a handler registered as a coroutine.
+ */
+#define COROUTINE_STACK_SIZE (256 * 1024)
+
 /*
  * Indicates that this RPC will be non-blocking. Requests will be managed in
  * separate threads allowing for concurrent execution.
@@ -0,0 +1,56 @@
+/* =============================================================================
+   coroutine.h
+
+   Stackful coroutines on top of ucontext. A coroutine runs a function on
+   its own stack until the function yields, then whoever resumed it carries
+   on. It can be resumed again later from any thread, and picks up where it
+   yielded.
+
+   References:
+   - makecontext(3): https://man7.org/linux/man-pages/man3/makecontext.3.html
+
+   Author: David Sha
+============================================================================= */
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <stddef.h>
+
+/* structures =============================================================== */
+typedef struct coroutine coroutine_t;
+
+/* function prototypes ====================================================== */
+
+/*
+ * Create a coroutine that has not started yet.
+ *
+ * @param fn The function to run.
+ * @param arg Passed to fn.
+ * @param stack_size Size of the coroutine's stack in bytes.
+ * @return The new coroutine.
+ */
+coroutine_t *coroutine_create(void (*fn)(void *), void *arg,
+                              size_t stack_size);
+
+/*
+ * Run a coroutine until it yields or its function returns. Coroutines may
+ * not resume other coroutines.
+ *
+ * @param co The coroutine, which must not be running or finished.
+ * @return TRUE if the function has returned, FALSE if it yielded.
+ */
+int coroutine_resume(coroutine_t *co);
+
+/*
+ * Go back to whoever resumed the running coroutine.
+ */
+void coroutine_yield(void);
+
+/*
+ * Free a coroutine that has finished or was never started.
+ *
+ * @param co The coroutine.
+ */
+void coroutine_free(coroutine_t *co);
+
+#endif
@@ -83,6 +83,21 @@ void *hashtable_lookup(hashtable_t *hashtable, char *key);
 void hashtable_remove(hashtable_t *hashtable, char *key,
                       void (*free_data)(void *));
 
+/*
+ * Remove every item whose data a function picks.
+ *
+ * @param hashtable The hashtable to remove the items from.
+ * @param pick The function deciding whether to remove the data, TRUE to
+ * remove it.
+ * @param arg Passed to pick.
+ * @param free_data The function to free the data of the items removed.
+ * NULL if no freeing is required.
+ * @return The number of items removed.
+ */
+int hashtable_remove_if(hashtable_t *hashtable,
+                        int (*pick)(void *data, void *arg), void *arg,
+                        void (*free_data)(void *));
+
 /*
  * Frees an item.
  *
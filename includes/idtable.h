@@ -0,0 +1,76 @@
+/* =============================================================================
+   idtable.h
+
+   Table of requests waiting for their replies, indexed by request id.
+   Request ids on a connection are handed out in order, so the slot of an
+   id is its low bits and the requests in flight spread evenly over the
+   slots. Entries are embedded in whatever they belong to, so adding and
+   removing one allocates nothing.
+
+   Author: David Sha
+============================================================================= */
+#ifndef IDTABLE_H
+#define IDTABLE_H
+
+#include <stdint.h>
+
+/* structures =============================================================== */
+typedef struct id_entry id_entry_t;
+struct id_entry {
+    uint64_t id;
+    void *data;
+    id_entry_t *next;
+};
+
+typedef struct {
+    id_entry_t **slots;
+    // one less than the number of slots, which is a power of two
+    uint64_t mask;
+    int count;
+} idtable_t;
+
+/* function prototypes ====================================================== */
+
+/*
+ * Create an empty table.
+ *
+ * @param size The number of slots, rounded up to a power of two.
+ * @return The new table.
+ */
+idtable_t *idtable_create(int size);
+
+/*
+ * Free a table. The entries still in it are not freed.
+ *
+ * @param t The table.
+ */
+void idtable_destroy(idtable_t *t);
+
+/*
+ * Add an entry, whose id and data the caller has set. No other entry in
+ * the table may have the same id.
+ *
+ * @param t The table.
+ * @param e The entry, which must stay put until it is removed.
+ */
+void idtable_insert(idtable_t *t, id_entry_t *e);
+
+/*
+ * Remove the entry with an id.
+ *
+ * @param t The table.
+ * @param id The id.
+ * @return The data of the entry, or NULL if there is none with the id.
+ */
+void *idtable_remove(idtable_t *t, uint64_t id);
+
+/*
+ * Remove every entry, passing the data of each to a function, which may
+ * free the entry.
+ *
+ * @param t The table.
+ * @param fn Called with the data of each entry removed.
+ */
+void idtable_clear(idtable_t *t, void (*fn)(void *data));
+
+#endif
@@ -0,0 +1,82 @@
+/* =============================================================================
+   limiter.h
+
+   Adaptive concurrency limiter. Callers acquire a slot before issuing a
+   request and release it with the observed round trip time, which the
+   limiter uses to grow or shrink the number of requests allowed in flight.
+
+   References:
+   - Additive increase/multiplicative decrease:
+     https://en.wikipedia.org/wiki/Additive_increase/multiplicative_decrease
+   - Gradient limit inspired by Netflix's concurrency-limits library:
+     https://github.com/Netflix/concurrency-limits
+
+   Author: David Sha
+============================================================================= */
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* structures =============================================================== */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    int algorithm;
+    double limit;
+    int in_flight;
+    int queued;
+    int max_queue;
+    unsigned long rejected;
+    unsigned long samples;
+    double rtt_noload;
+    double rtt_window_min;
+} limiter_t;
+
+/* function prototypes ====================================================== */
+
+/*
+ * Create a new limiter.
+ *
+ * @param algorithm The rpc_limit_algorithm used to adapt the limit.
+ * @param max_queue The number of callers allowed to wait for a slot once the
+ * limit is reached. Callers beyond this are rejected.
+ * @return The new limiter.
+ */
+limiter_t *limiter_create(int algorithm, int max_queue);
+
+/*
+ * Free a limiter. There must be no callers holding or waiting for a slot.
+ *
+ * @param l The limiter to free.
+ */
+void limiter_destroy(limiter_t *l);
+
+/*
+ * Acquire a slot, waiting in the queue if the limit has been reached.
+ *
+ * @param l The limiter.
+ * @return 0 if a slot was acquired, FAILED if the call was rejected.
+ */
+int limiter_acquire(limiter_t *l);
+
+/*
+ * Release a slot and update the limit.
+ *
+ * @param l The limiter.
+ * @param rtt_usec The round trip time of the request in microseconds.
+ * @param dropped TRUE if the request failed, which is treated as a sign of
+ * overload.
+ */
+void limiter_release(limiter_t *l, uint64_t rtt_usec, int dropped);
+
+/*
+ * Release a slot without updating the limit, for a request given up on
+ * for reasons that say nothing about the server's load.
+ *
+ * @param l The limiter.
+ */
+void limiter_cancel(limiter_t *l);
+
+#endif
@@ -0,0 +1,275 @@
+/* =============================================================================
+   mux.h
+
+   Multiplexed connections. Every message sent on a connection is split into
+   frames of at most MUX_FRAME_SIZE bytes, each tagged with the message's
+   request id. A writer thread sends one frame from each queued message in
+   turn, so a small message queued behind a large one goes out after at
+   most one frame of the large one. The receiver reassembles the frames of
+   each request id and returns messages as they complete. A sender that
+   gives up on a message can cancel it with an empty frame, which tells the
+   receiver to drop whatever it has of the message, and to drop its work on
+   the message if it has not started yet.
+
+   Frame format:
+     request id  8 bytes, big endian
+     flags       1 byte, MUX_FRAME_END on the last frame of a message, and
+                 the message's priority class in the MUX_FRAME_PRIORITY bits.
+                 MUX_FRAME_CANCEL with MUX_FRAME_END on an empty frame that
+                 cancels the message
+     length      4 bytes, big endian, at most MUX_FRAME_SIZE
+     payload     length bytes of the serialised rpc_message
+
+   Author: David Sha
+============================================================================= */
+#ifndef MUX_H
+#define MUX_H
+
+#include "capture.h"
+#include "protocol.h"
+#include <sys/socket.h>
+
+/*
+ * Size of the header in front of every frame.
+ */
+#define MUX_FRAME_HEADER_SIZE 13
+
+/*
+ * Set on the last frame of a message.
+ */
+#define MUX_FRAME_END 0x01
+
+/*
+ * Bits of the flags holding the priority class of the message.
+ */
+#define MUX_FRAME_PRIORITY 0x06
+#define MUX_FRAME_PRIORITY_SHIFT 1
+
+/*
+ * Set on an empty frame cancelling the message with its request id.
+ */
+#define MUX_FRAME_CANCEL 0x08
+
+/*
+ * Socket option turning on MSG_ZEROCOPY, missing from older libc headers.
+ */
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+/* structures =============================================================== */
+typedef struct mux mux_t;
+
+/*
+ * Counters of the MSG_ZEROCOPY sends of a mux.
+ */
+typedef struct {
+    // sendmsg calls made with MSG_ZEROCOPY
+    unsigned long sends;
+    // of those, how many the kernel has finished with
+    unsigned long completed;
+    // and how many it copied after all, e.g. on loopback
+    unsigned long copied;
+} mux_zerocopy_stats;
+
+/*
+ * Called once the transmit timestamp of a message arrives, with how long
+ * it took from mux_send until the kernel handed its last byte to the
+ * device.
+ *
+ * @param arg The argument given to mux_set_timestamping.
+ * @param usec The time taken in microseconds.
+ */
+typedef void (*mux_sent_fn)(void *arg, unsigned long usec);
+
+/*
+ * Decides whether to accept a message from the first bytes of it, before
+ * the rest is read or decoded. The message is thrown away if it is turned
+ * away, and any reply is up to the callback.
+ *
+ * @param arg The argument given to mux_set_admit.
+ * @param request_id The request id of the message.
+ * @param operation The operation of the message.
+ * @param function_name The function name of the message.
+ * @return TRUE to accept the message, FALSE to throw it away.
+ */
+typedef int (*mux_admit_fn)(void *arg, uint64_t request_id, int operation,
+                            const char *function_name);
+
+/*
+ * Called on the receiving thread when the peer cancels a message, whether
+ * or not it has been received in full.
+ *
+ * @param arg The argument given to mux_set_cancel.
+ * @param request_id The request id of the message.
+ */
+typedef void (*mux_cancel_fn)(void *arg, uint64_t request_id);
+
+/* function prototypes ====================================================== */
+
+/*
+ * Start multiplexing messages over a connected socket. The mux owns the
+ * socket from now on.
+ *
+ * @param sockfd The connected socket.
+ * @return The new mux.
+ */
+mux_t *mux_create(int sockfd);
+
+/*
+ * Queue a message to be sent. The message is serialised straight away, so
+ * it may be freed as soon as this returns. A message that fits in one
+ * frame is written by the calling thread when nothing else is being sent.
+ *
+ * @param m The mux.
+ * @param msg The message to send.
+ * @return 0 if the message was queued, FAILED if it is too large or the
+ * connection has failed.
+ */
+int mux_send(mux_t *m, rpc_message *msg);
+
+/*
+ * Queue a message to be sent by the writer thread, never writing on the
+ * calling thread, so that a slow peer cannot block the caller.
+ *
+ * @param m The mux.
+ * @param msg The message to send.
+ * @return 0 if the message was queued, FAILED if it is too large or the
+ * connection has failed.
+ */
+int mux_send_queued(mux_t *m, rpc_message *msg);
+
+/*
+ * Cancel a message sent with mux_send. A message none of which has been
+ * written is dropped from the queue. Otherwise the rest of it is replaced
+ * by a cancel frame, or a cancel frame follows it if it has all been
+ * written.
+ *
+ * @param m The mux.
+ * @param request_id The request id of the message.
+ */
+void mux_cancel(mux_t *m, uint64_t request_id);
+
+/*
+ * Wait for the next complete message from any request id. Only one thread
+ * may receive from a mux at a time.
+ *
+ * @param m The mux.
+ * @return The message, or NULL once the connection is closed or the peer
+ * breaks the framing.
+ */
+rpc_message *mux_receive(mux_t *m);
+
+/*
+ * Check every message received from now on with an admission callback,
+ * which runs on the receiving thread. Set it before the first mux_receive.
+ *
+ * @param m The mux.
+ * @param admit The callback.
+ * @param arg Passed to the callback.
+ */
+void mux_set_admit(mux_t *m, mux_admit_fn admit, void *arg);
+
+/*
+ * Have cancel frames passed to a callback, which runs on the receiving
+ * thread. Set it before the first mux_receive.
+ *
+ * @param m The mux.
+ * @param cancel The callback.
+ * @param arg Passed to the callback.
+ */
+void mux_set_cancel(mux_t *m, mux_cancel_fn cancel, void *arg);
+
+/*
+ * Spin on the socket for up to usec microseconds before blocking when
+ * waiting for data, and ask the kernel to busy poll the device queue.
+ * The spin shortens as long as nothing arrives while spinning.
+ *
+ * @param m The mux.
+ * @param usec Longest spin, or 0 to always block.
+ */
+void mux_set_busy_poll(mux_t *m, int usec);
+
+/*
+ * Send messages of at least threshold bytes with MSG_ZEROCOPY, so the
+ * kernel reads them from the message buffer instead of copying them into
+ * the socket. A message stays allocated until the kernel reports on the
+ * socket's error queue that it is done with it, which the writer thread
+ * checks after every frame. Up to MUX_ZEROCOPY_MAX_PENDING bytes may be
+ * waiting like this. Set it before the first mux_send.
+ *
+ * @param m The mux.
+ * @param threshold Smallest message sent in place, or 0 to copy all.
+ * @return 0 on success, FAILED if the kernel does not support it.
+ */
+int mux_set_zerocopy(mux_t *m, size_t threshold);
+
+/*
+ * Have the kernel timestamp the socket's traffic with SO_TIMESTAMPING.
+ * Received messages then have kernel_usec set to how long their last bytes
+ * waited in the receive buffer, and the software transmit timestamp of the
+ * last byte of every message sent is read from the socket's error queue
+ * and passed to sent. Set it before the first mux_send.
+ *
+ * @param m The mux.
+ * @param sent Called with the send time of each message, or NULL.
+ * @param arg Passed to sent.
+ * @return 0 on success, FAILED if the kernel does not support it.
+ */
+int mux_set_timestamping(mux_t *m, mux_sent_fn sent, void *arg);
+
+/*
+ * Append every message received from now on to a capture, as the bytes
+ * it arrived as, under a new connection number. Messages turned away by
+ * the admission callback are not captured. Set it before the first
+ * mux_receive.
+ *
+ * @param m The mux.
+ * @param cap The capture, which must outlive the mux.
+ */
+void mux_set_capture(mux_t *m, capture_t *cap);
+
+/*
+ * Read the connection's TCP_INFO, unless it was read less than
+ * TCP_INFO_INTERVAL_USEC ago.
+ *
+ * @param m The mux.
+ * @param force Read it however recently it was last read.
+ */
+void mux_sample_tcp_info(mux_t *m, int force);
+
+/*
+ * Get the connection's TCP_INFO as last read. host and port are left as
+ * they are.
+ *
+ * @param m The mux.
+ * @param info Filled in with the reading.
+ * @return 0 on success, FAILED if it has never been read.
+ */
+int mux_get_tcp_info(mux_t *m, rpc_connection_info *info);
+
+/*
+ * Get the counters of the zerocopy sends of a mux.
+ *
+ * @param m The mux.
+ * @param stats Filled in with the counters.
+ */
+void mux_get_zerocopy_stats(mux_t *m, mux_zerocopy_stats *stats);
+
+/*
+ * Shut the connection down in both directions, waking up a thread blocked
+ * in mux_receive. Messages still queued are dropped.
+ *
+ * @param m The mux.
+ */
+void mux_shutdown(mux_t *m);
+
+/*
+ * Send any queued messages, then close the socket and free the mux. No
+ * other thread may be using the mux.
+ *
+ * @param m The mux.
+ */
+void mux_free(mux_t *m);
+
+#endif
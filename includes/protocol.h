@@ -9,6 +9,7 @@
 #define PROTOCOL_H
 
 #include "rpc.h"
+#include <stdint.h>
 
 /*
  * The initial size of a buffer_t when it is created. This is not always
@@ -39,6 +40,16 @@
 #define MAX_PRINT_WIDTH 16
 #define MAX_PRINT_BYTE_SIZE (MAX_PRINT_HEIGHT * MAX_PRINT_WIDTH)
 
+/*
+ * Marks the server timing after the data of a serialised reply.
+ */
+#define TIMING_TAG 'T'
+
+/*
+ * Marks the trace context after the data of a serialised request.
+ */
+#define TRACE_TAG 'C'
+
 /* structures =============================================================== */
 
 /*
@@ -48,28 +59,53 @@ typedef struct {
     void *data;
     size_t next;
     size_t size;
+    // data is a region from the buffer pool rather than the heap
+    int pooled;
 } buffer_t;
 
 /*
- * The payload for requests/responses.
+ * The payload for requests/responses. The priority is carried in the frame
+ * headers rather than serialised with the rest of the message, so that it
+ * is known before the message has been received in full.
  */
 typedef struct {
-    int request_id;
+    uint64_t request_id;
     enum {
         FIND,
         CALL,
         REPLY_SUCCESS,
         REPLY_FAILURE,
+        // the server turned the call away to protect itself, by shedding
+        // it, a full bulkhead or a rate limit
+        REPLY_OVERLOADED,
     } operation;
+    int priority;
     char *function_name;
     rpc_data *data;
+    // when the message was decoded, and how long that took. Not sent
+    uint64_t received_usec;
+    unsigned long decode_usec;
+    // how long its last bytes waited in the kernel's receive buffer, when
+    // the connection has kernel timestamps on. Not sent
+    unsigned long kernel_usec;
+    // a reply may carry the server's timing after its data, which peers
+    // that do not know about it never read
+    int timed;
+    unsigned long queue_usec;
+    unsigned long handler_usec;
+    // a traced request carries its trace id and the id of the client span
+    // it was made in, likewise after its data
+    int traced;
+    uint64_t trace_id;
+    uint64_t span_id;
 } rpc_message;
 
 /* function prototypes ====================================================== */
 
 /*
  * Create a new buffer that will initially be calloc'd to size. Subsequent
- * reallocs will be in O(log n) and not zeroed out.
+ * reallocs will be in O(log n) and not zeroed out. Large buffers come from
+ * the buffer pool instead, without being zeroed.
  *
  * @param size The initial size of the buffer.
  * @return The new buffer.
@@ -84,7 +120,9 @@ buffer_t *new_buffer(size_t size);
 void buffer_free(buffer_t *b);
 
 /*
- * Reserve space in a buffer and use realloc if necessary in O(log n).
+ * Reserve space in a buffer and use realloc if necessary in O(log n). A
+ * buffer that grows past the buffer pool's threshold moves into a region
+ * from the pool.
  *
  * @param b The buffer to reserve space in.
  * @param size The number of bytes to reserve.
@@ -118,30 +156,13 @@ int read_bytes(int sockfd, unsigned char *buf, size_t size);
 void debug_print_bytes(const unsigned char *buffer, size_t len);
 
 /*
- * Send an rpc_message through a socket.
- *
- * @param sockfd The socket to send the message to.
- * @param msg The message to send.
- * @return 0 if successful, -1 otherwise.
- */
-int send_rpc_message(int sockfd, rpc_message *msg);
-
-/*
- * Receive an rpc_message from a socket.
+ * Serialise an rpc_message, ready to be sent over a multiplexed connection.
  *
- * @param sockfd The socket to receive the message from.
- * @return The message received. NULL if there was an error.
+ * @param msg The message to encode.
+ * @return A buffer whose first next bytes hold the encoded message, or NULL
+ * if the message is larger than MAX_MESSAGE_BYTE_SIZE.
  */
-rpc_message *receive_rpc_message(int sockfd);
-
-/*
- * Send a message through a socket and receive a response.
- * @param sockfd The socket to send the message to.
- * @param msg The message to send.
- * @return The response from the server. NULL if there was an error.
- * @note We must be wary of serialisation and endianess.
- */
-rpc_message *request(int sockfd, rpc_message *msg);
+buffer_t *encode_rpc_message(rpc_message *msg);
 
 /*
  * Serialise integer value into buffer. We assume that the integer value is
@@ -161,6 +182,23 @@ void serialise_int(buffer_t *b, int value);
  */
 int deserialise_int(buffer_t *b);
 
+/*
+ * Serialise an unsigned 64-bit value into buffer, big endian.
+ *
+ * @param b: buffer to serialise into
+ * @param value: value to serialise
+ */
+void serialise_uint64(buffer_t *b, uint64_t value);
+
+/*
+ * Deserialise an unsigned 64-bit value from buffer.
+ *
+ * @param buffer: buffer to deserialise from
+ * @return: deserialised value
+ * @note: buffer pointer is incremented
+ */
+uint64_t deserialise_uint64(buffer_t *b);
+
 /*
  * The length of the gamma code for a given integer value (x)
  * greater than 0.
@@ -190,6 +228,17 @@ void serialise_size_t(buffer_t *b, size_t value);
  */
 size_t deserialise_size_t(buffer_t *b);
 
+/*
+ * Deserialise size_t value from buffer, without reading past its size.
+ *
+ * @param buffer: buffer to deserialise from
+ * @param value: set to the deserialised size_t value
+ * @return: 0 on success, FAILED if the code runs past the end of the
+ * buffer or is too long for a size_t
+ * @note: buffer pointer is incremented only on success
+ */
+int deserialise_size_t_bounded(buffer_t *b, size_t *value);
+
 /*
  * Serialise string value into buffer.
  *
@@ -247,6 +296,21 @@ void serialise_rpc_message(buffer_t *b, const rpc_message *message);
  */
 rpc_message *deserialise_rpc_message(buffer_t *b);
 
+/*
+ * Read the request id, operation and function name at the start of a
+ * serialised rpc_message without decoding the rest, checking every read
+ * against the bytes that have arrived so far.
+ *
+ * @param buffer: buffer holding the first b->next bytes of the message
+ * @param request_id: set to the request id
+ * @param operation: set to the operation
+ * @param function_name: set to the function name, which points into the
+ * buffer
+ * @return: 0 on success, FAILED if the bytes so far do not hold all three
+ */
+int peek_rpc_message(const buffer_t *b, uint64_t *request_id, int *operation,
+                     const char **function_name);
+
 /*
  * Create a new string.
  *
@@ -274,8 +338,8 @@ rpc_data *new_rpc_data(int data1, size_t data2_len, void *data2);
  * @param data The data to send.
  * @return The new RPC message.
  */
-rpc_message *new_rpc_message(int request_id, int operation, char *function_name,
-                             rpc_data *data);
+rpc_message *new_rpc_message(uint64_t request_id, int operation,
+                             char *function_name, rpc_data *data);
 
 /*
  * Free an RPC message.
@@ -292,6 +356,14 @@ void rpc_message_free(rpc_message *message, void (*free_data)(rpc_data *));
  */
 rpc_message *create_failure_message();
 
+/*
+ * Create a reply to a call the server turned away because it is
+ * overloaded, so that the client can back off.
+ *
+ * @return The overloaded message.
+ */
+rpc_message *create_overloaded_message();
+
 /*
  * Print an RPC data.
  *
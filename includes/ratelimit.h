@@ -0,0 +1,54 @@
+/* =============================================================================
+   ratelimit.h
+
+   Lock-free token buckets for rate limiting calls on the server. A bucket
+   holds up to burst tokens, refilled at rate tokens per second, and every
+   accepted call takes one. It is kept as the generic cell rate algorithm,
+   which stores the whole bucket as a single time, the theoretical arrival
+   time of the next call, so taking a token is one compare-and-swap.
+
+   References:
+   - Generic cell rate algorithm:
+     https://en.wikipedia.org/wiki/Generic_cell_rate_algorithm
+
+   Author: David Sha
+============================================================================= */
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* structures =============================================================== */
+typedef struct {
+    // nanoseconds between tokens, 0 when there is no limit
+    _Atomic uint64_t interval;
+    // how far ahead of now the theoretical arrival time may run
+    _Atomic uint64_t tolerance;
+    _Atomic uint64_t tat;
+    _Atomic unsigned long limited;
+} token_bucket_t;
+
+/* function prototypes ====================================================== */
+
+/*
+ * Set the rate of a bucket, which starts full with its limited counter at
+ * zero. Safe to call while other
+ * threads are taking tokens.
+ *
+ * @param b The bucket.
+ * @param rate Tokens added per second, or 0 for no limit.
+ * @param burst Most tokens the bucket holds, at least 1.
+ */
+void token_bucket_init(token_bucket_t *b, double rate, int burst);
+
+/*
+ * Take a token if there is one.
+ *
+ * @param b The bucket.
+ * @param now The current time of the monotonic clock in nanoseconds.
+ * @return TRUE if a token was taken or there is no limit, FALSE otherwise.
+ */
+int token_bucket_take(token_bucket_t *b, uint64_t now);
+
+#endif
@@ -10,6 +10,11 @@
 
 #include <stddef.h>
 
+/*
+ * Longest function name kept in a span, including its terminator.
+ */
+#define RPC_SPAN_NAME_LENGTH 64
+
 /* structures =============================================================== */
 
 /*
@@ -18,6 +23,11 @@
 typedef struct rpc_server rpc_server;
 typedef struct rpc_client rpc_client;
 
+/*
+ * A client spread over several servers that provide the same functions.
+ */
+typedef struct rpc_group rpc_group;
+
 /*
  * The payload for requests/responses.
  */
@@ -38,6 +48,265 @@ typedef struct rpc_handle rpc_handle;
  */
 typedef rpc_data *(*rpc_handler)(rpc_data *);
 
+/*
+ * Allocator for the memory the library allocates, set with
+ * rpc_set_allocator. Every function is passed ctx.
+ */
+typedef struct {
+    void *(*malloc)(size_t size, void *ctx);
+    void *(*calloc)(size_t n, size_t size, void *ctx);
+    void *(*realloc)(void *ptr, size_t size, void *ctx);
+    void (*free)(void *ptr, void *ctx);
+    void *ctx;
+} rpc_allocator;
+
+/*
+ * Where the time of a call went, from rpc_call_timed. The server's part is
+ * only filled in by servers with rpc_server_set_timing on, and the rest of
+ * the total was spent on the network and in the client.
+ */
+typedef struct {
+    // from sending the request to receiving the reply
+    unsigned long total_usec;
+    // TRUE if the server reported the fields below
+    int server;
+    // from the request being decoded to a worker starting on it
+    unsigned long queue_usec;
+    // decoding the request once all of it had arrived
+    unsigned long decode_usec;
+    // running the handler
+    unsigned long handler_usec;
+} rpc_call_timing;
+
+/*
+ * Algorithms a client can use to adapt how many calls it allows in flight.
+ */
+typedef enum {
+    RPC_LIMIT_NONE,
+    RPC_LIMIT_AIMD,
+    RPC_LIMIT_GRADIENT,
+} rpc_limit_algorithm;
+
+/*
+ * Snapshot of a client's concurrency limiter.
+ */
+typedef struct {
+    int limit;
+    int in_flight;
+    int queued;
+    unsigned long rejected;
+} rpc_limit_stats;
+
+/*
+ * Options for a handler registered with rpc_register_ex. A zero field
+ * means no limit.
+ */
+typedef struct {
+    // most calls of this handler running at once
+    int max_concurrency;
+    // most calls waiting for one of those slots; more are rejected. Only
+    // used with max_concurrency
+    int max_queue;
+    // most calls accepted per second, over all clients; more are rejected
+    double rate;
+    // most calls accepted at once after a quiet spell. Only used with rate
+    int burst;
+    // run each call on its own stack, so that rpc_find, rpc_call,
+    // rpc_call_priority and the fan-out calls made by the handler suspend
+    // the call and free the worker for other calls until the reply arrives
+    int coroutine;
+    // frees the rpc_data the handler returns once the reply is sent. NULL
+    // means free() on data2 and then the struct, so a handler that
+    // allocates with rpc_malloc passes rpc_data_free
+    void (*free_result)(rpc_data *data);
+} rpc_handler_opts;
+
+/*
+ * Counters of a registered handler.
+ */
+typedef struct {
+    unsigned long calls;
+    unsigned long rejected;
+    unsigned long queued;
+    unsigned long limited;
+    int running;
+    int waiting;
+} rpc_handler_stats;
+
+/*
+ * Where a server's calls spent their time, summed over the calls made
+ * since rpc_server_set_timestamping was turned on, with the longest of
+ * each. Divide by requests or replies for the means.
+ */
+typedef struct {
+    unsigned long requests;
+    // waiting in the kernel's receive buffer, from kernel timestamps
+    unsigned long long receive_usec;
+    unsigned long max_receive_usec;
+    // waiting for a worker
+    unsigned long long queue_usec;
+    unsigned long max_queue_usec;
+    // running the handler
+    unsigned long long handler_usec;
+    unsigned long max_handler_usec;
+    unsigned long replies;
+    // from the reply being queued until the kernel handed it to the
+    // device, from kernel timestamps
+    unsigned long long send_usec;
+    unsigned long max_send_usec;
+} rpc_latency_stats;
+
+/*
+ * Options of a server's slow call log, see rpc_server_set_slow_log.
+ */
+typedef struct {
+    // calls taking at least this long from their last bytes arriving to
+    // their handler returning are logged
+    unsigned long threshold_usec;
+    // log one in every sample slow calls, 0 or 1 for all of them
+    int sample;
+    // how many leading bytes of the request's data2 to log in hex, at most
+    // SLOW_LOG_MAX_DATA
+    size_t data_bytes;
+} rpc_slow_log_opts;
+
+/*
+ * The trace a thread is working on, and the span its calls are made from.
+ * A trace_id of 0 means none.
+ */
+typedef struct {
+    unsigned long long trace_id;
+    unsigned long long span_id;
+} rpc_trace_context;
+
+typedef enum {
+    RPC_SPAN_CLIENT,
+    RPC_SPAN_SERVER,
+} rpc_span_kind;
+
+/*
+ * A traced call as seen by one side of it. The client span of a call is
+ * the parent of its server span, whose handler's calls are its children.
+ * Start times are on the realtime clock, so spans recorded by different
+ * hosts line up as well as their clocks do.
+ */
+typedef struct {
+    unsigned long long trace_id;
+    unsigned long long span_id;
+    // 0 for the root of the trace
+    unsigned long long parent_id;
+    rpc_span_kind kind;
+    char name[RPC_SPAN_NAME_LENGTH];
+    unsigned long long start_usec;
+    unsigned long total_usec;
+    // how a server span's time was spent, all 0 in client spans. receive
+    // is only known with rpc_server_set_timestamping on
+    unsigned long receive_usec;
+    unsigned long decode_usec;
+    unsigned long queue_usec;
+    unsigned long handler_usec;
+    // the call got no reply, or a failure
+    int failed;
+} rpc_span;
+
+/*
+ * Transport health of a connection, from the kernel's TCP_INFO as last
+ * read, at most TCP_INFO_INTERVAL_USEC ago.
+ */
+typedef struct {
+    // address and port of the other end
+    char host[46];
+    int port;
+    unsigned long rtt_usec;
+    unsigned long rttvar_usec;
+    // segments retransmitted over the life of the connection
+    unsigned long retransmits;
+    // congestion window, in segments
+    unsigned long cwnd;
+    // segments sent and not yet acknowledged
+    unsigned long unacked;
+} rpc_connection_info;
+
+/*
+ * Transport health over all of a server's connections.
+ */
+typedef struct {
+    int connections;
+    unsigned long mean_rtt_usec;
+    unsigned long max_rtt_usec;
+    unsigned long retransmits;
+    unsigned long min_cwnd;
+    unsigned long mean_cwnd;
+    unsigned long unacked;
+} rpc_transport_stats;
+
+/*
+ * Faults injected into the socket I/O of this process, to see how calls
+ * behave over a bad network without root or tc. Probabilities are from 0
+ * to 1 and apply to each send or receive on a connection. Delays hold up
+ * received data before the process sees it, so they add to the latency
+ * of calls without blocking the threads making them.
+ */
+typedef struct {
+    // added to every receive, plus a random part of up to jitter_usec
+    unsigned long delay_usec;
+    unsigned long jitter_usec;
+    // bytes per second each connection receives at most, or 0 for no
+    // limit. Received data is held up for as long as it takes at this rate
+    double bandwidth;
+    // receives held up by stall_usec, as data behind a lost segment waits
+    // for its retransmission. 0 for FAULT_STALL_USEC
+    double stall;
+    unsigned long stall_usec;
+    // sends and receives that only move some of the bytes asked for
+    double partial;
+    // sends on which the connection is shut down instead
+    double reset;
+} rpc_fault_opts;
+
+/*
+ * Counts of the faults injected into this process.
+ */
+typedef struct {
+    unsigned long delays;
+    unsigned long stalls;
+    unsigned long partials;
+    unsigned long resets;
+} rpc_fault_stats;
+
+/*
+ * Priority classes of calls. When a server is busy it runs queued calls of
+ * higher classes more often, and sheds lower classes first when its queue
+ * is full.
+ */
+typedef enum {
+    RPC_PRIORITY_INTERACTIVE,
+    RPC_PRIORITY_NORMAL,
+    RPC_PRIORITY_BATCH,
+} rpc_priority;
+
+/*
+ * Health of a single server in a group.
+ */
+typedef enum {
+    RPC_ENDPOINT_HEALTHY,
+    RPC_ENDPOINT_EJECTED,
+    RPC_ENDPOINT_PROBING,
+} rpc_endpoint_state;
+
+/*
+ * Snapshot of a single server in a group.
+ */
+typedef struct {
+    rpc_endpoint_state state;
+    double latency_usec;
+    double error_rate;
+    double weight;
+    unsigned long calls;
+    unsigned long failures;
+    int ejections;
+} rpc_endpoint_stats;
+
 /* function prototypes ====================================================== */
 
 /* ---------------- */
@@ -67,6 +336,184 @@ rpc_server *rpc_init_server(int port);
  */
 int rpc_register(rpc_server *srv, char *name, rpc_handler handler);
 
+/*
+ * Register a handler with options. A handler limited by max_concurrency
+ * is a bulkhead: however slow it gets, it only ties up that many of the
+ * server's workers, and its excess calls wait in its own queue or fail
+ * instead of starving the other handlers.
+ *
+ * @param opts The options, or NULL for none.
+ * @return As for rpc_register.
+ */
+int rpc_register_ex(rpc_server *srv, char *name, rpc_handler handler,
+                    rpc_handler_opts *opts);
+
+/*
+ * Get the counters of a registered handler.
+ *
+ * @param srv The server.
+ * @param name The name of the handler.
+ * @param stats Filled in with the counters.
+ * @return 0 on success, FAILED if the name is not registered or any of
+ * the parameters are NULL.
+ */
+int rpc_server_handler_stats(rpc_server *srv, char *name,
+                             rpc_handler_stats *stats);
+
+/*
+ * Set the scheduling weight of a client address. While the server is busy,
+ * connections take turns to have their calls run, and a connection from
+ * this address runs up to weight calls per turn instead of
+ * CLIENT_WEIGHT_DEFAULT. Applies to connections accepted afterwards.
+ *
+ * @param srv The server.
+ * @param addr The client address as the server sees it, e.g. "::1" or
+ * "192.0.2.1".
+ * @param weight The weight, at least 1.
+ * @return 0 on success, FAILED if the parameters are invalid.
+ */
+int rpc_server_set_client_weight(rpc_server *srv, char *addr, int weight);
+
+/*
+ * Limit the rate of calls from a client address. All connections from the
+ * address share one token bucket, and calls beyond it fail straight away,
+ * before their payload is read. A connection takes its bucket when it is
+ * accepted and keeps it. Changing the limit of an address applies at once
+ * to its connections. Changing the default only applies to addresses that
+ * have no bucket yet: existing connections keep the bucket made from the
+ * old default, which is dropped some time after they have all closed.
+ *
+ * @param srv The server.
+ * @param addr The client address as the server sees it, or NULL to give
+ * every address without a limit of its own a bucket of this size.
+ * @param rate Most calls per second, or 0 for no limit.
+ * @param burst Most calls accepted at once after a quiet spell.
+ * @return 0 on success, FAILED if the parameters are invalid.
+ */
+int rpc_server_set_client_rate(rpc_server *srv, char *addr, double rate,
+                               int burst);
+
+/*
+ * Trade CPU for latency. Connection threads spin on their sockets and idle
+ * workers spin on the run queues for up to usec microseconds before
+ * sleeping, so a call that arrives within that time is picked up without
+ * a wake-up. The spin shortens while nothing arrives, so an idle server
+ * soon sleeps again. Only worth it with a core to spare for every
+ * spinning thread. Applies to connections accepted afterwards.
+ *
+ * @param srv The server.
+ * @param usec Longest spin, or 0 to turn spinning off.
+ * @return 0 on success, FAILED if the parameters are invalid.
+ */
+int rpc_server_set_busy_poll(rpc_server *srv, int usec);
+
+/*
+ * Send replies of at least threshold bytes with MSG_ZEROCOPY, so the
+ * kernel reads them straight from the reply buffer instead of copying
+ * them into the socket. Each such reply stays allocated until the kernel
+ * is done with it. Pays off for replies of hundreds of kilobytes or more
+ * on a real network; on loopback the kernel copies them anyway. Applies
+ * to connections accepted afterwards.
+ *
+ * @param srv The server.
+ * @param threshold Smallest reply sent in place, or 0 to copy all.
+ * @return 0 on success, FAILED if the kernel does not support it.
+ */
+int rpc_server_set_zerocopy(rpc_server *srv, size_t threshold);
+
+/*
+ * Accept the first request of a connection in its SYN from clients using
+ * TCP Fast Open (see rpc_set_fast_open), saving them a round trip. Needs
+ * bit 0x2 of the net.ipv4.tcp_fastopen sysctl to take effect.
+ *
+ * @param srv The server.
+ * @param enabled TRUE to accept data in the SYN, FALSE to stop.
+ * @return 0 on success, FAILED if the kernel does not support it.
+ */
+int rpc_server_set_fast_open(rpc_server *srv, int enabled);
+
+/*
+ * Report in every reply how long the call waited in the server's queues,
+ * how long its request took to decode and how long its handler ran, for
+ * callers using rpc_call_timed. Older clients ignore the report.
+ *
+ * @param srv The server.
+ * @param enabled TRUE to report, FALSE to stop.
+ * @return 0 on success, FAILED if srv is NULL.
+ */
+int rpc_server_set_timing(rpc_server *srv, int enabled);
+
+/*
+ * Have the kernel timestamp the traffic of new connections, and count
+ * where their calls spend their time: in the kernel's receive buffer, in
+ * the server's queues, in the handler, and between the reply being queued
+ * and the kernel sending it. Tells latency added by the network stack
+ * apart from latency added by handlers. See rpc_server_latency_stats.
+ *
+ * @param srv The server.
+ * @param enabled TRUE to timestamp, FALSE to stop.
+ * @return 0 on success, FAILED if the kernel does not support it.
+ */
+int rpc_server_set_timestamping(rpc_server *srv, int enabled);
+
+/*
+ * Get the transport health of a server's connections, from their TCP_INFO
+ * as read every TCP_INFO_INTERVAL_USEC by the accept loop, to tell slow
+ * calls caused by retransmits or small congestion windows apart from
+ * slow handlers.
+ *
+ * @param srv The server.
+ * @param stats Filled in with the totals over all connections.
+ * @param worst Filled in with the connections of the longest round trip
+ * times, longest first, or NULL.
+ * @param n The size of worst.
+ * @return How many connections were put in worst, or FAILED if srv or
+ * stats is NULL.
+ */
+int rpc_server_transport_stats(rpc_server *srv, rpc_transport_stats *stats,
+                               rpc_connection_info *worst, int n);
+
+/*
+ * Log calls slower than a threshold to a file, one line of key=value pairs
+ * per call: when it finished, the function name, the client's address,
+ * the request and reply sizes, the time taken in total, in the kernel's
+ * receive buffer (with rpc_server_set_timestamping on), decoding, queued
+ * and in the handler, and optionally the start of the request's data2.
+ * Workers hand the records to a background thread through a lock-free
+ * ring, dropping them when it is full. Set it before rpc_serve_all.
+ *
+ * @param srv The server.
+ * @param path The file to append to, or NULL to stop logging.
+ * @param opts The options, which must not be NULL unless path is.
+ * @return 0 on success, FAILED if the file could not be opened or srv is
+ * NULL.
+ */
+int rpc_server_set_slow_log(rpc_server *srv, const char *path,
+                            const rpc_slow_log_opts *opts);
+
+/*
+ * Capture every request the server receives to a file, with when and on
+ * which connection it arrived, for rpc-replay to send again later. Only
+ * connections accepted from then on are captured, so set it before
+ * rpc_serve_all. Costs nothing when it is off.
+ *
+ * @param srv The server.
+ * @param path The file to create, replacing any file there.
+ * @return 0 on success, FAILED if the file could not be created or srv or
+ * path is NULL.
+ */
+int rpc_server_set_capture(rpc_server *srv, const char *path);
+
+/*
+ * Get where the calls of a server with rpc_server_set_timestamping on
+ * spent their time.
+ *
+ * @param srv The server.
+ * @param stats Filled in with the counters.
+ * @return 0 on success, FAILED if any of the parameters are NULL.
+ */
+int rpc_server_latency_stats(rpc_server *srv, rpc_latency_stats *stats);
+
 /*
  * Server function to handle incoming requests. This function will wait
  * for incoming requests for any registered functions, or rpc_find, on
@@ -96,6 +543,52 @@ void rpc_serve_all(rpc_server *srv);
  */
 rpc_client *rpc_init_client(char *addr, int port);
 
+/*
+ * Connect clients created from now on with TCP Fast Open. Once a server
+ * has handed out a cookie, a new client's first request is sent in the
+ * SYN, so a short-lived client saves the round trip of the handshake.
+ * rpc_init_client then no longer waits for the connection, and a server
+ * that has gone away only shows up as the first call failing.
+ *
+ * @param enabled TRUE to use TCP Fast Open, FALSE to stop.
+ */
+void rpc_set_fast_open(int enabled);
+
+/*
+ * Inject faults into the socket I/O of every connection of this process,
+ * clients and servers alike, from now on. Without a call to this, faults
+ * are read from the environment on the first send or receive:
+ * RPC_FAULT_DELAY_USEC, RPC_FAULT_JITTER_USEC, RPC_FAULT_BANDWIDTH,
+ * RPC_FAULT_STALL, RPC_FAULT_STALL_USEC, RPC_FAULT_PARTIAL and
+ * RPC_FAULT_RESET, named after the fields of rpc_fault_opts, which are
+ * ignored if any is invalid. With no faults, socket I/O costs one more
+ * atomic load.
+ *
+ * @param opts The faults, which are copied, or NULL for none.
+ * @return 0 on success, FAILED if a probability is outside 0 to 1 or the
+ * bandwidth is negative.
+ */
+int rpc_set_faults(const rpc_fault_opts *opts);
+
+/*
+ * Get how many faults have been injected into this process.
+ *
+ * @param stats Filled in with the counts.
+ */
+void rpc_get_fault_stats(rpc_fault_stats *stats);
+
+/*
+ * Initialises a client attached to a server in the same process. Calls
+ * made through it run the registered handler on the caller's thread,
+ * passing the caller's payload straight in, with no encoding, socket or
+ * worker in between. Scheduling, bulkheads and rate limits do not apply.
+ * The server does not have to be serving, but must outlive the client.
+ *
+ * @param srv The server.
+ * @return rpc_client*, or NULL on failure.
+ */
+rpc_client *rpc_init_local_client(rpc_server *srv);
+
 /*
  * Find the remote procedure with the given name.
  *
@@ -115,12 +608,77 @@ rpc_handle *rpc_find(rpc_client *cl, char *name);
  * @param h The handle for the remote procedure to call.
  * @param payload The data to send to the remote procedure.
  * @return The data returned by the remote procedure, or NULL if
- * the call fails, or if any of the parameters are NULL.
+ * the call fails, if the client's concurrency limit rejects it, or
+ * if any of the parameters are NULL.
  * @note The returned data should be freed by the caller using
- * rpc_data_free.
+ * rpc_data_free. A client may be shared by several threads.
  */
 rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload);
 
+/*
+ * Call a remote procedure in the given priority class. rpc_call uses
+ * RPC_PRIORITY_NORMAL.
+ *
+ * @param priority The priority class of the call.
+ * @return As for rpc_call. A call shed by a busy server returns NULL.
+ */
+rpc_data *rpc_call_priority(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                            rpc_priority priority);
+
+/*
+ * Call a remote procedure with a priority, and report where the time of
+ * the call went.
+ *
+ * @param cl The client to use.
+ * @param h The handle for the remote procedure to call.
+ * @param payload The data to send to the remote procedure.
+ * @param priority The priority class of the call.
+ * @param timing Filled in with the breakdown if the call gets a reply.
+ * @return As for rpc_call.
+ */
+rpc_data *rpc_call_timed(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                         rpc_priority priority, rpc_call_timing *timing);
+
+/*
+ * Call the same remote procedure on several servers at once from a single
+ * thread, and wait for every reply.
+ *
+ * @param clients The clients to call.
+ * @param n The number of clients.
+ * @param h The handle for the remote procedure to call.
+ * @param payload The data to send to every remote procedure.
+ * @param results Filled in with the data returned by each client's server,
+ * or NULL where the call failed, timed out or was cancelled.
+ * @param timeout_ms How long to wait for replies in milliseconds, or a
+ * negative value to wait forever. Calls on local clients run one after
+ * another on the calling thread once the others have been sent, and are
+ * not cut short by it.
+ * @return The number of successful calls, or FAILED if any of the
+ * parameters are invalid.
+ * @note Each non-NULL result should be freed using rpc_data_free.
+ */
+int rpc_call_all(rpc_client **clients, int n, rpc_handle *h,
+                 rpc_data *payload, rpc_data **results, int timeout_ms);
+
+/*
+ * Like rpc_call_all, but return as soon as k calls have succeeded, e.g.
+ * k = n / 2 + 1 for a quorum or k = 1 for the first reply, or as soon as
+ * too many have failed for k to succeed. Calls still outstanding are
+ * cancelled: their replies are discarded when they arrive, and each server
+ * is told, so that it drops the call if it is still waiting in its run
+ * queue. A call a server has already started runs to the end. Each call
+ * takes a slot of its client's concurrency limit, and one the limit turns
+ * away counts as failed. Made from a coroutine handler, the wait frees the
+ * worker as rpc_call does.
+ *
+ * @param k The number of successful calls to wait for, between 1 and n.
+ * @return The number of successful calls, or FAILED if any of the
+ * parameters are invalid.
+ */
+int rpc_call_some(rpc_client **clients, int n, rpc_handle *h,
+                  rpc_data *payload, rpc_data **results, int k,
+                  int timeout_ms);
+
 /*
  * Clean up the client state and close the connection. If an already
  * closed client is passed, do nothing.
@@ -130,15 +688,235 @@ rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload);
  */
 void rpc_close_client(rpc_client *cl);
 
+/*
+ * Limit how many calls a client allows in flight to its server. Calls from
+ * different threads overlap on the client's connection, so the limit bounds
+ * how many the server has queued or running for this client at once. It
+ * adapts to the observed latency of each call, so that load backs off as
+ * soon as the server starts queueing requests. Calls above the limit wait
+ * in a queue, and once the queue is full they fail immediately.
+ *
+ * @param cl The client to limit.
+ * @param algorithm How the limit adapts. RPC_LIMIT_NONE removes the limit.
+ * @param max_queue How many calls may wait for a slot. 0 rejects every call
+ * above the limit.
+ * @return 0 on success, FAILED on failure.
+ * @note This function should be called before any rpc_call on the client.
+ */
+int rpc_client_set_limit(rpc_client *cl, rpc_limit_algorithm algorithm,
+                         int max_queue);
+
+/*
+ * Trade CPU for latency. The client's reader thread spins on the socket,
+ * and callers spin waiting for their reply, for up to usec microseconds
+ * before sleeping. The spin shortens while replies take longer than that.
+ *
+ * @param cl The client.
+ * @param usec Longest spin, or 0 to turn spinning off.
+ * @return 0 on success, FAILED if the parameters are invalid.
+ */
+int rpc_client_set_busy_poll(rpc_client *cl, int usec);
+
+/*
+ * Send requests of at least threshold bytes with MSG_ZEROCOPY, as for
+ * rpc_server_set_zerocopy.
+ *
+ * @param cl The client.
+ * @param threshold Smallest request sent in place, or 0 to copy all.
+ * @return 0 on success, FAILED if the kernel does not support it.
+ * @note This function should be called before any rpc_call on the client.
+ */
+int rpc_client_set_zerocopy(rpc_client *cl, size_t threshold);
+
+/*
+ * Get the current state of a client's concurrency limiter.
+ *
+ * @param cl The client.
+ * @param stats The struct to fill in.
+ * @return 0 on success, FAILED if the client has no limiter.
+ */
+int rpc_client_limit_stats(rpc_client *cl, rpc_limit_stats *stats);
+
+/*
+ * Get the transport health of a client's connection, from its TCP_INFO as
+ * read at most TCP_INFO_INTERVAL_USEC ago.
+ *
+ * @param cl The client.
+ * @param info The struct to fill in.
+ * @return 0 on success, FAILED if the client is local or the kernel does
+ * not report TCP_INFO.
+ */
+int rpc_client_transport_info(rpc_client *cl, rpc_connection_info *info);
+
+/* --------------- */
+/* Group functions */
+/* --------------- */
+
+/*
+ * Initialises a group of clients, one for each server. Servers that cannot
+ * be reached yet start out ejected and are retried later.
+ *
+ * @param addrs The addresses of the servers.
+ * @param ports The ports of the servers.
+ * @param n The number of servers.
+ * @return rpc_group*, or NULL on failure.
+ */
+rpc_group *rpc_init_group(char **addrs, int *ports, int n);
+
+/*
+ * Find a remote procedure on any healthy server of the group. Handles only
+ * identify the procedure by name, so the handle may be used with every
+ * server in the group.
+ *
+ * @param g The group to use.
+ * @param name The name of the function.
+ * @return A handle for the remote procedure, or NULL on failure.
+ */
+rpc_handle *rpc_group_find(rpc_group *g, char *name);
+
+/*
+ * Call a remote procedure on one server of the group. Servers are picked
+ * by comparing the latency of two random candidates. Each server's error
+ * rate and latency is tracked, and outliers are temporarily ejected, then
+ * probed back in with gradually increasing weight.
+ *
+ * @param g The group to use.
+ * @param h The handle for the remote procedure.
+ * @param payload The data to send to the remote procedure.
+ * @return The data returned by the remote procedure, or NULL on failure.
+ * @note The returned data should be freed using rpc_data_free.
+ */
+rpc_data *rpc_group_call(rpc_group *g, rpc_handle *h, rpc_data *payload);
+
+/*
+ * Call a remote procedure on the server that owns a key. Keys are spread
+ * with rendezvous hashing, so a key keeps going to the same server, and
+ * adding or removing a server only moves the keys that server gains or
+ * loses. While the owner of a key is ejected, its calls go to the server
+ * that would own the key without it.
+ *
+ * @param g The group to use.
+ * @param key The bytes of the key.
+ * @param key_len The number of bytes in the key.
+ * @param h The handle for the remote procedure.
+ * @param payload The data to send to the remote procedure.
+ * @return The data returned by the remote procedure, or NULL on failure.
+ * @note The returned data should be freed using rpc_data_free.
+ */
+rpc_data *rpc_group_call_key(rpc_group *g, const void *key, size_t key_len,
+                             rpc_handle *h, rpc_data *payload);
+
+/*
+ * Add a server to a group.
+ *
+ * @param g The group.
+ * @param addr The address of the server.
+ * @param port The port of the server.
+ * @return 0 on success, FAILED if the server is already in the group.
+ */
+int rpc_group_add(rpc_group *g, char *addr, int port);
+
+/*
+ * Remove a server from a group. Calls in flight to it are allowed to
+ * finish.
+ *
+ * @param g The group.
+ * @param addr The address of the server.
+ * @param port The port of the server.
+ * @return 0 on success, FAILED if the server is not in the group.
+ */
+int rpc_group_remove(rpc_group *g, char *addr, int port);
+
+/*
+ * Enable or disable outlier ejection for a group. It is enabled by default.
+ *
+ * @param g The group.
+ * @param enabled TRUE to eject outliers, FALSE to keep every server in use.
+ */
+void rpc_group_set_outlier_detection(rpc_group *g, int enabled);
+
+/*
+ * Get the state of one server in the group.
+ *
+ * @param g The group.
+ * @param i The index of the server, in the order given to rpc_init_group
+ * followed by the servers added with rpc_group_add.
+ * @param stats The struct to fill in.
+ * @return 0 on success, FAILED if i is out of range.
+ */
+int rpc_group_endpoint_stats(rpc_group *g, int i, rpc_endpoint_stats *stats);
+
+/*
+ * Close every client in the group and free it.
+ *
+ * @param g The group to close.
+ */
+void rpc_close_group(rpc_group *g);
+
 /* ---------------- */
 /* Shared functions */
 /* ---------------- */
 
 /*
- * Free the memory allocated to rpc_data struct.
+ * Free the memory allocated to rpc_data struct. Use it on the rpc_data
+ * returned by rpc_call and friends, which is allocated with rpc_malloc.
  *
  * @param data The struct to free.
  */
 void rpc_data_free(rpc_data *data);
 
+/*
+ * Allocate all library memory with a, e.g. to use jemalloc arenas or a
+ * per-thread pool. Call it before any other library function, and never
+ * while the library holds memory from the previous allocator.
+ *
+ * @param a The allocator, which is copied, or NULL to go back to libc.
+ * @return 0 on success, FAILED if any of its functions are missing.
+ */
+int rpc_set_allocator(const rpc_allocator *a);
+
+/*
+ * Allocate and free with the library's allocator, which handlers and
+ * callers can use for memory the library frees or hands them.
+ */
+void *rpc_malloc(size_t size);
+void *rpc_calloc(size_t n, size_t size);
+void *rpc_realloc(void *ptr, size_t size);
+void rpc_free(void *ptr);
+
+/*
+ * Start a new trace on this thread, whose calls from now on are recorded
+ * as its spans and carry it to their servers. Servers run the handlers of
+ * traced calls in the call's trace, so calls the handlers make join it,
+ * and so on through every hop.
+ *
+ * @param ctx Filled in with the new trace, with span_id 0, or NULL.
+ */
+void rpc_trace_start(rpc_trace_context *ctx);
+
+/*
+ * Set the trace of this thread, e.g. one handed over from another thread.
+ *
+ * @param ctx The trace, or NULL to stop tracing this thread's calls.
+ */
+void rpc_trace_set(const rpc_trace_context *ctx);
+
+/*
+ * Get the trace of this thread.
+ *
+ * @param ctx Filled in with the trace.
+ * @return 0 on success, FAILED if the thread is not in a trace.
+ */
+int rpc_trace_current(rpc_trace_context *ctx);
+
+/*
+ * Take the spans recorded by this process, oldest first. Up to
+ * TRACE_BUFFER_SIZE are kept, and older ones are overwritten.
+ *
+ * @param spans Filled in with the spans.
+ * @param max The most spans to take.
+ * @return How many spans were taken.
+ */
+size_t rpc_trace_collect(rpc_span *spans, size_t max);
+
 #endif
@@ -0,0 +1,179 @@
+/* =============================================================================
+   scheduler.h
+
+   Run queues between a server's connection threads, which receive calls,
+   and its worker threads, which run them. There is one run queue per
+   priority class, and workers take calls from the classes in proportion to
+   their weights using smooth weighted round-robin. Within a class, every
+   connection has its own queue, and the connections with calls queued take
+   turns using deficit round-robin: a connection of weight w runs up to w
+   calls per turn, so a client pipelining thousands of calls cannot crowd
+   out the others. When the queues are full, the newest call of the longest
+   connection queue in the lowest class below the incoming one is shed to
+   make room, so batch work gives way to interactive work and heavy clients
+   give way to light ones. Calls that were suspended in the middle of a
+   nested call are resumed ahead of all of these.
+
+   References:
+   - Smooth weighted round-robin:
+     https://github.com/phusion/nginx/commit/27e94984486058d7
+   - M. Shreedhar and G. Varghese, Efficient Fair Queuing Using Deficit
+     Round-Robin, IEEE/ACM Transactions on Networking, 1996.
+
+   Author: David Sha
+============================================================================= */
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "linkedlist.h"
+#include "protocol.h"
+#include "rpc.h"
+#include "spin.h"
+#include <pthread.h>
+
+#define NUM_PRIORITIES (RPC_PRIORITY_BATCH + 1)
+
+/* structures =============================================================== */
+
+/*
+ * The calls queued from one connection. Only the scheduler touches its
+ * fields, under the scheduler's lock.
+ */
+typedef struct {
+    list_t *queues[NUM_PRIORITIES];
+    int deficit[NUM_PRIORITIES];
+    int queued[NUM_PRIORITIES];
+    int weight;
+} flow_t;
+
+/*
+ * A call waiting to be run, the connection it came from, and that
+ * connection's flow. A suspended call being resumed has call set instead
+ * of flow and msg.
+ */
+typedef struct {
+    void *conn;
+    flow_t *flow;
+    rpc_message *msg;
+    void *call;
+} job_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    list_t *active[NUM_PRIORITIES];
+    list_t *ready;
+    int held;
+    int class_queued[NUM_PRIORITIES];
+    int weights[NUM_PRIORITIES];
+    int current[NUM_PRIORITIES];
+    int queued;
+    int max_queue;
+    int closed;
+    unsigned long shed[NUM_PRIORITIES];
+    spin_t spin;
+} scheduler_t;
+
+/* function prototypes ====================================================== */
+
+/*
+ * Create a new scheduler.
+ *
+ * @param max_queue The most calls queued at once.
+ * @return The new scheduler.
+ */
+scheduler_t *scheduler_create(int max_queue);
+
+/*
+ * Free a scheduler. Its queues must be empty and no worker may be waiting.
+ *
+ * @param s The scheduler.
+ */
+void scheduler_destroy(scheduler_t *s);
+
+/*
+ * Create the flow of a new connection.
+ *
+ * @param weight How many calls the connection runs per turn, at least 1.
+ * @return The new flow.
+ */
+flow_t *flow_create(int weight);
+
+/*
+ * Free a flow. None of its calls may still be queued.
+ *
+ * @param flow The flow.
+ */
+void flow_free(flow_t *flow);
+
+/*
+ * Queue a call in its flow, in the class given by its message's priority.
+ *
+ * @param s The scheduler.
+ * @param job The call.
+ * @return NULL if the call was queued without shedding anything, otherwise
+ * the call that was shed, which may be job itself. The caller rejects it.
+ */
+job_t *scheduler_push(scheduler_t *s, job_t *job);
+
+/*
+ * Take a call that has not started yet out of its flow's queue.
+ *
+ * @param s The scheduler.
+ * @param flow The flow of the connection the call came from.
+ * @param request_id The request id of the call.
+ * @return The call, or NULL if it is not queued.
+ */
+job_t *scheduler_cancel(scheduler_t *s, flow_t *flow, uint64_t request_id);
+
+/*
+ * Wait for the next call to run.
+ *
+ * @param s The scheduler.
+ * @return The call, or NULL once the scheduler is closed, empty, and has
+ * no suspended calls.
+ */
+job_t *scheduler_pop(scheduler_t *s);
+
+/*
+ * Have workers with nothing to do spin for up to usec microseconds before
+ * sleeping.
+ *
+ * @param s The scheduler.
+ * @param usec Longest spin, or 0 to sleep straight away.
+ */
+void scheduler_set_busy_poll(scheduler_t *s, int usec);
+
+/*
+ * Note that a call has been suspended and will come back through
+ * scheduler_resume, so the workers must not exit before it does.
+ *
+ * @param s The scheduler.
+ */
+void scheduler_hold(scheduler_t *s);
+
+/*
+ * Note that a call noted with scheduler_hold has finished.
+ *
+ * @param s The scheduler.
+ */
+void scheduler_release(scheduler_t *s);
+
+/*
+ * Queue a suspended call to be resumed. It goes ahead of every new call
+ * and is never shed.
+ *
+ * @param s The scheduler.
+ * @param job The call, with call set.
+ */
+void scheduler_resume(scheduler_t *s, job_t *job);
+
+/*
+ * Stop accepting calls and wake up the workers, which finish the calls
+ * still queued and then exit.
+ *
+ * @param s The scheduler.
+ */
+void scheduler_close(scheduler_t *s);
+
+#endif
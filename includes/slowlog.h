@@ -0,0 +1,92 @@
+/* =============================================================================
+   slowlog.h
+
+   Log of the slow calls of a server. Workers that finish a call slower
+   than the threshold copy a record of it into a fixed ring of slots
+   without taking a lock, and a background thread drains the ring into a
+   file, one line per call. When the ring is full the record is dropped
+   and counted rather than making the worker wait, and only one in every
+   sample slow calls is recorded at all, so a server that turns slow all at
+   once does not slow down further from logging it.
+
+   The ring is a bounded multi-producer queue where every slot carries a
+   sequence number saying whose turn it is, so producers only contend on
+   the compare-and-swap claiming a slot.
+
+   References:
+   - D. Vyukov, Bounded MPMC queue,
+   https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+
+   Author: David Sha
+============================================================================= */
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include "config.h"
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* structures =============================================================== */
+
+/*
+ * A slow call, with how long each part of it took. The function name is
+ * cut short at SLOW_LOG_MAX_NAME bytes.
+ */
+typedef struct {
+    uint64_t time_usec;
+    char function[SLOW_LOG_MAX_NAME + 1];
+    char peer[INET6_ADDRSTRLEN];
+    size_t request_bytes;
+    size_t reply_bytes;
+    unsigned long total_usec;
+    unsigned long receive_usec;
+    unsigned long decode_usec;
+    unsigned long queue_usec;
+    unsigned long handler_usec;
+    size_t data_len;
+    unsigned char data[SLOW_LOG_MAX_DATA];
+} slow_entry_t;
+
+typedef struct slow_log slow_log_t;
+
+/* function prototypes ====================================================== */
+
+/*
+ * Open a file to log to, appending to it, and start the thread draining
+ * the ring into it.
+ *
+ * @param path The file.
+ * @param sample Record one in every sample slow calls, 1 for all of them.
+ * @return The new log, or NULL if the file could not be opened.
+ */
+slow_log_t *slow_log_open(const char *path, int sample);
+
+/*
+ * Decide whether to record a slow call, which is worth checking before
+ * filling in an entry.
+ *
+ * @param log The log.
+ * @return TRUE if the call is to be recorded with slow_log_push.
+ */
+int slow_log_sampled(slow_log_t *log);
+
+/*
+ * Copy a slow call into the ring. Safe to call from any thread.
+ *
+ * @param log The log.
+ * @param entry The call.
+ * @return TRUE if it was queued, FALSE if the ring was full and it was
+ * dropped.
+ */
+int slow_log_push(slow_log_t *log, const slow_entry_t *entry);
+
+/*
+ * Write out what is left in the ring, stop the thread and close the file.
+ * Nothing may be pushed from then on.
+ *
+ * @param log The log.
+ */
+void slow_log_close(slow_log_t *log);
+
+#endif
@@ -9,6 +9,7 @@
 #define SOCKETS_H
 
 #include <arpa/inet.h>
+#include <sys/socket.h>
 
 /* function prototypes ====================================================== */
 
@@ -26,14 +27,29 @@ int create_listening_socket(char *port);
  *
  * @param addr The address to connect to.
  * @param port The port number to connect to.
+ * @param fast_open Use TCP Fast Open, so that once the server has handed
+ * out a cookie, the first write is sent with the SYN instead of after the
+ * handshake. Errors connecting then only show up on that write.
  * @return A file descriptor for the socket.
  * @note This function was adapted from week 9 tute.
  */
-int create_connection_socket(char *addr, char *port);
+int create_connection_socket(char *addr, char *port, int fast_open);
 
 /*
- * Accept a connection from a client in a non-blocking manner. This assumes
- * this function is run within a loop.
+ * Accept data in the SYN of connections from clients using TCP Fast Open,
+ * with up to FAST_OPEN_QUEUE such connections waiting to be accepted.
+ * Needs bit 0x2 of the net.ipv4.tcp_fastopen sysctl to take effect.
+ *
+ * @param sockfd The listening socket.
+ * @param enabled TRUE to accept data in the SYN, FALSE to stop.
+ * @return 0 on success, FAILED on failure.
+ */
+int set_fast_open(int sockfd, int enabled);
+
+/*
+ * Accept a connection from a client in a non-blocking manner, waiting at most
+ * ACCEPT_TIMEOUT_USEC for a connection request. This assumes this function
+ * is run within a loop.
  *
  * @param sockfd The socket file descriptor.
  * @param client_addr The client's address that will be populated by this
@@ -42,9 +58,32 @@ int create_connection_socket(char *addr, char *port);
  * during this function call.
  * @return The client's socket file descriptor, or -1 if no client is connected.
  */
-int non_blocking_accept(int sockfd, struct sockaddr_in *client_addr,
+int non_blocking_accept(int sockfd, struct sockaddr_storage *client_addr,
                         socklen_t *client_addr_size);
 
+/*
+ * Send small writes straight away instead of holding them back until the
+ * previous write is acknowledged. Every message is written in one go, so
+ * Nagle's algorithm only delays requests that are pipelined behind replies
+ * still in flight.
+ *
+ * @param sockfd The socket file descriptor.
+ * @return 0 on success, FAILED on failure.
+ */
+int set_nodelay(int sockfd);
+
+/*
+ * sendmsg, recv and recvmsg on a connection, with the faults set with
+ * rpc_set_faults or the environment injected. Every byte a mux sends or
+ * receives goes through these.
+ *
+ * @return What the system call returned, or FAILED with errno set to
+ * ECONNRESET if the connection was shut down by an injected reset.
+ */
+ssize_t socket_sendmsg(int sockfd, const struct msghdr *mh, int flags);
+ssize_t socket_recv(int sockfd, void *buf, size_t size, int flags);
+ssize_t socket_recvmsg(int sockfd, struct msghdr *mh, int flags);
+
 /*
  * Checks if a socket is closed.
  *
@@ -0,0 +1,46 @@
+/* =============================================================================
+   spin.h
+
+   Spin-then-park waiting. A thread that expects to be woken within a few
+   microseconds polls for its condition instead of sleeping in the kernel,
+   which saves the wake-up latency, and parks once the spin budget runs
+   out. The budget adapts: it is restored whenever a spin pays off and
+   halved whenever it does not, so an idle waiter soon stops burning CPU.
+   With a single CPU the thread being waited for cannot run while we spin,
+   so spinning is turned off there.
+
+   Author: David Sha
+============================================================================= */
+#ifndef SPIN_H
+#define SPIN_H
+
+#include <stdatomic.h>
+
+/* structures =============================================================== */
+typedef struct {
+    _Atomic int max_usec;
+    _Atomic int usec;
+} spin_t;
+
+/* function prototypes ====================================================== */
+
+/*
+ * Set the spin budget, which stays 0 on a machine with one CPU. Safe to
+ * call while another thread is spinning.
+ *
+ * @param s The spinner.
+ * @param max_usec Longest spin in microseconds, or 0 to never spin.
+ */
+void spin_init(spin_t *s, int max_usec);
+
+/*
+ * Poll until the condition holds or the budget runs out.
+ *
+ * @param s The spinner.
+ * @param poll Checks the condition, returning TRUE once it holds.
+ * @param arg Passed to poll.
+ * @return TRUE if the condition holds, FALSE if the caller should park.
+ */
+int spin_wait(spin_t *s, int (*poll)(void *arg), void *arg);
+
+#endif
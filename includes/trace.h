@@ -0,0 +1,43 @@
+/* =============================================================================
+   trace.h
+
+   Trace context propagation. Every thread has a current trace context,
+   which is empty until rpc_trace_start or rpc_trace_set, or until a
+   server worker runs the handler of a traced call. Calls made in a trace
+   get a span id of their own and carry the trace to their server, and
+   both ends record their span of the call in a buffer of the process,
+   which rpc_trace_collect empties. The public functions are declared in
+   rpc.h.
+
+   Author: David Sha
+============================================================================= */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "rpc.h"
+#include <stdint.h>
+
+/* function prototypes ====================================================== */
+
+/*
+ * Make up an id for a trace or span, which is never 0.
+ *
+ * @return The new id.
+ */
+uint64_t trace_new_id(void);
+
+/*
+ * Get the trace context of this thread without copying it.
+ *
+ * @return The context, whose trace_id is 0 outside a trace.
+ */
+const rpc_trace_context *trace_context(void);
+
+/*
+ * Add a span to the buffer, overwriting the oldest one when it is full.
+ *
+ * @param span The span, which is copied.
+ */
+void trace_record(const rpc_span *span);
+
+#endif
@@ -0,0 +1,82 @@
+/* =============================================================================
+   alloc.c
+
+   The allocator behind every allocation the library makes.
+
+   Author: David Sha
+============================================================================= */
+#include "alloc.h"
+#include "config.h"
+#include <stdlib.h>
+
+/*
+ * libc behind the rpc_allocator interface.
+ */
+static void *libc_malloc(size_t size, void *ctx);
+static void *libc_calloc(size_t n, size_t size, void *ctx);
+static void *libc_realloc(void *ptr, size_t size, void *ctx);
+static void libc_free(void *ptr, void *ctx);
+
+static const rpc_allocator libc_allocator = {
+    .malloc = libc_malloc,
+    .calloc = libc_calloc,
+    .realloc = libc_realloc,
+    .free = libc_free,
+    .ctx = NULL,
+};
+
+/*
+ * The allocator in use, which points at a copy of the one set so the
+ * caller need not keep theirs around.
+ */
+static rpc_allocator custom;
+static const rpc_allocator *allocator = &libc_allocator;
+
+int rpc_set_allocator(const rpc_allocator *a) {
+    if (a == NULL) {
+        allocator = &libc_allocator;
+        return 0;
+    }
+    if (a->malloc == NULL || a->calloc == NULL || a->realloc == NULL ||
+        a->free == NULL) {
+        return FAILED;
+    }
+    custom = *a;
+    allocator = &custom;
+    return 0;
+}
+
+int rpc_allocator_is_default(void) {
+    return allocator == &libc_allocator ? TRUE : FALSE;
+}
+
+void *rpc_malloc(size_t size) {
+    return allocator->malloc(size, allocator->ctx);
+}
+
+void *rpc_calloc(size_t n, size_t size) {
+    return allocator->calloc(n, size, allocator->ctx);
+}
+
+void *rpc_realloc(void *ptr, size_t size) {
+    return allocator->realloc(ptr, size, allocator->ctx);
+}
+
+void rpc_free(void *ptr) {
+    if (ptr != NULL) {
+        allocator->free(ptr, allocator->ctx);
+    }
+}
+
+/* helper functions ========================================================= */
+static void *libc_malloc(size_t size, void *ctx) { return malloc(size); }
+
+static void *libc_calloc(size_t n, size_t size, void *ctx) {
+    return calloc(n, size);
+}
+
+static void *libc_realloc(void *ptr, size_t size, void *ctx) {
+    return realloc(ptr, size);
+}
+
+static void libc_free(void *ptr, void *ctx) { free(ptr); }
@@ -0,0 +1,119 @@
+/* =============================================================================
+   bufpool.c
+
+   A pool of 2 MB regions for large I/O buffers.
+
+   References:
+   - Huge pages: https://docs.kernel.org/admin-guide/mm/hugetlbpage.html
+   - Transparent huge pages:
+     https://docs.kernel.org/admin-guide/mm/transhuge.html
+
+   Author: David Sha
+============================================================================= */
+#include "bufpool.h"
+#include "config.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+/*
+ * Map a region, aligned to its size so that transparent huge pages can
+ * back it when MAP_HUGETLB is not available.
+ *
+ * @param hugetlb Set to TRUE if the region came from MAP_HUGETLB.
+ * @return The region, or NULL on failure.
+ */
+static void *map_region(int *hugetlb);
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static void *free_regions = NULL;
+static buffer_pool_stats stats = {0};
+static _Atomic size_t threshold = BUFFER_POOL_THRESHOLD;
+
+void *buffer_pool_take(void) {
+    pthread_mutex_lock(&lock);
+    void *region = free_regions;
+    if (region != NULL) {
+        // the next free region is kept in the first bytes of each one
+        free_regions = *(void **)region;
+        stats.free--;
+        stats.reused++;
+        stats.taken++;
+    }
+    pthread_mutex_unlock(&lock);
+    if (region != NULL) {
+        return region;
+    }
+
+    int hugetlb = FALSE;
+    region = map_region(&hugetlb);
+    if (region == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&lock);
+    stats.mapped++;
+    stats.hugetlb += hugetlb;
+    stats.taken++;
+    pthread_mutex_unlock(&lock);
+    return region;
+}
+
+void buffer_pool_give(void *region) {
+    pthread_mutex_lock(&lock);
+    if (stats.free < BUFFER_POOL_MAX_REGIONS) {
+        *(void **)region = free_regions;
+        free_regions = region;
+        stats.free++;
+        region = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+    if (region != NULL) {
+        munmap(region, BUFFER_POOL_REGION_SIZE);
+    }
+}
+
+void buffer_pool_set_threshold(size_t size) { atomic_store(&threshold, size); }
+
+size_t buffer_pool_threshold(void) { return atomic_load(&threshold); }
+
+void buffer_pool_get_stats(buffer_pool_stats *out) {
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+/* helper functions ========================================================= */
+static void *map_region(int *hugetlb) {
+#ifdef MAP_HUGETLB
+    void *region = mmap(NULL, BUFFER_POOL_REGION_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (region != MAP_FAILED) {
+        *hugetlb = TRUE;
+        return region;
+    }
+#endif
+
+    // no huge pages reserved, so map twice the size and trim it to an
+    // aligned region that transparent huge pages can back
+    size_t len = 2 * BUFFER_POOL_REGION_SIZE;
+    unsigned char *raw = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    uintptr_t start = ((uintptr_t)raw + BUFFER_POOL_REGION_SIZE - 1) &
+                      ~((uintptr_t)BUFFER_POOL_REGION_SIZE - 1);
+    unsigned char *aligned = (unsigned char *)start;
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    size_t tail = (raw + len) - (aligned + BUFFER_POOL_REGION_SIZE);
+    if (tail > 0) {
+        munmap(aligned + BUFFER_POOL_REGION_SIZE, tail);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, BUFFER_POOL_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
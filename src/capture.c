@@ -0,0 +1,137 @@
+/* =============================================================================
+   capture.c
+
+   Capture of received requests to a file, and reading them back.
+
+   Author: David Sha
+============================================================================= */
+#define _DEFAULT_SOURCE
+#include "capture.h"
+#include "clock.h"
+#include "protocol.h"
+#include <assert.h>
+#include <endian.h>
+#include <pthread.h>
+#include <string.h>
+
+/*
+ * Size of the fixed part of a record, in front of the message.
+ */
+#define RECORD_HEADER_SIZE 17
+
+/* structures =============================================================== */
+struct capture {
+    FILE *file;
+    uint64_t start_usec;
+    uint32_t next_connection;
+    pthread_mutex_t lock;
+};
+
+/* helper function declarations ============================================= */
+
+/*
+ * Write the fixed part of a record into a buffer of RECORD_HEADER_SIZE.
+ */
+void pack_record_header(unsigned char *header, uint64_t time_usec,
+                        uint32_t connection, int priority, uint32_t len);
+
+/* capture ================================================================== */
+capture_t *capture_open(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        debug_print("Could not create capture %s\n", path);
+        return NULL;
+    }
+    capture_t *cap = (capture_t *)rpc_malloc(sizeof(*cap));
+    assert(cap);
+    cap->file = file;
+    cap->start_usec = monotonic_usec();
+    cap->next_connection = 0;
+    pthread_mutex_init(&cap->lock, NULL);
+
+    uint64_t start = htobe64(realtime_usec());
+    fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_SIZE, file);
+    fwrite(&start, sizeof(start), 1, file);
+    return cap;
+}
+
+uint32_t capture_connection(capture_t *cap) {
+    pthread_mutex_lock(&cap->lock);
+    uint32_t connection = cap->next_connection++;
+    pthread_mutex_unlock(&cap->lock);
+    return connection;
+}
+
+void capture_write(capture_t *cap, uint32_t connection, int priority,
+                   const void *bytes, size_t len) {
+    // stamped under the lock so that times never go back through the file,
+    // and stdio buffers the records, so most only cost a copy
+    unsigned char header[RECORD_HEADER_SIZE];
+    pthread_mutex_lock(&cap->lock);
+    pack_record_header(header, monotonic_usec() - cap->start_usec,
+                       connection, priority, len);
+    fwrite(header, 1, sizeof(header), cap->file);
+    fwrite(bytes, 1, len, cap->file);
+    pthread_mutex_unlock(&cap->lock);
+}
+
+void capture_close(capture_t *cap) {
+    if (cap == NULL) {
+        return;
+    }
+    fclose(cap->file);
+    pthread_mutex_destroy(&cap->lock);
+    free_and_null(cap);
+}
+
+int capture_read_header(FILE *file, uint64_t *start_usec) {
+    char magic[CAPTURE_MAGIC_SIZE];
+    uint64_t start;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0 ||
+        fread(&start, sizeof(start), 1, file) != 1) {
+        return FAILED;
+    }
+    if (start_usec != NULL) {
+        *start_usec = be64toh(start);
+    }
+    return 0;
+}
+
+int capture_read(FILE *file, capture_record_t *rec) {
+    unsigned char header[RECORD_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header)) {
+        return FALSE;
+    }
+    uint64_t time_usec;
+    uint32_t connection, len;
+    memcpy(&time_usec, header, sizeof(time_usec));
+    memcpy(&connection, header + 8, sizeof(connection));
+    memcpy(&len, header + 13, sizeof(len));
+    rec->time_usec = be64toh(time_usec);
+    rec->connection = be32toh(connection);
+    rec->priority = header[12];
+    rec->len = be32toh(len);
+    if (rec->len > MAX_MESSAGE_BYTE_SIZE) {
+        return FALSE;
+    }
+    rec->bytes = (unsigned char *)rpc_malloc(rec->len > 0 ? rec->len : 1);
+    assert(rec->bytes);
+    if (fread(rec->bytes, 1, rec->len, file) != rec->len) {
+        free_and_null(rec->bytes);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* helper functions ========================================================= */
+void pack_record_header(unsigned char *header, uint64_t time_usec,
+                        uint32_t connection, int priority, uint32_t len) {
+    time_usec = htobe64(time_usec);
+    connection = htobe32(connection);
+    len = htobe32(len);
+    memcpy(header, &time_usec, sizeof(time_usec));
+    memcpy(header + 8, &connection, sizeof(connection));
+    header[12] = (unsigned char)priority;
+    memcpy(header + 13, &len, sizeof(len));
+}
@@ -0,0 +1,58 @@
+/* =============================================================================
+   chash.c
+
+   Hash functions for routing keys to servers.
+
+   Author: David Sha
+============================================================================= */
+#include "chash.h"
+
+/*
+ * MurmurHash3's 64-bit finaliser.
+ */
+static uint64_t fmix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t hash_bytes(const void *key, size_t len) {
+    const unsigned char *p = (const unsigned char *)key;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return fmix64(h);
+}
+
+uint64_t hash_combine(uint64_t a, uint64_t b) {
+    return fmix64(a ^ (b + 0x9e3779b97f4a7c15ULL + (a << 6) + (a >> 2)));
+}
+
+int rendezvous_hash(uint64_t key, const uint64_t *nodes, int n) {
+    int best = -1;
+    uint64_t best_score = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t score = hash_combine(key, nodes[i]);
+        if (best == -1 || score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+int jump_hash(uint64_t key, int n) {
+    int64_t b = -1, j = 0;
+    while (j < n) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t)((b + 1) *
+                      ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+    }
+    return (int)b;
+}
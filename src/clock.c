@@ -0,0 +1,26 @@
+/* =============================================================================
+   clock.c
+
+   Time helpers used for latency measurements.
+
+   Author: David Sha
+============================================================================= */
+#define _POSIX_C_SOURCE 200112L
+#include "clock.h"
+#include <time.h>
+
+uint64_t monotonic_usec(void) {
+    return monotonic_nsec() / 1000;
+}
+
+uint64_t monotonic_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t realtime_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
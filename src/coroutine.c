@@ -0,0 +1,76 @@
+/* =============================================================================
+   coroutine.c
+
+   Stackful coroutines on top of ucontext.
+
+   Author: David Sha
+============================================================================= */
+#include "coroutine.h"
+#include "config.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <ucontext.h>
+
+struct coroutine {
+    ucontext_t ctx;
+    ucontext_t caller;
+    void (*fn)(void *);
+    void *arg;
+    void *stack;
+    int finished;
+};
+
+/*
+ * The coroutine running on this thread, if any.
+ */
+static __thread coroutine_t *running = NULL;
+
+/*
+ * Entry point of every coroutine. makecontext only passes int arguments,
+ * so the coroutine is found through the thread's running coroutine.
+ */
+static void trampoline(void) {
+    coroutine_t *co = running;
+    co->fn(co->arg);
+    co->finished = TRUE;
+    // returning switches to uc_link, the context that last resumed us
+}
+
+coroutine_t *coroutine_create(void (*fn)(void *), void *arg,
+                              size_t stack_size) {
+    coroutine_t *co = (coroutine_t *)rpc_malloc(sizeof(*co));
+    assert(co);
+    co->stack = rpc_malloc(stack_size);
+    assert(co->stack);
+    co->fn = fn;
+    co->arg = arg;
+    co->finished = FALSE;
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack;
+    co->ctx.uc_stack.ss_size = stack_size;
+    co->ctx.uc_link = &co->caller;
+    makecontext(&co->ctx, trampoline, 0);
+    return co;
+}
+
+int coroutine_resume(coroutine_t *co) {
+    assert(running == NULL && !co->finished);
+    running = co;
+    swapcontext(&co->caller, &co->ctx);
+    running = NULL;
+    return co->finished;
+}
+
+void coroutine_yield(void) {
+    coroutine_t *co = running;
+    assert(co);
+    swapcontext(&co->ctx, &co->caller);
+}
+
+void coroutine_free(coroutine_t *co) {
+    if (co == NULL) {
+        return;
+    }
+    free_and_null(co->stack);
+    free_and_null(co);
+}
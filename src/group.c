@@ -0,0 +1,623 @@
+/* =============================================================================
+   group.c
+
+   A client spread over several servers providing the same functions. Each
+   server's latency and error rate is tracked so that outliers can be
+   ejected for a while and then probed back in with increasing weight.
+   Calls can also be routed by key with rendezvous hashing, so that each key
+   keeps landing on the same server.
+
+   References:
+   - Outlier detection modelled on Envoy's:
+     https://www.envoyproxy.io/docs/envoy/latest/intro/arch_overview/upstream/outlier
+   - Power of two choices:
+     https://www.eecs.harvard.edu/~michaelm/postscripts/mythesis.pdf
+
+   Author: David Sha
+============================================================================= */
+#define _POSIX_C_SOURCE 200112L
+#include "chash.h"
+#include "clock.h"
+#include "config.h"
+#include "protocol.h"
+#include "rpc.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* structures =============================================================== */
+typedef struct {
+    char *addr;
+    int port;
+    uint64_t id;
+    int removed;
+    rpc_client *cl;
+    int connecting;
+    int reconnect;
+    rpc_endpoint_state state;
+    double latency;
+    double error_rate;
+    unsigned long calls;
+    unsigned long failures;
+    unsigned long calls_since_return;
+    int consecutive_failures;
+    int in_flight;
+    int ejections;
+    uint64_t ejected_until;
+    uint64_t probe_start;
+} endpoint_t;
+
+struct rpc_group {
+    pthread_mutex_t lock;
+    endpoint_t **endpoints;
+    int n;
+    int size;
+    int outlier_detection;
+    unsigned int seed;
+};
+
+/* helper function declarations ============================================= */
+
+/*
+ * Work out the weight of an endpoint, moving it between states as its
+ * ejection or probing period ends.
+ *
+ * @param e The endpoint.
+ * @param now The current time in microseconds.
+ * @return The weight of the endpoint, 0 if it must not be used.
+ */
+static double endpoint_weight(endpoint_t *e, uint64_t now);
+
+/*
+ * Pick the endpoint for the next call. Two candidates are drawn at random
+ * in proportion to their weights, and the one with the lower expected
+ * latency wins. If every endpoint is ejected, the one that is due back
+ * first is used.
+ *
+ * @param g The group, which must be locked.
+ * @return The endpoint, or NULL if the group is empty.
+ */
+static endpoint_t *pick_endpoint(rpc_group *g);
+
+/*
+ * Pick the endpoint that owns a key: the one with the highest rendezvous
+ * score among the endpoints that are not ejected.
+ *
+ * @param g The group, which must be locked.
+ * @param key The hash of the key.
+ * @return The endpoint, or NULL if the group is empty.
+ */
+static endpoint_t *pick_endpoint_for_key(rpc_group *g, uint64_t key);
+
+/*
+ * Call a remote procedure on an endpoint, reconnecting first if needed.
+ *
+ * @param g The group, which must be locked. It is unlocked on return.
+ * @param e The endpoint to call.
+ * @param h The handle for the remote procedure.
+ * @param payload The data to send.
+ * @return The data returned by the remote procedure, or NULL on failure.
+ */
+static rpc_data *call_endpoint(rpc_group *g, endpoint_t *e, rpc_handle *h,
+                               rpc_data *payload);
+
+/*
+ * Identify an endpoint by its address, so that it keeps its keys no matter
+ * where it sits in the group.
+ *
+ * @param addr The address of the server.
+ * @param port The port of the server.
+ * @return The hash identifying the endpoint.
+ */
+static uint64_t endpoint_id(char *addr, int port);
+
+/*
+ * Create an endpoint and connect to it. An unreachable endpoint starts out
+ * ejected.
+ *
+ * @param addr The address of the server.
+ * @param port The port of the server.
+ * @return The new endpoint.
+ */
+static endpoint_t *new_endpoint(char *addr, int port);
+
+/*
+ * Close an endpoint's client and free it.
+ *
+ * @param e The endpoint.
+ */
+static void endpoint_free(endpoint_t *e);
+
+/*
+ * Record the outcome of a call and eject the endpoint if it has become an
+ * outlier.
+ *
+ * @param g The group, which must be locked.
+ * @param e The endpoint that was called.
+ * @param latency The latency of the call in microseconds.
+ * @param failed TRUE if the call failed.
+ */
+static void record_call(rpc_group *g, endpoint_t *e, uint64_t latency,
+                        int failed);
+
+/*
+ * Is the endpoint an outlier compared to the rest of the group?
+ *
+ * @param g The group, which must be locked.
+ * @param e The endpoint.
+ * @return TRUE if it should be ejected.
+ */
+static int is_outlier(rpc_group *g, endpoint_t *e);
+
+/*
+ * Eject an endpoint, unless too many endpoints are ejected already.
+ *
+ * @param g The group, which must be locked.
+ * @param e The endpoint.
+ * @param now The current time in microseconds.
+ * @return TRUE if the endpoint was ejected.
+ */
+static int eject(rpc_group *g, endpoint_t *e, uint64_t now);
+
+/* group ==================================================================== */
+rpc_group *rpc_init_group(char **addrs, int *ports, int n) {
+    if (addrs == NULL || ports == NULL || n <= 0) {
+        return NULL;
+    }
+
+    rpc_group *g = (rpc_group *)rpc_malloc(sizeof(*g));
+    assert(g);
+    g->size = n;
+    g->endpoints = (endpoint_t **)rpc_malloc(g->size * sizeof(*g->endpoints));
+    assert(g->endpoints);
+    g->n = 0;
+    g->outlier_detection = TRUE;
+    g->seed = (unsigned int)monotonic_usec();
+    pthread_mutex_init(&g->lock, NULL);
+
+    for (int i = 0; i < n; i++) {
+        g->endpoints[g->n++] = new_endpoint(addrs[i], ports[i]);
+    }
+
+    return g;
+}
+
+int rpc_group_add(rpc_group *g, char *addr, int port) {
+    if (g == NULL || addr == NULL || port < 0) {
+        return FAILED;
+    }
+
+    // connect before taking the lock so calls are not held up
+    endpoint_t *e = new_endpoint(addr, port);
+    pthread_mutex_lock(&g->lock);
+    for (int i = 0; i < g->n; i++) {
+        if (g->endpoints[i]->id == e->id) {
+            pthread_mutex_unlock(&g->lock);
+            endpoint_free(e);
+            return FAILED;
+        }
+    }
+    if (g->n == g->size) {
+        g->size *= 2;
+        g->endpoints = (endpoint_t **)rpc_realloc(
+            g->endpoints, g->size * sizeof(*g->endpoints));
+        assert(g->endpoints);
+    }
+    g->endpoints[g->n++] = e;
+    pthread_mutex_unlock(&g->lock);
+    return EXIT_SUCCESS;
+}
+
+int rpc_group_remove(rpc_group *g, char *addr, int port) {
+    if (g == NULL || addr == NULL) {
+        return FAILED;
+    }
+
+    uint64_t id = endpoint_id(addr, port);
+    endpoint_t *e = NULL;
+
+    pthread_mutex_lock(&g->lock);
+    for (int i = 0; i < g->n; i++) {
+        if (g->endpoints[i]->id == id) {
+            e = g->endpoints[i];
+            memmove(&g->endpoints[i], &g->endpoints[i + 1],
+                    (g->n - i - 1) * sizeof(*g->endpoints));
+            g->n--;
+            break;
+        }
+    }
+
+    // calls still in flight free the endpoint when they finish
+    int free_now = FALSE;
+    if (e != NULL) {
+        e->removed = TRUE;
+        free_now = e->in_flight == 0;
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    if (e == NULL) {
+        return FAILED;
+    }
+    if (free_now) {
+        endpoint_free(e);
+    }
+    return EXIT_SUCCESS;
+}
+
+rpc_handle *rpc_group_find(rpc_group *g, char *name) {
+    if (g == NULL || name == NULL) {
+        return NULL;
+    }
+
+    // try the healthy endpoints first
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0;; i++) {
+            pthread_mutex_lock(&g->lock);
+            if (i >= g->n) {
+                pthread_mutex_unlock(&g->lock);
+                break;
+            }
+            endpoint_t *e = g->endpoints[i];
+            int usable = e->cl != NULL && !e->connecting &&
+                         (pass == 1 || e->state != RPC_ENDPOINT_EJECTED);
+            if (usable) {
+                e->in_flight++;
+            }
+            pthread_mutex_unlock(&g->lock);
+            if (!usable) {
+                continue;
+            }
+
+            rpc_handle *h = rpc_find(e->cl, name);
+            pthread_mutex_lock(&g->lock);
+            e->in_flight--;
+            int free_now = e->removed && e->in_flight == 0;
+            pthread_mutex_unlock(&g->lock);
+            if (free_now) {
+                endpoint_free(e);
+            }
+            if (h != NULL) {
+                return h;
+            }
+        }
+    }
+    return NULL;
+}
+
+rpc_data *rpc_group_call(rpc_group *g, rpc_handle *h, rpc_data *payload) {
+    if (g == NULL || h == NULL || payload == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g->lock);
+    return call_endpoint(g, pick_endpoint(g), h, payload);
+}
+
+rpc_data *rpc_group_call_key(rpc_group *g, const void *key, size_t key_len,
+                             rpc_handle *h, rpc_data *payload) {
+    if (g == NULL || key == NULL || h == NULL || payload == NULL) {
+        return NULL;
+    }
+
+    uint64_t hash = hash_bytes(key, key_len);
+    pthread_mutex_lock(&g->lock);
+    return call_endpoint(g, pick_endpoint_for_key(g, hash), h, payload);
+}
+
+void rpc_group_set_outlier_detection(rpc_group *g, int enabled) {
+    if (g == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&g->lock);
+    g->outlier_detection = enabled;
+    pthread_mutex_unlock(&g->lock);
+}
+
+int rpc_group_endpoint_stats(rpc_group *g, int i, rpc_endpoint_stats *stats) {
+    if (g == NULL || stats == NULL || i < 0) {
+        return FAILED;
+    }
+    pthread_mutex_lock(&g->lock);
+    if (i >= g->n) {
+        pthread_mutex_unlock(&g->lock);
+        return FAILED;
+    }
+    endpoint_t *e = g->endpoints[i];
+    stats->weight = endpoint_weight(e, monotonic_usec());
+    stats->state = e->state;
+    stats->latency_usec = e->latency;
+    stats->error_rate = e->error_rate;
+    stats->calls = e->calls;
+    stats->failures = e->failures;
+    stats->ejections = e->ejections;
+    pthread_mutex_unlock(&g->lock);
+    return EXIT_SUCCESS;
+}
+
+void rpc_close_group(rpc_group *g) {
+    if (g == NULL) {
+        return;
+    }
+    for (int i = 0; i < g->n; i++) {
+        endpoint_free(g->endpoints[i]);
+    }
+    free_and_null(g->endpoints);
+    pthread_mutex_destroy(&g->lock);
+    free_and_null(g);
+}
+
+/* group helper functions =================================================== */
+static uint64_t endpoint_id(char *addr, int port) {
+    char id[MAX_NAME_LENGTH + MAX_PORT_LENGTH + 2];
+    snprintf(id, sizeof(id), "%s:%d", addr, port);
+    return hash_bytes(id, strlen(id));
+}
+
+static endpoint_t *new_endpoint(char *addr, int port) {
+    endpoint_t *e = (endpoint_t *)rpc_calloc(1, sizeof(*e));
+    assert(e);
+    e->addr = new_string(addr);
+    e->port = port;
+    e->id = endpoint_id(addr, port);
+
+    e->state = RPC_ENDPOINT_HEALTHY;
+    if ((e->cl = rpc_init_client(addr, port)) == NULL) {
+        debug_print("Endpoint %s:%d unreachable\n", e->addr, e->port);
+        e->state = RPC_ENDPOINT_EJECTED;
+        e->ejections = 1;
+        e->ejected_until = monotonic_usec() + OUTLIER_BASE_EJECTION_USEC;
+        e->reconnect = TRUE;
+    }
+    return e;
+}
+
+static void endpoint_free(endpoint_t *e) {
+    rpc_close_client(e->cl);
+    free_and_null(e->addr);
+    free_and_null(e);
+}
+
+static rpc_data *call_endpoint(rpc_group *g, endpoint_t *e, rpc_handle *h,
+                               rpc_data *payload) {
+    if (e == NULL) {
+        pthread_mutex_unlock(&g->lock);
+        return NULL;
+    }
+
+    // an endpoint coming back from an ejection caused by failures gets a
+    // fresh connection, as long as nobody is still using the old one
+    rpc_client *stale = NULL;
+    int reconnect = FALSE;
+    if ((e->cl == NULL || e->reconnect) && !e->connecting &&
+        e->in_flight == 0) {
+        e->connecting = TRUE;
+        stale = e->cl;
+        e->cl = NULL;
+        reconnect = TRUE;
+    } else if (e->cl == NULL) {
+        // another call is still reconnecting it, so nothing was tried and
+        // nothing is recorded against it
+        pthread_mutex_unlock(&g->lock);
+        return NULL;
+    }
+    e->in_flight++;
+    rpc_client *cl = e->cl;
+    pthread_mutex_unlock(&g->lock);
+
+    if (reconnect) {
+        rpc_close_client(stale);
+        cl = rpc_init_client(e->addr, e->port);
+        pthread_mutex_lock(&g->lock);
+        e->cl = cl;
+        e->connecting = FALSE;
+        e->reconnect = (cl == NULL);
+        pthread_mutex_unlock(&g->lock);
+    }
+
+    uint64_t start = monotonic_usec();
+    rpc_data *result = cl ? rpc_call(cl, h, payload) : NULL;
+    uint64_t latency = monotonic_usec() - start;
+
+    pthread_mutex_lock(&g->lock);
+    record_call(g, e, latency, result == NULL);
+    int free_now = e->removed && e->in_flight == 0;
+    pthread_mutex_unlock(&g->lock);
+    if (free_now) {
+        endpoint_free(e);
+    }
+
+    return result;
+}
+
+static double endpoint_weight(endpoint_t *e, uint64_t now) {
+    if (e->state == RPC_ENDPOINT_EJECTED) {
+        if (now < e->ejected_until) {
+            return 0;
+        }
+
+        // start probing with a fresh view of the endpoint
+        debug_print("Probing endpoint %s:%d\n", e->addr, e->port);
+        e->state = RPC_ENDPOINT_PROBING;
+        e->probe_start = now;
+        e->calls_since_return = 0;
+        e->consecutive_failures = 0;
+        e->error_rate = 0;
+        e->latency = 0;
+    }
+
+    if (e->cl == NULL && e->connecting) {
+        return 0;
+    }
+
+    if (e->state == RPC_ENDPOINT_PROBING) {
+        uint64_t elapsed = now - e->probe_start;
+        if (elapsed < OUTLIER_PROBE_USEC) {
+            return OUTLIER_PROBE_WEIGHT + (1 - OUTLIER_PROBE_WEIGHT) *
+                                              elapsed / OUTLIER_PROBE_USEC;
+        }
+
+        // survived probing, so slowly forget about past ejections
+        e->state = RPC_ENDPOINT_HEALTHY;
+        if (e->ejections > 0) {
+            e->ejections--;
+        }
+    }
+    return 1;
+}
+
+static endpoint_t *pick_endpoint(rpc_group *g) {
+    if (g->n == 0) {
+        return NULL;
+    }
+
+    uint64_t now = monotonic_usec();
+    double weights[g->n], total = 0;
+    endpoint_t *due = NULL;
+    for (int i = 0; i < g->n; i++) {
+        endpoint_t *e = g->endpoints[i];
+        weights[i] = g->outlier_detection || e->state != RPC_ENDPOINT_EJECTED
+                         ? endpoint_weight(e, now)
+                         : 1;
+        total += weights[i];
+        if (due == NULL || e->ejected_until < due->ejected_until) {
+            due = e;
+        }
+    }
+    if (total == 0) {
+        return due;
+    }
+
+    // draw two candidates and keep the one with the lower expected latency
+    endpoint_t *best = NULL;
+    double best_score = 0;
+    for (int draw = 0; draw < 2; draw++) {
+        double r = rand_r(&g->seed) / (RAND_MAX + 1.0) * total;
+        endpoint_t *e = NULL;
+        for (int i = 0; i < g->n; i++) {
+            if (weights[i] > 0) {
+                e = g->endpoints[i];
+                if (r < weights[i]) {
+                    break;
+                }
+                r -= weights[i];
+            }
+        }
+        double score = e->latency * (e->in_flight + 1);
+        if (best == NULL || score < best_score) {
+            best = e;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+static endpoint_t *pick_endpoint_for_key(rpc_group *g, uint64_t key) {
+    uint64_t now = monotonic_usec();
+    endpoint_t *best = NULL, *due = NULL;
+    uint64_t best_score = 0;
+    for (int i = 0; i < g->n; i++) {
+        endpoint_t *e = g->endpoints[i];
+        if (due == NULL || e->ejected_until < due->ejected_until) {
+            due = e;
+        }
+
+        // keys owned by an ejected endpoint fall through to their next
+        // highest scoring endpoint, and come back once it returns
+        if (g->outlier_detection && endpoint_weight(e, now) == 0) {
+            continue;
+        }
+        uint64_t score = hash_combine(key, e->id);
+        if (best == NULL || score > best_score) {
+            best = e;
+            best_score = score;
+        }
+    }
+    return best ? best : due;
+}
+
+static void record_call(rpc_group *g, endpoint_t *e, uint64_t latency,
+                        int failed) {
+    e->in_flight--;
+    e->calls++;
+    e->calls_since_return++;
+    e->error_rate +=
+        OUTLIER_EWMA_ALPHA * ((failed ? 1.0 : 0.0) - e->error_rate);
+    if (failed) {
+        e->failures++;
+        e->consecutive_failures++;
+    } else {
+        e->consecutive_failures = 0;
+        if (e->latency == 0) {
+            e->latency = latency;
+        } else {
+            e->latency += OUTLIER_EWMA_ALPHA * (latency - e->latency);
+        }
+    }
+
+    if (g->outlier_detection && !e->removed &&
+        e->state != RPC_ENDPOINT_EJECTED && is_outlier(g, e) &&
+        eject(g, e, monotonic_usec()) &&
+        e->consecutive_failures >= OUTLIER_CONSECUTIVE_FAILURES) {
+        // ejected for failing, so it comes back on a fresh connection
+        e->reconnect = TRUE;
+    }
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int is_outlier(rpc_group *g, endpoint_t *e) {
+    if (e->consecutive_failures >= OUTLIER_CONSECUTIVE_FAILURES) {
+        return TRUE;
+    }
+    if (e->calls_since_return < OUTLIER_MIN_CALLS) {
+        return FALSE;
+    }
+    if (e->error_rate > OUTLIER_ERROR_RATE) {
+        return TRUE;
+    }
+
+    // compare the latency against the median of the other endpoints
+    double others[g->n];
+    int n = 0;
+    for (int i = 0; i < g->n; i++) {
+        endpoint_t *other = g->endpoints[i];
+        if (other != e && other->state != RPC_ENDPOINT_EJECTED &&
+            other->latency > 0) {
+            others[n++] = other->latency;
+        }
+    }
+    if (n == 0) {
+        return FALSE;
+    }
+    qsort(others, n, sizeof(*others), cmp_double);
+    double median = n % 2 ? others[n / 2]
+                          : (others[n / 2 - 1] + others[n / 2]) / 2;
+    return e->latency > OUTLIER_LATENCY_FACTOR * median &&
+           e->latency > median + OUTLIER_LATENCY_MARGIN_USEC;
+}
+
+static int eject(rpc_group *g, endpoint_t *e, uint64_t now) {
+    int ejected = 0;
+    for (int i = 0; i < g->n; i++) {
+        ejected += g->endpoints[i]->state == RPC_ENDPOINT_EJECTED;
+    }
+    if (ejected + 1 > g->n * OUTLIER_MAX_EJECTION_PERCENT / 100) {
+        return FALSE;
+    }
+
+    e->ejections++;
+    uint64_t duration = (uint64_t)OUTLIER_BASE_EJECTION_USEC * e->ejections;
+    if (duration > OUTLIER_MAX_EJECTION_USEC) {
+        duration = OUTLIER_MAX_EJECTION_USEC;
+    }
+    e->state = RPC_ENDPOINT_EJECTED;
+    e->ejected_until = now + duration;
+    debug_print("Ejected endpoint %s:%d for %lu us\n", e->addr, e->port,
+                (unsigned long)duration);
+    return TRUE;
+}
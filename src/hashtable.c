@@ -24,9 +24,9 @@ unsigned long hash(const char *str) {
 hashtable_t *hashtable_create(int size) {
     assert(size > 0);
     hashtable_t *hashtable;
-    hashtable = (hashtable_t *)malloc(sizeof(*hashtable));
+    hashtable = (hashtable_t *)rpc_malloc(sizeof(*hashtable));
     assert(hashtable);
-    hashtable->table = (item_t **)malloc(sizeof(item_t *) * size);
+    hashtable->table = (item_t **)rpc_malloc(sizeof(item_t *) * size);
     assert(hashtable->table);
     for (int i = 0; i < size; i++) {
         hashtable->table[i] = NULL;
@@ -52,9 +52,9 @@ void hashtable_destroy(hashtable_t *hashtable, void (*free_data)(void *)) {
 void hashtable_insert(hashtable_t *hashtable, char *key, void *data) {
     assert(hashtable && key && data);
     unsigned long index = hash(key) % hashtable->size;
-    item_t *new = (item_t *)malloc(sizeof(*new));
+    item_t *new = (item_t *)rpc_malloc(sizeof(*new));
     assert(new);
-    new->key = (char *)malloc(strlen(key) + 1);
+    new->key = (char *)rpc_malloc(strlen(key) + 1);
     assert(new->key);
     strcpy((char *)new->key, key);
     new->data = data;
@@ -99,6 +99,27 @@ void hashtable_remove(hashtable_t *hashtable, char *key,
     }
 }
 
+int hashtable_remove_if(hashtable_t *hashtable,
+                        int (*pick)(void *data, void *arg), void *arg,
+                        void (*free_data)(void *)) {
+    assert(hashtable && pick);
+    int removed = 0;
+    for (int i = 0; i < hashtable->size; i++) {
+        item_t **prev = &hashtable->table[i];
+        while (*prev) {
+            item_t *curr = *prev;
+            if (pick(curr->data, arg)) {
+                *prev = curr->next;
+                hashtable_item_free(curr, free_data);
+                removed++;
+            } else {
+                prev = &curr->next;
+            }
+        }
+    }
+    return removed;
+}
+
 void hashtable_item_free(item_t *item, void (*free_data)(void *)) {
     assert(item);
     char *key = (char *)item->key;
@@ -0,0 +1,70 @@
+/* =============================================================================
+   idtable.c
+
+   Table of requests waiting for their replies, indexed by request id.
+
+   Author: David Sha
+============================================================================= */
+#include "idtable.h"
+#include "config.h"
+#include <assert.h>
+#include <stdlib.h>
+
+idtable_t *idtable_create(int size) {
+    assert(size > 0);
+    uint64_t slots = 1;
+    while (slots < (uint64_t)size) {
+        slots <<= 1;
+    }
+    idtable_t *t = (idtable_t *)rpc_malloc(sizeof(*t));
+    assert(t);
+    t->slots = (id_entry_t **)rpc_malloc(slots * sizeof(*t->slots));
+    assert(t->slots);
+    for (uint64_t i = 0; i < slots; i++) {
+        t->slots[i] = NULL;
+    }
+    t->mask = slots - 1;
+    t->count = 0;
+    return t;
+}
+
+void idtable_destroy(idtable_t *t) {
+    assert(t);
+    free_and_null(t->slots);
+    free_and_null(t);
+}
+
+void idtable_insert(idtable_t *t, id_entry_t *e) {
+    assert(t && e);
+    id_entry_t **slot = &t->slots[e->id & t->mask];
+    e->next = *slot;
+    *slot = e;
+    t->count++;
+}
+
+void *idtable_remove(idtable_t *t, uint64_t id) {
+    assert(t);
+    for (id_entry_t **p = &t->slots[id & t->mask]; *p; p = &(*p)->next) {
+        if ((*p)->id == id) {
+            id_entry_t *e = *p;
+            *p = e->next;
+            t->count--;
+            return e->data;
+        }
+    }
+    return NULL;
+}
+
+void idtable_clear(idtable_t *t, void (*fn)(void *data)) {
+    assert(t && fn);
+    for (uint64_t i = 0; i <= t->mask && t->count > 0; i++) {
+        id_entry_t *e = t->slots[i];
+        t->slots[i] = NULL;
+        while (e != NULL) {
+            id_entry_t *next = e->next;
+            t->count--;
+            fn(e->data);
+            e = next;
+        }
+    }
+}
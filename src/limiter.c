@@ -0,0 +1,135 @@
+/* =============================================================================
+   limiter.c
+
+   Adaptive concurrency limiter.
+
+   Author: David Sha
+============================================================================= */
+#include "limiter.h"
+#include "config.h"
+#include "rpc.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+/*
+ * Update the limit using additive increase/multiplicative decrease. A request
+ * counts as a drop if it failed or took much longer than the no-load RTT.
+ */
+static void update_aimd(limiter_t *l, double rtt, int dropped) {
+    if (dropped || rtt > LIMIT_AIMD_TOLERANCE * l->rtt_noload) {
+        l->limit *= LIMIT_AIMD_BACKOFF;
+    } else if (l->in_flight * 2 >= l->limit) {
+        // only grow if the current limit is actually being used
+        l->limit += 1.0 / l->limit;
+    }
+}
+
+/*
+ * Update the limit using the ratio of the no-load RTT to the latest RTT. When
+ * queueing builds up the sample RTT rises above the no-load RTT and the
+ * gradient shrinks the limit, while the square root term leaves room for a
+ * small queue so the limit can still probe upwards.
+ */
+static void update_gradient(limiter_t *l, double rtt, int dropped) {
+    if (dropped) {
+        l->limit *= LIMIT_AIMD_BACKOFF;
+        return;
+    }
+
+    // do not grow the limit if it is not being used
+    double gradient = LIMIT_GRADIENT_TOLERANCE * l->rtt_noload / rtt;
+    gradient = fmax(0.5, fmin(1.0, gradient));
+    if (gradient == 1.0 && l->in_flight * 2 < l->limit) {
+        return;
+    }
+
+    double target = l->limit * gradient + sqrt(l->limit);
+    l->limit = l->limit * (1 - LIMIT_GRADIENT_SMOOTHING) +
+               target * LIMIT_GRADIENT_SMOOTHING;
+}
+
+limiter_t *limiter_create(int algorithm, int max_queue) {
+    limiter_t *l = (limiter_t *)rpc_malloc(sizeof(*l));
+    assert(l);
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->available, NULL);
+    l->algorithm = algorithm;
+    l->limit = LIMIT_INITIAL;
+    l->in_flight = 0;
+    l->queued = 0;
+    l->max_queue = max_queue < 0 ? 0 : max_queue;
+    l->rejected = 0;
+    l->samples = 0;
+    l->rtt_noload = 0;
+    l->rtt_window_min = 0;
+    return l;
+}
+
+void limiter_destroy(limiter_t *l) {
+    if (l == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->available);
+    free_and_null(l);
+}
+
+int limiter_acquire(limiter_t *l) {
+    pthread_mutex_lock(&l->lock);
+    if (l->in_flight >= (int)l->limit) {
+        if (l->queued >= l->max_queue) {
+            l->rejected++;
+            pthread_mutex_unlock(&l->lock);
+            return FAILED;
+        }
+        l->queued++;
+        while (l->in_flight >= (int)l->limit) {
+            pthread_cond_wait(&l->available, &l->lock);
+        }
+        l->queued--;
+    }
+    l->in_flight++;
+    pthread_mutex_unlock(&l->lock);
+    return 0;
+}
+
+void limiter_release(limiter_t *l, uint64_t rtt_usec, int dropped) {
+    double rtt = rtt_usec > 0 ? (double)rtt_usec : 1.0;
+
+    pthread_mutex_lock(&l->lock);
+
+    // track the lowest RTT over a window so the no-load baseline can move
+    // if the server permanently gets faster or slower
+    if (!dropped) {
+        if (l->samples == 0) {
+            l->rtt_noload = l->rtt_window_min = rtt;
+        }
+        l->rtt_window_min = fmin(l->rtt_window_min, rtt);
+        l->rtt_noload = fmin(l->rtt_noload, rtt);
+        if (++l->samples % LIMIT_NOLOAD_WINDOW == 0) {
+            l->rtt_noload = l->rtt_window_min;
+            l->rtt_window_min = rtt;
+        }
+    }
+
+    if (l->samples > 0) {
+        if (l->algorithm == RPC_LIMIT_AIMD) {
+            update_aimd(l, rtt, dropped);
+        } else if (l->algorithm == RPC_LIMIT_GRADIENT) {
+            update_gradient(l, rtt, dropped);
+        }
+    }
+    l->limit = fmax(LIMIT_MIN, fmin(LIMIT_MAX, l->limit));
+
+    l->in_flight--;
+    pthread_cond_broadcast(&l->available);
+    pthread_mutex_unlock(&l->lock);
+}
+
+void limiter_cancel(limiter_t *l) {
+    pthread_mutex_lock(&l->lock);
+    l->in_flight--;
+    pthread_cond_broadcast(&l->available);
+    pthread_mutex_unlock(&l->lock);
+}
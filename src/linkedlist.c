@@ -14,7 +14,7 @@
 
 list_t *create_empty_list() {
     list_t *list;
-    list = (list_t *)malloc(sizeof(*list));
+    list = (list_t *)rpc_malloc(sizeof(*list));
     assert(list);
     list->head = list->foot = NULL;
     return list;
@@ -51,7 +51,7 @@ void free_list(list_t *list, void (*free_data)(void *data)) {
 list_t *prepend(list_t *list, void *data) {
     assert(list && data);
     node_t *new;
-    new = (node_t *)malloc(sizeof(*new));
+    new = (node_t *)rpc_malloc(sizeof(*new));
     assert(new);
     new->data = data;
     new->prev = NULL;
@@ -69,7 +69,7 @@ list_t *prepend(list_t *list, void *data) {
 list_t *append(list_t *list, void *data) {
     assert(list && data);
     node_t *new;
-    new = (node_t *)malloc(sizeof(*new));
+    new = (node_t *)rpc_malloc(sizeof(*new));
     assert(new);
     new->data = data;
     new->next = NULL;
@@ -179,7 +179,7 @@ void print_list(list_t *list, void (*print_data)(void *)) {
 list_t *insert_prev(list_t *list, node_t *node, void *data) {
     assert(list && node && data);
     node_t *new;
-    new = (node_t *)malloc(sizeof(*new));
+    new = (node_t *)rpc_malloc(sizeof(*new));
     assert(new);
     new->data = data;
     new->prev = node->prev;
@@ -197,7 +197,7 @@ list_t *insert_prev(list_t *list, node_t *node, void *data) {
 list_t *insert_next(list_t *list, node_t *node, void *data) {
     assert(list && node && data);
     node_t *new;
-    new = (node_t *)malloc(sizeof(*new));
+    new = (node_t *)rpc_malloc(sizeof(*new));
     assert(new);
     new->data = data;
     new->next = node->next;
@@ -0,0 +1,1081 @@
+/* =============================================================================
+   mux.c
+
+   Multiplexed connections: messages split into frames tagged with their
+   request id, written round-robin and reassembled per request id.
+
+   Author: David Sha
+============================================================================= */
+#define _DEFAULT_SOURCE
+#include "mux.h"
+#include "clock.h"
+#include "config.h"
+#include "linkedlist.h"
+#include "sockets.h"
+#include "spin.h"
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <time.h> // before linux/errqueue.h, which needs struct timespec
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+/* structures =============================================================== */
+
+/*
+ * A message queued for sending, of which the first sent bytes are on the
+ * wire.
+ */
+typedef struct {
+    uint64_t id;
+    int priority;
+    buffer_t *buf;
+    size_t sent;
+    // set when sent with MSG_ZEROCOPY, which needs the frame headers to
+    // stay put as well as the payload
+    unsigned char *headers;
+    // the kernel is done with the message once every zerocopy send before
+    // this id has completed
+    uint32_t zerocopy_end;
+    // realtime clock when queued, to compare with its transmit timestamp
+    uint64_t queued_usec;
+    // the rest of the message is to be replaced by a cancel frame
+    int cancel;
+} outgoing_t;
+
+/*
+ * A message waiting for its transmit timestamp, which the kernel tags with
+ * the offset of the last byte of the send in the connection's output.
+ */
+typedef struct {
+    uint32_t key;
+    uint64_t queued_usec;
+} tx_probe_t;
+
+/*
+ * A message of which only some frames have arrived.
+ */
+typedef struct {
+    uint64_t id;
+    buffer_t *buf;
+    int checked;
+    int dropped;
+} partial_t;
+
+struct mux {
+    int sockfd;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    list_t *outgoing;
+    int writing;
+    int closing;
+    int broken;
+    pthread_t writer;
+    // the message the writer thread is sending a frame of
+    outgoing_t *current;
+    list_t *partial;
+    mux_admit_fn admit;
+    void *admit_arg;
+    mux_cancel_fn cancel;
+    void *cancel_arg;
+    unsigned char *rbuf;
+    size_t rstart;
+    size_t rend;
+    spin_t spin;
+    size_t zerocopy_threshold;
+    // ids of zerocopy sends, only touched by the writer thread
+    uint32_t zerocopy_next;
+    uint32_t zerocopy_done;
+    // messages the kernel may still be reading, in the order sent
+    list_t *zerocopy_sent;
+    size_t zerocopy_sent_bytes;
+    mux_zerocopy_stats zerocopy_stats;
+    // kernel timestamps. tx_bytes counts the bytes written since they were
+    // turned on, and is only touched by whoever is writing
+    int timestamping;
+    mux_sent_fn sent;
+    void *sent_arg;
+    uint32_t tx_bytes;
+    // messages waiting for their transmit timestamps, in the order sent
+    list_t *tx_pending;
+    // how long the data of the last recv waited in the kernel
+    unsigned long rx_wait_usec;
+    // the last reading of TCP_INFO, and when it was taken
+    rpc_connection_info tcp_info;
+    uint64_t tcp_info_usec;
+    // where received messages are copied to, if anywhere
+    capture_t *capture;
+    uint32_t capture_connection;
+};
+
+/*
+ * A non-blocking receive tried while spinning.
+ */
+typedef struct {
+    mux_t *m;
+    void *buf;
+    size_t size;
+    ssize_t n;
+} poll_recv_t;
+
+/* helper function declarations ============================================= */
+
+/*
+ * Send the queued messages one frame at a time, taking turns between them.
+ */
+void *mux_writer_thread(void *arg);
+
+/*
+ * Queue a message to be sent.
+ *
+ * @param m The mux.
+ * @param msg The message to send.
+ * @param direct Write the message on the calling thread instead when it
+ * fits in one frame and the connection is idle.
+ * @return 0 if the message was queued or sent, FAILED if it is too large
+ * or the connection has failed.
+ */
+int queue_message(mux_t *m, rpc_message *msg, int direct);
+
+/*
+ * Write the next frame of a message.
+ *
+ * @param m The mux, which the caller must have set writing on.
+ * @param o The message.
+ * @param cancel Send a cancel frame in place of the rest of the message.
+ * @return TRUE if that was the last frame, FALSE if there are more to send,
+ * or FAILED if the connection failed.
+ */
+int send_next_frame(mux_t *m, outgoing_t *o, int cancel);
+
+/*
+ * Create an empty message that is sent as a cancel frame.
+ *
+ * @param id The request id of the message being cancelled.
+ */
+outgoing_t *new_cancel_frame(uint64_t id);
+
+/*
+ * Write a frame header followed by its payload.
+ *
+ * @param zerocopy Send with MSG_ZEROCOPY, so both must stay unchanged
+ * until the send completes.
+ * @param timestamp Ask for a transmit timestamp of the frame's last byte.
+ * @return 0 on success, FAILED if the connection failed.
+ */
+int send_frame(mux_t *m, unsigned char *header, unsigned char *payload,
+               size_t len, int zerocopy, int timestamp);
+
+/*
+ * Read the zerocopy completions and transmit timestamps from the socket's
+ * error queue, free the messages the kernel is done with, and report the
+ * send times of the messages timestamped.
+ *
+ * @param m The mux.
+ * @param timeout_ms How long to wait for a completion, 0 to not wait.
+ */
+void reap_error_queue(mux_t *m, int timeout_ms);
+
+/*
+ * Match a transmit timestamp to the message it is for, dropping those
+ * before it whose timestamps never came.
+ *
+ * @param m The mux.
+ * @param key The offset of the byte timestamped.
+ * @param usec When the byte was sent, on the realtime clock.
+ */
+void tx_stamped(mux_t *m, uint32_t key, uint64_t usec);
+
+/*
+ * Has the kernel finished with a message sent with MSG_ZEROCOPY?
+ */
+int zerocopy_complete(mux_t *m, outgoing_t *o);
+
+/*
+ * Read exactly size bytes. Small reads are served from a buffer, so that
+ * a frame header and a small payload usually take a single recv.
+ *
+ * @return 0 on success, FAILED if the connection failed or was closed.
+ */
+int mux_read(mux_t *m, unsigned char *buf, size_t size);
+
+/*
+ * Receive into buf as recv does, noting how long the data waited in the
+ * kernel when timestamps are on.
+ */
+ssize_t mux_recv(mux_t *m, void *buf, size_t size, int flags);
+
+/*
+ * Read and throw away size bytes.
+ *
+ * @return 0 on success, FAILED if the connection failed or was closed.
+ */
+int mux_skip(mux_t *m, size_t size);
+
+/*
+ * Receive whatever has arrived, without blocking.
+ *
+ * @param arg The poll_recv_t, whose n is set to what recv returned.
+ * @return TRUE unless nothing has arrived yet.
+ */
+int poll_recv(void *arg);
+
+/*
+ * Ask the admission callback about a message once its head has arrived.
+ * A message that is turned away is marked dropped and its bytes freed.
+ *
+ * @param m The mux.
+ * @param p The message received so far.
+ */
+void check_admission(mux_t *m, partial_t *p);
+
+/*
+ * Free a queued message.
+ */
+void outgoing_free(void *data);
+
+/*
+ * Free a partly received message.
+ */
+void partial_free(void *data);
+
+/* mux ====================================================================== */
+mux_t *mux_create(int sockfd) {
+    mux_t *m = (mux_t *)rpc_malloc(sizeof(*m));
+    assert(m);
+    m->sockfd = sockfd;
+
+    // frames only take turns while they are queued here. Once written they
+    // wait in the kernel's buffers in order, so keep those buffers short
+    int lowat = MUX_FRAME_SIZE;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+    int rcvbuf = MUX_RECEIVE_BUFFER_SIZE;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->queued, NULL);
+    m->outgoing = create_empty_list();
+    m->current = NULL;
+    m->writing = FALSE;
+    m->closing = FALSE;
+    m->broken = FALSE;
+    m->partial = create_empty_list();
+    m->admit = NULL;
+    m->admit_arg = NULL;
+    m->cancel = NULL;
+    m->cancel_arg = NULL;
+    m->rbuf = (unsigned char *)rpc_malloc(MUX_READ_SIZE);
+    assert(m->rbuf);
+    m->rstart = m->rend = 0;
+    spin_init(&m->spin, 0);
+    m->zerocopy_threshold = 0;
+    m->zerocopy_next = m->zerocopy_done = 0;
+    m->zerocopy_sent = create_empty_list();
+    m->zerocopy_sent_bytes = 0;
+    memset(&m->zerocopy_stats, 0, sizeof(m->zerocopy_stats));
+    m->timestamping = FALSE;
+    m->sent = NULL;
+    m->sent_arg = NULL;
+    m->tx_bytes = 0;
+    m->tx_pending = create_empty_list();
+    m->rx_wait_usec = 0;
+    memset(&m->tcp_info, 0, sizeof(m->tcp_info));
+    m->tcp_info_usec = 0;
+    m->capture = NULL;
+    m->capture_connection = 0;
+    if (pthread_create(&m->writer, NULL, mux_writer_thread, m) != 0) {
+        debug_print("%s", "Creating writer thread failed\n");
+        free_list(m->outgoing, NULL);
+        free_list(m->partial, NULL);
+        free_list(m->zerocopy_sent, NULL);
+        free_list(m->tx_pending, NULL);
+        free_and_null(m->rbuf);
+        pthread_cond_destroy(&m->queued);
+        pthread_mutex_destroy(&m->lock);
+        free_and_null(m);
+        return NULL;
+    }
+    return m;
+}
+
+int mux_send(mux_t *m, rpc_message *msg) {
+    return queue_message(m, msg, TRUE);
+}
+
+int mux_send_queued(mux_t *m, rpc_message *msg) {
+    return queue_message(m, msg, FALSE);
+}
+
+void mux_cancel(mux_t *m, uint64_t request_id) {
+    pthread_mutex_lock(&m->lock);
+    if (m->broken || m->closing) {
+        pthread_mutex_unlock(&m->lock);
+        return;
+    }
+
+    // the writer is in the middle of a frame, and sends the cancel frame
+    // next if that was not the last one
+    if (m->current != NULL && m->current->id == request_id &&
+        !m->current->cancel) {
+        m->current->cancel = TRUE;
+        pthread_mutex_unlock(&m->lock);
+        return;
+    }
+    for (node_t *curr = m->outgoing->head; curr; curr = curr->next) {
+        outgoing_t *o = (outgoing_t *)curr->data;
+        if (o->id != request_id || o->cancel) {
+            continue;
+        }
+        if (o->sent == 0) {
+            // the peer has seen none of it, so there is nothing to cancel
+            remove_node(m->outgoing, curr);
+            pthread_mutex_unlock(&m->lock);
+            outgoing_free(o);
+            return;
+        }
+        o->cancel = TRUE;
+        pthread_mutex_unlock(&m->lock);
+        return;
+    }
+
+    // it has all been written, so tell the peer after it
+    append(m->outgoing, new_cancel_frame(request_id));
+    pthread_cond_signal(&m->queued);
+    pthread_mutex_unlock(&m->lock);
+}
+
+rpc_message *mux_receive(mux_t *m) {
+    unsigned char header[MUX_FRAME_HEADER_SIZE];
+    while (TRUE) {
+        if (mux_read(m, header, sizeof(header)) == FAILED) {
+            return NULL;
+        }
+        uint64_t id;
+        uint32_t len;
+        memcpy(&id, header, sizeof(id));
+        memcpy(&len, header + sizeof(id) + 1, sizeof(len));
+        id = be64toh(id);
+        len = be32toh(len);
+        int flags = header[sizeof(id)];
+        if (len > MUX_FRAME_SIZE) {
+            debug_print("Frame of %u bytes is too large\n", len);
+            return NULL;
+        }
+
+        // drop what has arrived of a cancelled message, and let the owner
+        // drop the message if it arrived in full
+        if (flags & MUX_FRAME_CANCEL) {
+            if (mux_skip(m, len) == FAILED) {
+                return NULL;
+            }
+            for (node_t *curr = m->partial->head; curr; curr = curr->next) {
+                partial_t *p = (partial_t *)curr->data;
+                if (p->id == id) {
+                    remove_node(m->partial, curr);
+                    partial_free(p);
+                    break;
+                }
+            }
+            if (m->cancel != NULL) {
+                m->cancel(m->cancel_arg, id);
+            }
+            continue;
+        }
+
+        // find the message this frame belongs to
+        partial_t *p = NULL;
+        for (node_t *curr = m->partial->head; curr; curr = curr->next) {
+            if (((partial_t *)curr->data)->id == id) {
+                p = (partial_t *)curr->data;
+                break;
+            }
+        }
+        if (p == NULL) {
+            if (list_len(m->partial) >= MUX_MAX_STREAMS) {
+                debug_print("%s", "Too many messages in progress\n");
+                return NULL;
+            }
+            p = (partial_t *)rpc_malloc(sizeof(*p));
+            assert(p);
+            p->id = id;
+            p->buf = new_buffer(len > 0 ? len : INITIAL_BUFFER_SIZE);
+            p->checked = m->admit == NULL;
+            p->dropped = FALSE;
+            append(m->partial, p);
+        }
+
+        // the rest of a message that was turned away is thrown away unread
+        if (p->dropped) {
+            if (mux_skip(m, len) == FAILED) {
+                return NULL;
+            }
+            if (flags & MUX_FRAME_END) {
+                remove_data(m->partial, p);
+                partial_free(p);
+            }
+            continue;
+        }
+        if (p->buf->next + len > MAX_MESSAGE_BYTE_SIZE) {
+            debug_print("%s", "Message too large\n");
+            return NULL;
+        }
+
+        reserve_space(p->buf, len);
+        if (mux_read(m, p->buf->data + p->buf->next, len) == FAILED) {
+            return NULL;
+        }
+        p->buf->next += len;
+        if (!p->checked) {
+            check_admission(m, p);
+        }
+        if (!(flags & MUX_FRAME_END)) {
+            continue;
+        }
+
+        // the message is complete
+        remove_data(m->partial, p);
+        if (p->dropped) {
+            partial_free(p);
+            continue;
+        }
+        p->buf->size = p->buf->next;
+        p->buf->next = 0;
+        int priority = (flags & MUX_FRAME_PRIORITY) >> MUX_FRAME_PRIORITY_SHIFT;
+        if (m->capture != NULL) {
+            capture_write(m->capture, m->capture_connection, priority,
+                          p->buf->data, p->buf->size);
+        }
+        uint64_t start = monotonic_usec();
+        rpc_message *msg = deserialise_rpc_message(p->buf);
+        partial_free(p);
+        if (msg == NULL) {
+            debug_print("%s", "Error deserialising message\n");
+            return NULL;
+        }
+        msg->received_usec = monotonic_usec();
+        msg->decode_usec = msg->received_usec - start;
+        msg->kernel_usec = m->rx_wait_usec;
+
+        // treat classes we do not know about as normal
+        if (priority <= RPC_PRIORITY_BATCH) {
+            msg->priority = priority;
+        }
+        debug_print_rpc_message(msg);
+        return msg;
+    }
+}
+
+void mux_set_admit(mux_t *m, mux_admit_fn admit, void *arg) {
+    m->admit = admit;
+    m->admit_arg = arg;
+}
+
+void mux_set_cancel(mux_t *m, mux_cancel_fn cancel, void *arg) {
+    m->cancel = cancel;
+    m->cancel_arg = arg;
+}
+
+void mux_set_busy_poll(mux_t *m, int usec) {
+    // let the kernel poll the device queue for us too, where it can
+    int prefer = usec > 0;
+    setsockopt(m->sockfd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+    setsockopt(m->sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer,
+               sizeof(prefer));
+    spin_init(&m->spin, usec);
+}
+
+int mux_set_zerocopy(mux_t *m, size_t threshold) {
+    int on = threshold > 0;
+    if (setsockopt(m->sockfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) {
+        debug_print("%s", "SO_ZEROCOPY not supported\n");
+        return FAILED;
+    }
+    m->zerocopy_threshold = threshold;
+    return 0;
+}
+
+int mux_set_timestamping(mux_t *m, mux_sent_fn sent, void *arg) {
+    // software timestamps only, with the error queue carrying just the
+    // timestamps and the offsets they are for rather than the packets
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    if (setsockopt(m->sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                   sizeof(flags)) < 0) {
+        debug_print("%s", "SO_TIMESTAMPING not supported\n");
+        return FAILED;
+    }
+    m->sent = sent;
+    m->sent_arg = arg;
+    m->tx_bytes = 0;
+    m->timestamping = TRUE;
+    return 0;
+}
+
+void mux_set_capture(mux_t *m, capture_t *cap) {
+    m->capture = cap;
+    m->capture_connection = capture_connection(cap);
+}
+
+void mux_sample_tcp_info(mux_t *m, int force) {
+    uint64_t now = monotonic_usec();
+    pthread_mutex_lock(&m->lock);
+    int due = force || m->tcp_info_usec == 0 ||
+              now - m->tcp_info_usec >= TCP_INFO_INTERVAL_USEC;
+    pthread_mutex_unlock(&m->lock);
+    if (!due) {
+        return;
+    }
+
+    // a single system call, which copies the kernel's counters
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if (getsockopt(m->sockfd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) {
+        return;
+    }
+    pthread_mutex_lock(&m->lock);
+    m->tcp_info.rtt_usec = ti.tcpi_rtt;
+    m->tcp_info.rttvar_usec = ti.tcpi_rttvar;
+    m->tcp_info.retransmits = ti.tcpi_total_retrans;
+    m->tcp_info.cwnd = ti.tcpi_snd_cwnd;
+    m->tcp_info.unacked = ti.tcpi_unacked;
+    m->tcp_info_usec = now;
+    pthread_mutex_unlock(&m->lock);
+}
+
+int mux_get_tcp_info(mux_t *m, rpc_connection_info *info) {
+    pthread_mutex_lock(&m->lock);
+    if (m->tcp_info_usec == 0) {
+        pthread_mutex_unlock(&m->lock);
+        return FAILED;
+    }
+    info->rtt_usec = m->tcp_info.rtt_usec;
+    info->rttvar_usec = m->tcp_info.rttvar_usec;
+    info->retransmits = m->tcp_info.retransmits;
+    info->cwnd = m->tcp_info.cwnd;
+    info->unacked = m->tcp_info.unacked;
+    pthread_mutex_unlock(&m->lock);
+    return 0;
+}
+
+void mux_get_zerocopy_stats(mux_t *m, mux_zerocopy_stats *stats) {
+    pthread_mutex_lock(&m->lock);
+    *stats = m->zerocopy_stats;
+    pthread_mutex_unlock(&m->lock);
+}
+
+void mux_shutdown(mux_t *m) {
+    pthread_mutex_lock(&m->lock);
+    m->broken = TRUE;
+    pthread_cond_signal(&m->queued);
+    pthread_mutex_unlock(&m->lock);
+    shutdown(m->sockfd, SHUT_RDWR);
+}
+
+void mux_free(mux_t *m) {
+    // let the writer drain the queue before it exits
+    pthread_mutex_lock(&m->lock);
+    m->closing = TRUE;
+    pthread_cond_signal(&m->queued);
+    pthread_mutex_unlock(&m->lock);
+    pthread_join(m->writer, NULL);
+
+    // give the kernel a moment to finish with messages sent in place,
+    // since their memory may be reused as soon as it is freed
+    if (!m->broken) {
+        for (int i = 0; i < 10 && !is_empty_list(m->zerocopy_sent); i++) {
+            reap_error_queue(m, 100);
+        }
+    }
+    close(m->sockfd);
+    free_list(m->zerocopy_sent, outgoing_free);
+    free_list(m->tx_pending, rpc_free);
+    free_list(m->outgoing, outgoing_free);
+    free_list(m->partial, partial_free);
+    free_and_null(m->rbuf);
+    pthread_cond_destroy(&m->queued);
+    pthread_mutex_destroy(&m->lock);
+    free_and_null(m);
+}
+
+/* helper functions ========================================================= */
+void *mux_writer_thread(void *arg) {
+    mux_t *m = (mux_t *)arg;
+
+    pthread_mutex_lock(&m->lock);
+    while (TRUE) {
+        while (!m->broken &&
+               (m->writing || (is_empty_list(m->outgoing) && !m->closing))) {
+            pthread_cond_wait(&m->queued, &m->lock);
+        }
+        if (m->broken || is_empty_list(m->outgoing)) {
+            break;
+        }
+
+        // take the next message in turn and send one frame of it
+        outgoing_t *o = (outgoing_t *)pop(m->outgoing);
+        int cancel = o->cancel;
+        m->current = o;
+        m->writing = TRUE;
+        pthread_mutex_unlock(&m->lock);
+        int sent = send_next_frame(m, o, cancel);
+        pthread_mutex_lock(&m->lock);
+        m->writing = FALSE;
+        m->current = NULL;
+
+        // cancelled while its last frame was being written
+        if (sent == TRUE && o->cancel && !cancel) {
+            append(m->outgoing, new_cancel_frame(o->id));
+        }
+
+        if (sent == FAILED) {
+            debug_print("%s", "Error writing to socket\n");
+            outgoing_free(o);
+            m->broken = TRUE;
+            break;
+        }
+
+        // unfinished messages go to the back of the queue, and ones sent
+        // in place wait for the kernel to be done with them
+        if (sent == TRUE && o->headers != NULL) {
+            append(m->zerocopy_sent, o);
+            m->zerocopy_sent_bytes += o->buf->next;
+        } else if (sent == TRUE) {
+            outgoing_free(o);
+        } else {
+            append(m->outgoing, o);
+        }
+        if (!is_empty_list(m->zerocopy_sent) ||
+            !is_empty_list(m->tx_pending)) {
+            pthread_mutex_unlock(&m->lock);
+            reap_error_queue(m, 0);
+            pthread_mutex_lock(&m->lock);
+        }
+    }
+    int broken = m->broken;
+    pthread_mutex_unlock(&m->lock);
+
+    // wake up the reader, since the connection is no use without a writer
+    if (broken) {
+        shutdown(m->sockfd, SHUT_RDWR);
+    }
+    return NULL;
+}
+
+int queue_message(mux_t *m, rpc_message *msg, int direct) {
+    buffer_t *buf = encode_rpc_message(msg);
+    if (buf == NULL) {
+        return FAILED;
+    }
+
+    outgoing_t *o = (outgoing_t *)rpc_malloc(sizeof(*o));
+    assert(o);
+    o->id = msg->request_id;
+    o->priority = msg->priority;
+    o->buf = buf;
+    o->sent = 0;
+    o->headers = NULL;
+    o->zerocopy_end = 0;
+    o->queued_usec = m->timestamping ? realtime_usec() : 0;
+    o->cancel = FALSE;
+    if (m->zerocopy_threshold > 0 && buf->next >= m->zerocopy_threshold) {
+        size_t frames = (buf->next + MUX_FRAME_SIZE - 1) / MUX_FRAME_SIZE;
+        o->headers =
+            (unsigned char *)rpc_malloc(frames * MUX_FRAME_HEADER_SIZE);
+        assert(o->headers);
+    }
+
+    pthread_mutex_lock(&m->lock);
+    if (m->broken || m->closing) {
+        pthread_mutex_unlock(&m->lock);
+        outgoing_free(o);
+        return FAILED;
+    }
+
+    // a message that fits in one frame is written straight away when the
+    // connection is idle, saving a hand-off to the writer thread
+    if (direct && !m->writing && is_empty_list(m->outgoing) &&
+        buf->next <= MUX_FRAME_SIZE && o->headers == NULL) {
+        m->writing = TRUE;
+        pthread_mutex_unlock(&m->lock);
+        int sent = send_next_frame(m, o, FALSE);
+        outgoing_free(o);
+        pthread_mutex_lock(&m->lock);
+        m->writing = FALSE;
+        if (sent == FAILED) {
+            m->broken = TRUE;
+        }
+        pthread_cond_signal(&m->queued);
+        pthread_mutex_unlock(&m->lock);
+        if (sent == FAILED) {
+            shutdown(m->sockfd, SHUT_RDWR);
+            return FAILED;
+        }
+        return 0;
+    }
+
+    append(m->outgoing, o);
+    pthread_cond_signal(&m->queued);
+    pthread_mutex_unlock(&m->lock);
+    return 0;
+}
+
+int send_next_frame(mux_t *m, outgoing_t *o, int cancel) {
+    unsigned char stack_header[MUX_FRAME_HEADER_SIZE];
+    unsigned char *header = stack_header;
+    if (o->headers != NULL) {
+        header = o->headers + o->sent / MUX_FRAME_SIZE * MUX_FRAME_HEADER_SIZE;
+
+        // bound the memory waiting on the kernel
+        while (TRUE) {
+            pthread_mutex_lock(&m->lock);
+            int full = !m->broken &&
+                       m->zerocopy_sent_bytes > MUX_ZEROCOPY_MAX_PENDING;
+            pthread_mutex_unlock(&m->lock);
+            if (!full) {
+                break;
+            }
+            reap_error_queue(m, 100);
+        }
+    }
+    size_t len = cancel ? 0 : o->buf->next - o->sent;
+    if (len > MUX_FRAME_SIZE) {
+        len = MUX_FRAME_SIZE;
+    }
+    int last = cancel || (o->sent + len == o->buf->next);
+    uint64_t id = htobe64(o->id);
+    uint32_t frame_len = htobe32(len);
+    memcpy(header, &id, sizeof(id));
+    header[sizeof(id)] = (last ? MUX_FRAME_END : 0) |
+                         (cancel ? MUX_FRAME_CANCEL : 0) |
+                         (o->priority << MUX_FRAME_PRIORITY_SHIFT);
+    memcpy(header + sizeof(id) + 1, &frame_len, sizeof(frame_len));
+
+    // the probe goes in first, as the timestamp may be read by the writer
+    // thread as soon as the frame is sent
+    int timestamp = m->timestamping && last && !cancel;
+    if (timestamp) {
+        tx_probe_t *probe = (tx_probe_t *)rpc_malloc(sizeof(*probe));
+        assert(probe);
+        probe->key = m->tx_bytes + MUX_FRAME_HEADER_SIZE + len - 1;
+        probe->queued_usec = o->queued_usec;
+        pthread_mutex_lock(&m->lock);
+        append(m->tx_pending, probe);
+        pthread_mutex_unlock(&m->lock);
+    }
+    if (send_frame(m, header, (unsigned char *)o->buf->data + o->sent, len,
+                   o->headers != NULL, timestamp) == FAILED) {
+        return FAILED;
+    }
+    o->sent += len;
+    o->zerocopy_end = m->zerocopy_next;
+    if (timestamp) {
+        reap_error_queue(m, 0);
+    }
+    return last;
+}
+
+int send_frame(mux_t *m, unsigned char *header, unsigned char *payload,
+               size_t len, int zerocopy, int timestamp) {
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = MUX_FRAME_HEADER_SIZE},
+        {.iov_base = payload, .iov_len = len},
+    };
+    struct msghdr mh = {.msg_iov = iov, .msg_iovlen = 2};
+
+    // timestamp this send only, rather than every send on the socket. A
+    // send cut short is timestamped too, but at an offset nobody waits for
+    unsigned char control[CMSG_SPACE(sizeof(uint32_t))];
+    if (timestamp) {
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SO_TIMESTAMPING;
+        c->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+        uint32_t tx = SOF_TIMESTAMPING_TX_SOFTWARE;
+        memcpy(CMSG_DATA(c), &tx, sizeof(tx));
+    }
+    while (mh.msg_iovlen > 0) {
+        // MSG_NOSIGNAL, as a peer going away must not kill the process
+        int flags = MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0);
+        ssize_t n = socket_sendmsg(m->sockfd, &mh, flags);
+        if (n < 0 && errno == ENOBUFS && zerocopy) {
+            // out of memory to track zerocopy sends, so copy this one
+            zerocopy = FALSE;
+            continue;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return FAILED;
+        }
+        m->tx_bytes += n;
+
+        // every successful zerocopy send gets the next id
+        if (zerocopy) {
+            m->zerocopy_next++;
+            pthread_mutex_lock(&m->lock);
+            m->zerocopy_stats.sends++;
+            pthread_mutex_unlock(&m->lock);
+        }
+        while (mh.msg_iovlen > 0 && (size_t)n >= mh.msg_iov->iov_len) {
+            n -= mh.msg_iov->iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (mh.msg_iovlen > 0) {
+            mh.msg_iov->iov_base = (unsigned char *)mh.msg_iov->iov_base + n;
+            mh.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+void reap_error_queue(mux_t *m, int timeout_ms) {
+    if (timeout_ms > 0) {
+        // completions are signalled as an error on the socket
+        struct pollfd pfd = {.fd = m->sockfd, .events = 0};
+        poll(&pfd, 1, timeout_ms);
+    }
+    while (TRUE) {
+        unsigned char control[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+                              CMSG_SPACE(sizeof(struct sock_extended_err)) +
+                              CMSG_SPACE(sizeof(struct sockaddr_in6))];
+        struct msghdr mh = {.msg_control = control,
+                            .msg_controllen = sizeof(control)};
+        if (recvmsg(m->sockfd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+
+        // a timestamp comes ahead of the error saying what it is for
+        uint64_t stamp_usec = 0;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c != NULL;
+             c = CMSG_NXTHDR(&mh, c)) {
+            if (c->cmsg_level == SOL_SOCKET &&
+                c->cmsg_type == SCM_TIMESTAMPING) {
+                struct scm_timestamping ts;
+                memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+                stamp_usec = (uint64_t)ts.ts[0].tv_sec * 1000000 +
+                             ts.ts[0].tv_nsec / 1000;
+                continue;
+            }
+            if (!(c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) &&
+                !(c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err *err =
+                (struct sock_extended_err *)CMSG_DATA(c);
+            if (err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING &&
+                stamp_usec > 0) {
+                tx_stamped(m, err->ee_data, stamp_usec);
+                continue;
+            }
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+                continue;
+            }
+
+            // ids ee_info to ee_data have completed, and TCP completes
+            // them in order
+            m->zerocopy_done = err->ee_data + 1;
+            unsigned long n = err->ee_data - err->ee_info + 1;
+            pthread_mutex_lock(&m->lock);
+            m->zerocopy_stats.completed += n;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                m->zerocopy_stats.copied += n;
+            }
+            pthread_mutex_unlock(&m->lock);
+        }
+    }
+
+    pthread_mutex_lock(&m->lock);
+    while (!is_empty_list(m->zerocopy_sent) &&
+           zerocopy_complete(m, (outgoing_t *)m->zerocopy_sent->head->data)) {
+        outgoing_t *o = (outgoing_t *)pop(m->zerocopy_sent);
+        m->zerocopy_sent_bytes -= o->buf->next;
+        outgoing_free(o);
+    }
+    pthread_mutex_unlock(&m->lock);
+}
+
+void tx_stamped(mux_t *m, uint32_t key, uint64_t usec) {
+    int found = FALSE;
+    uint64_t queued_usec = 0;
+    pthread_mutex_lock(&m->lock);
+    while (!is_empty_list(m->tx_pending)) {
+        tx_probe_t *probe = (tx_probe_t *)m->tx_pending->head->data;
+
+        // offsets wrap around too
+        int32_t ahead = (int32_t)(probe->key - key);
+        if (ahead > 0) {
+            break;
+        }
+        if (ahead == 0) {
+            found = TRUE;
+            queued_usec = probe->queued_usec;
+        }
+        rpc_free(pop(m->tx_pending));
+    }
+    pthread_mutex_unlock(&m->lock);
+    if (found && m->sent != NULL) {
+        m->sent(m->sent_arg, usec > queued_usec ? usec - queued_usec : 0);
+    }
+}
+
+int zerocopy_complete(mux_t *m, outgoing_t *o) {
+    // ids wrap around, so compare their distance
+    return (int32_t)(m->zerocopy_done - o->zerocopy_end) >= 0;
+}
+
+int mux_read(mux_t *m, unsigned char *buf, size_t size) {
+    while (size > 0) {
+        // take what we can from the buffer
+        if (m->rstart < m->rend) {
+            size_t n = m->rend - m->rstart;
+            n = n < size ? n : size;
+            memcpy(buf, m->rbuf + m->rstart, n);
+            m->rstart += n;
+            buf += n;
+            size -= n;
+            continue;
+        }
+
+        // large reads skip the buffer, the rest refill it
+        unsigned char *dst = size >= MUX_READ_SIZE ? buf : m->rbuf;
+        size_t want = size >= MUX_READ_SIZE ? size : MUX_READ_SIZE;
+        ssize_t n;
+        poll_recv_t pr = {.m = m, .buf = dst, .size = want};
+        if (atomic_load(&m->spin.max_usec) > 0 &&
+            spin_wait(&m->spin, poll_recv, &pr)) {
+            n = pr.n;
+        } else {
+            n = mux_recv(m, dst, want, 0);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            debug_print("%s", n == 0 ? "Connection closed\n"
+                                     : "Error reading from socket\n");
+            return FAILED;
+        }
+        if (dst == buf) {
+            buf += n;
+            size -= n;
+        } else {
+            m->rstart = 0;
+            m->rend = n;
+        }
+    }
+    return 0;
+}
+
+ssize_t mux_recv(mux_t *m, void *buf, size_t size, int flags) {
+    if (!m->timestamping) {
+        return socket_recv(m->sockfd, buf, size, flags);
+    }
+    unsigned char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct iovec iov = {.iov_base = buf, .iov_len = size};
+    struct msghdr mh = {.msg_iov = &iov,
+                        .msg_iovlen = 1,
+                        .msg_control = control,
+                        .msg_controllen = sizeof(control)};
+    ssize_t n = socket_recvmsg(m->sockfd, &mh, flags);
+    if (n <= 0) {
+        return n;
+    }
+
+    // TCP gives the timestamp of the last segment read
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c != NULL;
+         c = CMSG_NXTHDR(&mh, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            uint64_t stamp = (uint64_t)ts.ts[0].tv_sec * 1000000 +
+                             ts.ts[0].tv_nsec / 1000;
+            uint64_t now = realtime_usec();
+            m->rx_wait_usec = now > stamp ? now - stamp : 0;
+        }
+    }
+    return n;
+}
+
+int mux_skip(mux_t *m, size_t size) {
+    unsigned char scratch[MUX_READ_SIZE];
+    while (size > 0) {
+        size_t n = size < sizeof(scratch) ? size : sizeof(scratch);
+        if (mux_read(m, scratch, n) == FAILED) {
+            return FAILED;
+        }
+        size -= n;
+    }
+    return 0;
+}
+
+int poll_recv(void *arg) {
+    poll_recv_t *pr = (poll_recv_t *)arg;
+    pr->n = mux_recv(pr->m, pr->buf, pr->size, MSG_DONTWAIT);
+    return !(pr->n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+void check_admission(mux_t *m, partial_t *p) {
+    uint64_t request_id;
+    int operation;
+    const char *function_name;
+    if (peek_rpc_message(p->buf, &request_id, &operation, &function_name) ==
+        FAILED) {
+        // not all of the head yet
+        return;
+    }
+    p->checked = TRUE;
+    if (!m->admit(m->admit_arg, request_id, operation, function_name)) {
+        p->dropped = TRUE;
+        buffer_free(p->buf);
+        p->buf = NULL;
+    }
+}
+
+outgoing_t *new_cancel_frame(uint64_t id) {
+    outgoing_t *o = (outgoing_t *)rpc_malloc(sizeof(*o));
+    assert(o);
+    o->id = id;
+    o->priority = 0;
+    o->buf = new_buffer(1);
+    o->sent = 0;
+    o->headers = NULL;
+    o->zerocopy_end = 0;
+    o->queued_usec = 0;
+    o->cancel = TRUE;
+    return o;
+}
+
+void outgoing_free(void *data) {
+    outgoing_t *o = (outgoing_t *)data;
+    buffer_free(o->buf);
+    free_and_null(o->headers);
+    free_and_null(o);
+}
+
+void partial_free(void *data) {
+    partial_t *p = (partial_t *)data;
+    if (p->buf != NULL) {
+        buffer_free(p->buf);
+    }
+    free_and_null(p);
+}
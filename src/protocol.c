@@ -11,10 +11,13 @@
    Author: David Sha
 ============================================================================= */
 #include "protocol.h"
+#include "bufpool.h"
 #include "config.h"
 #include <assert.h>
 #include <ctype.h>
+#include <endian.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -23,26 +26,70 @@
 #include <unistd.h>
 
 buffer_t *new_buffer(size_t size) {
-    buffer_t *b = (buffer_t *)malloc(sizeof(*b));
+    buffer_t *b = (buffer_t *)rpc_malloc(sizeof(*b));
     assert(b);
-    b->data = calloc(size, sizeof(*b->data));
-    assert(b->data);
     b->next = 0;
+    b->pooled = FALSE;
+    size_t threshold = buffer_pool_threshold();
+    if (threshold > 0 && size >= threshold &&
+        size <= BUFFER_POOL_REGION_SIZE &&
+        (b->data = buffer_pool_take()) != NULL) {
+        b->size = BUFFER_POOL_REGION_SIZE;
+        b->pooled = TRUE;
+        return b;
+    }
+    b->data = rpc_calloc(size, sizeof(*b->data));
+    assert(b->data);
     b->size = size;
     return b;
 }
 
 void buffer_free(buffer_t *b) {
+    if (b->pooled) {
+        buffer_pool_give(b->data);
+        b->data = NULL;
+    }
     free_and_null(b->data);
     free_and_null(b);
 }
 
 void reserve_space(buffer_t *b, size_t size) {
-    while (b->next + size > b->size) {
-        // double the size of the buffer for O(log n) reallocations
-        b->size *= 2;
-        b->data = realloc(b->data, b->size);
+    if (b->next + size <= b->size) {
+        return;
+    }
+
+    // double the size of the buffer for O(log n) reallocations
+    size_t new_size = b->size;
+    while (b->next + size > new_size) {
+        new_size *= 2;
+    }
+
+    // a large buffer moves into a region of the pool once, and out again
+    // only if it outgrows the region
+    void *data = NULL;
+    size_t threshold = buffer_pool_threshold();
+    if (!b->pooled && threshold > 0 && new_size >= threshold &&
+        new_size <= BUFFER_POOL_REGION_SIZE) {
+        data = buffer_pool_take();
+    }
+    if (data != NULL) {
+        memcpy(data, b->data, b->next);
+        rpc_free(b->data);
+        b->data = data;
+        b->size = BUFFER_POOL_REGION_SIZE;
+        b->pooled = TRUE;
+    } else if (b->pooled) {
+        data = rpc_malloc(new_size);
+        assert(data);
+        memcpy(data, b->data, b->next);
+        buffer_pool_give(b->data);
+        b->data = data;
+        b->size = new_size;
+        b->pooled = FALSE;
+    } else {
+        b->data = rpc_realloc(b->data, new_size);
         assert(b->data);
+        b->size = new_size;
     }
 }
 
@@ -124,128 +171,43 @@ void debug_print_bytes(const unsigned char *buf, size_t len) {
     }
 }
 
-int send_rpc_message(int sockfd, rpc_message *msg) {
-    int result = FAILED;
-
-    // convert message to serialised form
+buffer_t *encode_rpc_message(rpc_message *msg) {
     buffer_t *buf = new_buffer(INITIAL_BUFFER_SIZE);
     serialise_rpc_message(buf, msg);
 
-    // send an integer representing the size of the message
-    size_t size = buf->next;
-    size_t gamma_size = gamma_code_length(MAX_MESSAGE_BYTE_SIZE);
-    buffer_t *size_buf = new_buffer(gamma_size);
-    buffer_t *n_buf = new_buffer(gamma_size);
-    serialise_size_t(size_buf, size);
-
     // we will only check once that the message is not too large
-    if (size > MAX_MESSAGE_BYTE_SIZE) {
+    if (buf->next > MAX_MESSAGE_BYTE_SIZE) {
         debug_print("%s", "Message too large\n");
         fprintf(stderr, "Overlength error\n");
-        goto cleanup;
-    }
-    if (write_bytes(sockfd, size_buf->data, size_buf->size) < 0) {
-        goto cleanup;
-    }
-
-    // read that the number of bytes sent is correct
-    if (read_bytes(sockfd, n_buf->data, n_buf->size) <= 0) {
-        goto cleanup;
-    }
-    size_t n = deserialise_size_t(n_buf);
-    if (n != size) {
-        debug_print("Error: sent %ld bytes but received %ld bytes before "
-                    "sending message\n",
-                    size, n);
-        goto cleanup;
-    } else {
-        debug_print("%s", "Looks good, sending payload...\n");
-    }
-
-    // send the message
-    if (write_bytes(sockfd, buf->data, buf->next) < 0) {
-        goto cleanup;
-    }
-
-    // success if we get here
-    result = 0;
-
-cleanup:
-    // free buffers
-    buffer_free(buf);
-    buffer_free(size_buf);
-    buffer_free(n_buf);
-
-    return result;
-}
-
-rpc_message *receive_rpc_message(int sockfd) {
-    rpc_message *msg = NULL;
-    buffer_t *size_buf = NULL, *buf = NULL;
-
-    // read size of message and send back to confirm
-    size_buf = new_buffer(gamma_code_length(MAX_MESSAGE_BYTE_SIZE));
-    if (read_bytes(sockfd, size_buf->data, size_buf->size) <= 0) {
-        debug_print("%s", "Error reading message size\n");
-        goto cleanup;
-    }
-    size_t size = deserialise_size_t(size_buf);
-    debug_print("Sending back the expected size of %ld bytes...\n", size);
-    if (write_bytes(sockfd, size_buf->data, size_buf->size) < 0) {
-        debug_print("%s", "Error writing to socket\n");
-        goto cleanup;
-    }
-
-    // now read the message
-    buf = new_buffer(size);
-    if (read_bytes(sockfd, buf->data, size) <= 0) {
-        debug_print("%s", "Error reading message\n");
-        goto cleanup;
-    }
-    if ((msg = deserialise_rpc_message(buf)) == NULL) {
-        debug_print("%s", "Error deserialising message\n");
-        goto cleanup;
-    }
-
-    // success if we get here
-    debug_print_rpc_message(msg);
-
-cleanup:
-    // free buffers
-    if (size_buf != NULL) {
-        buffer_free(size_buf);
-    }
-    if (buf != NULL) {
         buffer_free(buf);
+        return NULL;
     }
-
-    return msg;
+    return buf;
 }
 
-rpc_message *request(int sockfd, rpc_message *msg) {
-    rpc_message *result = NULL;
-
-    // send message
-    if (send_rpc_message(sockfd, msg) == FAILED) {
-        goto cleanup;
-    }
-
-    // receive response
-    result = receive_rpc_message(sockfd);
+void serialise_int(buffer_t *b, int value) {
+    uint64_t big_endian = htobe64(value);
+    reserve_space(b, sizeof(uint64_t));
+    memcpy(b->data + b->next, &big_endian, sizeof(uint64_t));
+    b->next += sizeof(uint64_t);
+}
 
-cleanup:
-    rpc_message_free(msg, NULL);
-    return result;
+int deserialise_int(buffer_t *b) {
+    assert(b->next + sizeof(uint64_t) <= b->size);
+    uint64_t big_endian;
+    memcpy(&big_endian, b->data + b->next, sizeof(uint64_t));
+    b->next += sizeof(uint64_t);
+    return be64toh(big_endian);
 }
 
-void serialise_int(buffer_t *b, int value) {
+void serialise_uint64(buffer_t *b, uint64_t value) {
     uint64_t big_endian = htobe64(value);
     reserve_space(b, sizeof(uint64_t));
     memcpy(b->data + b->next, &big_endian, sizeof(uint64_t));
     b->next += sizeof(uint64_t);
 }
 
-int deserialise_int(buffer_t *b) {
+uint64_t deserialise_uint64(buffer_t *b) {
     assert(b->next + sizeof(uint64_t) <= b->size);
     uint64_t big_endian;
     memcpy(&big_endian, b->data + b->next, sizeof(uint64_t));
@@ -310,6 +272,29 @@ size_t deserialise_size_t(buffer_t *b) {
     return value - 1;
 }
 
+int deserialise_size_t_bounded(buffer_t *b, size_t *value) {
+    const unsigned char *data = b->data;
+    size_t pos = b->next;
+
+    // a code of n zeros is followed by n + 1 bits
+    unsigned int length = 0;
+    while (pos < b->size && data[pos] == 0x00) {
+        length++;
+        pos++;
+    }
+    if (length >= 8 * sizeof(size_t) || pos + length + 1 > b->size) {
+        return FAILED;
+    }
+
+    size_t decoded = 0;
+    for (unsigned int i = 0; i < length + 1; i++) {
+        decoded = (decoded << 1) | data[pos++];
+    }
+    b->next = pos;
+    *value = decoded - 1;
+    return 0;
+}
+
 void serialise_string(buffer_t *b, const char *value) {
     size_t len = strlen(value) + 1;
     serialise_size_t(b, len);
@@ -352,14 +337,29 @@ rpc_data *deserialise_rpc_data(buffer_t *b) {
 }
 
 void serialise_rpc_message(buffer_t *b, const rpc_message *message) {
-    serialise_int(b, message->request_id);
+    serialise_uint64(b, message->request_id);
     serialise_int(b, message->operation);
     serialise_string(b, message->function_name);
     serialise_rpc_data(b, message->data);
+    if (message->timed) {
+        reserve_space(b, 1);
+        ((unsigned char *)b->data)[b->next++] = TIMING_TAG;
+        serialise_size_t(b, message->queue_usec);
+        serialise_size_t(b, message->decode_usec);
+        serialise_size_t(b, message->handler_usec);
+    }
+    if (message->traced) {
+        uint64_t ids[2] = {htobe64(message->trace_id),
+                           htobe64(message->span_id)};
+        reserve_space(b, 1 + sizeof(ids));
+        ((unsigned char *)b->data)[b->next++] = TRACE_TAG;
+        memcpy((unsigned char *)b->data + b->next, ids, sizeof(ids));
+        b->next += sizeof(ids);
+    }
 }
 
 rpc_message *deserialise_rpc_message(buffer_t *b) {
-    int request_id = deserialise_int(b);
+    uint64_t request_id = deserialise_uint64(b);
     int operation = deserialise_int(b);
     char *function_name = deserialise_string(b);
     rpc_data *data = deserialise_rpc_data(b);
@@ -370,39 +370,112 @@ rpc_message *deserialise_rpc_message(buffer_t *b) {
     }
     rpc_message *message =
         new_rpc_message(request_id, operation, function_name, data);
+
+    // tagged trailers follow in any order, and reading stops at a tag we
+    // do not know or a trailer cut short
+    while (b->next < b->size) {
+        unsigned char tag = ((unsigned char *)b->data)[b->next];
+        if (tag == TIMING_TAG) {
+            size_t start = b->next++;
+            size_t usec[3];
+            if (deserialise_size_t_bounded(b, &usec[0]) == FAILED ||
+                deserialise_size_t_bounded(b, &usec[1]) == FAILED ||
+                deserialise_size_t_bounded(b, &usec[2]) == FAILED) {
+                b->next = start;
+                break;
+            }
+            message->timed = TRUE;
+            message->queue_usec = usec[0];
+            message->decode_usec = usec[1];
+            message->handler_usec = usec[2];
+        } else if (tag == TRACE_TAG && b->next + 17 <= b->size) {
+            uint64_t ids[2];
+            memcpy(ids, (unsigned char *)b->data + b->next + 1, sizeof(ids));
+            b->next += 1 + sizeof(ids);
+            message->traced = TRUE;
+            message->trace_id = be64toh(ids[0]);
+            message->span_id = be64toh(ids[1]);
+        } else {
+            break;
+        }
+    }
     return message;
 }
 
+int peek_rpc_message(const buffer_t *b, uint64_t *request_id, int *operation,
+                     const char **function_name) {
+    const unsigned char *data = b->data;
+    size_t end = b->next, pos = 2 * sizeof(uint64_t);
+    if (end < pos) {
+        return FAILED;
+    }
+    uint64_t big_endian;
+    memcpy(&big_endian, data, sizeof(uint64_t));
+    *request_id = be64toh(big_endian);
+    memcpy(&big_endian, data + sizeof(uint64_t), sizeof(uint64_t));
+    *operation = be64toh(big_endian);
+
+    // Elias gamma coded length of the name, including its null byte
+    unsigned int zeros = 0;
+    while (pos < end && data[pos] == 0x00) {
+        zeros++;
+        pos++;
+    }
+    if (zeros >= 8 * sizeof(size_t) || pos + zeros + 1 > end) {
+        return FAILED;
+    }
+    size_t len = 0;
+    for (unsigned int i = 0; i < zeros + 1; i++) {
+        len = (len << 1) | (data[pos++] & 0x01);
+    }
+    len--;
+    if (len == 0 || len > end - pos || data[pos + len - 1] != '\0') {
+        return FAILED;
+    }
+    *function_name = (const char *)(data + pos);
+    return 0;
+}
+
 char *new_string(const char *value) {
-    char *string = (char *)malloc(sizeof(char) * (strlen(value) + 1));
+    char *string = (char *)rpc_malloc(sizeof(char) * (strlen(value) + 1));
     assert(string);
     strcpy(string, value);
     return string;
 }
 
 rpc_data *new_rpc_data(int data1, size_t data2_len, void *data2) {
-    rpc_data *data = (rpc_data *)malloc(sizeof(*data));
+    rpc_data *data = (rpc_data *)rpc_malloc(sizeof(*data));
     assert(data);
     data->data1 = data1;
     data->data2_len = data2_len;
     if (data2_len == 0) {
         data->data2 = NULL;
     } else {
-        data->data2 = malloc(data2_len);
+        data->data2 = rpc_malloc(data2_len);
         assert(data->data2);
         memcpy(data->data2, data2, data2_len);
     }
     return data;
 }
 
-rpc_message *new_rpc_message(int request_id, int operation, char *function_name,
-                             rpc_data *data) {
-    rpc_message *message = (rpc_message *)malloc(sizeof(*message));
+rpc_message *new_rpc_message(uint64_t request_id, int operation,
+                             char *function_name, rpc_data *data) {
+    rpc_message *message = (rpc_message *)rpc_malloc(sizeof(*message));
     assert(message);
     message->request_id = request_id;
     message->operation = operation;
+    message->priority = RPC_PRIORITY_NORMAL;
     message->function_name = function_name;
     message->data = data;
+    message->received_usec = 0;
+    message->decode_usec = 0;
+    message->kernel_usec = 0;
+    message->timed = FALSE;
+    message->queue_usec = 0;
+    message->handler_usec = 0;
+    message->traced = FALSE;
+    message->trace_id = 0;
+    message->span_id = 0;
     return message;
 }
 
@@ -419,6 +492,11 @@ rpc_message *create_failure_message() {
                            new_rpc_data(0, 0, NULL));
 }
 
+rpc_message *create_overloaded_message() {
+    return new_rpc_message(0, REPLY_OVERLOADED, new_string(""),
+                           new_rpc_data(0, 0, NULL));
+}
+
 void debug_print_rpc_data(rpc_data *data) {
     int max_print_size = 10;
     if (data == NULL) {
@@ -444,8 +522,9 @@ void debug_print_rpc_data(rpc_data *data) {
 
 void debug_print_rpc_message(rpc_message *message) {
     debug_print("%s", "rpc_message\n");
-    debug_print(" |- request_id: %d\n", message->request_id);
+    debug_print(" |- request_id: %" PRIu64 "\n", message->request_id);
     debug_print(" |- operation: %d\n", message->operation);
+    debug_print(" |- priority: %d\n", message->priority);
     debug_print(" |- function_name: %s\n", message->function_name);
     debug_print_rpc_data(message->data);
 }
@@ -0,0 +1,46 @@
+/* =============================================================================
+   ratelimit.c
+
+   Lock-free token buckets.
+
+   Author: David Sha
+============================================================================= */
+#include "ratelimit.h"
+#include "config.h"
+
+void token_bucket_init(token_bucket_t *b, double rate, int burst) {
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+    if (rate > 0 && interval == 0) {
+        interval = 1;
+    }
+    burst = burst < 1 ? 1 : burst;
+    atomic_store(&b->tolerance, interval * (burst - 1));
+    atomic_store(&b->tat, 0);
+    atomic_store(&b->limited, 0);
+    atomic_store(&b->interval, interval);
+}
+
+int token_bucket_take(token_bucket_t *b, uint64_t now) {
+    uint64_t interval =
+        atomic_load_explicit(&b->interval, memory_order_relaxed);
+    if (interval == 0) {
+        return TRUE;
+    }
+    uint64_t tolerance =
+        atomic_load_explicit(&b->tolerance, memory_order_relaxed);
+    uint64_t tat = atomic_load_explicit(&b->tat, memory_order_relaxed);
+    while (TRUE) {
+        // a call is early if the bucket would need more than burst tokens
+        uint64_t start = tat > now ? tat : now;
+        if (start - now > tolerance) {
+            atomic_fetch_add_explicit(&b->limited, 1, memory_order_relaxed);
+            return FALSE;
+        }
+        if (atomic_compare_exchange_weak_explicit(&b->tat, &tat,
+                                                  start + interval,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            return TRUE;
+        }
+    }
+}
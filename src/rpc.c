@@ -11,17 +11,32 @@
 ============================================================================= */
 #define _POSIX_C_SOURCE 200112L
 #include "rpc.h"
+#include "capture.h"
+#include "clock.h"
 #include "config.h"
+#include "coroutine.h"
 #include "hashtable.h"
+#include "idtable.h"
+#include "limiter.h"
 #include "linkedlist.h"
+#include "mux.h"
 #include "protocol.h"
+#include "ratelimit.h"
+#include "scheduler.h"
+#include "slowlog.h"
 #include "sockets.h"
+#include "spin.h"
+#include "trace.h"
 #include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/net_tstamp.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 /* signal handling ========================================================== */
@@ -36,10 +51,29 @@ static void sig_handler(int _) {
 }
 
 /* helper function declarations ============================================= */
+
+/*
+ * The token bucket shared by the connections from a client address. The
+ * counts are under the server's peers_lock.
+ */
 typedef struct {
+    token_bucket_t bucket;
+    // set by rpc_server_set_client_rate for the address, so never dropped
+    int configured;
+    int connections;
+} client_bucket_t;
+
+typedef struct {
+    rpc_server *srv;
     int sockfd;
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     socklen_t addr_size;
+    char host[INET6_ADDRSTRLEN];
+    mux_t *mux;
+    flow_t *flow;
+    client_bucket_t *bucket;
+    int refs;
+    pthread_mutex_t lock;
 } rpc_client_state;
 
 typedef struct {
@@ -47,6 +81,52 @@ typedef struct {
     rpc_client_state *cl;
 } handle_all_requests_args;
 
+/*
+ * A registered handler, its bulkhead and its counters.
+ */
+typedef struct {
+    rpc_handler handler;
+    rpc_handler_opts opts;
+    int running;
+    list_t *waiting;
+    unsigned long calls;
+    unsigned long rejected;
+    unsigned long queued;
+    token_bucket_t bucket;
+    pthread_mutex_t lock;
+} handler_entry_t;
+
+/*
+ * States of a call running as a coroutine. A call yields while RUNNING and
+ * its worker then parks it, unless the reply it waits for has already
+ * woken it.
+ */
+enum { CALL_RUNNING, CALL_PARKED, CALL_WOKEN };
+
+/*
+ * A call running as a coroutine, so that it can be suspended while it
+ * waits for a nested call.
+ */
+typedef struct {
+    rpc_server *srv;
+    handler_entry_t *entry;
+    job_t *job;
+    coroutine_t *co;
+    job_t resume;
+    int state;
+    pthread_mutex_t lock;
+} coroutine_call_t;
+
+/*
+ * The coroutine call running on this thread, if any.
+ */
+static __thread coroutine_call_t *current_call = NULL;
+
+/*
+ * Whether clients created from now on connect with TCP Fast Open.
+ */
+static _Atomic int client_fast_open = FALSE;
+
 /*
  * Handle all requests from the client in a separate thread.
  *
@@ -66,12 +146,167 @@ void *handle_all_requests_thread(void *arg);
 void handle_all_requests(rpc_server *srv, rpc_client_state *cl);
 
 /*
- * Handle a request from the client.
+ * Run calls from the scheduler's queues until the server shuts down.
+ *
+ * @param arg The server state.
+ * @return NULL on success.
+ * @note This function is called by pthread_create.
+ */
+void *worker_thread(void *arg);
+
+/*
+ * Run a call taken from the scheduler, unless its handler's bulkhead is
+ * full, in which case it waits in the handler's queue or is rejected. A
+ * worker that finishes a call goes on to the calls waiting for the same
+ * handler.
+ *
+ * @param srv The server state.
+ * @param job The call.
+ */
+void run_job(rpc_server *srv, job_t *job);
+
+/*
+ * Run calls of a handler that holds a bulkhead slot, starting with job and
+ * going on to the calls waiting for the same handler, until none are left
+ * or one is suspended.
  *
  * @param srv The server state.
+ * @param entry The handler.
+ * @param job The first call.
+ */
+void run_calls(rpc_server *srv, handler_entry_t *entry, job_t *job);
+
+/*
+ * Take the next call waiting for a handler's bulkhead slot, or give the
+ * slot up if there is none.
+ *
+ * @param entry The handler.
+ * @return The call, or NULL.
+ */
+job_t *next_call(handler_entry_t *entry);
+
+/*
+ * Start a call, as a coroutine if its handler asks for one.
+ *
+ * @param srv The server state.
+ * @param entry The handler.
+ * @param job The call.
+ * @return TRUE if the call has finished, FALSE if it was suspended.
+ */
+int start_call(rpc_server *srv, handler_entry_t *entry, job_t *job);
+
+/*
+ * Run a coroutine call until it finishes or parks waiting for a reply.
+ *
+ * @param call The call.
+ * @return TRUE if the call has finished and been freed, FALSE if it was
+ * suspended.
+ */
+int resume_call(coroutine_call_t *call);
+
+/*
+ * Body of a coroutine call.
+ */
+void coroutine_call_main(void *arg);
+
+/*
+ * Wake a coroutine call once the reply it waits for has arrived.
+ */
+void wake_call(void *arg);
+
+/*
+ * Run a call, reply and free it.
+ *
+ * @param srv The server state.
+ * @param job The call.
+ */
+void finish_job(rpc_server *srv, job_t *job);
+
+/*
+ * Free a handler entry.
+ */
+void handler_entry_free(void *data);
+
+/*
+ * Queue a call for the workers, rejecting whichever call is shed.
+ *
+ * @param srv The server state.
+ * @param cl The client state.
+ * @param msg The call.
+ */
+void schedule_request(rpc_server *srv, rpc_client_state *cl,
+                      rpc_message *msg);
+
+/*
+ * Reply with a failure to a call that will not be run, and free it.
+ *
+ * @param job The call.
+ */
+void reject_request(job_t *job);
+
+/*
+ * Drop a reference to a client's connection. The last one sends any
+ * queued replies, closes the connection, and takes the client off the
+ * server's list and frees it.
+ *
  * @param cl The client state.
  */
-void handle_request(rpc_server *srv, rpc_client_state *cl);
+void client_state_release(rpc_client_state *cl);
+
+/*
+ * Handle a request from the client and queue the reply.
+ *
+ * @param srv The server state.
+ * @param cl The client state.
+ * @param msg The request, which is freed.
+ */
+void handle_request(rpc_server *srv, rpc_client_state *cl, rpc_message *msg);
+
+/*
+ * Count where a call spent its time, for rpc_server_latency_stats.
+ *
+ * @param srv The server state.
+ * @param receive_usec Time in the kernel's receive buffer.
+ * @param queue_usec Time waiting for a worker.
+ * @param handler_usec Time in the handler.
+ */
+void record_call(rpc_server *srv, unsigned long receive_usec,
+                 unsigned long queue_usec, unsigned long handler_usec);
+
+/*
+ * Count the send time of a reply, passed to mux_set_timestamping.
+ *
+ * @param arg The server state.
+ * @param usec From the reply being queued until the kernel sent it.
+ */
+void record_send(void *arg, unsigned long usec);
+
+/*
+ * Hand a call to the slow call log if it took too long and is sampled.
+ *
+ * @param srv The server state.
+ * @param cl The client state.
+ * @param msg The request.
+ * @param reply The reply, or NULL if there is none.
+ * @param queue_usec Time waiting for a worker.
+ * @param handler_usec Time in the handler.
+ */
+void log_slow_call(rpc_server *srv, rpc_client_state *cl, rpc_message *msg,
+                   rpc_message *reply, unsigned long queue_usec,
+                   unsigned long handler_usec);
+
+/*
+ * Record the server span of a traced call.
+ *
+ * @param msg The request.
+ * @param reply The reply, or NULL if there is none.
+ * @param span_id The id of the span the handler ran under.
+ * @param queue_usec Time waiting for a worker.
+ * @param handler_usec Time in the handler.
+ */
+void record_server_span(rpc_message *msg, rpc_message *reply,
+                        uint64_t span_id, unsigned long queue_usec,
+                        unsigned long handler_usec);
 
 /*
  * Handle a find request from the client.
@@ -87,10 +322,21 @@ rpc_message *handle_find_request(rpc_server *srv, rpc_message *msg);
  *
  * @param srv The server state.
  * @param msg The message from the client.
+ * @param free_data Set to the function that frees the data of the
+ * response, which is the handler's if it came from the handler.
  * @return The response to the client. If the call fails, the operation
  * field of the response will be set to REPLY_FAILURE.
  */
-rpc_message *handle_call_request(rpc_server *srv, rpc_message *msg);
+rpc_message *handle_call_request(rpc_server *srv, rpc_message *msg,
+                                 void (**free_data)(rpc_data *));
+
+/*
+ * Free what a handler returned with libc, for handlers registered without
+ * free_result.
+ *
+ * @param data The handler's result.
+ */
+void free_handler_result(rpc_data *data);
 
 /*
  * Shuts down the server and frees the server state.
@@ -106,6 +352,76 @@ void rpc_shutdown_server(rpc_server *srv);
  */
 void debug_print_client_info(rpc_client_state *cl);
 
+/*
+ * Get a client address as a string, with IPv4 clients of a dual-stack
+ * socket given in dotted form.
+ *
+ * @param addr The client address.
+ * @param host Filled in with the address, or an empty string if the
+ * address family is unknown.
+ */
+void peer_host(struct sockaddr_storage *addr, char host[INET6_ADDRSTRLEN]);
+
+/*
+ * Get the port of a client address.
+ *
+ * @param addr The client address.
+ * @return The port, or 0 if the address family is unknown.
+ */
+int peer_port(struct sockaddr_storage *addr);
+
+/*
+ * Read the TCP_INFO of every connection still open.
+ *
+ * @param srv The server state.
+ */
+void sample_connections(rpc_server *srv);
+
+/*
+ * Look up the scheduling weight of a client address.
+ *
+ * @param srv The server state.
+ * @param host The client address.
+ * @return The weight set with rpc_server_set_client_weight, or
+ * CLIENT_WEIGHT_DEFAULT.
+ */
+int client_weight(rpc_server *srv, char *host);
+
+/*
+ * Find the token bucket shared by the connections from a client address,
+ * creating it from the default limit if the address has none, and count
+ * a new connection using it. Once there are MAX_CLIENT_BUCKETS, buckets
+ * are swept first.
+ *
+ * @param srv The server state.
+ * @param host The client address.
+ * @return The bucket, or NULL if calls from the address are not limited.
+ */
+client_bucket_t *client_bucket(rpc_server *srv, char *host);
+
+/*
+ * Can a bucket be dropped? Only one made from the default limit, with no
+ * connections, that has refilled, which is no different from a new one.
+ *
+ * @param data The client_bucket_t.
+ * @param arg The current time of the monotonic clock in nanoseconds.
+ * @return TRUE if the bucket can be dropped.
+ */
+int client_bucket_idle(void *data, void *arg);
+
+/*
+ * Admission callback of a connection's mux. Turns away calls over the
+ * rate limit of their client or their handler, with a failure reply,
+ * before their payload is read.
+ */
+int admit_call(void *arg, uint64_t request_id, int operation,
+               const char *function_name);
+
+/*
+ * Cancel callback of a connection's mux. Drops a call the client has given
+ * up on if it is still waiting for a worker. No reply is sent.
+ */
+void cancel_call(void *arg, uint64_t request_id);
 /*
  * Create a new RPC handle.
  *
@@ -114,6 +430,191 @@ void debug_print_client_info(rpc_client_state *cl);
  */
 rpc_handle *new_rpc_handle(const char *name);
 
+/*
+ * Requests, possibly on different clients, whose replies one caller is
+ * waiting for.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int successes;
+    // called with each reply, for waiters that do not sleep on cond
+    void (*wake)(void *arg);
+    void *wake_arg;
+    // set when the deadline of a gather_timer_t passes
+    int expired;
+} gather_t;
+
+/*
+ * Wakes a gather whose waiter does not sleep on cond once a deadline
+ * passes, since nothing else does while no replies come.
+ */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct timespec deadline;
+    int stopped;
+    gather_t *g;
+} gather_timer_t;
+
+/*
+ * A request waiting for its reply.
+ */
+typedef struct {
+    // in the client's pending table under its request id
+    id_entry_t entry;
+    int done;
+    rpc_message *reply;
+    gather_t *g;
+    // the client span of a traced call, with span_id 0 for untraced ones
+    uint64_t trace_id;
+    uint64_t parent_id;
+    uint64_t span_id;
+    uint64_t start_usec;
+    uint64_t end_usec;
+    // holds a slot of its client's limiter, and when its reply came on the
+    // monotonic clock
+    int limited;
+    uint64_t done_usec;
+} waiter_t;
+
+/*
+ * Initialise a gather, whose condition variable uses the monotonic clock.
+ */
+void gather_init(gather_t *g);
+
+/*
+ * Destroy a gather once no reader can reach its waiters.
+ */
+void gather_destroy(gather_t *g);
+
+/*
+ * Start a thread that sets expired on a gather and wakes it at a
+ * deadline, unless the timer is stopped first.
+ *
+ * @param t The timer.
+ * @param g The gather, whose wake must be set.
+ * @param deadline When to wake the gather, on the monotonic clock.
+ * @return 0 on success, FAILED if the thread could not be started.
+ */
+int gather_timer_start(gather_timer_t *t, gather_t *g,
+                       const struct timespec *deadline);
+
+/*
+ * Stop a timer and wait for its thread, after which it no longer touches
+ * the gather.
+ *
+ * @param t The timer.
+ */
+void gather_timer_stop(gather_timer_t *t);
+
+/*
+ * Wait for the deadline of a gather_timer_t.
+ *
+ * @param arg The timer.
+ * @return NULL once the deadline has passed or the timer is stopped.
+ */
+void *gather_timer_thread(void *arg);
+
+/*
+ * Send a request and register a waiter for its reply.
+ *
+ * @param cl The client to send the request through.
+ * @param w The waiter, whose g must be set.
+ * @param operation FIND or CALL.
+ * @param name The function name.
+ * @param payload The data to send.
+ * @param priority The priority class of the request.
+ * @return 0 if the request was sent, FAILED otherwise.
+ */
+int submit_request(rpc_client *cl, waiter_t *w, int operation, char *name,
+                   rpc_data *payload, rpc_priority priority);
+
+/*
+ * Stop waiting for a reply. Once this returns the reader thread no longer
+ * touches the waiter, and a reply that arrives later is discarded. The
+ * server is told, so that it can drop the request if it has not started
+ * it.
+ *
+ * @param cl The client the request was sent through.
+ * @param w The waiter.
+ */
+void cancel_request(rpc_client *cl, waiter_t *w);
+
+/*
+ * Send a request and wait for its reply.
+ *
+ * @param cl The client to send the request through.
+ * @param operation FIND or CALL.
+ * @param name The function name.
+ * @param payload The data to send.
+ * @param priority The priority class of the request.
+ * @return The reply, or NULL if the connection failed.
+ */
+rpc_message *request(rpc_client *cl, int operation, char *name,
+                     rpc_data *payload, rpc_priority priority);
+
+/*
+ * Handle a request on the caller's thread, for a client attached to a
+ * server in the same process. Nothing is encoded and the handler is given
+ * the caller's payload.
+ *
+ * @param srv The server.
+ * @param operation FIND or CALL.
+ * @param name The function name.
+ * @param payload The data to send.
+ * @return The reply.
+ */
+rpc_message *local_request(rpc_server *srv, int operation, char *name,
+                           rpc_data *payload);
+
+/*
+ * Hand a reply to its waiter. The client must be locked, unless it is
+ * local.
+ *
+ * @param w The waiter.
+ * @param reply The reply, or NULL if the request failed.
+ */
+void deliver(waiter_t *w, rpc_message *reply);
+
+/*
+ * Record the client span of a traced call once its waiter is finished
+ * with, whether or not it got a reply.
+ *
+ * @param w The waiter.
+ * @param name The function name.
+ */
+void record_client_span(waiter_t *w, const char *name);
+
+/*
+ * Read replies from the server and hand them to their waiters.
+ *
+ * @param arg The client.
+ * @return NULL once the connection has closed.
+ */
+void *client_reader_thread(void *arg);
+
+/*
+ * Fail a waiter whose connection has gone, for idtable_clear.
+ */
+void fail_waiter(void *arg);
+
+/*
+ * Has a waiter had its reply? Checked without the lock while spinning.
+ */
+int waiter_done(void *arg);
+
+/*
+ * Should a call with this reply count as dropped by a limiter? Only a
+ * successful reply says how long the server took to run the call.
+ *
+ * @param reply The reply, or NULL if the call got none.
+ * @return TRUE if the call failed or was turned away, FALSE otherwise.
+ */
+int reply_dropped(rpc_message *reply);
+
 /*
  * Is the RPC handle malformed?
  *
@@ -129,13 +630,33 @@ struct rpc_server {
     hashtable_t *handlers;
     list_t *clients;
     list_t *threads;
+    scheduler_t *scheduler;
+    pthread_t workers[SERVER_WORKERS];
+    hashtable_t *weights;
+    hashtable_t *buckets;
+    // how many buckets there are, and how many trigger the next sweep
+    int bucket_count;
+    int bucket_sweep_at;
+    double client_rate;
+    int client_burst;
+    int busy_poll_usec;
+    size_t zerocopy_threshold;
+    int timing;
+    int timestamping;
+    rpc_latency_stats latency;
+    pthread_mutex_t latency_lock;
+    slow_log_t *slow_log;
+    rpc_slow_log_opts slow_opts;
+    uint64_t tcp_info_usec;
+    capture_t *capture;
+    pthread_mutex_t peers_lock;
 };
 
 rpc_server *rpc_init_server(int port) {
 
     // allocate memory for the server state
     rpc_server *srv;
-    srv = (rpc_server *)malloc(sizeof(*srv));
+    srv = (rpc_server *)rpc_malloc(sizeof(*srv));
     if (srv == NULL) {
         debug_print("%s", "malloc failed\n");
         return NULL;
@@ -155,11 +676,33 @@ rpc_server *rpc_init_server(int port) {
     srv->handlers = hashtable_create(HASHTABLE_SIZE);
     srv->clients = create_empty_list();
     srv->threads = create_empty_list();
+    srv->scheduler = scheduler_create(SERVER_MAX_QUEUE);
+    srv->weights = hashtable_create(HASHTABLE_SIZE);
+    srv->buckets = hashtable_create(HASHTABLE_SIZE);
+    srv->bucket_count = 0;
+    srv->bucket_sweep_at = MAX_CLIENT_BUCKETS;
+    srv->client_rate = 0;
+    srv->client_burst = 0;
+    srv->busy_poll_usec = 0;
+    srv->zerocopy_threshold = 0;
+    srv->timing = FALSE;
+    srv->timestamping = FALSE;
+    memset(&srv->latency, 0, sizeof(srv->latency));
+    pthread_mutex_init(&srv->latency_lock, NULL);
+    srv->slow_log = NULL;
+    srv->tcp_info_usec = monotonic_usec();
+    srv->capture = NULL;
+    pthread_mutex_init(&srv->peers_lock, NULL);
 
     return srv;
 }
 
 int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
+    return rpc_register_ex(srv, name, handler, NULL);
+}
+
+int rpc_register_ex(rpc_server *srv, char *name, rpc_handler handler,
+                    rpc_handler_opts *opts) {
     // check if any of the parameters are NULL
     if (srv == NULL || name == NULL || handler == NULL) {
         return FAILED;
@@ -170,14 +713,39 @@ int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
     if (len > MAX_NAME_LENGTH || len == 0) {
         return FAILED;
     }
+    rpc_handler_opts none = {0};
+    if (opts == NULL) {
+        opts = &none;
+    }
+    if (opts->max_concurrency < 0 || opts->max_queue < 0 || opts->rate < 0 ||
+        opts->burst < 0) {
+        return FAILED;
+    }
 
-    // if the handler already exists, remove it
-    if (hashtable_lookup(srv->handlers, name) != NULL) {
-        hashtable_remove(srv->handlers, name, NULL);
+    // if the handler already exists, update it in place since workers may
+    // be using it
+    handler_entry_t *entry = hashtable_lookup(srv->handlers, name);
+    if (entry != NULL) {
+        pthread_mutex_lock(&entry->lock);
+        entry->handler = handler;
+        entry->opts = *opts;
+        pthread_mutex_unlock(&entry->lock);
+        token_bucket_init(&entry->bucket, opts->rate, opts->burst);
+        debug_print("Replaced \"%s\" function handler\n", name);
+        return EXIT_SUCCESS;
     }
 
     // add handler to a hashtable
-    hashtable_insert(srv->handlers, name, handler);
+    entry = (handler_entry_t *)rpc_malloc(sizeof(*entry));
+    assert(entry);
+    entry->handler = handler;
+    entry->opts = *opts;
+    entry->running = 0;
+    entry->waiting = create_empty_list();
+    entry->calls = entry->rejected = entry->queued = 0;
+    token_bucket_init(&entry->bucket, opts->rate, opts->burst);
+    pthread_mutex_init(&entry->lock, NULL);
+    hashtable_insert(srv->handlers, name, entry);
 
     // check if the handler was successfully added
     if (hashtable_lookup(srv->handlers, name) == NULL) {
@@ -189,6 +757,222 @@ int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
     return EXIT_SUCCESS;
 }
 
+int rpc_server_handler_stats(rpc_server *srv, char *name,
+                             rpc_handler_stats *stats) {
+    if (srv == NULL || name == NULL || stats == NULL) {
+        return FAILED;
+    }
+    handler_entry_t *entry = hashtable_lookup(srv->handlers, name);
+    if (entry == NULL) {
+        return FAILED;
+    }
+    pthread_mutex_lock(&entry->lock);
+    stats->calls = entry->calls;
+    stats->rejected = entry->rejected;
+    stats->queued = entry->queued;
+    stats->limited = atomic_load(&entry->bucket.limited);
+    stats->running = entry->running;
+    stats->waiting = list_len(entry->waiting);
+    pthread_mutex_unlock(&entry->lock);
+    return EXIT_SUCCESS;
+}
+
+int rpc_server_set_client_weight(rpc_server *srv, char *addr, int weight) {
+    if (srv == NULL || addr == NULL || weight < 1 ||
+        strlen(addr) >= INET6_ADDRSTRLEN) {
+        return FAILED;
+    }
+    pthread_mutex_lock(&srv->peers_lock);
+    int *w = hashtable_lookup(srv->weights, addr);
+    if (w == NULL) {
+        w = (int *)rpc_malloc(sizeof(*w));
+        assert(w);
+        hashtable_insert(srv->weights, addr, w);
+    }
+    *w = weight;
+    pthread_mutex_unlock(&srv->peers_lock);
+    return EXIT_SUCCESS;
+}
+
+int rpc_server_set_client_rate(rpc_server *srv, char *addr, double rate,
+                               int burst) {
+    if (srv == NULL || rate < 0 || burst < 0 ||
+        (addr != NULL && strlen(addr) >= INET6_ADDRSTRLEN)) {
+        return FAILED;
+    }
+    pthread_mutex_lock(&srv->peers_lock);
+    if (addr == NULL) {
+        srv->client_rate = rate;
+        srv->client_burst = burst;
+    } else {
+        client_bucket_t *b = hashtable_lookup(srv->buckets, addr);
+        if (b == NULL) {
+            b = (client_bucket_t *)rpc_malloc(sizeof(*b));
+            assert(b);
+            b->connections = 0;
+            hashtable_insert(srv->buckets, addr, b);
+            srv->bucket_count++;
+        }
+        b->configured = TRUE;
+        token_bucket_init(&b->bucket, rate, burst);
+    }
+    pthread_mutex_unlock(&srv->peers_lock);
+    return EXIT_SUCCESS;
+}
+
+int rpc_server_set_busy_poll(rpc_server *srv, int usec) {
+    if (srv == NULL || usec < 0) {
+        return FAILED;
+    }
+    srv->busy_poll_usec = usec;
+    scheduler_set_busy_poll(srv->scheduler, usec);
+    return EXIT_SUCCESS;
+}
+
+int rpc_server_set_fast_open(rpc_server *srv, int enabled) {
+    if (srv == NULL) {
+        return FAILED;
+    }
+    return set_fast_open(srv->sockfd, enabled) == FAILED ? FAILED
+                                                          : EXIT_SUCCESS;
+}
+
+int rpc_server_set_timing(rpc_server *srv, int enabled) {
+    if (srv == NULL) {
+        return FAILED;
+    }
+    srv->timing = enabled ? TRUE : FALSE;
+    return EXIT_SUCCESS;
+}
+
+int rpc_server_set_timestamping(rpc_server *srv, int enabled) {
+    if (srv == NULL) {
+        return FAILED;
+    }
+
+    // find out from the listening socket whether the kernel supports it,
+    // while connections get their own flags in mux_set_timestamping
+    int flags = enabled ? SOF_TIMESTAMPING_RX_SOFTWARE |
+                              SOF_TIMESTAMPING_SOFTWARE
+                        : 0;
+    if (setsockopt(srv->sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                   sizeof(flags)) < 0) {
+        debug_print("%s", "SO_TIMESTAMPING not supported\n");
+        return FAILED;
+    }
+    srv->timestamping = enabled ? TRUE : FALSE;
+    return EXIT_SUCCESS;
+}
+
+int rpc_server_set_capture(rpc_server *srv, const char *path) {
+    if (srv == NULL || path == NULL) {
+        return FAILED;
+    }
+    capture_close(srv->capture);
+    if ((srv->capture = capture_open(path)) == NULL) {
+        return FAILED;
+    }
+    return EXIT_SUCCESS;
+}
+
+int rpc_server_transport_stats(rpc_server *srv, rpc_transport_stats *stats,
+                               rpc_connection_info *worst, int n) {
+    if (srv == NULL || stats == NULL) {
+        return FAILED;
+    }
+    memset(stats, 0, sizeof(*stats));
+    unsigned long long rtt_sum = 0, cwnd_sum = 0;
+    int found = 0;
+    pthread_mutex_lock(&srv->peers_lock);
+    for (node_t *curr = srv->clients->head; curr; curr = curr->next) {
+        rpc_client_state *cl = (rpc_client_state *)curr->data;
+        rpc_connection_info info;
+        if (mux_get_tcp_info(cl->mux, &info) == FAILED) {
+            continue;
+        }
+        strcpy(info.host, cl->host);
+        info.port = peer_port(&cl->addr);
+
+        stats->connections++;
+        rtt_sum += info.rtt_usec;
+        cwnd_sum += info.cwnd;
+        stats->retransmits += info.retransmits;
+        stats->unacked += info.unacked;
+        if (info.rtt_usec > stats->max_rtt_usec) {
+            stats->max_rtt_usec = info.rtt_usec;
+        }
+        if (stats->connections == 1 || info.cwnd < stats->min_cwnd) {
+            stats->min_cwnd = info.cwnd;
+        }
+
+        // keep the longest round trips, sorted, by insertion
+        if (worst == NULL || n <= 0) {
+            continue;
+        }
+        int i = found < n ? found++ : n;
+        for (; i > 0 && worst[i - 1].rtt_usec < info.rtt_usec; i--) {
+            if (i < n) {
+                worst[i] = worst[i - 1];
+            }
+        }
+        if (i < n) {
+            worst[i] = info;
+        }
+    }
+    pthread_mutex_unlock(&srv->peers_lock);
+    if (stats->connections > 0) {
+        stats->mean_rtt_usec = rtt_sum / stats->connections;
+        stats->mean_cwnd = cwnd_sum / stats->connections;
+    }
+    return found;
+}
+
+int rpc_server_set_slow_log(rpc_server *srv, const char *path,
+                            const rpc_slow_log_opts *opts) {
+    if (srv == NULL || (path != NULL && opts == NULL)) {
+        return FAILED;
+    }
+    slow_log_close(srv->slow_log);
+    srv->slow_log = NULL;
+    if (path == NULL) {
+        return EXIT_SUCCESS;
+    }
+    if ((srv->slow_log = slow_log_open(path, opts->sample)) == NULL) {
+        return FAILED;
+    }
+    srv->slow_opts = *opts;
+    if (srv->slow_opts.data_bytes > SLOW_LOG_MAX_DATA) {
+        srv->slow_opts.data_bytes = SLOW_LOG_MAX_DATA;
+    }
+    return EXIT_SUCCESS;
+}
+
+int rpc_server_latency_stats(rpc_server *srv, rpc_latency_stats *stats) {
+    if (srv == NULL || stats == NULL) {
+        return FAILED;
+    }
+    pthread_mutex_lock(&srv->latency_lock);
+    *stats = srv->latency;
+    pthread_mutex_unlock(&srv->latency_lock);
+    return EXIT_SUCCESS;
+}
+
+int rpc_server_set_zerocopy(rpc_server *srv, size_t threshold) {
+    if (srv == NULL) {
+        return FAILED;
+    }
+
+    // find out from the listening socket whether the kernel supports it
+    int on = threshold > 0;
+    if (setsockopt(srv->sockfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) <
+        0) {
+        debug_print("%s", "SO_ZEROCOPY not supported\n");
+        return FAILED;
+    }
+    srv->zerocopy_threshold = threshold;
+    return EXIT_SUCCESS;
+}
+
 void rpc_serve_all(rpc_server *srv) {
 
     // check if the server is NULL
@@ -200,8 +984,21 @@ void rpc_serve_all(rpc_server *srv) {
     struct sigaction act = {.sa_handler = sig_handler};
     sigaction(SIGINT, &act, NULL);
 
+    // calls are run by a fixed pool of workers
+    for (int i = 0; i < SERVER_WORKERS; i++) {
+        pthread_create(&srv->workers[i], NULL, worker_thread, srv);
+    }
+
     // keep running until SIGINT is received
     while (keep_running) {
+        // the accept below times out often enough to keep the readings of
+        // TCP_INFO about as fresh as TCP_INFO_INTERVAL_USEC
+        uint64_t now = monotonic_usec();
+        if (now - srv->tcp_info_usec >= TCP_INFO_INTERVAL_USEC) {
+            sample_connections(srv);
+            srv->tcp_info_usec = now;
+        }
+
         // listen on socket, incoming connection requests will be queued
         if (listen(srv->sockfd, BACKLOG) < 0) {
             debug_print("%s", "Listen failed. Stopping server...\n");
@@ -209,7 +1006,7 @@ void rpc_serve_all(rpc_server *srv) {
         }
 
         // accept a connection non-blocking using select
-        struct sockaddr_in cl_addr;
+        struct sockaddr_storage cl_addr;
         socklen_t cl_addr_size = sizeof(cl_addr);
         int cl_sockfd;
         cl_sockfd = non_blocking_accept(srv->sockfd, &cl_addr, &cl_addr_size);
@@ -218,14 +1015,41 @@ void rpc_serve_all(rpc_server *srv) {
         }
 
         // store client information
-        rpc_client_state *cl = (rpc_client_state *)malloc(sizeof(*cl));
+        rpc_client_state *cl = (rpc_client_state *)rpc_malloc(sizeof(*cl));
         assert(cl);
+        cl->srv = srv;
         cl->sockfd = cl_sockfd;
         cl->addr = cl_addr;
         cl->addr_size = cl_addr_size;
+        if ((cl->mux = mux_create(cl_sockfd)) == NULL) {
+            close(cl_sockfd);
+            free_and_null(cl);
+            continue;
+        }
+        peer_host(&cl->addr, cl->host);
+        cl->flow = flow_create(client_weight(srv, cl->host));
+        cl->bucket = client_bucket(srv, cl->host);
+        mux_set_admit(cl->mux, admit_call, cl);
+        mux_set_cancel(cl->mux, cancel_call, cl);
+        if (srv->busy_poll_usec > 0) {
+            mux_set_busy_poll(cl->mux, srv->busy_poll_usec);
+        }
+        if (srv->zerocopy_threshold > 0) {
+            mux_set_zerocopy(cl->mux, srv->zerocopy_threshold);
+        }
+        if (srv->timestamping) {
+            mux_set_timestamping(cl->mux, record_send, srv);
+        }
+        if (srv->capture != NULL) {
+            mux_set_capture(cl->mux, srv->capture);
+        }
+        cl->refs = 1;
+        pthread_mutex_init(&cl->lock, NULL);
 
         // add to list of clients
+        pthread_mutex_lock(&srv->peers_lock);
         append(srv->clients, cl);
+        pthread_mutex_unlock(&srv->peers_lock);
 
         // print the client connection information
         debug_print("%s",
@@ -233,10 +1057,10 @@ void rpc_serve_all(rpc_server *srv) {
         debug_print_client_info(cl);
 
         // handle requests from the client in a new thread
-        pthread_t *thread = (pthread_t *)malloc(sizeof(*thread));
+        pthread_t *thread = (pthread_t *)rpc_malloc(sizeof(*thread));
         append(srv->threads, thread);
         handle_all_requests_args *args =
-            (handle_all_requests_args *)malloc(sizeof(*args));
+            (handle_all_requests_args *)rpc_malloc(sizeof(*args));
         assert(args);
         args->srv = srv;
         args->cl = cl;
@@ -284,6 +1108,147 @@ void debug_print_client_info(rpc_client_state *cl) {
     }
 }
 
+void peer_host(struct sockaddr_storage *addr, char host[INET6_ADDRSTRLEN]) {
+    host[0] = '\0';
+    if (addr->ss_family == AF_INET) {
+        struct sockaddr_in *s = (struct sockaddr_in *)addr;
+        inet_ntop(AF_INET, &s->sin_addr, host, INET6_ADDRSTRLEN);
+    } else if (addr->ss_family == AF_INET6) {
+        struct sockaddr_in6 *s = (struct sockaddr_in6 *)addr;
+        if (IN6_IS_ADDR_V4MAPPED(&s->sin6_addr)) {
+            inet_ntop(AF_INET, &s->sin6_addr.s6_addr[12], host,
+                      INET6_ADDRSTRLEN);
+        } else {
+            inet_ntop(AF_INET6, &s->sin6_addr, host, INET6_ADDRSTRLEN);
+        }
+    }
+}
+
+int peer_port(struct sockaddr_storage *addr) {
+    if (addr->ss_family == AF_INET) {
+        return ntohs(((struct sockaddr_in *)addr)->sin_port);
+    } else if (addr->ss_family == AF_INET6) {
+        return ntohs(((struct sockaddr_in6 *)addr)->sin6_port);
+    }
+    return 0;
+}
+
+void sample_connections(rpc_server *srv) {
+    // hold a reference to each connection so that it outlives the reading
+    // even if the client disconnects meanwhile. The last reference takes
+    // the list's lock, so they are dropped after letting go of it
+    list_t *open = create_empty_list();
+    pthread_mutex_lock(&srv->peers_lock);
+    for (node_t *curr = srv->clients->head; curr; curr = curr->next) {
+        rpc_client_state *cl = (rpc_client_state *)curr->data;
+
+        // one whose last reference has gone is about to be taken off
+        pthread_mutex_lock(&cl->lock);
+        int alive = cl->refs > 0;
+        if (alive) {
+            cl->refs++;
+        }
+        pthread_mutex_unlock(&cl->lock);
+        if (alive) {
+            append(open, cl);
+        }
+    }
+    pthread_mutex_unlock(&srv->peers_lock);
+
+    rpc_client_state *cl;
+    while ((cl = (rpc_client_state *)pop(open)) != NULL) {
+        mux_sample_tcp_info(cl->mux, TRUE);
+        client_state_release(cl);
+    }
+    free_list(open, NULL);
+}
+
+int client_weight(rpc_server *srv, char *host) {
+    int weight = CLIENT_WEIGHT_DEFAULT;
+    pthread_mutex_lock(&srv->peers_lock);
+    int *w = hashtable_lookup(srv->weights, host);
+    if (w != NULL) {
+        weight = *w;
+    }
+    pthread_mutex_unlock(&srv->peers_lock);
+    return weight;
+}
+
+client_bucket_t *client_bucket(rpc_server *srv, char *host) {
+    pthread_mutex_lock(&srv->peers_lock);
+    client_bucket_t *b = hashtable_lookup(srv->buckets, host);
+    if (b == NULL && srv->client_rate > 0) {
+        // addresses come and go, so drop the buckets nobody would miss
+        // before adding another. Sweeping again only once the table has
+        // doubled keeps this cheap when most buckets are in use
+        if (srv->bucket_count >= srv->bucket_sweep_at) {
+            uint64_t now = monotonic_nsec();
+            srv->bucket_count -= hashtable_remove_if(
+                srv->buckets, client_bucket_idle, &now, rpc_free);
+            srv->bucket_sweep_at = 2 * srv->bucket_count > MAX_CLIENT_BUCKETS
+                                       ? 2 * srv->bucket_count
+                                       : MAX_CLIENT_BUCKETS;
+            debug_print("Swept client buckets, %d left\n", srv->bucket_count);
+        }
+        b = (client_bucket_t *)rpc_malloc(sizeof(*b));
+        assert(b);
+        token_bucket_init(&b->bucket, srv->client_rate, srv->client_burst);
+        b->configured = FALSE;
+        b->connections = 0;
+        hashtable_insert(srv->buckets, host, b);
+        srv->bucket_count++;
+    }
+    if (b != NULL) {
+        b->connections++;
+    }
+    pthread_mutex_unlock(&srv->peers_lock);
+    return b;
+}
+
+int client_bucket_idle(void *data, void *arg) {
+    client_bucket_t *b = (client_bucket_t *)data;
+    uint64_t now = *(uint64_t *)arg;
+    return !b->configured && b->connections == 0 &&
+           atomic_load(&b->bucket.tat) + atomic_load(&b->bucket.tolerance) <
+               now;
+}
+
+int admit_call(void *arg, uint64_t request_id, int operation,
+               const char *function_name) {
+    rpc_client_state *cl = (rpc_client_state *)arg;
+    if (operation != CALL) {
+        return TRUE;
+    }
+    uint64_t now = monotonic_nsec();
+    handler_entry_t *entry =
+        hashtable_lookup(cl->srv->handlers, (char *)function_name);
+    token_bucket_t *bucket = cl->bucket ? &cl->bucket->bucket : NULL;
+    if ((bucket == NULL || token_bucket_take(bucket, now)) &&
+        (entry == NULL || token_bucket_take(&entry->bucket, now))) {
+        return TRUE;
+    }
+
+    debug_print("Rate limited call %" PRIu64 " to \"%s\"\n", request_id,
+                function_name);
+    rpc_message *overloaded = create_overloaded_message();
+    overloaded->request_id = request_id;
+    mux_send(cl->mux, overloaded);
+    rpc_message_free(overloaded, rpc_data_free);
+    return FALSE;
+}
+
+void cancel_call(void *arg, uint64_t request_id) {
+    rpc_client_state *cl = (rpc_client_state *)arg;
+    job_t *job = scheduler_cancel(cl->srv->scheduler, cl->flow, request_id);
+    if (job == NULL) {
+        return;
+    }
+    debug_print("Cancelled call %" PRIu64 "\n", request_id);
+    rpc_message_free(job->msg, rpc_data_free);
+    client_state_release(cl);
+    free_and_null(job);
+}
+
 void *handle_all_requests_thread(void *arg) {
     handle_all_requests_args *args = (handle_all_requests_args *)arg;
     handle_all_requests(args->srv, args->cl);
@@ -292,31 +1257,234 @@ void *handle_all_requests_thread(void *arg) {
 }
 
 void handle_all_requests(rpc_server *srv, rpc_client_state *cl) {
-    while (keep_running && !is_socket_closed(cl->sockfd)) {
-        handle_request(srv, cl);
+    rpc_message *msg;
+    while (keep_running && (msg = mux_receive(cl->mux)) != NULL) {
+        // finding a function is cheap, so only calls wait for a worker
+        if (msg->operation == CALL) {
+            schedule_request(srv, cl, msg);
+        } else {
+            handle_request(srv, cl, msg);
+        }
         debug_print("%s",
                     "==================================================\n");
         debug_print("%s", "Waiting for request...\n");
     }
+
+    // the client has gone, but calls already queued still run and reply
+    debug_print("%s", "Client disconnected\n");
+    client_state_release(cl);
+}
+
+void *worker_thread(void *arg) {
+    rpc_server *srv = (rpc_server *)arg;
+    job_t *job;
+    while ((job = scheduler_pop(srv->scheduler)) != NULL) {
+        run_job(srv, job);
+    }
+    return NULL;
 }
 
-void handle_request(rpc_server *srv, rpc_client_state *cl) {
-    // check that socket is not closed
-    if (is_socket_closed(cl->sockfd)) {
-        debug_print("%s", "Client disconnected\n");
+void run_job(rpc_server *srv, job_t *job) {
+    // a suspended call whose reply has arrived
+    if (job->call != NULL) {
+        coroutine_call_t *call = (coroutine_call_t *)job->call;
+        handler_entry_t *entry = call->entry;
+        if (resume_call(call)) {
+            run_calls(srv, entry, next_call(entry));
+        }
         return;
     }
 
-    // receive rpc_message from the client and process it
-    rpc_message *msg;
-    if ((msg = receive_rpc_message(cl->sockfd)) == NULL) {
-        debug_print("%s", "Receiving message failed. Responding with failure "
-                          "message...\n");
-        send_rpc_message(cl->sockfd, create_failure_message());
+    handler_entry_t *entry =
+        hashtable_lookup(srv->handlers, job->msg->function_name);
+    if (entry == NULL) {
+        finish_job(srv, job);
+        return;
+    }
+
+    // a full bulkhead parks the call in the handler's queue, or rejects it
+    pthread_mutex_lock(&entry->lock);
+    int limit = entry->opts.max_concurrency;
+    if (limit > 0 && entry->running >= limit) {
+        if (list_len(entry->waiting) < entry->opts.max_queue) {
+            append(entry->waiting, job);
+            entry->queued++;
+            pthread_mutex_unlock(&entry->lock);
+        } else {
+            entry->rejected++;
+            pthread_mutex_unlock(&entry->lock);
+            debug_print("Bulkhead of \"%s\" is full\n",
+                        job->msg->function_name);
+            reject_request(job);
+        }
         return;
     }
+    entry->running++;
+    entry->calls++;
+    pthread_mutex_unlock(&entry->lock);
+    run_calls(srv, entry, job);
+}
+
+void run_calls(rpc_server *srv, handler_entry_t *entry, job_t *job) {
+    // keep the slot while there are calls waiting for it. A suspended call
+    // keeps it until it finishes, on whichever worker resumes it
+    while (job != NULL) {
+        if (!start_call(srv, entry, job)) {
+            return;
+        }
+        job = next_call(entry);
+    }
+}
+
+job_t *next_call(handler_entry_t *entry) {
+    pthread_mutex_lock(&entry->lock);
+    job_t *job = (job_t *)pop(entry->waiting);
+    if (job != NULL) {
+        entry->calls++;
+    } else {
+        entry->running--;
+    }
+    pthread_mutex_unlock(&entry->lock);
+    return job;
+}
+
+int start_call(rpc_server *srv, handler_entry_t *entry, job_t *job) {
+    pthread_mutex_lock(&entry->lock);
+    int coroutine = entry->opts.coroutine;
+    pthread_mutex_unlock(&entry->lock);
+    if (!coroutine) {
+        finish_job(srv, job);
+        return TRUE;
+    }
 
+    coroutine_call_t *call = (coroutine_call_t *)rpc_malloc(sizeof(*call));
+    assert(call);
+    call->srv = srv;
+    call->entry = entry;
+    call->job = job;
+    call->co = coroutine_create(coroutine_call_main, call,
+                                COROUTINE_STACK_SIZE);
+    call->resume = (job_t){.conn = job->conn, .call = call};
+    call->state = CALL_RUNNING;
+    pthread_mutex_init(&call->lock, NULL);
+    scheduler_hold(srv->scheduler);
+    return resume_call(call);
+}
+
+int resume_call(coroutine_call_t *call) {
+    while (TRUE) {
+        current_call = call;
+        int finished = coroutine_resume(call->co);
+        current_call = NULL;
+        if (finished) {
+            scheduler_release(call->srv->scheduler);
+            coroutine_free(call->co);
+            pthread_mutex_destroy(&call->lock);
+            free_and_null(call);
+            return TRUE;
+        }
+
+        // the call yielded waiting for a reply. Park it, unless the reply
+        // beat us to it, in which case carry on running it here
+        pthread_mutex_lock(&call->lock);
+        if (call->state == CALL_WOKEN) {
+            call->state = CALL_RUNNING;
+            pthread_mutex_unlock(&call->lock);
+            continue;
+        }
+        call->state = CALL_PARKED;
+        pthread_mutex_unlock(&call->lock);
+        return FALSE;
+    }
+}
+
+void coroutine_call_main(void *arg) {
+    coroutine_call_t *call = (coroutine_call_t *)arg;
+    finish_job(call->srv, call->job);
+}
+
+void wake_call(void *arg) {
+    coroutine_call_t *call = (coroutine_call_t *)arg;
+    pthread_mutex_lock(&call->lock);
+    if (call->state == CALL_PARKED) {
+        call->state = CALL_RUNNING;
+        pthread_mutex_unlock(&call->lock);
+        scheduler_resume(call->srv->scheduler, &call->resume);
+    } else {
+        call->state = CALL_WOKEN;
+        pthread_mutex_unlock(&call->lock);
+    }
+}
+
+void finish_job(rpc_server *srv, job_t *job) {
+    rpc_client_state *cl = (rpc_client_state *)job->conn;
+    handle_request(srv, cl, job->msg);
+    client_state_release(cl);
+    free_and_null(job);
+}
+
+void handler_entry_free(void *data) {
+    handler_entry_t *entry = (handler_entry_t *)data;
+    free_list(entry->waiting, NULL);
+    pthread_mutex_destroy(&entry->lock);
+    free_and_null(entry);
+}
+
+void schedule_request(rpc_server *srv, rpc_client_state *cl,
+                      rpc_message *msg) {
+    job_t *job = (job_t *)rpc_malloc(sizeof(*job));
+    assert(job);
+    job->conn = cl;
+    job->flow = cl->flow;
+    job->msg = msg;
+    job->call = NULL;
+    pthread_mutex_lock(&cl->lock);
+    cl->refs++;
+    pthread_mutex_unlock(&cl->lock);
+
+    job_t *shed = scheduler_push(srv->scheduler, job);
+    if (shed != NULL) {
+        debug_print("Shedding call %" PRIu64 " of priority %d\n",
+                    shed->msg->request_id, shed->msg->priority);
+        reject_request(shed);
+    }
+}
+
+void reject_request(job_t *job) {
+    rpc_client_state *cl = (rpc_client_state *)job->conn;
+    rpc_message *overloaded = create_overloaded_message();
+    overloaded->request_id = job->msg->request_id;
+    mux_send(cl->mux, overloaded);
+    rpc_message_free(overloaded, rpc_data_free);
+    rpc_message_free(job->msg, rpc_data_free);
+    client_state_release(cl);
+    free_and_null(job);
+}
+
+void client_state_release(rpc_client_state *cl) {
+    pthread_mutex_lock(&cl->lock);
+    int refs = --cl->refs;
+    pthread_mutex_unlock(&cl->lock);
+    if (refs == 0) {
+        rpc_server *srv = cl->srv;
+        pthread_mutex_lock(&srv->peers_lock);
+        remove_data(srv->clients, cl);
+        if (cl->bucket != NULL) {
+            cl->bucket->connections--;
+        }
+        pthread_mutex_unlock(&srv->peers_lock);
+        mux_free(cl->mux);
+        flow_free(cl->flow);
+        pthread_mutex_destroy(&cl->lock);
+        free_and_null(cl);
+    }
+}
+
+void handle_request(rpc_server *srv, rpc_client_state *cl, rpc_message *msg) {
     rpc_message *new_msg = NULL;
+    void (*free_data)(rpc_data *) = rpc_data_free;
+    uint64_t start, end;
+    rpc_trace_context ctx = {0, 0};
     switch (msg->operation) {
     case FIND:
         debug_print("%s", "Received FIND request\n");
@@ -327,7 +1495,36 @@ void handle_request(rpc_server *srv, rpc_client_state *cl) {
     case CALL:
         debug_print("%s", "Received CALL request\n");
         debug_print("Calling handler: %s\n", msg->function_name);
-        new_msg = handle_call_request(srv, msg);
+
+        // the handler runs in the caller's trace, under a span of its own,
+        // so that the calls it makes are that span's children
+        if (msg->traced) {
+            ctx.trace_id = msg->trace_id;
+            ctx.span_id = trace_new_id();
+        }
+        rpc_trace_set(&ctx);
+        start = monotonic_usec();
+        new_msg = handle_call_request(srv, msg, &free_data);
+        end = monotonic_usec();
+        rpc_trace_set(NULL);
+        if (msg->traced) {
+            record_server_span(msg, new_msg, ctx.span_id,
+                               start - msg->received_usec, end - start);
+        }
+        if (srv->timestamping) {
+            record_call(srv, msg->kernel_usec, start - msg->received_usec,
+                        end - start);
+        }
+        if (srv->slow_log != NULL) {
+            log_slow_call(srv, cl, msg, new_msg, start - msg->received_usec,
+                          end - start);
+        }
+        if (new_msg != NULL && srv->timing) {
+            new_msg->timed = TRUE;
+            new_msg->queue_usec = start - msg->received_usec;
+            new_msg->decode_usec = msg->decode_usec;
+            new_msg->handler_usec = end - start;
+        }
         break;
 
     case REPLY_SUCCESS:
@@ -340,6 +1537,11 @@ void handle_request(rpc_server *srv, rpc_client_state *cl) {
         debug_print("%s", "Doing nothing...\n");
         break;
 
+    case REPLY_OVERLOADED:
+        debug_print("%s", "Received REPLY_OVERLOADED request\n");
+        debug_print("%s", "Doing nothing...\n");
+        break;
+
     default:
         debug_print("Received unknown request: %d\n", msg->operation);
         debug_print("%s", "Doing nothing...\n");
@@ -349,13 +1551,100 @@ void handle_request(rpc_server *srv, rpc_client_state *cl) {
     // check if handling the request failed
     if (new_msg == NULL) {
         debug_print("%s", "Handling request failed. Not sending reply...\n");
+        rpc_message_free(msg, rpc_data_free);
         return;
     }
 
-    // send the message to the server
-    send_rpc_message(cl->sockfd, new_msg);
+    // replies carry the id of their request so they can be matched up
+    new_msg->request_id = msg->request_id;
+
+    // queue the reply, whose frames are interleaved with any other replies
+    // still being sent on this connection
+    mux_send(cl->mux, new_msg);
     rpc_message_free(msg, rpc_data_free);
-    rpc_message_free(new_msg, rpc_data_free);
+    rpc_message_free(new_msg, free_data);
+}
+
+void record_call(rpc_server *srv, unsigned long receive_usec,
+                 unsigned long queue_usec, unsigned long handler_usec) {
+    rpc_latency_stats *l = &srv->latency;
+    pthread_mutex_lock(&srv->latency_lock);
+    l->requests++;
+    l->receive_usec += receive_usec;
+    l->queue_usec += queue_usec;
+    l->handler_usec += handler_usec;
+    if (receive_usec > l->max_receive_usec) {
+        l->max_receive_usec = receive_usec;
+    }
+    if (queue_usec > l->max_queue_usec) {
+        l->max_queue_usec = queue_usec;
+    }
+    if (handler_usec > l->max_handler_usec) {
+        l->max_handler_usec = handler_usec;
+    }
+    pthread_mutex_unlock(&srv->latency_lock);
+}
+
+void log_slow_call(rpc_server *srv, rpc_client_state *cl, rpc_message *msg,
+                   rpc_message *reply, unsigned long queue_usec,
+                   unsigned long handler_usec) {
+    unsigned long total =
+        msg->kernel_usec + msg->decode_usec + queue_usec + handler_usec;
+    if (total < srv->slow_opts.threshold_usec ||
+        !slow_log_sampled(srv->slow_log)) {
+        return;
+    }
+    slow_entry_t e;
+    e.time_usec = realtime_usec();
+    strncpy(e.function, msg->function_name, SLOW_LOG_MAX_NAME);
+    e.function[SLOW_LOG_MAX_NAME] = '\0';
+    strcpy(e.peer, cl != NULL ? cl->host : "");
+    e.request_bytes = msg->data != NULL ? msg->data->data2_len : 0;
+    e.reply_bytes = reply != NULL && reply->data != NULL
+                        ? reply->data->data2_len
+                        : 0;
+    e.total_usec = total;
+    e.receive_usec = msg->kernel_usec;
+    e.decode_usec = msg->decode_usec;
+    e.queue_usec = queue_usec;
+    e.handler_usec = handler_usec;
+    e.data_len = e.request_bytes < srv->slow_opts.data_bytes
+                     ? e.request_bytes
+                     : srv->slow_opts.data_bytes;
+    if (e.data_len > 0) {
+        memcpy(e.data, msg->data->data2, e.data_len);
+    }
+    slow_log_push(srv->slow_log, &e);
+}
+
+void record_server_span(rpc_message *msg, rpc_message *reply,
+                        uint64_t span_id, unsigned long queue_usec,
+                        unsigned long handler_usec) {
+    rpc_span span = {.trace_id = msg->trace_id,
+                     .span_id = span_id,
+                     .parent_id = msg->span_id,
+                     .kind = RPC_SPAN_SERVER,
+                     .receive_usec = msg->kernel_usec,
+                     .decode_usec = msg->decode_usec,
+                     .queue_usec = queue_usec,
+                     .handler_usec = handler_usec};
+    strncpy(span.name, msg->function_name, RPC_SPAN_NAME_LENGTH - 1);
+    span.total_usec =
+        span.receive_usec + span.decode_usec + queue_usec + handler_usec;
+    span.start_usec = realtime_usec() - span.total_usec;
+    span.failed = reply == NULL || reply->operation != REPLY_SUCCESS;
+    trace_record(&span);
+}
+
+void record_send(void *arg, unsigned long usec) {
+    rpc_server *srv = (rpc_server *)arg;
+    pthread_mutex_lock(&srv->latency_lock);
+    srv->latency.replies++;
+    srv->latency.send_usec += usec;
+    if (usec > srv->latency.max_send_usec) {
+        srv->latency.max_send_usec = usec;
+    }
+    pthread_mutex_unlock(&srv->latency_lock);
 }
 
 rpc_message *handle_find_request(rpc_server *srv, rpc_message *msg) {
@@ -369,13 +1658,23 @@ rpc_message *handle_find_request(rpc_server *srv, rpc_message *msg) {
                            new_rpc_data(exists, 0, NULL));
 }
 
-rpc_message *handle_call_request(rpc_server *srv, rpc_message *msg) {
-    rpc_handler handler = hashtable_lookup(srv->handlers, msg->function_name);
+rpc_message *handle_call_request(rpc_server *srv, rpc_message *msg,
+                                 void (**free_data)(rpc_data *)) {
+    handler_entry_t *entry =
+        hashtable_lookup(srv->handlers, msg->function_name);
 
     // if the handler does not exist, respond with failure
-    if (handler == NULL) {
+    *free_data = rpc_data_free;
+    if (entry == NULL) {
         return create_failure_message();
     }
+    pthread_mutex_lock(&entry->lock);
+    rpc_handler handler = entry->handler;
+    void (*free_result)(rpc_data *) = entry->opts.free_result;
+    pthread_mutex_unlock(&entry->lock);
+    if (free_result == NULL) {
+        free_result = free_handler_result;
+    }
 
     // run the handler
     rpc_data *new_data = handler(msg->data);
@@ -384,11 +1683,14 @@ rpc_message *handle_call_request(rpc_server *srv, rpc_message *msg) {
     debug_print("%s", "Data returned by handler:\n");
     debug_print_rpc_data(new_data);
     if (is_malformed(new_data)) {
-        rpc_data_free(new_data);
+        if (new_data != NULL) {
+            free_result(new_data);
+        }
         return create_failure_message();
     }
 
     // create a new message to send back to the client
+    *free_data = free_result;
     return new_rpc_message(msg->request_id, REPLY_SUCCESS,
                            new_string(msg->function_name), new_data);
 }
@@ -407,15 +1709,28 @@ void rpc_shutdown_server(rpc_server *srv) {
         curr = curr->next;
     }
 
+    // then let the workers finish the calls still queued
+    scheduler_close(srv->scheduler);
+    for (int i = 0; i < SERVER_WORKERS; i++) {
+        pthread_join(srv->workers[i], NULL);
+    }
+    scheduler_destroy(srv->scheduler);
+
     // close the socket
     close(srv->sockfd);
 
     // free the hashtable
-    hashtable_destroy(srv->handlers, NULL);
+    hashtable_destroy(srv->handlers, handler_entry_free);
+    hashtable_destroy(srv->weights, rpc_free);
+    hashtable_destroy(srv->buckets, rpc_free);
+    pthread_mutex_destroy(&srv->peers_lock);
+    pthread_mutex_destroy(&srv->latency_lock);
+    slow_log_close(srv->slow_log);
+    capture_close(srv->capture);
 
     // free the lists
-    free_list(srv->clients, free);
-    free_list(srv->threads, free);
+    free_list(srv->clients, rpc_free);
+    free_list(srv->threads, rpc_free);
 
     // free the server state
     free_and_null(srv);
@@ -427,6 +1742,17 @@ struct rpc_client {
     char *addr;
     int port;
     int sockfd;
+    mux_t *mux;
+    int connected;
+    // unsigned, so that it wraps around rather than overflowing
+    uint64_t next_request_id;
+    // requests waiting for their replies, keyed by request id
+    idtable_t *pending;
+    pthread_mutex_t lock;
+    pthread_t reader;
+    limiter_t *limiter;
+    spin_t spin;
+    rpc_server *local;
 };
 
 struct rpc_handle {
@@ -442,19 +1768,46 @@ rpc_client *rpc_init_client(char *addr, int port) {
 
     // allocate memory for the client state
     rpc_client *cl;
-    cl = (rpc_client *)malloc(sizeof(*cl));
+    cl = (rpc_client *)rpc_malloc(sizeof(*cl));
     assert(cl);
 
     // add the address and port to the client state
     cl->addr = new_string(addr);
     cl->port = port;
+    cl->next_request_id = 0;
+    cl->limiter = NULL;
+    spin_init(&cl->spin, 0);
+    cl->local = NULL;
 
     // convert port from int to a string
     char sport[MAX_PORT_LENGTH + 1];
     sprintf(sport, "%d", port);
 
     // create a socket
-    if ((cl->sockfd = create_connection_socket(addr, sport)) == FAILED) {
+    cl->sockfd =
+        create_connection_socket(addr, sport, atomic_load(&client_fast_open));
+    if (cl->sockfd == FAILED) {
+        free_and_null(cl->addr);
+        free_and_null(cl);
+        return NULL;
+    }
+
+    // calls from different threads share the connection, and a reader
+    // thread hands each reply to the call waiting for it
+    cl->mux = mux_create(cl->sockfd);
+    cl->connected = TRUE;
+    cl->pending = idtable_create(PENDING_TABLE_SIZE);
+    pthread_mutex_init(&cl->lock, NULL);
+    if (cl->mux == NULL ||
+        pthread_create(&cl->reader, NULL, client_reader_thread, cl) != 0) {
+        debug_print("%s", "Starting client threads failed\n");
+        if (cl->mux) {
+            mux_free(cl->mux);
+        } else {
+            close(cl->sockfd);
+        }
+        idtable_destroy(cl->pending);
+        pthread_mutex_destroy(&cl->lock);
         free_and_null(cl->addr);
         free_and_null(cl);
         return NULL;
@@ -463,6 +1816,30 @@ rpc_client *rpc_init_client(char *addr, int port) {
     return cl;
 }
 
+void rpc_set_fast_open(int enabled) {
+    atomic_store(&client_fast_open, enabled ? TRUE : FALSE);
+}
+
+rpc_client *rpc_init_local_client(rpc_server *srv) {
+    if (srv == NULL) {
+        return NULL;
+    }
+    rpc_client *cl = (rpc_client *)rpc_malloc(sizeof(*cl));
+    assert(cl);
+    cl->addr = new_string("local");
+    cl->port = srv->port;
+    cl->sockfd = FAILED;
+    cl->mux = NULL;
+    cl->connected = TRUE;
+    cl->next_request_id = 0;
+    cl->pending = idtable_create(PENDING_TABLE_SIZE);
+    pthread_mutex_init(&cl->lock, NULL);
+    cl->limiter = NULL;
+    spin_init(&cl->spin, 0);
+    cl->local = srv;
+    return cl;
+}
+
 rpc_handle *rpc_find(rpc_client *cl, char *name) {
 
     // check if any of the parameters are NULL
@@ -472,8 +1849,7 @@ rpc_handle *rpc_find(rpc_client *cl, char *name) {
 
     // send message to the server and wait for a reply
     rpc_data *data = new_rpc_data(0, 0, NULL);
-    rpc_message *reply =
-        request(cl->sockfd, new_rpc_message(0, FIND, new_string(name), data));
+    rpc_message *reply = request(cl, FIND, name, data, RPC_PRIORITY_NORMAL);
     rpc_data_free(data);
     if (reply == NULL) {
         return NULL;
@@ -492,22 +1868,60 @@ rpc_handle *rpc_find(rpc_client *cl, char *name) {
 }
 
 rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
+    return rpc_call_priority(cl, h, payload, RPC_PRIORITY_NORMAL);
+}
+
+rpc_data *rpc_call_priority(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                            rpc_priority priority) {
+    return rpc_call_timed(cl, h, payload, priority, NULL);
+}
+
+rpc_data *rpc_call_timed(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                         rpc_priority priority, rpc_call_timing *timing) {
     // check if any of the parameters are NULL
     if (cl == NULL || h == NULL || payload == NULL) {
         return NULL;
     }
+    if (priority < RPC_PRIORITY_INTERACTIVE || priority > RPC_PRIORITY_BATCH) {
+        return NULL;
+    }
 
     if (is_malformed(payload)) {
         return NULL;
     }
 
-    // use socket to send a message to the server
-    rpc_message *reply = request(
-        cl->sockfd, new_rpc_message(0, CALL, new_string(h->name), payload));
+    // wait for a slot if the server is already busy with our calls
+    if (cl->limiter && limiter_acquire(cl->limiter) == FAILED) {
+        debug_print("%s", "Call rejected by concurrency limit\n");
+        return NULL;
+    }
+    uint64_t start = monotonic_usec();
+
+    // send a message to the server and wait for the reply
+    rpc_message *reply = request(cl, CALL, h->name, payload, priority);
+
+    // calls overlap on the connection, so the latency includes the time the
+    // request spent queued at the server behind our other calls, which is
+    // exactly the queueing the limiter is trying to avoid. The wait for a
+    // slot is left out. A call the server turned away comes back fast, so
+    // it counts as dropped rather than as a latency sample
+    uint64_t elapsed = monotonic_usec() - start;
+    if (cl->limiter) {
+        limiter_release(cl->limiter, elapsed, reply_dropped(reply));
+    }
     if (reply == NULL) {
         return NULL;
     }
 
+    // the server's share is only known if it has timing turned on
+    if (timing != NULL) {
+        timing->total_usec = elapsed;
+        timing->server = reply->timed;
+        timing->queue_usec = reply->timed ? reply->queue_usec : 0;
+        timing->decode_usec = reply->timed ? reply->decode_usec : 0;
+        timing->handler_usec = reply->timed ? reply->handler_usec : 0;
+    }
+
     // send the reply back to the client
     rpc_data *data = NULL;
     if (reply->operation == REPLY_SUCCESS) {
@@ -515,6 +1929,9 @@ rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
     } else if (reply->operation == REPLY_FAILURE) {
         debug_print("%s", "Handler not found\n");
         rpc_data_free(reply->data);
+    } else if (reply->operation == REPLY_OVERLOADED) {
+        debug_print("%s", "Call turned away by overloaded server\n");
+        rpc_data_free(reply->data);
     } else {
         debug_print("%s", "Invalid reply operation\n");
     }
@@ -532,8 +1949,15 @@ void rpc_close_client(rpc_client *cl) {
         return;
     }
 
-    // close the socket
-    close(cl->sockfd);
+    // close the connection, which stops the reader thread
+    if (cl->local == NULL) {
+        mux_shutdown(cl->mux);
+        pthread_join(cl->reader, NULL);
+        mux_free(cl->mux);
+    }
+    idtable_destroy(cl->pending);
+    pthread_mutex_destroy(&cl->lock);
+    limiter_destroy(cl->limiter);
 
     // free the address
     free_and_null(cl->addr);
@@ -542,6 +1966,209 @@ void rpc_close_client(rpc_client *cl) {
     free_and_null(cl);
 }
 
+int rpc_call_all(rpc_client **clients, int n, rpc_handle *h,
+                 rpc_data *payload, rpc_data **results, int timeout_ms) {
+    return rpc_call_some(clients, n, h, payload, results, n, timeout_ms);
+}
+
+int rpc_call_some(rpc_client **clients, int n, rpc_handle *h,
+                  rpc_data *payload, rpc_data **results, int k,
+                  int timeout_ms) {
+    // check if any of the parameters are invalid
+    if (clients == NULL || n <= 0 || h == NULL || payload == NULL ||
+        results == NULL || k <= 0 || k > n || is_malformed(payload)) {
+        return FAILED;
+    }
+    for (int i = 0; i < n; i++) {
+        results[i] = NULL;
+        if (clients[i] == NULL) {
+            return FAILED;
+        }
+    }
+
+    // a coroutine call gives its worker back while it waits
+    gather_t g;
+    gather_init(&g);
+    coroutine_call_t *call = current_call;
+    if (call != NULL) {
+        g.wake = wake_call;
+        g.wake_arg = call;
+    }
+
+    // send every request before waiting for any reply. Calls on local
+    // clients run on this thread as they are submitted, so they go last,
+    // once the remote ones are already on their way. A call turned away by
+    // its client's limiter counts as failed
+    waiter_t *waiters = (waiter_t *)rpc_malloc(n * sizeof(*waiters));
+    assert(waiters);
+    int sent = 0;
+    uint64_t start = monotonic_usec();
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < n; i++) {
+            if ((clients[i]->local != NULL) != pass) {
+                continue;
+            }
+            waiters[i] = (waiter_t){.g = &g};
+            limiter_t *limiter = clients[i]->limiter;
+            if (limiter && limiter_acquire(limiter) == FAILED) {
+                debug_print("%s", "Call rejected by concurrency limit\n");
+                waiters[i].done = TRUE;
+                continue;
+            }
+            waiters[i].limited = limiter != NULL;
+            if (submit_request(clients[i], &waiters[i], CALL, h->name,
+                               payload, RPC_PRIORITY_NORMAL) == 0) {
+                sent++;
+            }
+        }
+    }
+
+    // wait until enough calls have succeeded, or until too many have
+    // failed for the rest to make up k
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    gather_timer_t timer;
+    int yield = call != NULL;
+    int timer_running = FALSE;
+    if (yield && timeout_ms >= 0) {
+        // without a timer to wake it the coroutine sleeps on cond instead
+        timer_running = gather_timer_start(&timer, &g, &deadline) == 0;
+        yield = timer_running;
+    }
+    int timed_out = FALSE;
+    pthread_mutex_lock(&g.lock);
+    while (g.successes < k && sent - (g.done - g.successes) >= k) {
+        if (yield && g.expired) {
+            timed_out = TRUE;
+        } else if (yield) {
+            // other calls run on the worker meanwhile, in their own
+            // traces, and we may come back on another worker
+            rpc_trace_context ctx = *trace_context();
+            pthread_mutex_unlock(&g.lock);
+            coroutine_yield();
+            rpc_trace_set(&ctx);
+            pthread_mutex_lock(&g.lock);
+            continue;
+        } else if (timeout_ms < 0) {
+            pthread_cond_wait(&g.cond, &g.lock);
+            continue;
+        } else {
+            timed_out = pthread_cond_timedwait(&g.cond, &g.lock,
+                                               &deadline) == ETIMEDOUT;
+        }
+        if (timed_out) {
+            debug_print("%s", "Fan-out timed out\n");
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g.lock);
+    if (timer_running) {
+        gather_timer_stop(&timer);
+    }
+
+    // cancel the stragglers, whose servers drop them if they have not
+    // started them, and whose replies are discarded when they arrive
+    int successes = 0;
+    for (int i = 0; i < n; i++) {
+        cancel_request(clients[i], &waiters[i]);
+        record_client_span(&waiters[i], h->name);
+        rpc_message *reply = waiters[i].reply;
+
+        // a straggler cut off by the timeout is a sign of overload, but
+        // one cancelled because the outcome was settled says nothing
+        if (waiters[i].limited && !waiters[i].done && !timed_out) {
+            limiter_cancel(clients[i]->limiter);
+        } else if (waiters[i].limited) {
+            uint64_t end = waiters[i].done_usec != 0 ? waiters[i].done_usec
+                                                     : monotonic_usec();
+            limiter_release(clients[i]->limiter, end - start,
+                            reply_dropped(reply));
+        }
+        if (reply == NULL) {
+            continue;
+        }
+        if (reply->operation == REPLY_SUCCESS) {
+            results[i] = reply->data;
+            successes++;
+            rpc_message_free(reply, NULL);
+        } else {
+            rpc_message_free(reply, rpc_data_free);
+        }
+    }
+    free_and_null(waiters);
+    gather_destroy(&g);
+    return successes;
+}
+
+int rpc_client_set_limit(rpc_client *cl, rpc_limit_algorithm algorithm,
+                         int max_queue) {
+    if (cl == NULL) {
+        return FAILED;
+    }
+    if (algorithm != RPC_LIMIT_NONE && algorithm != RPC_LIMIT_AIMD &&
+        algorithm != RPC_LIMIT_GRADIENT) {
+        return FAILED;
+    }
+
+    limiter_destroy(cl->limiter);
+    cl->limiter = NULL;
+    if (algorithm != RPC_LIMIT_NONE) {
+        cl->limiter = limiter_create(algorithm, max_queue);
+    }
+    return EXIT_SUCCESS;
+}
+
+int rpc_client_set_busy_poll(rpc_client *cl, int usec) {
+    if (cl == NULL || usec < 0) {
+        return FAILED;
+    }
+    if (cl->local == NULL) {
+        mux_set_busy_poll(cl->mux, usec);
+        spin_init(&cl->spin, usec);
+    }
+    return EXIT_SUCCESS;
+}
+
+int rpc_client_set_zerocopy(rpc_client *cl, size_t threshold) {
+    if (cl == NULL) {
+        return FAILED;
+    }
+    if (cl->local == NULL) {
+        return mux_set_zerocopy(cl->mux, threshold);
+    }
+    return EXIT_SUCCESS;
+}
+
+int rpc_client_limit_stats(rpc_client *cl, rpc_limit_stats *stats) {
+    if (cl == NULL || cl->limiter == NULL || stats == NULL) {
+        return FAILED;
+    }
+    limiter_t *l = cl->limiter;
+    pthread_mutex_lock(&l->lock);
+    stats->limit = (int)l->limit;
+    stats->in_flight = l->in_flight;
+    stats->queued = l->queued;
+    stats->rejected = l->rejected;
+    pthread_mutex_unlock(&l->lock);
+    return EXIT_SUCCESS;
+}
+
+int rpc_client_transport_info(rpc_client *cl, rpc_connection_info *info) {
+    if (cl == NULL || info == NULL || cl->local != NULL ||
+        mux_get_tcp_info(cl->mux, info) == FAILED) {
+        return FAILED;
+    }
+    snprintf(info->host, sizeof(info->host), "%s", cl->addr);
+    info->port = cl->port;
+    return EXIT_SUCCESS;
+}
+
 void rpc_data_free(rpc_data *data) {
     if (data == NULL) {
         return;
@@ -552,14 +2179,309 @@ void rpc_data_free(rpc_data *data) {
     free_and_null(data);
 }
 
+void free_handler_result(rpc_data *data) {
+    if (data == NULL) {
+        return;
+    }
+    free(data->data2);
+    free(data);
+}
+
 /* client helper functions ================================================== */
 rpc_handle *new_rpc_handle(const char *name) {
+    // callers free handles with free(), so they come from libc whatever the
+    // allocator
     rpc_handle *handle = (rpc_handle *)malloc(sizeof(*handle));
     assert(handle);
     strncpy(handle->name, name, MAX_NAME_LENGTH);
     return handle;
 }
 
+void gather_init(gather_t *g) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    g->done = 0;
+    g->successes = 0;
+    g->wake = NULL;
+    g->wake_arg = NULL;
+    g->expired = FALSE;
+}
+
+void gather_destroy(gather_t *g) {
+    pthread_cond_destroy(&g->cond);
+    pthread_mutex_destroy(&g->lock);
+}
+
+int gather_timer_start(gather_timer_t *t, gather_t *g,
+                       const struct timespec *deadline) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    t->deadline = *deadline;
+    t->stopped = FALSE;
+    t->g = g;
+    if (pthread_create(&t->thread, NULL, gather_timer_thread, t) != 0) {
+        debug_print("%s", "Creating timer thread failed\n");
+        pthread_cond_destroy(&t->cond);
+        pthread_mutex_destroy(&t->lock);
+        return FAILED;
+    }
+    return 0;
+}
+
+void gather_timer_stop(gather_timer_t *t) {
+    pthread_mutex_lock(&t->lock);
+    t->stopped = TRUE;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+}
+
+void *gather_timer_thread(void *arg) {
+    gather_timer_t *t = (gather_timer_t *)arg;
+    pthread_mutex_lock(&t->lock);
+    int rc = 0;
+    while (!t->stopped && rc != ETIMEDOUT) {
+        rc = pthread_cond_timedwait(&t->cond, &t->lock, &t->deadline);
+    }
+    if (!t->stopped) {
+        gather_t *g = t->g;
+        pthread_mutex_lock(&g->lock);
+        g->expired = TRUE;
+        g->wake(g->wake_arg);
+        pthread_mutex_unlock(&g->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+int submit_request(rpc_client *cl, waiter_t *w, int operation, char *name,
+                   rpc_data *payload, rpc_priority priority) {
+    w->done = FALSE;
+    w->reply = NULL;
+
+    // calls made in a trace get a span of their own, the parent of the
+    // server's span
+    const rpc_trace_context *ctx = trace_context();
+    w->span_id = 0;
+    if (operation == CALL && ctx->trace_id != 0) {
+        w->trace_id = ctx->trace_id;
+        w->parent_id = ctx->span_id;
+        w->span_id = trace_new_id();
+        w->start_usec = realtime_usec();
+        w->end_usec = 0;
+    }
+
+    // register for the reply before sending, as it may arrive at once
+    // a request that is never sent counts as done, so it is not cancelled
+    pthread_mutex_lock(&cl->lock);
+    if (!cl->connected) {
+        w->done = TRUE;
+        pthread_mutex_unlock(&cl->lock);
+        return FAILED;
+    }
+    w->entry.id = cl->next_request_id++;
+    w->entry.data = w;
+    if (cl->local != NULL) {
+        // the handler may call through this client itself, so it runs
+        // without the lock
+        pthread_mutex_unlock(&cl->lock);
+        deliver(w, local_request(cl->local, operation, name, payload));
+        return 0;
+    }
+    idtable_insert(cl->pending, &w->entry);
+    pthread_mutex_unlock(&cl->lock);
+
+    rpc_message *msg =
+        new_rpc_message(w->entry.id, operation, new_string(name), payload);
+    msg->priority = priority;
+    if (w->span_id != 0) {
+        msg->traced = TRUE;
+        msg->trace_id = w->trace_id;
+        msg->span_id = w->span_id;
+    }
+    int sent = mux_send(cl->mux, msg);
+    rpc_message_free(msg, NULL);
+    if (sent == FAILED) {
+        // the server never got it, so there is nothing to tell it
+        pthread_mutex_lock(&cl->lock);
+        if (!w->done) {
+            idtable_remove(cl->pending, w->entry.id);
+            w->done = TRUE;
+        }
+        pthread_mutex_unlock(&cl->lock);
+        return FAILED;
+    }
+    return 0;
+}
+
+void cancel_request(rpc_client *cl, waiter_t *w) {
+    pthread_mutex_lock(&cl->lock);
+    int pending = !w->done;
+    if (pending) {
+        idtable_remove(cl->pending, w->entry.id);
+    }
+    pthread_mutex_unlock(&cl->lock);
+    if (pending && cl->local == NULL) {
+        mux_cancel(cl->mux, w->entry.id);
+    }
+}
+
+rpc_message *request(rpc_client *cl, int operation, char *name,
+                     rpc_data *payload, rpc_priority priority) {
+    if (cl->local != NULL) {
+        return local_request(cl->local, operation, name, payload);
+    }
+
+    gather_t g;
+    gather_init(&g);
+    waiter_t w = {.g = &g};
+
+    // a coroutine call gives its worker back while it waits
+    coroutine_call_t *call = current_call;
+    if (call != NULL) {
+        g.wake = wake_call;
+        g.wake_arg = call;
+    }
+    if (submit_request(cl, &w, operation, name, payload, priority) == 0) {
+        if (call == NULL && atomic_load(&cl->spin.max_usec) > 0) {
+            spin_wait(&cl->spin, waiter_done, &w);
+        }
+        pthread_mutex_lock(&g.lock);
+        while (!w.done) {
+            if (call != NULL) {
+                // other calls run on the worker meanwhile, in their own
+                // traces, and we may come back on another worker
+                rpc_trace_context ctx = *trace_context();
+                pthread_mutex_unlock(&g.lock);
+                coroutine_yield();
+                rpc_trace_set(&ctx);
+                pthread_mutex_lock(&g.lock);
+            } else {
+                pthread_cond_wait(&g.cond, &g.lock);
+            }
+        }
+        pthread_mutex_unlock(&g.lock);
+    }
+    record_client_span(&w, name);
+    gather_destroy(&g);
+    return w.reply;
+}
+
+rpc_message *local_request(rpc_server *srv, int operation, char *name,
+                           rpc_data *payload) {
+    rpc_message msg = {.request_id = 0,
+                       .operation = operation,
+                       .function_name = name,
+                       .data = payload,
+                       .priority = RPC_PRIORITY_NORMAL};
+    if (operation == FIND) {
+        return handle_find_request(srv, &msg);
+    }
+    void (*free_data)(rpc_data *);
+    rpc_message *reply = handle_call_request(srv, &msg, &free_data);
+
+    // the caller frees the result with rpc_data_free, so copy it unless it
+    // already came from the library's allocator
+    if (free_data != rpc_data_free &&
+        !(free_data == free_handler_result && rpc_allocator_is_default())) {
+        rpc_data *data = reply->data;
+        reply->data = new_rpc_data(data->data1, data->data2_len, data->data2);
+        free_data(data);
+    }
+    return reply;
+}
+
+void deliver(waiter_t *w, rpc_message *reply) {
+    gather_t *g = w->g;
+    pthread_mutex_lock(&g->lock);
+    w->reply = reply;
+    w->done = TRUE;
+    if (w->span_id != 0) {
+        w->end_usec = realtime_usec();
+    }
+    if (w->limited) {
+        w->done_usec = monotonic_usec();
+    }
+    g->done++;
+    if (reply != NULL && reply->operation == REPLY_SUCCESS) {
+        g->successes++;
+    }
+    pthread_cond_broadcast(&g->cond);
+    if (g->wake != NULL) {
+        g->wake(g->wake_arg);
+    }
+    pthread_mutex_unlock(&g->lock);
+}
+
+void record_client_span(waiter_t *w, const char *name) {
+    if (w->span_id == 0) {
+        return;
+    }
+    rpc_span span = {.trace_id = w->trace_id,
+                     .span_id = w->span_id,
+                     .parent_id = w->parent_id,
+                     .kind = RPC_SPAN_CLIENT,
+                     .start_usec = w->start_usec};
+    strncpy(span.name, name, RPC_SPAN_NAME_LENGTH - 1);
+    uint64_t end = w->end_usec != 0 ? w->end_usec : realtime_usec();
+    span.total_usec = end > w->start_usec ? end - w->start_usec : 0;
+    span.failed =
+        w->reply == NULL || w->reply->operation != REPLY_SUCCESS;
+    trace_record(&span);
+}
+
+void fail_waiter(void *arg) {
+    deliver((waiter_t *)arg, NULL);
+}
+
+int waiter_done(void *arg) {
+    waiter_t *w = (waiter_t *)arg;
+    return __atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+}
+
+int reply_dropped(rpc_message *reply) {
+    return reply == NULL || reply->operation != REPLY_SUCCESS;
+}
+
+void *client_reader_thread(void *arg) {
+    rpc_client *cl = (rpc_client *)arg;
+    rpc_message *reply;
+    while ((reply = mux_receive(cl->mux)) != NULL) {
+        pthread_mutex_lock(&cl->lock);
+        waiter_t *w =
+            (waiter_t *)idtable_remove(cl->pending, reply->request_id);
+        if (w != NULL) {
+            deliver(w, reply);
+        } else {
+            // the caller gave up on this request
+            debug_print("Discarding stale reply %" PRIu64 "\n",
+                        reply->request_id);
+            rpc_message_free(reply, rpc_data_free);
+        }
+        pthread_mutex_unlock(&cl->lock);
+
+        // cheap unless TCP_INFO_INTERVAL_USEC has passed since the last
+        mux_sample_tcp_info(cl->mux, FALSE);
+    }
+
+    // the connection is gone, so fail everything still waiting on it
+    pthread_mutex_lock(&cl->lock);
+    cl->connected = FALSE;
+    idtable_clear(cl->pending, fail_waiter);
+    pthread_mutex_unlock(&cl->lock);
+    return NULL;
+}
+
 int is_malformed(rpc_data *data) {
     if (data == NULL) {
         return TRUE;
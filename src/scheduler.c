@@ -0,0 +1,272 @@
+/* =============================================================================
+   scheduler.c
+
+   Priority run queues for server workers, shared fairly between
+   connections.
+
+   Author: David Sha
+============================================================================= */
+#include "scheduler.h"
+#include "config.h"
+#include <assert.h>
+#include <stdlib.h>
+
+/*
+ * Remove the newest call of the longest flow queued in a class.
+ *
+ * @param s The scheduler, locked.
+ * @param priority The class, which must have calls queued.
+ * @return The call.
+ */
+static job_t *shed_from(scheduler_t *s, int priority);
+
+/*
+ * Take a flow off the active list of a class once its queue is empty.
+ *
+ * @param s The scheduler, locked.
+ * @param flow The flow.
+ * @param priority The class.
+ */
+static void deactivate(scheduler_t *s, flow_t *flow, int priority);
+
+/*
+ * Is there a call to run? Checked without the lock while spinning.
+ */
+static int has_work(void *arg);
+
+scheduler_t *scheduler_create(int max_queue) {
+    scheduler_t *s = (scheduler_t *)rpc_malloc(sizeof(*s));
+    assert(s);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->available, NULL);
+    for (int i = 0; i < NUM_PRIORITIES; i++) {
+        s->active[i] = create_empty_list();
+        s->class_queued[i] = 0;
+        s->current[i] = 0;
+        s->shed[i] = 0;
+    }
+    s->ready = create_empty_list();
+    s->held = 0;
+    spin_init(&s->spin, 0);
+    s->weights[RPC_PRIORITY_INTERACTIVE] = PRIORITY_WEIGHT_INTERACTIVE;
+    s->weights[RPC_PRIORITY_NORMAL] = PRIORITY_WEIGHT_NORMAL;
+    s->weights[RPC_PRIORITY_BATCH] = PRIORITY_WEIGHT_BATCH;
+    s->queued = 0;
+    s->max_queue = max_queue;
+    s->closed = FALSE;
+    return s;
+}
+
+void scheduler_destroy(scheduler_t *s) {
+    if (s == NULL) {
+        return;
+    }
+    for (int i = 0; i < NUM_PRIORITIES; i++) {
+        free_list(s->active[i], NULL);
+    }
+    free_list(s->ready, NULL);
+    pthread_cond_destroy(&s->available);
+    pthread_mutex_destroy(&s->lock);
+    free_and_null(s);
+}
+
+flow_t *flow_create(int weight) {
+    flow_t *flow = (flow_t *)rpc_malloc(sizeof(*flow));
+    assert(flow);
+    for (int i = 0; i < NUM_PRIORITIES; i++) {
+        flow->queues[i] = create_empty_list();
+        flow->deficit[i] = 0;
+        flow->queued[i] = 0;
+    }
+    flow->weight = weight < 1 ? 1 : weight;
+    return flow;
+}
+
+void flow_free(flow_t *flow) {
+    if (flow == NULL) {
+        return;
+    }
+    for (int i = 0; i < NUM_PRIORITIES; i++) {
+        free_list(flow->queues[i], NULL);
+    }
+    free_and_null(flow);
+}
+
+job_t *scheduler_push(scheduler_t *s, job_t *job) {
+    int priority = job->msg->priority;
+    flow_t *flow = job->flow;
+    job_t *shed = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->closed) {
+        shed = job;
+    } else if (s->queued >= s->max_queue) {
+        // make room by shedding from the lowest class below this one, or
+        // shed this call if there is none
+        shed = job;
+        for (int i = NUM_PRIORITIES - 1; i > priority; i--) {
+            if (s->class_queued[i] > 0) {
+                shed = shed_from(s, i);
+                break;
+            }
+        }
+    }
+    if (shed != job) {
+        if (is_empty_list(flow->queues[priority])) {
+            append(s->active[priority], flow);
+        }
+        append(flow->queues[priority], job);
+        flow->queued[priority]++;
+        s->class_queued[priority]++;
+        s->queued++;
+        pthread_cond_signal(&s->available);
+    }
+    if (shed != NULL) {
+        s->shed[shed->msg->priority]++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return shed;
+}
+
+job_t *scheduler_cancel(scheduler_t *s, flow_t *flow,
+                        uint64_t request_id) {
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < NUM_PRIORITIES; i++) {
+        for (node_t *n = flow->queues[i]->head; n != NULL; n = n->next) {
+            job_t *job = (job_t *)n->data;
+            if (job->msg->request_id != request_id) {
+                continue;
+            }
+            remove_node(flow->queues[i], n);
+            flow->queued[i]--;
+            s->class_queued[i]--;
+            s->queued--;
+            if (is_empty_list(flow->queues[i])) {
+                deactivate(s, flow, i);
+            }
+            pthread_mutex_unlock(&s->lock);
+            return job;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+job_t *scheduler_pop(scheduler_t *s) {
+    if (atomic_load(&s->spin.max_usec) > 0) {
+        spin_wait(&s->spin, has_work, s);
+    }
+    pthread_mutex_lock(&s->lock);
+    while (s->queued == 0 && is_empty_list(s->ready) &&
+           !(s->closed && s->held == 0)) {
+        pthread_cond_wait(&s->available, &s->lock);
+    }
+    if (!is_empty_list(s->ready)) {
+        job_t *job = (job_t *)pop(s->ready);
+        pthread_mutex_unlock(&s->lock);
+        return job;
+    }
+    if (s->queued == 0) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+
+    // smooth weighted round-robin over the classes with calls queued
+    int best = FAILED, total = 0;
+    for (int i = 0; i < NUM_PRIORITIES; i++) {
+        if (s->class_queued[i] == 0) {
+            continue;
+        }
+        s->current[i] += s->weights[i];
+        total += s->weights[i];
+        if (best == FAILED || s->current[i] > s->current[best]) {
+            best = i;
+        }
+    }
+    s->current[best] -= total;
+
+    // deficit round-robin over the flows of that class, where the flow at
+    // the head of the active list is topped up once per turn
+    flow_t *flow = (flow_t *)s->active[best]->head->data;
+    if (flow->deficit[best] <= 0) {
+        flow->deficit[best] += flow->weight;
+    }
+    job_t *job = (job_t *)pop(flow->queues[best]);
+    flow->deficit[best]--;
+    flow->queued[best]--;
+    s->class_queued[best]--;
+    s->queued--;
+    if (is_empty_list(flow->queues[best])) {
+        deactivate(s, flow, best);
+    } else if (flow->deficit[best] <= 0) {
+        // turn over, go to the back of the line
+        append(s->active[best], pop(s->active[best]));
+    }
+    pthread_mutex_unlock(&s->lock);
+    return job;
+}
+
+void scheduler_set_busy_poll(scheduler_t *s, int usec) {
+    spin_init(&s->spin, usec);
+}
+
+void scheduler_hold(scheduler_t *s) {
+    pthread_mutex_lock(&s->lock);
+    s->held++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void scheduler_release(scheduler_t *s) {
+    pthread_mutex_lock(&s->lock);
+    if (--s->held == 0 && s->closed) {
+        pthread_cond_broadcast(&s->available);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void scheduler_resume(scheduler_t *s, job_t *job) {
+    pthread_mutex_lock(&s->lock);
+    append(s->ready, job);
+    pthread_cond_signal(&s->available);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void scheduler_close(scheduler_t *s) {
+    pthread_mutex_lock(&s->lock);
+    s->closed = TRUE;
+    pthread_cond_broadcast(&s->available);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* helper functions ========================================================= */
+static job_t *shed_from(scheduler_t *s, int priority) {
+    flow_t *longest = NULL;
+    int longest_len = 0;
+    for (node_t *n = s->active[priority]->head; n != NULL; n = n->next) {
+        flow_t *flow = (flow_t *)n->data;
+        if (flow->queued[priority] > longest_len) {
+            longest = flow;
+            longest_len = flow->queued[priority];
+        }
+    }
+    job_t *job = (job_t *)remove_data(longest->queues[priority],
+                                      longest->queues[priority]->foot->data);
+    longest->queued[priority]--;
+    s->class_queued[priority]--;
+    s->queued--;
+    if (is_empty_list(longest->queues[priority])) {
+        deactivate(s, longest, priority);
+    }
+    return job;
+}
+
+static int has_work(void *arg) {
+    scheduler_t *s = (scheduler_t *)arg;
+    return __atomic_load_n(&s->queued, __ATOMIC_RELAXED) > 0 ||
+           __atomic_load_n(&s->ready->head, __ATOMIC_RELAXED) != NULL;
+}
+
+static void deactivate(scheduler_t *s, flow_t *flow, int priority) {
+    remove_data(s->active[priority], flow);
+    flow->deficit[priority] = 0;
+}
@@ -0,0 +1,216 @@
+/* =============================================================================
+   slowlog.c
+
+   Log of slow calls, queued in a lock-free ring and written out by a
+   background thread.
+
+   Author: David Sha
+============================================================================= */
+#define _DEFAULT_SOURCE
+#include "slowlog.h"
+#include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* structures =============================================================== */
+
+/*
+ * A slot of the ring. A slot at position pos is free for a producer when
+ * seq is pos, and holds an entry for the drainer when seq is pos + 1.
+ */
+typedef struct {
+    _Atomic uint64_t seq;
+    slow_entry_t entry;
+} slot_t;
+
+struct slow_log {
+    FILE *file;
+    slot_t *slots;
+    // next position to fill, claimed by producers with a compare-and-swap
+    _Atomic uint64_t tail;
+    // next position to drain, only touched by the drainer
+    uint64_t head;
+    _Atomic unsigned long seen;
+    _Atomic unsigned long dropped;
+    unsigned long reported;
+    int sample;
+    _Atomic int closing;
+    pthread_t drainer;
+};
+
+/* helper function declarations ============================================= */
+
+/*
+ * Write out the ring until it is empty, then sleep a while, until the log
+ * is closed.
+ */
+void *slow_log_drainer(void *arg);
+
+/*
+ * Write out the entries in the ring.
+ *
+ * @return How many were written.
+ */
+int slow_log_drain(slow_log_t *log);
+
+/*
+ * Write an entry as a line of key=value pairs.
+ */
+void write_entry(FILE *file, const slow_entry_t *e);
+
+/* slow log ================================================================= */
+slow_log_t *slow_log_open(const char *path, int sample) {
+    FILE *file = fopen(path, "a");
+    if (file == NULL) {
+        debug_print("Could not open slow log %s\n", path);
+        return NULL;
+    }
+    slow_log_t *log = (slow_log_t *)rpc_malloc(sizeof(*log));
+    assert(log);
+    log->file = file;
+    log->slots = (slot_t *)rpc_malloc(SLOW_LOG_RING_SIZE * sizeof(slot_t));
+    assert(log->slots);
+    for (uint64_t i = 0; i < SLOW_LOG_RING_SIZE; i++) {
+        atomic_init(&log->slots[i].seq, i);
+    }
+    atomic_init(&log->tail, 0);
+    log->head = 0;
+    atomic_init(&log->seen, 0);
+    atomic_init(&log->dropped, 0);
+    log->reported = 0;
+    log->sample = sample < 1 ? 1 : sample;
+    atomic_init(&log->closing, FALSE);
+    if (pthread_create(&log->drainer, NULL, slow_log_drainer, log) != 0) {
+        debug_print("%s", "Creating slow log thread failed\n");
+        fclose(file);
+        free_and_null(log->slots);
+        free_and_null(log);
+        return NULL;
+    }
+    return log;
+}
+
+int slow_log_sampled(slow_log_t *log) {
+    unsigned long n =
+        atomic_fetch_add_explicit(&log->seen, 1, memory_order_relaxed);
+    return n % log->sample == 0;
+}
+
+int slow_log_push(slow_log_t *log, const slow_entry_t *entry) {
+    uint64_t pos = atomic_load_explicit(&log->tail, memory_order_relaxed);
+    slot_t *slot;
+    while (TRUE) {
+        slot = &log->slots[pos & (SLOW_LOG_RING_SIZE - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            // the slot is free, so claim it unless another producer beat
+            // us to it, in which case pos now holds the new tail
+            if (atomic_compare_exchange_weak_explicit(
+                    &log->tail, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // the drainer has not got to the entry a lap behind yet
+            atomic_fetch_add_explicit(&log->dropped, 1, memory_order_relaxed);
+            return FALSE;
+        } else {
+            pos = atomic_load_explicit(&log->tail, memory_order_relaxed);
+        }
+    }
+    slot->entry = *entry;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return TRUE;
+}
+
+void slow_log_close(slow_log_t *log) {
+    if (log == NULL) {
+        return;
+    }
+    atomic_store(&log->closing, TRUE);
+    pthread_join(log->drainer, NULL);
+    fclose(log->file);
+    free_and_null(log->slots);
+    free_and_null(log);
+}
+
+/* helper functions ========================================================= */
+void *slow_log_drainer(void *arg) {
+    slow_log_t *log = (slow_log_t *)arg;
+    struct timespec pause = {.tv_sec = SLOW_LOG_DRAIN_USEC / 1000000,
+                             .tv_nsec = SLOW_LOG_DRAIN_USEC % 1000000 * 1000};
+    while (TRUE) {
+        // whatever was pushed before closing is drained before exiting
+        int closing = atomic_load(&log->closing);
+        if (slow_log_drain(log) == 0) {
+            if (closing) {
+                break;
+            }
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+int slow_log_drain(slow_log_t *log) {
+    int n = 0;
+    while (TRUE) {
+        slot_t *slot = &log->slots[log->head & (SLOW_LOG_RING_SIZE - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != log->head + 1) {
+            break;
+        }
+        write_entry(log->file, &slot->entry);
+
+        // hand the slot back to the producers for the next lap
+        atomic_store_explicit(&slot->seq, log->head + SLOW_LOG_RING_SIZE,
+                              memory_order_release);
+        log->head++;
+        n++;
+    }
+    unsigned long dropped = atomic_load(&log->dropped);
+    if (dropped != log->reported) {
+        fprintf(log->file, "# %lu slow calls dropped with the log full\n",
+                dropped - log->reported);
+        log->reported = dropped;
+        n++;
+    }
+    if (n > 0) {
+        fflush(log->file);
+    }
+    return n;
+}
+
+void write_entry(FILE *file, const slow_entry_t *e) {
+    time_t sec = e->time_usec / 1000000;
+    struct tm tm;
+    char when[32];
+    gmtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+    fprintf(file, "time=%s.%06luZ function=", when,
+            (unsigned long)(e->time_usec % 1000000));
+
+    // names come from clients, so keep them to one word on one line
+    for (const char *c = e->function; *c != '\0'; c++) {
+        fputc(isgraph((unsigned char)*c) ? *c : '?', file);
+    }
+    fprintf(file,
+            " peer=%s request_bytes=%zu reply_bytes=%zu total_usec=%lu "
+            "receive_usec=%lu decode_usec=%lu queue_usec=%lu "
+            "handler_usec=%lu",
+            e->peer[0] != '\0' ? e->peer : "-", e->request_bytes,
+            e->reply_bytes, e->total_usec, e->receive_usec, e->decode_usec,
+            e->queue_usec, e->handler_usec);
+    if (e->data_len > 0) {
+        fprintf(file, " data=");
+        for (size_t i = 0; i < e->data_len; i++) {
+            fprintf(file, "%02x", e->data[i]);
+        }
+    }
+    fputc('\n', file);
+}
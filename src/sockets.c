@@ -6,13 +6,130 @@
    Author: David Sha
 ============================================================================= */
 #define _POSIX_C_SOURCE 200112L
+#include "sockets.h"
+#include "clock.h"
 #include "config.h"
+#include "rpc.h"
+#include <errno.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
+#include <time.h>
 #include <unistd.h>
 
+/*
+ * Faults to inject, read from the environment once unless set first.
+ * faults_on is checked before anything else, so I/O without faults only
+ * pays for loading it.
+ */
+static pthread_once_t faults_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t faults_lock = PTHREAD_MUTEX_INITIALIZER;
+static rpc_fault_opts faults;
+static rpc_fault_stats fault_counts;
+static _Atomic int faults_on = FALSE;
+static __thread uint64_t fault_state = 0;
+
+/* helper function declarations ============================================= */
+
+/*
+ * Read the faults to inject from the environment.
+ */
+void load_faults(void);
+
+/*
+ * Are the faults valid: probabilities from 0 to 1 and a bandwidth of at
+ * least 0?
+ */
+int valid_faults(const rpc_fault_opts *f);
+
+/*
+ * Is there anything to inject in the faults?
+ */
+int any_faults(const rpc_fault_opts *f);
+
+/*
+ * Get the faults to inject, if any.
+ *
+ * @param f Filled in with the faults.
+ * @return TRUE if there are faults to inject.
+ */
+int current_faults(rpc_fault_opts *f);
+
+/*
+ * Decide whether to inject a fault.
+ *
+ * @param p The probability of the fault.
+ * @return TRUE if it is to be injected.
+ */
+int fault_chance(double p);
+
+/*
+ * Count a fault that was injected.
+ *
+ * @param count The counter of the fault.
+ */
+void count_fault(unsigned long *count);
+
+/*
+ * A random number for this thread.
+ */
+uint64_t fault_random(void);
+
+/*
+ * Copy a message header with the bytes it covers cut to a random number
+ * short of all of them, leaving at least one.
+ *
+ * @param mh The message header.
+ * @param cut Filled in with the shortened header.
+ * @param iov FAULT_MAX_IOV entries to hold the pieces of cut.
+ * @return TRUE if it was cut short, FALSE if it was too small or in too
+ * many pieces.
+ */
+int cut_short(const struct msghdr *mh, struct msghdr *cut, struct iovec *iov);
+
+/*
+ * Hold up data that has just been received by the delay, jitter, any
+ * stall, and the time it takes to arrive at the bandwidth, as if it had
+ * taken that much longer to arrive.
+ *
+ * @param f The faults.
+ * @param n The number of bytes received.
+ */
+void fault_delay(const rpc_fault_opts *f, size_t n);
+
+/*
+ * Sleep for usec microseconds, going back to sleep if interrupted.
+ */
+void fault_sleep(unsigned long usec);
+
+/* sockets ================================================================== */
+
+int set_nodelay(int sockfd) {
+    int on = 1;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on) < 0) {
+        debug_print("%s", "Error disabling Nagle's algorithm\n");
+        return FAILED;
+    }
+    return 0;
+}
+
+int set_fast_open(int sockfd, int enabled) {
+    int queue = enabled ? FAST_OPEN_QUEUE : 0;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof queue) <
+        0) {
+        debug_print("%s", "Error setting TCP_FASTOPEN\n");
+        return FAILED;
+    }
+    return 0;
+}
+
 int create_listening_socket(char *port) {
     int re, s, sockfd = FAILED;
     struct addrinfo hints, *res = NULL;
@@ -56,7 +173,7 @@ cleanup:
     return sockfd;
 }
 
-int create_connection_socket(char *addr, char *port) {
+int create_connection_socket(char *addr, char *port, int fast_open) {
     int s, sockfd = FAILED;
     struct addrinfo hints, *servinfo = NULL, *rp = NULL;
 
@@ -77,7 +194,16 @@ int create_connection_socket(char *addr, char *port) {
         if (sockfd == FAILED) {
             continue;
         }
+
+        // with a cookie from an earlier connection, connect returns at
+        // once and the first write goes out in the SYN
+        int on = 1;
+        if (fast_open && setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                                    &on, sizeof on) < 0) {
+            debug_print("%s", "Error setting TCP_FASTOPEN_CONNECT\n");
+        }
         if (connect(sockfd, rp->ai_addr, rp->ai_addrlen) != FAILED) {
+            set_nodelay(sockfd);
             break;
         }
         close(sockfd);
@@ -85,6 +211,7 @@ int create_connection_socket(char *addr, char *port) {
 
     if (rp == NULL) {
         debug_print("%s", "Could not connect to server\n");
+        sockfd = FAILED;
         goto cleanup;
     }
 
@@ -95,13 +222,13 @@ cleanup:
     return sockfd;
 }
 
-int non_blocking_accept(int sockfd, struct sockaddr_in *client_addr,
+int non_blocking_accept(int sockfd, struct sockaddr_storage *client_addr,
                         socklen_t *client_addr_size) {
     int new_sockfd = FAILED;
     fd_set readfds;
     FD_ZERO(&readfds);
     FD_SET(sockfd, &readfds);
-    struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+    struct timeval tv = {.tv_sec = 0, .tv_usec = ACCEPT_TIMEOUT_USEC};
     int retval = select(sockfd + 1, &readfds, NULL, NULL, &tv);
     if (retval == FAILED) {
         debug_print("%s", "Error in select\n");
@@ -112,6 +239,8 @@ int non_blocking_accept(int sockfd, struct sockaddr_in *client_addr,
         if (new_sockfd < 0) {
             debug_print("%s", "Error accepting connection\n");
             new_sockfd = FAILED;
+        } else {
+            set_nodelay(new_sockfd);
         }
     } else {
         // no connection requests received
@@ -134,3 +263,242 @@ int is_socket_closed(int sockfd) {
         return FALSE;
     }
 }
+
+ssize_t socket_sendmsg(int sockfd, const struct msghdr *mh, int flags) {
+    rpc_fault_opts f;
+    if (!current_faults(&f)) {
+        return sendmsg(sockfd, mh, flags);
+    }
+    if (fault_chance(f.reset)) {
+        count_fault(&fault_counts.resets);
+
+        // the peer and any thread blocked receiving see the connection
+        // end, while the descriptor stays with its owner
+        shutdown(sockfd, SHUT_RDWR);
+        errno = ECONNRESET;
+        return FAILED;
+    }
+
+    struct msghdr cut;
+    struct iovec iov[FAULT_MAX_IOV];
+    if (fault_chance(f.partial) && cut_short(mh, &cut, iov)) {
+        count_fault(&fault_counts.partials);
+        mh = &cut;
+    }
+    return sendmsg(sockfd, mh, flags);
+}
+
+ssize_t socket_recv(int sockfd, void *buf, size_t size, int flags) {
+    rpc_fault_opts f;
+    if (!current_faults(&f)) {
+        return recv(sockfd, buf, size, flags);
+    }
+    if (size > 1 && fault_chance(f.partial)) {
+        count_fault(&fault_counts.partials);
+        size = 1 + fault_random() % (size - 1);
+    }
+    ssize_t n = recv(sockfd, buf, size, flags);
+    if (n > 0) {
+        fault_delay(&f, n);
+    }
+    return n;
+}
+
+ssize_t socket_recvmsg(int sockfd, struct msghdr *mh, int flags) {
+    rpc_fault_opts f;
+    if (!current_faults(&f)) {
+        return recvmsg(sockfd, mh, flags);
+    }
+    struct msghdr cut;
+    struct iovec iov[FAULT_MAX_IOV];
+    ssize_t n;
+    if (fault_chance(f.partial) && cut_short(mh, &cut, iov)) {
+        count_fault(&fault_counts.partials);
+        n = recvmsg(sockfd, &cut, flags);
+        mh->msg_controllen = cut.msg_controllen;
+        mh->msg_flags = cut.msg_flags;
+    } else {
+        n = recvmsg(sockfd, mh, flags);
+    }
+    if (n > 0) {
+        fault_delay(&f, n);
+    }
+    return n;
+}
+
+int rpc_set_faults(const rpc_fault_opts *opts) {
+    if (opts != NULL && !valid_faults(opts)) {
+        return FAILED;
+    }
+
+    // settings made here win over the environment
+    pthread_once(&faults_once, load_faults);
+    pthread_mutex_lock(&faults_lock);
+    memset(&faults, 0, sizeof(faults));
+    if (opts != NULL) {
+        faults = *opts;
+        if (faults.stall_usec == 0) {
+            faults.stall_usec = FAULT_STALL_USEC;
+        }
+    }
+    atomic_store(&faults_on, opts != NULL && any_faults(&faults));
+    pthread_mutex_unlock(&faults_lock);
+    return 0;
+}
+
+void rpc_get_fault_stats(rpc_fault_stats *stats) {
+    pthread_mutex_lock(&faults_lock);
+    *stats = fault_counts;
+    pthread_mutex_unlock(&faults_lock);
+}
+
+/* helper functions ========================================================= */
+void load_faults(void) {
+    const char *names[] = {"RPC_FAULT_DELAY_USEC", "RPC_FAULT_JITTER_USEC",
+                           "RPC_FAULT_BANDWIDTH",  "RPC_FAULT_STALL",
+                           "RPC_FAULT_STALL_USEC", "RPC_FAULT_PARTIAL",
+                           "RPC_FAULT_RESET"};
+    double values[7] = {0};
+    for (int i = 0; i < 7; i++) {
+        const char *value = getenv(names[i]);
+        if (value == NULL) {
+            continue;
+        }
+        char *end;
+        values[i] = strtod(value, &end);
+        if (end == value || *end != '\0' || values[i] < 0) {
+            fprintf(stderr, "Ignoring faults: invalid %s=%s\n", names[i],
+                    value);
+            return;
+        }
+    }
+    rpc_fault_opts opts = {.delay_usec = (unsigned long)values[0],
+                           .jitter_usec = (unsigned long)values[1],
+                           .bandwidth = values[2],
+                           .stall = values[3],
+                           .stall_usec = (unsigned long)values[4],
+                           .partial = values[5],
+                           .reset = values[6]};
+
+    if (!valid_faults(&opts)) {
+        fprintf(stderr, "Ignoring faults: probabilities must be from 0 to "
+                        "1\n");
+        return;
+    }
+    if (!any_faults(&opts)) {
+        return;
+    }
+
+    // called from within pthread_once, so set the faults directly
+    if (opts.stall_usec == 0) {
+        opts.stall_usec = FAULT_STALL_USEC;
+    }
+    pthread_mutex_lock(&faults_lock);
+    faults = opts;
+    pthread_mutex_unlock(&faults_lock);
+    atomic_store(&faults_on, TRUE);
+}
+
+int valid_faults(const rpc_fault_opts *f) {
+    return f->stall >= 0 && f->stall <= 1 && f->partial >= 0 &&
+           f->partial <= 1 && f->reset >= 0 && f->reset <= 1 &&
+           f->bandwidth >= 0;
+}
+
+int any_faults(const rpc_fault_opts *f) {
+    return f->delay_usec > 0 || f->jitter_usec > 0 || f->bandwidth > 0 ||
+           f->stall > 0 || f->partial > 0 || f->reset > 0;
+}
+
+int current_faults(rpc_fault_opts *f) {
+    pthread_once(&faults_once, load_faults);
+    if (!atomic_load_explicit(&faults_on, memory_order_relaxed)) {
+        return FALSE;
+    }
+    pthread_mutex_lock(&faults_lock);
+    *f = faults;
+    pthread_mutex_unlock(&faults_lock);
+    return TRUE;
+}
+
+int fault_chance(double p) {
+    // in steps of one in a million, which is fine enough for a network
+    return p > 0 && fault_random() % 1000000 < p * 1000000;
+}
+
+void count_fault(unsigned long *count) {
+    pthread_mutex_lock(&faults_lock);
+    (*count)++;
+    pthread_mutex_unlock(&faults_lock);
+}
+
+uint64_t fault_random(void) {
+    // xorshift64*, seeded differently for every thread of every process
+    if (fault_state == 0) {
+        fault_state = monotonic_nsec() ^ ((uint64_t)getpid() << 32) ^
+                      (uint64_t)(uintptr_t)&fault_state;
+        fault_state |= 1;
+    }
+    fault_state ^= fault_state >> 12;
+    fault_state ^= fault_state << 25;
+    fault_state ^= fault_state >> 27;
+    return fault_state * 0x2545F4914F6CDD1DULL;
+}
+
+int cut_short(const struct msghdr *mh, struct msghdr *cut, struct iovec *iov) {
+    if (mh->msg_iovlen > FAULT_MAX_IOV) {
+        return FALSE;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < mh->msg_iovlen; i++) {
+        total += mh->msg_iov[i].iov_len;
+    }
+    if (total < 2) {
+        return FALSE;
+    }
+    size_t keep = 1 + fault_random() % (total - 1);
+    *cut = *mh;
+    cut->msg_iov = iov;
+    cut->msg_iovlen = 0;
+    for (size_t i = 0; i < mh->msg_iovlen && keep > 0; i++) {
+        iov[i] = mh->msg_iov[i];
+        if (iov[i].iov_len > keep) {
+            iov[i].iov_len = keep;
+        }
+        keep -= iov[i].iov_len;
+        cut->msg_iovlen++;
+    }
+    return TRUE;
+}
+
+void fault_delay(const rpc_fault_opts *f, size_t n) {
+    unsigned long wait = f->delay_usec;
+    if (f->jitter_usec > 0) {
+        wait += fault_random() % (f->jitter_usec + 1);
+    }
+    if (wait > 0) {
+        count_fault(&fault_counts.delays);
+    }
+
+    // every connection has a thread of its own reading it, so sleeping
+    // for as long as the bytes take at the bandwidth paces each connection
+    // on its own, while senders only block once the socket buffers fill
+    if (f->bandwidth > 0) {
+        wait += (unsigned long)(n * 1e6 / f->bandwidth);
+    }
+
+    // the reader sleeps rather than the sender, so a stall holds up what
+    // follows on the connection but not the threads waiting for replies
+    if (fault_chance(f->stall)) {
+        count_fault(&fault_counts.stalls);
+        wait += f->stall_usec;
+    }
+    fault_sleep(wait);
+}
+
+void fault_sleep(unsigned long usec) {
+    struct timespec ts = {.tv_sec = usec / 1000000,
+                          .tv_nsec = usec % 1000000 * 1000};
+    while (usec > 0 && nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
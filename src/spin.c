@@ -0,0 +1,48 @@
+/* =============================================================================
+   spin.c
+
+   Spin-then-park waiting.
+
+   Author: David Sha
+============================================================================= */
+#include "spin.h"
+#include "clock.h"
+#include "config.h"
+#include <stdint.h>
+#include <unistd.h>
+
+void spin_init(spin_t *s, int max_usec) {
+    // with one CPU the thread we wait for cannot run while we spin
+    if (max_usec < 0 || sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        max_usec = 0;
+    }
+    atomic_store(&s->max_usec, max_usec);
+    atomic_store(&s->usec, max_usec);
+}
+
+int spin_wait(spin_t *s, int (*poll)(void *arg), void *arg) {
+    int usec = atomic_load_explicit(&s->usec, memory_order_relaxed);
+    if (usec == 0) {
+        // do not give up on spinning for good while it is enabled
+        int max_usec = atomic_load_explicit(&s->max_usec, memory_order_relaxed);
+        if (max_usec == 0) {
+            return poll(arg);
+        }
+        usec = 1;
+    }
+
+    uint64_t deadline = monotonic_nsec() + (uint64_t)usec * 1000;
+    do {
+        if (poll(arg)) {
+            atomic_store_explicit(&s->usec,
+                                  atomic_load_explicit(&s->max_usec,
+                                                       memory_order_relaxed),
+                                  memory_order_relaxed);
+            return TRUE;
+        }
+        cpu_relax();
+    } while (monotonic_nsec() < deadline);
+
+    atomic_store_explicit(&s->usec, usec / 2, memory_order_relaxed);
+    return FALSE;
+}
@@ -0,0 +1,100 @@
+/* =============================================================================
+   trace.c
+
+   Trace context propagation and the buffer of recorded spans.
+
+   Author: David Sha
+============================================================================= */
+#include "trace.h"
+#include "clock.h"
+#include "config.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * The trace of this thread, and the state of its id generator.
+ */
+static __thread rpc_trace_context current = {0, 0};
+static __thread uint64_t id_state = 0;
+
+/*
+ * The spans not yet collected, in a ring that overwrites the oldest.
+ */
+static rpc_span spans[TRACE_BUFFER_SIZE];
+static size_t spans_head = 0;
+static size_t spans_count = 0;
+static pthread_mutex_t spans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t trace_new_id(void) {
+    // xorshift64*, seeded differently for every thread of every process
+    if (id_state == 0) {
+        id_state = monotonic_nsec() ^ ((uint64_t)getpid() << 32) ^
+                   (uint64_t)(uintptr_t)&id_state;
+        id_state |= 1;
+    }
+    uint64_t id;
+    do {
+        id_state ^= id_state >> 12;
+        id_state ^= id_state << 25;
+        id_state ^= id_state >> 27;
+        id = id_state * 0x2545F4914F6CDD1DULL;
+    } while (id == 0);
+    return id;
+}
+
+const rpc_trace_context *trace_context(void) {
+    return &current;
+}
+
+void trace_record(const rpc_span *span) {
+    pthread_mutex_lock(&spans_lock);
+    spans[(spans_head + spans_count) % TRACE_BUFFER_SIZE] = *span;
+    if (spans_count < TRACE_BUFFER_SIZE) {
+        spans_count++;
+    } else {
+        spans_head = (spans_head + 1) % TRACE_BUFFER_SIZE;
+    }
+    pthread_mutex_unlock(&spans_lock);
+}
+
+void rpc_trace_start(rpc_trace_context *ctx) {
+    current.trace_id = trace_new_id();
+    current.span_id = 0;
+    if (ctx != NULL) {
+        *ctx = current;
+    }
+}
+
+void rpc_trace_set(const rpc_trace_context *ctx) {
+    if (ctx == NULL) {
+        current.trace_id = current.span_id = 0;
+    } else {
+        current = *ctx;
+    }
+}
+
+int rpc_trace_current(rpc_trace_context *ctx) {
+    if (current.trace_id == 0) {
+        return FAILED;
+    }
+    if (ctx != NULL) {
+        *ctx = current;
+    }
+    return EXIT_SUCCESS;
+}
+
+size_t rpc_trace_collect(rpc_span *out, size_t max) {
+    if (out == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&spans_lock);
+    size_t n = 0;
+    while (n < max && spans_count > 0) {
+        out[n++] = spans[spans_head];
+        spans_head = (spans_head + 1) % TRACE_BUFFER_SIZE;
+        spans_count--;
+    }
+    pthread_mutex_unlock(&spans_lock);
+    return n;
+}
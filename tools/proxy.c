@@ -0,0 +1,541 @@
+/* =============================================================================
+   proxy.c
+
+   RPC proxy. Accepts client connections speaking the RPC protocol and
+   routes each FIND and CALL by the longest matching prefix of its function
+   name to a pool of backend servers. Requests from all clients are
+   multiplexed over a few connections to each backend, which collapses the
+   mesh of connections between clients and servers. Requests are forwarded
+   as soon as they arrive and replies are passed back as soon as they
+   return, so a slow call never holds up the ones behind it.
+
+   Usage: ./rpc-proxy [-p port] [-c connections] -r prefix=addr:port[,...]
+
+   -p  port to listen on, 4000 by default
+   -c  connections to open to each backend, 2 by default
+   -r  route names starting with prefix to the listed backends. A prefix
+       of * matches every name. May be given several times.
+
+   e.g. ./rpc-proxy -p 4000 -r add=::1:3000,::1:3001 -r '*=::1:3002'
+
+   Author: David Sha
+============================================================================= */
+#define _POSIX_C_SOURCE 200112L
+#include "config.h"
+#include "idtable.h"
+#include "linkedlist.h"
+#include "mux.h"
+#include "protocol.h"
+#include "rpc.h"
+#include "sockets.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* signal handling ========================================================== */
+static volatile sig_atomic_t keep_running = 1;
+
+/*
+ * Int handler for SIGINT.
+ */
+static void sig_handler(int _) {
+    (void)_;
+    keep_running = 0;
+}
+
+/* structures =============================================================== */
+
+/*
+ * A client connection. It is freed once the client has gone and every
+ * reply owed to it has been passed back.
+ */
+typedef struct {
+    mux_t *mux;
+    int refs;
+    pthread_mutex_t lock;
+} client_t;
+
+/*
+ * A client request waiting for its reply from a backend.
+ */
+typedef struct {
+    // in the backend's pending table under its request id on the backend
+    id_entry_t entry;
+    uint64_t client_id;
+    client_t *client;
+} waiter_t;
+
+/*
+ * A multiplexed connection to a backend. A reader thread passes each reply
+ * back to the client whose request has the matching id. Requests are sent
+ * without the lock, and the reader waits for the sends in progress before
+ * it frees a lost connection.
+ */
+typedef struct {
+    char *addr;
+    int port;
+    mux_t *mux;
+    int reader_running;
+    int sending;
+    // unsigned, so that it wraps around rather than overflowing
+    uint64_t next_id;
+    idtable_t *pending;
+    pthread_mutex_t lock;
+    pthread_cond_t reader_done;
+    pthread_cond_t sends_done;
+} backend_t;
+
+typedef struct {
+    char *prefix;
+    backend_t **backends;
+    int n;
+    unsigned int next;
+} route_t;
+
+typedef struct {
+    list_t *routes;
+    int port;
+    int connections;
+} proxy_t;
+
+/* function declarations ==================================================== */
+
+/*
+ * Parse the command line into the proxy's configuration.
+ */
+static proxy_t *parse_args(int argc, char *argv[]);
+
+/*
+ * Parse a route of the form prefix=addr:port[,addr:port...], opening the
+ * given number of connections to each backend.
+ */
+static route_t *parse_route(char *spec, int connections);
+
+/*
+ * Free a route that was never used, along with its backends.
+ */
+static void route_free(route_t *route);
+
+/*
+ * Find the route with the longest prefix matching the name.
+ */
+static route_t *match_route(proxy_t *proxy, const char *name);
+
+/*
+ * Forward a request to a backend. The reply is passed back to the client
+ * by the backend's reader thread.
+ *
+ * @return 0 if the request was sent, FAILED if the backend could not be
+ * reached.
+ */
+static int forward(backend_t *b, rpc_message *msg, client_t *client);
+
+/*
+ * Pass a reply back to the client that is waiting for it, and free the
+ * waiter. The reply is left to the client's writer thread, so that a slow
+ * client cannot hold up the backend's reader.
+ */
+static void reply_to(waiter_t *w, rpc_message *reply);
+
+/*
+ * Fail a waiter whose backend connection was lost, for idtable_clear.
+ */
+static void fail_waiter(void *arg);
+
+/*
+ * Drop a reference to a client, freeing it with the last one.
+ */
+static void client_release(client_t *client);
+
+/*
+ * Connect to a backend and start its reader thread, first waiting for the
+ * reader of a lost connection to finish with it. The backend must be
+ * locked.
+ */
+static int backend_connect(backend_t *b);
+
+/*
+ * Read replies from a backend and hand them to their waiters.
+ */
+static void *backend_reader(void *arg);
+
+/*
+ * Serve one client connection until it closes.
+ */
+static void *client_thread(void *arg);
+
+typedef struct {
+    proxy_t *proxy;
+    client_t *client;
+} client_args;
+
+/* proxy ==================================================================== */
+int main(int argc, char *argv[]) {
+    proxy_t *proxy = parse_args(argc, argv);
+    if (is_empty_list(proxy->routes)) {
+        fprintf(stderr, "usage: %s [-p port] [-c connections] "
+                        "-r prefix=addr:port[,addr:port...]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char sport[MAX_PORT_LENGTH + 2];
+    snprintf(sport, sizeof(sport), "%d", proxy->port);
+    int sockfd = create_listening_socket(sport);
+    if (sockfd == FAILED || listen(sockfd, BACKLOG) < 0) {
+        fprintf(stderr, "Could not listen on port %d\n", proxy->port);
+        exit(EXIT_FAILURE);
+    }
+
+    // handle SIGINT, and do not die when a peer goes away mid-write
+    struct sigaction act = {.sa_handler = sig_handler};
+    sigaction(SIGINT, &act, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (keep_running) {
+        struct sockaddr_storage cl_addr;
+        socklen_t cl_addr_size = sizeof(cl_addr);
+        int cl_sockfd = non_blocking_accept(sockfd, &cl_addr, &cl_addr_size);
+        if (cl_sockfd < 0) {
+            continue;
+        }
+
+        client_t *client = (client_t *)malloc(sizeof(*client));
+        assert(client);
+        if ((client->mux = mux_create(cl_sockfd)) == NULL) {
+            close(cl_sockfd);
+            free(client);
+            continue;
+        }
+        client->refs = 1;
+        pthread_mutex_init(&client->lock, NULL);
+
+        client_args *args = (client_args *)malloc(sizeof(*args));
+        assert(args);
+        args->proxy = proxy;
+        args->client = client;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, client_thread, args) != 0) {
+            debug_print("%s", "Creating thread failed\n");
+            client_release(client);
+            free(args);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    debug_print("%s", "\nShutting down...\n");
+    close(sockfd);
+    return 0;
+}
+
+static void *client_thread(void *arg) {
+    client_args *args = (client_args *)arg;
+    proxy_t *proxy = args->proxy;
+    client_t *client = args->client;
+    free(args);
+
+    rpc_message *msg;
+    while (keep_running && (msg = mux_receive(client->mux)) != NULL) {
+        route_t *route = match_route(proxy, msg->function_name);
+        if (route != NULL &&
+            (msg->operation == FIND || msg->operation == CALL)) {
+            unsigned int i = __sync_fetch_and_add(&route->next, 1);
+            if (forward(route->backends[i % route->n], msg, client) == 0) {
+                rpc_message_free(msg, rpc_data_free);
+                continue;
+            }
+        }
+
+        // nothing to route to: report names as missing, calls as failed
+        rpc_message *reply;
+        if (route == NULL && msg->operation == FIND) {
+            reply = new_rpc_message(0, REPLY_SUCCESS,
+                                    new_string(msg->function_name),
+                                    new_rpc_data(FALSE, 0, NULL));
+        } else {
+            reply = create_failure_message();
+        }
+        reply->request_id = msg->request_id;
+        mux_send(client->mux, reply);
+        rpc_message_free(msg, rpc_data_free);
+        rpc_message_free(reply, rpc_data_free);
+    }
+    client_release(client);
+    return NULL;
+}
+
+static int forward(backend_t *b, rpc_message *msg, client_t *client) {
+    waiter_t *w = (waiter_t *)malloc(sizeof(*w));
+    assert(w);
+    uint64_t client_id = msg->request_id;
+    w->client_id = client_id;
+    w->client = client;
+
+    // the reply may come back before mux_send returns, so the waiter is
+    // registered first
+    pthread_mutex_lock(&b->lock);
+    if (b->mux == NULL && backend_connect(b) == FAILED) {
+        pthread_mutex_unlock(&b->lock);
+        free(w);
+        return FAILED;
+    }
+    uint64_t id = b->next_id++;
+    w->entry.id = id;
+    w->entry.data = w;
+    idtable_insert(b->pending, &w->entry);
+    pthread_mutex_lock(&client->lock);
+    client->refs++;
+    pthread_mutex_unlock(&client->lock);
+    mux_t *mux = b->mux;
+    b->sending++;
+    pthread_mutex_unlock(&b->lock);
+
+    // the waiter belongs to the reader from here on, and may already be
+    // freed
+    msg->request_id = id;
+    int sent = mux_send(mux, msg);
+    msg->request_id = client_id;
+
+    pthread_mutex_lock(&b->lock);
+    if (--b->sending == 0) {
+        pthread_cond_broadcast(&b->sends_done);
+    }
+    if (sent == FAILED && idtable_remove(b->pending, id) != NULL) {
+        pthread_mutex_unlock(&b->lock);
+        client_release(client);
+        free(w);
+        return FAILED;
+    }
+
+    // a waiter the reader has taken is answered by it, even if the send
+    // failed
+    pthread_mutex_unlock(&b->lock);
+    return 0;
+}
+
+static void reply_to(waiter_t *w, rpc_message *reply) {
+    if (reply == NULL) {
+        reply = create_failure_message();
+    }
+    reply->request_id = w->client_id;
+    mux_send_queued(w->client->mux, reply);
+    rpc_message_free(reply, rpc_data_free);
+    client_release(w->client);
+    free(w);
+}
+
+static void fail_waiter(void *arg) {
+    reply_to((waiter_t *)arg, NULL);
+}
+
+static void client_release(client_t *client) {
+    pthread_mutex_lock(&client->lock);
+    int refs = --client->refs;
+    pthread_mutex_unlock(&client->lock);
+    if (refs == 0) {
+        mux_free(client->mux);
+        pthread_mutex_destroy(&client->lock);
+        free(client);
+    }
+}
+
+static int backend_connect(backend_t *b) {
+    // wait for the previous connection's reader to finish failing its
+    // waiters, which it does without the lock
+    while (b->reader_running) {
+        pthread_cond_wait(&b->reader_done, &b->lock);
+    }
+    if (b->mux != NULL) {
+        // another request reconnected while we waited
+        return EXIT_SUCCESS;
+    }
+
+    char sport[MAX_PORT_LENGTH + 2];
+    snprintf(sport, sizeof(sport), "%d", b->port);
+    int sockfd = create_connection_socket(b->addr, sport, FALSE);
+    if (sockfd == FAILED) {
+        debug_print("Backend %s:%d unreachable\n", b->addr, b->port);
+        return FAILED;
+    }
+    if ((b->mux = mux_create(sockfd)) == NULL) {
+        close(sockfd);
+        return FAILED;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, backend_reader, b) != 0) {
+        mux_free(b->mux);
+        b->mux = NULL;
+        return FAILED;
+    }
+    pthread_detach(thread);
+    b->reader_running = TRUE;
+    return EXIT_SUCCESS;
+}
+
+static void *backend_reader(void *arg) {
+    backend_t *b = (backend_t *)arg;
+    pthread_mutex_lock(&b->lock);
+    mux_t *mux = b->mux;
+    pthread_mutex_unlock(&b->lock);
+
+    rpc_message *reply;
+    while ((reply = mux_receive(mux)) != NULL) {
+        pthread_mutex_lock(&b->lock);
+        waiter_t *w = (waiter_t *)idtable_remove(b->pending, reply->request_id);
+        pthread_mutex_unlock(&b->lock);
+        if (w != NULL) {
+            reply_to(w, reply);
+        } else {
+            debug_print("Unexpected reply %" PRIu64 "\n", reply->request_id);
+            rpc_message_free(reply, rpc_data_free);
+        }
+    }
+
+    // the connection is gone, so fail everything still waiting on it
+    debug_print("Lost backend %s:%d\n", b->addr, b->port);
+    pthread_mutex_lock(&b->lock);
+    idtable_t *pending = b->pending;
+    b->pending = idtable_create(PENDING_TABLE_SIZE);
+    b->mux = NULL;
+    pthread_mutex_unlock(&b->lock);
+
+    idtable_clear(pending, fail_waiter);
+    idtable_destroy(pending);
+
+    // requests still being sent on the connection hold on to it
+    pthread_mutex_lock(&b->lock);
+    while (b->sending > 0) {
+        pthread_cond_wait(&b->sends_done, &b->lock);
+    }
+    pthread_mutex_unlock(&b->lock);
+    mux_free(mux);
+
+    pthread_mutex_lock(&b->lock);
+    b->reader_running = FALSE;
+    pthread_cond_broadcast(&b->reader_done);
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+static route_t *match_route(proxy_t *proxy, const char *name) {
+    route_t *best = NULL;
+    size_t best_len = 0;
+    for (node_t *curr = proxy->routes->head; curr; curr = curr->next) {
+        route_t *route = (route_t *)curr->data;
+        size_t len = strlen(route->prefix);
+        if (strncmp(name, route->prefix, len) == 0 &&
+            (best == NULL || len > best_len)) {
+            best = route;
+            best_len = len;
+        }
+    }
+    return best;
+}
+
+/* argument parsing ========================================================= */
+static proxy_t *parse_args(int argc, char *argv[]) {
+    proxy_t *proxy = (proxy_t *)malloc(sizeof(*proxy));
+    assert(proxy);
+    proxy->routes = create_empty_list();
+    proxy->port = 4000;
+    proxy->connections = 2;
+
+    // read the connection count first since routes depend on it
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && atoi(argv[i + 1]) > 0) {
+            proxy->connections = atoi(argv[i + 1]);
+        }
+    }
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0) {
+            proxy->port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            route_t *route = parse_route(argv[++i], proxy->connections);
+            if (route == NULL) {
+                fprintf(stderr, "Invalid route %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            append(proxy->routes, route);
+        }
+    }
+    return proxy;
+}
+
+static route_t *parse_route(char *spec, int connections) {
+    char *eq = strchr(spec, '=');
+    if (eq == NULL) {
+        return NULL;
+    }
+
+    route_t *route = (route_t *)malloc(sizeof(*route));
+    assert(route);
+    *eq = '\0';
+    route->prefix = new_string(strcmp(spec, "*") == 0 ? "" : spec);
+    route->n = 0;
+    route->next = 0;
+    route->backends = NULL;
+
+    // each backend is addr:port, where addr may itself contain colons
+    char *saveptr = NULL;
+    for (char *tok = strtok_r(eq + 1, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        char *colon = strrchr(tok, ':');
+        if (colon == NULL) {
+            route_free(route);
+            return NULL;
+        }
+        *colon = '\0';
+        char *addr = tok;
+        if (addr[0] == '[' && colon[-1] == ']') {
+            colon[-1] = '\0';
+            addr++;
+        }
+
+        route->backends = (backend_t **)realloc(
+            route->backends,
+            (route->n + connections) * sizeof(*route->backends));
+        assert(route->backends);
+        for (int i = 0; i < connections; i++) {
+            backend_t *b = (backend_t *)malloc(sizeof(*b));
+            assert(b);
+            b->addr = new_string(addr);
+            b->port = atoi(colon + 1);
+            b->mux = NULL;
+            b->reader_running = FALSE;
+            b->sending = 0;
+            b->next_id = 0;
+            b->pending = idtable_create(PENDING_TABLE_SIZE);
+            pthread_mutex_init(&b->lock, NULL);
+            pthread_cond_init(&b->reader_done, NULL);
+            pthread_cond_init(&b->sends_done, NULL);
+            route->backends[route->n++] = b;
+        }
+    }
+    if (route->n == 0) {
+        route_free(route);
+        return NULL;
+    }
+    return route;
+}
+
+static void route_free(route_t *route) {
+    for (int i = 0; i < route->n; i++) {
+        backend_t *b = route->backends[i];
+        free_and_null(b->addr);
+        idtable_destroy(b->pending);
+        pthread_mutex_destroy(&b->lock);
+        pthread_cond_destroy(&b->reader_done);
+        pthread_cond_destroy(&b->sends_done);
+        free(b);
+    }
+    free(route->backends);
+    free_and_null(route->prefix);
+    free(route);
+}
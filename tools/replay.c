@@ -0,0 +1,441 @@
+/* =============================================================================
+   replay.c
+
+   Replays a capture made with rpc_server_set_capture against a server.
+   Every captured connection gets a connection of its own, which sends the
+   requests captured on it in the same order, with the same data and
+   trailers, and at the same offsets from the start divided by the speed.
+   Replies are matched to their requests, and the latency percentiles of the
+   replayed requests printed at the end, along with how far behind schedule
+   requests were sent, which shows when the replay could not keep up.
+
+   Usage: ./rpc-replay [-s speed] [-w window] -f file addr:port
+
+   -s  1 for the original speed, the default, 2 for twice as fast, and so
+       on. 0 sends every request as soon as the window allows
+   -w  requests in flight on each connection at most, 64 by default
+   -f  the capture file
+
+   e.g. ./rpc-replay -s 2 -f /tmp/rpc.cap ::1:3000
+
+   Author: David Sha
+============================================================================= */
+#define _POSIX_C_SOURCE 200112L
+#include "capture.h"
+#include "clock.h"
+#include "config.h"
+#include "mux.h"
+#include "protocol.h"
+#include "rpc.h"
+#include "sockets.h"
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* structures =============================================================== */
+
+/*
+ * A captured request, and what became of it when replayed.
+ */
+typedef struct {
+    capture_record_t rec;
+    uint64_t sent_usec;
+    unsigned long latency_usec;
+    unsigned long lag_usec;
+    int replied;
+    int failed;
+} request_t;
+
+/*
+ * A connection to the server replaying one captured connection. Request
+ * ids are the positions of the requests in the connection's list, so
+ * replies need no lookup.
+ */
+typedef struct {
+    mux_t *mux;
+    request_t **requests;
+    int n;
+    int sent;
+    int answered;
+    int broken;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t sender;
+    pthread_t reader;
+} conn_t;
+
+typedef struct {
+    char *addr;
+    int port;
+    char *file;
+    double speed;
+    int window;
+} replay_t;
+
+/* function declarations ==================================================== */
+
+/*
+ * Parse the command line into the replay's configuration.
+ */
+static replay_t *parse_args(int argc, char *argv[]);
+
+/*
+ * Read every request of a capture file.
+ *
+ * @param n Set to the number of requests.
+ * @return The requests, in the order they were captured.
+ */
+static request_t *load_capture(const char *path, int *n);
+
+/*
+ * Send a connection's requests on schedule, keeping at most window in
+ * flight.
+ */
+static void *sender_thread(void *arg);
+
+/*
+ * Match replies to requests until every request is answered or the
+ * connection closes.
+ */
+static void *reader_thread(void *arg);
+
+/*
+ * Sleep until a time on the monotonic clock.
+ */
+static void sleep_until(uint64_t usec);
+
+/*
+ * Print the mean and percentiles of the latencies of the requests that
+ * were answered.
+ */
+static void print_report(request_t *requests, int n, uint64_t elapsed_usec);
+
+/*
+ * The configuration, and when the replay started.
+ */
+static replay_t *replay = NULL;
+static uint64_t start_usec = 0;
+
+/* replay =================================================================== */
+int main(int argc, char *argv[]) {
+    replay = parse_args(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+
+    int n;
+    request_t *requests = load_capture(replay->file, &n);
+    if (n == 0) {
+        fprintf(stderr, "No requests in %s\n", replay->file);
+        exit(EXIT_FAILURE);
+    }
+
+    // split the requests between the captured connections, keeping their
+    // order
+    int conns_n = 0;
+    for (int i = 0; i < n; i++) {
+        if ((int)requests[i].rec.connection >= conns_n) {
+            conns_n = requests[i].rec.connection + 1;
+        }
+    }
+    conn_t *conns = (conn_t *)calloc(conns_n, sizeof(*conns));
+    assert(conns);
+    for (int i = 0; i < n; i++) {
+        conns[requests[i].rec.connection].n++;
+    }
+    char sport[MAX_PORT_LENGTH + 2];
+    snprintf(sport, sizeof(sport), "%d", replay->port);
+    for (int c = 0; c < conns_n; c++) {
+        conn_t *conn = &conns[c];
+        conn->requests = (request_t **)malloc(
+            (conn->n > 0 ? conn->n : 1) * sizeof(*conn->requests));
+        assert(conn->requests);
+        conn->n = 0;
+        pthread_mutex_init(&conn->lock, NULL);
+        pthread_cond_init(&conn->cond, NULL);
+    }
+    for (int i = 0; i < n; i++) {
+        conn_t *conn = &conns[requests[i].rec.connection];
+        conn->requests[conn->n++] = &requests[i];
+    }
+
+    // connect everything up front, so connecting is not timed
+    for (int c = 0; c < conns_n; c++) {
+        if (conns[c].n == 0) {
+            continue;
+        }
+        int sockfd = create_connection_socket(replay->addr, sport, FALSE);
+        if (sockfd == FAILED ||
+            (conns[c].mux = mux_create(sockfd)) == NULL) {
+            fprintf(stderr, "Could not connect to %s:%d\n", replay->addr,
+                    replay->port);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    start_usec = monotonic_usec();
+    for (int c = 0; c < conns_n; c++) {
+        if (conns[c].n > 0) {
+            pthread_create(&conns[c].reader, NULL, reader_thread, &conns[c]);
+            pthread_create(&conns[c].sender, NULL, sender_thread, &conns[c]);
+        }
+    }
+    for (int c = 0; c < conns_n; c++) {
+        if (conns[c].n > 0) {
+            pthread_join(conns[c].sender, NULL);
+            pthread_join(conns[c].reader, NULL);
+        }
+    }
+    uint64_t elapsed = monotonic_usec() - start_usec;
+
+    // connections that never sent a request are not replayed
+    int active = 0;
+    for (int c = 0; c < conns_n; c++) {
+        active += conns[c].n > 0;
+    }
+    printf("%d requests over %d connections", n, active);
+    if (replay->speed > 0) {
+        printf(" at %gx speed\n", replay->speed);
+    } else {
+        printf(" at full speed, %d in flight each\n", replay->window);
+    }
+    print_report(requests, n, elapsed);
+
+    for (int c = 0; c < conns_n; c++) {
+        if (conns[c].mux != NULL) {
+            mux_free(conns[c].mux);
+        }
+        free(conns[c].requests);
+        pthread_mutex_destroy(&conns[c].lock);
+        pthread_cond_destroy(&conns[c].cond);
+    }
+    for (int i = 0; i < n; i++) {
+        free_and_null(requests[i].rec.bytes);
+    }
+    free(conns);
+    free(requests);
+    free(replay);
+    return 0;
+}
+
+static void *sender_thread(void *arg) {
+    conn_t *conn = (conn_t *)arg;
+    for (int i = 0; i < conn->n; i++) {
+        request_t *req = conn->requests[i];
+        uint64_t due = start_usec;
+        if (replay->speed > 0) {
+            due += (uint64_t)(req->rec.time_usec / replay->speed);
+            sleep_until(due);
+        }
+
+        pthread_mutex_lock(&conn->lock);
+        while (!conn->broken && conn->sent - conn->answered >= replay->window) {
+            pthread_cond_wait(&conn->cond, &conn->lock);
+        }
+        int broken = conn->broken;
+        pthread_mutex_unlock(&conn->lock);
+        if (broken) {
+            break;
+        }
+
+        // the bytes are decoded and encoded again rather than written as
+        // they are, so that the request id can be replaced
+        buffer_t b = {.data = req->rec.bytes,
+                      .next = 0,
+                      .size = req->rec.len,
+                      .pooled = FALSE};
+        rpc_message *msg = deserialise_rpc_message(&b);
+        req->sent_usec = monotonic_usec();
+        req->lag_usec = req->sent_usec > due ? req->sent_usec - due : 0;
+        int sent = FAILED;
+        if (msg != NULL) {
+            msg->request_id = i;
+            msg->priority = req->rec.priority;
+            sent = mux_send(conn->mux, msg);
+            rpc_message_free(msg, rpc_data_free);
+        }
+
+        pthread_mutex_lock(&conn->lock);
+        conn->sent++;
+        if (sent == FAILED) {
+            req->failed = TRUE;
+            conn->answered++;
+            pthread_cond_broadcast(&conn->cond);
+        }
+        pthread_mutex_unlock(&conn->lock);
+    }
+
+    // whatever was not sent counts as failed, and wakes up the reader
+    pthread_mutex_lock(&conn->lock);
+    for (int i = conn->sent; i < conn->n; i++) {
+        conn->requests[i]->failed = TRUE;
+    }
+    conn->answered += conn->n - conn->sent;
+    conn->sent = conn->n;
+    if (conn->answered == conn->n) {
+        mux_shutdown(conn->mux);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return NULL;
+}
+
+static void *reader_thread(void *arg) {
+    conn_t *conn = (conn_t *)arg;
+    rpc_message *reply;
+    while ((reply = mux_receive(conn->mux)) != NULL) {
+        uint64_t now = monotonic_usec();
+        uint64_t id = reply->request_id;
+        pthread_mutex_lock(&conn->lock);
+        if (id < (uint64_t)conn->n && !conn->requests[id]->replied) {
+            request_t *req = conn->requests[id];
+            req->replied = TRUE;
+            req->latency_usec = now - req->sent_usec;
+            req->failed = reply->operation != REPLY_SUCCESS;
+            conn->answered++;
+            pthread_cond_broadcast(&conn->cond);
+        }
+        int done = conn->sent == conn->n && conn->answered == conn->n;
+        pthread_mutex_unlock(&conn->lock);
+        rpc_message_free(reply, rpc_data_free);
+        if (done) {
+            break;
+        }
+    }
+
+    // the server went away, so fail everything still waiting
+    pthread_mutex_lock(&conn->lock);
+    conn->broken = TRUE;
+    for (int i = 0; i < conn->sent; i++) {
+        if (!conn->requests[i]->replied) {
+            conn->requests[i]->failed = TRUE;
+        }
+    }
+    pthread_cond_broadcast(&conn->cond);
+    pthread_mutex_unlock(&conn->lock);
+    return NULL;
+}
+
+static void sleep_until(uint64_t usec) {
+    uint64_t now = monotonic_usec();
+    if (usec > now) {
+        struct timespec ts = {.tv_sec = (usec - now) / 1000000,
+                              .tv_nsec = (usec - now) % 1000000 * 1000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+static int compare_ulong(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_report(request_t *requests, int n, uint64_t elapsed_usec) {
+    unsigned long *latencies = (unsigned long *)malloc(n * sizeof(*latencies));
+    assert(latencies);
+    int ok = 0, failed = 0;
+    double sum = 0, lag_sum = 0;
+    unsigned long lag_max = 0;
+    for (int i = 0; i < n; i++) {
+        lag_sum += requests[i].lag_usec;
+        if (requests[i].lag_usec > lag_max) {
+            lag_max = requests[i].lag_usec;
+        }
+        if (requests[i].failed || !requests[i].replied) {
+            failed++;
+            continue;
+        }
+        latencies[ok++] = requests[i].latency_usec;
+        sum += requests[i].latency_usec;
+    }
+    qsort(latencies, ok, sizeof(*latencies), compare_ulong);
+
+    printf("%d answered, %d failed in %.3f s, %.0f requests/s\n", ok, failed,
+           elapsed_usec / 1e6, n / (elapsed_usec / 1e6));
+    if (replay->speed > 0) {
+        printf("sent behind schedule: mean %.1f us, max %lu us\n",
+               lag_sum / n, lag_max);
+    }
+    if (ok > 0) {
+        double ps[] = {50, 90, 99, 99.9};
+        printf("latency us: mean %.1f", sum / ok);
+        for (size_t i = 0; i < sizeof(ps) / sizeof(ps[0]); i++) {
+            size_t at = (size_t)(ps[i] / 100 * (ok - 1) + 0.5);
+            printf(", p%g %lu", ps[i], latencies[at]);
+        }
+        printf(", max %lu\n", latencies[ok - 1]);
+    }
+    free(latencies);
+}
+
+static request_t *load_capture(const char *path, int *n) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL || capture_read_header(file, NULL) == FAILED) {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        exit(EXIT_FAILURE);
+    }
+    int size = 1024;
+    request_t *requests = (request_t *)malloc(size * sizeof(*requests));
+    assert(requests);
+    *n = 0;
+    capture_record_t rec;
+    while (capture_read(file, &rec)) {
+        if (*n == size) {
+            size *= 2;
+            requests =
+                (request_t *)realloc(requests, size * sizeof(*requests));
+            assert(requests);
+        }
+        memset(&requests[*n], 0, sizeof(requests[*n]));
+        requests[(*n)++].rec = rec;
+    }
+    fclose(file);
+    return requests;
+}
+
+/* argument parsing ========================================================= */
+static replay_t *parse_args(int argc, char *argv[]) {
+    replay_t *r = (replay_t *)malloc(sizeof(*r));
+    assert(r);
+    r->addr = NULL;
+    r->port = 0;
+    r->file = NULL;
+    r->speed = 1;
+    r->window = 64;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:w:f:")) != -1) {
+        switch (opt) {
+        case 's':
+            r->speed = atof(optarg);
+            break;
+        case 'w':
+            r->window = atoi(optarg);
+            break;
+        case 'f':
+            r->file = optarg;
+            break;
+        default:
+            break;
+        }
+    }
+
+    // the server is addr:port, where addr may itself contain colons
+    char *colon = optind < argc ? strrchr(argv[optind], ':') : NULL;
+    if (r->file == NULL || colon == NULL || r->speed < 0 || r->window < 1) {
+        fprintf(stderr, "usage: %s [-s speed] [-w window] -f file addr:port\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    *colon = '\0';
+    r->addr = argv[optind];
+    if (r->addr[0] == '[' && colon[-1] == ']') {
+        colon[-1] = '\0';
+        r->addr++;
+    }
+    r->port = atoi(colon + 1);
+    return r;
+}